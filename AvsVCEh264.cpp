@@ -39,6 +39,7 @@ typedef unsigned __int64    uint64;
 //#include <stdio.h>
 #include <stdlib.h>
 #include <malloc.h>
+#include <winsock2.h>
 #include <windows.h>
 #include <windows.h>
 //#include <string.h>
@@ -48,23 +49,59 @@ typedef unsigned __int64    uint64;
 #include "configFile.h"
 #include "timer.h"
 #include "buffer.h"
+#include "annexb.h"
+#include "encoderBackend.h"
 #include "OVstuff.h"
+#include "ovSimulator.h"
+#include "swEncoder.h"
 #include "avisynthUtil.h"
+#include "output.h"
+#include "arena.h"
+#include "nalrewrite.h"
+#include "fmp4.h"
+#include "tsmux.h"
+#include "nalindex.h"
+#include "segmenter.h"
+#include "lookahead.h"
+#include "twopass.h"
+#include "keyframes.h"
+#include "checkpoint.h"
+#include "chunked.h"
+#include "incremental.h"
+#include "smartcut.h"
+#include "scaler.h"
+#include "farm.h"
+#include "scheduler.h"
+#include "daemon.h"
+#include "ladder.h"
+#include "control.h"
+#include "live.h"
+#include "playlist.h"
 
 
 
 
 /** Global **/
 unsigned int currentFrame = 0;
+unsigned int firstFrame = 0;        // > 0 when resumed from a checkpoint
+uint64 firstOffset = 0;             // size of the output kept then
 unsigned int alignedSurfaceWidth = 0;
 unsigned int alignedSurfaceHeight = 0;
 unsigned int hostPtrSize = 0;
 
 
-cl_device_id clDeviceID;
+cl_device_id clDeviceID = NULL;
+
+// Encoder backends, selected with -b
+const EncoderBackend *backends[] = {&vceBackend, &simBackend, &swBackend, NULL};
+const EncoderBackend *backend = &vceBackend;
 
 // Threads
-HANDLE hThreadAvsDec, hThreadEnc, hThreadMonitor;
+HANDLE hThreadAvsDec, hThreadEnc, hThreadMonitor, hThreadAvsInit;
+
+// Script evaluation, done while the encoder is initialized
+bool avsInitStatus = false;
+double avsInitTime = 0;
 
 // Timer
 Timer timer;
@@ -72,11 +109,18 @@ Timer timer;
 // Buffer
 Buffer* frameBuffer;
 
+// Scene cuts & QP of the single session encode, when enabled
+Lookahead lookahead;
+
+// Bitrate of every segment of the second pass, when enabled
+TwoPassStats twoPass;
+
 
 DWORD WINAPI threadMonitor(LPVOID id)
 {
-    unsigned int gpuFreq, size, prev_currentFrame = 0;
-    clGetDeviceInfo(clDeviceID, CL_DEVICE_MAX_CLOCK_FREQUENCY, sizeof(unsigned int), &gpuFreq, &size);
+    unsigned int gpuFreq = 0, size, prev_currentFrame = 0;
+    if (backend == &vceBackend && clDeviceID)
+        clGetDeviceInfo(clDeviceID, CL_DEVICE_MAX_CLOCK_FREQUENCY, sizeof(unsigned int), &gpuFreq, &size);
 
 	// Show Info
     fprintf(stderr, "Width       %d\n", info->width);
@@ -85,12 +129,14 @@ DWORD WINAPI threadMonitor(LPVOID id)
 	fprintf(stderr, "Frames      %d\n", info->num_frames);
 	fprintf(stderr, "Duration    %d s\n", info->num_frames * info->fps_denominator /  info->fps_numerator);
 	fprintf(stderr, "GPU Freq    %6.2f MHz\n", (float)gpuFreq);
+	fprintf(stderr, "Backend     %s\n", backend->name);
 
 	// wait
-	while (currentFrame == 0)
+	while (currentFrame <= firstFrame)
 		Sleep(5);
 
 	double prev_time = timer.getInMicroSec();
+	prev_currentFrame = firstFrame;
 
 	// Show loop
 	fprintf(stderr, "\n");
@@ -107,10 +153,10 @@ DWORD WINAPI threadMonitor(LPVOID id)
 		prev_currentFrame = currentFrame_snapshot;
 
 		time *= 0.000001;
-		double fps = currentFrame_snapshot / time;
+		double fps = (currentFrame_snapshot - firstFrame) / time;
 
-    	unsigned int remaining_s = time * (double)info->num_frames /
-						(double)currentFrame_snapshot - time;
+    	unsigned int remaining_s = time * (double)(info->num_frames - currentFrame_snapshot) /
+						(double)(currentFrame_snapshot - firstFrame);
 
 		unsigned int elapsed_s = time;
     	unsigned int elapsed_h = elapsed_s / 3600;
@@ -134,52 +180,56 @@ DWORD WINAPI threadMonitor(LPVOID id)
 }
 
 
+DWORD WINAPI threadAvsInit(LPVOID input)
+{
+    Timer avsTimer;
+    avsTimer.start();
+    avsInitStatus = AVS_Init((char*)input);
+    avsInitTime = avsTimer.getElapsedTime();
+    return 0;
+}
+
+
 DWORD WINAPI threadAvsDec(LPVOID id)
 {
-	BYTE pUVrow[info->width];
-	for (int f = 0; f < info->num_frames; f++)
+	// with the lookahead the frames wait here until they are decided
+	BYTE *pending[LOOKAHEAD_MAX_FRAMES + 1];
+	unsigned int written = 0;
+
+	for (int f = firstFrame; f < info->num_frames; f++)
 	{
 		while (BufferIsFull(frameBuffer))
 			Sleep(250); // only bad if encodes more than 1000fps, then decrease
 
-		AVS_VideoFrame *frame = avs_get_frame(clip, f);
-
-        const BYTE *pYplane = avs_get_read_ptr_p(frame, AVS_PLANAR_Y);
-        const BYTE *pUplane = avs_get_read_ptr_p(frame, AVS_PLANAR_U);
-		const BYTE *pVplane = avs_get_read_ptr_p(frame, AVS_PLANAR_V);
 		BYTE *frameData  = (BYTE*) malloc(hostPtrSize);
+		if (playlist.count)
+			playlistFrameNV12(&playlist, f, frameData, alignedSurfaceWidth);
+		else
+			avsGetFrameNV12(f, frameData, alignedSurfaceWidth);
 
-		BYTE *pBuf = frameData;
-
-        // Y plane
-        unsigned int pitch = avs_get_pitch_p(frame, AVS_PLANAR_Y);
-		for (int h = 0; h < info->height; h++)
+		if (lookahead.config.frames == 0)
 		{
-			memcpy(pBuf, pYplane, info->width);
-			pBuf += alignedSurfaceWidth;
-			pYplane += pitch;
+			BufferWrite(frameBuffer, (BufferType)frameData);
+			continue;
 		}
 
-		// UV planes
-		unsigned int uiHalfHeight = info->height >> 1;
-		unsigned int uiHalfWidth  = info->width >> 1; //chromaWidth
-		unsigned int pos = 0;
-		for (unsigned int h = 0; h < uiHalfHeight; h++)
+		pending[(f - firstFrame) % (LOOKAHEAD_MAX_FRAMES + 1)] = frameData;
+		lookaheadAnalyze(&lookahead, frameData, alignedSurfaceWidth);
+		for (; written < lookahead.decided; written++)
 		{
-			for (unsigned int i = 0; i < uiHalfWidth; ++i)
-			{
-				pUVrow[i*2]     = pUplane[pos + i];
-				pUVrow[i*2 + 1] = pVplane[pos + i];
-			}
-			memcpy(pBuf, pUVrow, info->width);
-			pBuf += alignedSurfaceWidth;
-			pos += uiHalfWidth;
+			while (!BufferWrite(frameBuffer, (BufferType)pending[written % (LOOKAHEAD_MAX_FRAMES + 1)]))
+				Sleep(5);
 		}
+	}
 
-		BufferWrite(frameBuffer, (BufferType)frameData);
-
-        // not sure release is needed, but it doesn't cause an error
-        avs_release_frame(frame);
+	if (lookahead.config.frames)
+	{
+		lookaheadFlush(&lookahead);
+		for (; written < lookahead.decided; written++)
+		{
+			while (!BufferWrite(frameBuffer, (BufferType)pending[written % (LOOKAHEAD_MAX_FRAMES + 1)]))
+				Sleep(5);
+		}
 	}
 	return 0;
 }
@@ -187,95 +237,92 @@ DWORD WINAPI threadAvsDec(LPVOID id)
 /*******************************************************************************
  *  @fn     encodeProcess
  *  @brief  Encode an input video file and output encoded H.264 video file
- *  @param[in] encodeHandle : Hanlde for the encoder
+ *  @param[in] session      : Encoder session, with the frame format filled
+ *  @param[in] device       : Device on which the session is created
  *  @param[out] outFile		: output encoded H.264 video file
- *  @param[in] oveContext   : Hanlde to the encoder context
- *  @param[in] deviceID     : Device on which encoder context to be created
  *  @param[in] pConfig      : OvConfigCtrl
  *  @return bool : true if successful; otherwise false.
  ******************************************************************************/
-bool encodeProcess(OVEncodeHandle *encodeHandle, char *outFile,
-			OPContextHandle oveContext, unsigned int deviceId, OvConfigCtrl *pConfig)
+bool encodeProcess(EncoderSession *session, EncoderDevice *device, char *outFile, OvConfigCtrl *pConfig)
 {
-    cl_int err;
-    unsigned int numEventInWaitList = 0;
-    OPMemHandle inputSurface;
-    OVresult res = 0;
-
+    const EncoderBackend *encoder = session->backend;
 
     // Initilizes encoder session & buffers
-    // Create an OVE Session (Platform context, id, mode, profile, format, ...)
-    // encode task priority. FOR POSSIBLY LOW LATENCY OVE_ENCODE_TASK_PRIORITY_LEVEL2 */
-    encodeHandle->session = OVEncodeCreateSession(oveContext, deviceId,
-                                pConfig->encodeMode, pConfig->profileLevel,
-                                pConfig->pictFormat, info->width,
-                                info->height, pConfig->priority);
-
-    if (encodeHandle->session == NULL)
-    {
-        fprintf(stderr, "OVEncodeCreateSession failed.\n");
+    Timer sessionTimer;
+    sessionTimer.start();
+    if (!encoder->createSession(session, device, pConfig))
         return false;
-    }
 
     // Configure the encoding engine based upon the config file specifications
-    res = setEncodeConfig(encodeHandle->session, pConfig);
-    if (!res)
+    if (!encoder->sendConfig(session, pConfig, ENC_CONFIG_ALL))
     {
         fprintf(stderr, "OVEncodeSendConfig returned error\n");
         return false;
     }
+    fprintf(stderr, "Session     %.3f s\n", sessionTimer.getElapsedTime());
 
-    // Create a command queue
-    encodeHandle->clCmdQueue = clCreateCommandQueue((cl_context)oveContext, clDeviceID, 0, &err);
-    if(err != CL_SUCCESS)
-    {
-        fprintf(stderr, "Create command queue failed! Error :%d\n", err);
-        return false;
-    }
-
-
-    for(int i = 0; i < MAX_INPUT_SURFACE; i++)
-    {
-        encodeHandle->inputSurfaces[i] = clCreateBuffer((cl_context)oveContext, CL_MEM_READ_WRITE, hostPtrSize, NULL, &err);
-
-        if (err != CL_SUCCESS)
-        {
-            fprintf(stderr, "clCreateBuffer returned error %d\n", err);
-            return false;
-        }
-    }
+    // .m3u8 & .mpd: the segments have their own files, written next to the playlist
+    Segmenter seg;
+    bool segmented = segmentIsOutput(outFile);
+    if (segmented)
+        segmentOpen(&seg, outFile, info, pConfig, &keyframes);
 
-    // Output file handle
-    FILE *fw = fopen(outFile, "wb");
-    if (fw == NULL)
-    {
-        printf("Error opening the output file %s\n", outFile);
+    // Output file, truncated at the checkpoint when resumed, or the standard output
+    OutputFile output;
+    if (!segmented && !outputOpen(&output, outFile, firstOffset, outputEstimate(pConfig, info)))
         return false;
-    }
-
-    // Setup the picture parameters
-    OVE_ENCODE_PARAMETERS_H264 pictureParameter;
-    unsigned int numEncodeTaskInputBuffers = 1;
-    OVE_INPUT_DESCRIPTION *encodeTaskInputBufferList
-			= (OVE_INPUT_DESCRIPTION *) malloc(sizeof(OVE_INPUT_DESCRIPTION) *
-				numEncodeTaskInputBuffers);
+    uint64 outputSize = firstOffset;
+
+    // The output of the tasks is written by the writer thread of the arena
+    BitstreamArena arena;
+    if (!segmented)
+        arenaOpen(&arena, &output);
+    bool status = true;
+
+    // .mp4: the access units are muxed in fragments, with the audio of the script
+    Mp4Muxer mux;
+    bool mp4 = mp4IsOutput(outFile);
+    if (mp4)
+        mp4Open(&mux, info, playlist.count ? NULL : clip);
+
+    // .ts, -ts & udp://: every access unit is a PES packet
+    TsMuxer ts;
+    bool tsOutput = tsIsOutput(outFile);
+    if (tsOutput)
+        tsOpen(&ts, info);
+
+    // Annex-B: the AUDs & SPS/PPS of the [rewrite] section are spliced in
+    NalRewriter rewriter;
+    rewriteOpen(&rewriter, !mp4 && !tsOutput && !segmented);
 
 	OVE_OUTPUT_DESCRIPTION taskDescriptionList = {sizeof(OVE_OUTPUT_DESCRIPTION), 0, OVE_TASK_STATUS_NONE, 0, 0};
 
 	// Setup the picture parameters
+    OVE_ENCODE_PARAMETERS_H264 pictureParameter;
 	memset(&pictureParameter, 0, sizeof(OVE_ENCODE_PARAMETERS_H264));
 	pictureParameter.size = sizeof(OVE_ENCODE_PARAMETERS_H264);
 	pictureParameter.flags.value = 0;
 	pictureParameter.flags.flags.reserved = 0;
-	pictureParameter.insertSPS = (OVE_BOOL)(currentFrame == 0);
+	pictureParameter.insertSPS = (OVE_BOOL)true;
 	pictureParameter.pictureStructure = OVE_PICTURE_STRUCTURE_H264_FRAME;
 	pictureParameter.forceRefreshMap = (OVE_BOOL)true;
 	pictureParameter.forceIMBPeriod = 0;
 	pictureParameter.forcePicType = OVE_PICTURE_TYPE_H264_NONE;
 
+	// Keyframes of the list, with SPS/PPS only on them
+	unsigned int keyframeCursor = 0;
+	unsigned int nextKeyframe = keyframeNext(&keyframes, &keyframeCursor);
+	while (nextKeyframe < firstFrame)
+		nextKeyframe = keyframeNext(&keyframes, &keyframeCursor);
+	if (keyframes.count)
+		pictureParameter.insertSPS = (OVE_BOOL)false;
+
+	// Latency of every frame, for the index
+	Timer taskTimer;
+
 
 	// Go!
-    for (currentFrame = 0; currentFrame < (unsigned)info->num_frames; currentFrame++)
+    for (currentFrame = firstFrame; currentFrame < (unsigned)info->num_frames; currentFrame++)
     {
     	if (GetAsyncKeyState(VK_F8))
 			break;
@@ -283,106 +330,142 @@ bool encodeProcess(OVEncodeHandle *encodeHandle, char *outFile,
 		while (BufferIsEmpty(frameBuffer))
 			Sleep(250); // only bad if encodes more than 1000fps
 
-        inputSurface = encodeHandle->inputSurfaces[currentFrame % MAX_INPUT_SURFACE];
-
-        cl_int status;
-		cl_event inMapEvt, unmapEvent;
-        void* mapPtr = clEnqueueMapBuffer(encodeHandle->clCmdQueue, (cl_mem)inputSurface,
-										CL_TRUE, CL_MAP_READ | CL_MAP_WRITE, 0,
-										hostPtrSize, 0, NULL, &inMapEvt, &status);
-
-        clFlush(encodeHandle->clCmdQueue);
-        waitForEvent(inMapEvt);
-        clReleaseEvent(inMapEvt);
-
-		//Read into the input surface buffer
-        BufferType pBuf = 0;
-        BufferRead(frameBuffer, &pBuf);
-        memcpy((BYTE*)mapPtr, (BYTE*)pBuf, hostPtrSize);
-        free(pBuf);
-
-        clEnqueueUnmapMemObject(encodeHandle->clCmdQueue, (cl_mem)inputSurface, mapPtr, 0, NULL, &unmapEvent);
-        clFlush(encodeHandle->clCmdQueue);
-        waitForEvent(unmapEvent);
-        clReleaseEvent(unmapEvent);
-
-        // use the input surface buffer as our Picture
-        encodeTaskInputBufferList[0].bufferType = OVE_BUFFER_TYPE_PICTURE;
-        encodeTaskInputBufferList[0].buffer.pPicture =  (OVE_SURFACE_HANDLE) inputSurface;
-
-        // Encode a single picture.
-        // calling VCE for frame encode
-
 		// http://stackoverflow.com/questions/9618369/h-264-over-rtp-identify-sps-and-pps-frames
         // pictureParameter.insertSPS = (OVE_BOOL)(currentFrame == 0);
 
-		OPEventHandle event;
-		unsigned int iTaskID;
+        // Bitrate of the segment, from the first pass
+        if (twoPass.numSegments && (currentFrame % twoPass.segmentFrames == 0 || currentFrame == firstFrame))
+        {
+            pConfig->rateControl.encRateControlTargetBitRate = twoPass.segmentRate[currentFrame / twoPass.segmentFrames];
+            if (!encoder->sendConfig(session, pConfig, ENC_CONFIG_RATE))
+            {
+                fprintf(stderr, "OVEncodeSendConfig returned error\n");
+                status = false;
+                break;
+            }
+        }
+
+        // Scene cut IDR & QP of the lookahead
+        if (lookahead.config.frames)
+        {
+            LookaheadDecision *decision = &lookahead.decisions[currentFrame - firstFrame];
+            pictureParameter.forcePicType = decision->idr ? OVE_PICTURE_TYPE_H264_IDR : OVE_PICTURE_TYPE_H264_NONE;
+            if (decision->qpI != pConfig->rateControl.encQP_I || decision->qpP != pConfig->rateControl.encQP_P)
+            {
+                pConfig->rateControl.encQP_I = decision->qpI;
+                pConfig->rateControl.encQP_P = decision->qpP;
+                if (!encoder->sendConfig(session, pConfig, ENC_CONFIG_RATE))
+                {
+                    fprintf(stderr, "OVEncodeSendConfig returned error\n");
+                    status = false;
+                    break;
+                }
+            }
+        }
 
-        res = OVEncodeTask(encodeHandle->session, numEncodeTaskInputBuffers,
-                  encodeTaskInputBufferList, &pictureParameter, &iTaskID,
-                  numEventInWaitList, NULL, &event);
+        // IDR of the keyframe list, or of the checkpoint the encode resumes from
+        bool keyframe = currentFrame == nextKeyframe || (firstFrame && currentFrame == firstFrame);
+        if (keyframe)
+            nextKeyframe = keyframeNext(&keyframes, &keyframeCursor);
 
-        if (!res)
+        // Reconfiguration sent to the control pipe
+        if (control.pending && !controlApply(&control, session, pConfig, currentFrame, &keyframe))
         {
-            fprintf(stderr, "OVEncodeTask returned error %d\n", res);
-            return false;
+            status = false;
+            break;
         }
 
-        // Wait for Encode session completes
-        err = clWaitForEvents(1, (cl_event*)&(event));
-        if (err != CL_SUCCESS)
+        if (keyframe)
         {
-        	fprintf(stderr, "clWaitForEvents returned error %d\n", err);
-            return false;
+            pictureParameter.forcePicType = OVE_PICTURE_TYPE_H264_IDR;
+            pictureParameter.insertSPS = (OVE_BOOL)true;
         }
 
-        // Query output
-		unsigned int numTaskDescriptionsRequested = 1;
-		unsigned int numTaskDescriptionsReturned = 0;
+        // Encode a single picture.
+        BufferType pBuf = 0;
+        BufferRead(frameBuffer, &pBuf);
+        unsigned int iTaskID;
+        taskTimer.start();
+        bool submitted = encoder->submit(session, (BYTE*)pBuf, &pictureParameter, &iTaskID);
+        free(pBuf);
 
-        //do
-        //{
-            res = OVEncodeQueryTaskDescription(encodeHandle->session, numTaskDescriptionsRequested,
-                                               &numTaskDescriptionsReturned, &taskDescriptionList);
-            if (!res)
-            {
-                fprintf(stderr, "OVEncodeQueryTaskDescription returned error %d\n", err);
-                return false;
-            }
-        //}
-        //while (taskDescriptionList.status == OVE_TASK_STATUS_NONE);
+        if (keyframe)
+        {
+            pictureParameter.forcePicType = OVE_PICTURE_TYPE_H264_NONE;
+            pictureParameter.insertSPS = (OVE_BOOL)(keyframes.count == 0);
+        }
 
+        // Wait for the task and query output
+        if (!submitted || !encoder->query(session, &taskDescriptionList))
+        {
+            status = false;
+            break;
+        }
 
 		#ifdef DEBUG
-        if (numTaskDescriptionsReturned > 1)
-			fprintf(stderr, "Warning: numTaskDescriptions returned: %d\n", numTaskDescriptionsReturned);
-
 		if (taskDescriptionList.status != OVE_TASK_STATUS_COMPLETE)
 			fprintf(stderr, "Warning: taskDescriptionList.status returned: %d\n", taskDescriptionList.status);
 		#endif
 
-        // Write compressed frame to the output file
+        // Copy the compressed frame to the arena, the task is released right away
 		if (taskDescriptionList.status == OVE_TASK_STATUS_COMPLETE &&
 				taskDescriptionList.size_of_bitstream_data > 0)
 		{
-			// Write output data
-			fwrite(taskDescriptionList.bitstream_data, 1,
-				   taskDescriptionList.size_of_bitstream_data, fw);
-
-			OVEncodeReleaseTask(encodeHandle->session, taskDescriptionList.taskID);
+			// an IDR is a point the encode can resume from, once the output before it is written
+			if (journal.fj && journalDue(&journal) &&
+					annexbIsIdr((BYTE*)taskDescriptionList.bitstream_data,
+					            taskDescriptionList.size_of_bitstream_data) &&
+					arenaFlush(&arena))
+				journalCheckpoint(&journal, &output, currentFrame, outputSize);
+
+			if (segmented)
+				status = segmentAppend(&seg, (BYTE*)taskDescriptionList.bitstream_data,
+				                       taskDescriptionList.size_of_bitstream_data);
+			else if (mp4)
+				status = mp4Append(&mux, &arena, (BYTE*)taskDescriptionList.bitstream_data,
+				                   taskDescriptionList.size_of_bitstream_data);
+			else if (tsOutput)
+			{
+				tsMuxFrame(&ts, (BYTE*)taskDescriptionList.bitstream_data,
+				           taskDescriptionList.size_of_bitstream_data, currentFrame);
+				status = arenaAppend(&arena, ts.data, ts.size);
+			}
+			else
+			{
+				// the payload is copied once, between the NAL units inserted
+				rewriteFrame(&rewriter, (BYTE*)taskDescriptionList.bitstream_data,
+				             taskDescriptionList.size_of_bitstream_data);
+				for (unsigned int i = 0; i < rewriter.count && status; i++)
+					status = arenaAppend(&arena, rewriter.fragments[i].data, rewriter.fragments[i].size);
+
+				// the NAL headers are read while the frame is in the cache
+				if (nalIndex.fi)
+					indexFrame(&nalIndex, currentFrame, outputSize, rewriter.fragments, rewriter.count,
+					           taskTimer.getInMicroSec());
+				outputSize += rewriter.size;
+			}
 		}
-
-        if (event)
-            clReleaseEvent((cl_event) event);
+		releaseQueried(session, &taskDescriptionList);
+		if (!status)
+			break;
     }
 
 
 	// Free memory resources
-    fclose(fw);
-    free(encodeTaskInputBufferList);
+    if (mp4)
+        status = mp4Close(&mux, &arena) && status;
+    if (tsOutput)
+        tsClose(&ts);
+    rewriteClose(&rewriter);
+    if (segmented)
+        status = segmentClose(&seg) && status;
+    else
+    {
+        status = arenaClose(&arena) && status;
+        status = outputClose(&output) && status;
+    }
 
-    return true;
+    return status;
 }
 
 
@@ -390,7 +473,67 @@ bool encodeProcess(OVEncodeHandle *encodeHandle, char *outFile,
 void showHelp()
 {
     puts("Help on encoding usages and configurations...\n");
-    puts("AvsVCEh264 -i input.avs -o output.h264 -c configFile.ini\n");
+    puts("AvsVCEh264 -i input.avs -o output.h264 -c configFile.ini [-b vce|sim|sw] [-p sessions]\n"
+         "           [-farm port [-w workers]] [-2pass] [-k keyframes.txt] [-live]\n"
+         "           [-control name] [-resume] [-incremental] [-ts] [-index bin|csv]\n");
+    puts("AvsVCEh264 -i input.avs -o output.h264 -c configFile.ini -from encoded.h264 -cut cuts.txt\n");
+    puts("AvsVCEh264 -playlist scripts.txt -o output.h264 -c configFile.ini [-b vce|sim|sw] [-k keyframes.txt]\n"
+         "           [-control name]\n");
+    puts("AvsVCEh264 -worker host:port [-b vce|sim|sw] [-c configFile.ini]\n");
+    puts("AvsVCEh264 -i input.avs -o output.h264 -c config1.ini -c config2.ini ... [-b vce|sim|sw]\n");
+    puts("AvsVCEh264 -i input.avs -ladder ladder.txt [-b vce|sim|sw] [-k keyframes.txt]\n");
+    puts("AvsVCEh264 -jobs jobList.txt [-b vce|sim|sw] [-c configFile.ini]\n");
+    puts("AvsVCEh264 -daemon [-b vce|sim|sw] [-c configFile.ini]\n");
+    puts("AvsVCEh264 -submit -i input.avs -o output.h264 -c configFile.ini\n");
+    puts("AvsVCEh264 -stop\n");
+    puts("AvsVCEh264 -control name -send \"bitrate 4000000 peak 6000000 idr\"\n");
+    puts("  -b : encoder backend, vce (default), sim (simulator, no VCE needed)\n"
+         "       or sw (software encoder, no VCE needed)\n");
+    puts("  -p : chunked mode, the clip is split in segments encoded concurrently\n"
+         "       with this many sessions on every device\n");
+    puts("  -farm : farm coordinator, the segments are encoded by the workers\n"
+         "          that connect to this TCP port\n");
+    puts("  -w : worker processes started on this machine by the coordinator\n");
+    puts("  -worker : encodes segments for the coordinator at host:port\n");
+    puts("  -2pass : a fast first pass measures the clip, the second one spreads\n"
+         "           the target bitrate over it by complexity (CBR & VBR)\n");
+    puts("  -k : frames encoded as IDRs with SPS/PPS, numbers separated by spaces,\n"
+         "       commas or lines (single session, sweep & ladder)\n");
+    puts("  -live : live source, a queue of 1-2 frames, intra refresh & frames\n"
+         "          dropped past their deadline, latency percentiles at the end\n");
+    puts("  -control : changes are accepted on \\\\.\\pipe\\name while encoding\n");
+    puts("  -send : sends a change to a running encode: bitrate, peak, qpI, qpP,\n"
+         "          qpB & idrPeriod with their values, idr to apply it on an IDR\n");
+    puts("  -resume : continues a stopped or crashed encode from the last IDR\n"
+         "            recorded in output.h264.journal\n");
+    puts("  -incremental : hashes every frame & encodes only the GOPs that changed\n"
+         "                 since the previous output, the others are copied\n");
+    puts("  -cut : writes the ranges of frames of the list, one per line: first last,\n"
+         "         copied from the -from stream, only the frames before the first\n"
+         "         IDR of each range are encoded again\n");
+    puts("  -playlist : encodes the scripts of the list, one per line, into one\n"
+         "              stream with a single session, instead of -i\n");
+    puts("  -o output.mp4 : muxes the stream in MP4 fragments starting at the\n"
+         "                  IDRs, with the audio of the script (single session)\n");
+    puts("  -o output.m3u8 : writes HLS segments of fMP4, output-00001.m4s..., and\n"
+         "                   updates the playlist as each one is done; DASH with\n"
+         "                   output.mpd (single session)\n");
+    puts("  -o - : writes the stream to the standard output (single session,\n"
+         "         chunked, live & smart cut)\n");
+    puts("  -index bin|csv : writes output.h264.idx or output.h264.csv, the offset,\n"
+         "                   size, NAL types & latency of every frame\n");
+    puts("  -ts : writes an MPEG transport stream, also for an output ending in .ts\n"
+         "        or udp://host:port (live only)\n");
+    puts("  -probe : probes the devices instead of reading them from the cache\n");
+    puts("  -jobs : encodes the jobs of the list at the same time, one per line:\n"
+         "          input.avs output.h264 configFile.ini [weight [priority]]\n");
+    puts("  -c : several configuration files make a sweep, the clip is decoded once\n"
+         "       & encoded with all of them into output.config1.h264, ...\n");
+    puts("  -ladder : decodes the clip once & encodes the renditions of the list,\n"
+         "            one per line: width height output.h264 configFile.ini\n"
+         "            [bilinear|bicubic|lanczos]\n");
+    puts("  -daemon : keeps the encoder warm & encodes the jobs sent with -submit,\n"
+         "            until -stop\n");
 }
 
 int GetWindowsVersion()
@@ -403,18 +546,117 @@ int GetWindowsVersion()
 	return GetVersionEx(&vInfo) ? vInfo.dwMajorVersion : 0;
 }
 
+/*******************************************************************************
+ *  @fn     openDevices
+ *  @brief  Queries the devices of the backend & creates their encoder contexts
+ *  @param[out] deviceHandle : Hanlde for the device information
+ *  @param[in] configFile    : User configuration file name or NULL
+ *  @param[in] allDevices    : Use every device instead of the first one
+ *  @param[in] useCache      : Read the devices & capabilities from the cache
+ *  @param[out] numDevices   : Devices returned
+ *  @return EncoderDevice* : the devices or NULL if failed.
+ ******************************************************************************/
+EncoderDevice *openDevices(OVDeviceHandle *deviceHandle, char *configFile, bool allDevices,
+                           bool useCache, unsigned int *numDevices)
+{
+    puts("Initializing Encoder...\n");
+    memset(deviceHandle, 0, sizeof(OVDeviceHandle));
+    bool status;
+    if (backend == &vceBackend)
+    {
+        status = getDevice(deviceHandle, useCache);
+    }
+    else if (backend == &simBackend)
+    {
+        simInit(configFile);
+        status = simGetDevice(deviceHandle);
+    }
+    else
+    {
+        status = swGetDevice(deviceHandle);
+    }
+    if (status == false)
+        return NULL;
+
+    // Check deviceHandle.numDevices for number of devices and choose the device on
+    // which user wants to create the encoder. In this case device 0 is choosen,
+    // the chunked mode uses all of them.
+    *numDevices = allDevices ? deviceHandle->numDevices : 1;
+
+    // Create the encoder context on the devices specified by deviceID
+    EncoderDevice *devices = new EncoderDevice[*numDevices];
+    for (unsigned int d = 0; d < *numDevices; d++)
+    {
+        devices[d].context = NULL;
+        devices[d].deviceId = deviceHandle->deviceInfo[d].device_id;
+        if (backend == &vceBackend)
+            encodeCreate(&devices[d].context, devices[d].deviceId, deviceHandle);
+    }
+    clDeviceID = reinterpret_cast<cl_device_id>(devices[0].deviceId);
+
+    // The capabilities are known now, the next runs can skip the probing. The
+    // cache holds every device, the ones this run does not use are probed too.
+    if (backend == &vceBackend && !deviceHandle->cached)
+    {
+        for (unsigned int d = *numDevices; d < deviceHandle->numDevices; d++)
+        {
+            OPContextHandle context = NULL;
+            encodeCreate(&context, deviceHandle->deviceInfo[d].device_id, deviceHandle);
+            encodeDestroy(context);
+        }
+        writeDeviceCache(deviceHandle);
+    }
+    return devices;
+}
+
+
+/*******************************************************************************
+ *  @fn     closeDevices
+ *  @brief  Destroys the encoder contexts & frees the device information
+ *  @return bool : true if successful; otherwise false.
+ ******************************************************************************/
+bool closeDevices(EncoderDevice *devices, unsigned int numDevices, OVDeviceHandle *deviceHandle)
+{
+    bool status = true;
+    for (unsigned int d = 0; d < numDevices; d++)
+        status = encodeDestroy(devices[d].context) && status;
+    delete [] devices;
+
+    // Free memory used for deviceInfo.
+    delete [] deviceHandle->deviceInfo;
+    delete [] deviceHandle->caps;
+    return status;
+}
+
+
 int main(int argc, char* argv[])
 {
     char input[255] = {0};
     char output[255] = {0};
     char configFile[255] = {0};
-
-	// Currently the OpenEncode support is only for vista and w7
-    if(GetWindowsVersion() < 6)
-    {
-        puts("Error : Unsupported OS! Vista/Win7 required.\n");
-        return 1;
-    }
+    char *configs[LADDER_MAX_RENDITIONS];  // sweep mode if more than one
+    int numConfigs = 0;
+    unsigned int sessionsPerDevice = 0;    // chunked mode if > 0
+    char workerOf[255] = {0};              // farm worker mode, coordinator address
+    char jobList[255] = {0};               // job list mode
+    char ladderFile[255] = {0};            // ladder mode, renditions
+    char keyframeFile[255] = {0};          // frames forced to IDR
+    bool daemonMode = false;               // serve the jobs of -submit
+    bool submit = false;                   // send the job to the daemon
+    bool stopDaemon = false;
+    bool useCache = true;                  // devices from the cache, unless -probe
+    bool twoPassMode = false;
+    bool liveMode = false;                 // low latency, frames dropped when late
+    bool resume = false;                   // continue from the last checkpoint
+    bool incremental = false;              // reuse the unchanged GOPs of the output
+    char playlistFile[255] = {0};          // scripts encoded one after another
+    char cutFile[255] = {0};               // smart cut, ranges kept
+    char cutSource[255] = {0};             // stream that is cut
+    char controlName[255] = {0};           // control pipe of the encode
+    char controlCommand[600] = {0};        // request sent to a running encode
+    char indexFormat[8] = {0};             // sidecar index, bin or csv
+    unsigned int farmPort = 0;             // farm coordinator mode if > 0
+    unsigned int localWorkers = 0;
 
     // Helps on command line configuration usage cases
     if (argc < 2)
@@ -427,66 +669,528 @@ int main(int argc, char* argv[])
     int argCheck = 0;
     for (int i = 0; i < argc; i++)
     {
-        if (strncmp(argv[i], "-h", 2) == 0)
+        if (strcmp(argv[i], "-h") == 0)
         {
             showHelp();
             return 1;
         }
 
+        // daemon
+        if (strcmp(argv[i], "-daemon") == 0)
+            daemonMode = true;
+        if (strcmp(argv[i], "-submit") == 0)
+            submit = true;
+        if (strcmp(argv[i], "-stop") == 0)
+            stopDaemon = true;
+
+        // probe the devices again, refreshing the cache
+        if (strcmp(argv[i], "-probe") == 0)
+            useCache = false;
+
+        // two pass encode
+        if (strcmp(argv[i], "-2pass") == 0)
+            twoPassMode = true;
+
+        // live mode
+        if (strcmp(argv[i], "-live") == 0)
+            liveMode = true;
+
+        // resume from the journal of the output
+        if (strcmp(argv[i], "-resume") == 0 || strcmp(argv[i], "--resume") == 0)
+            resume = true;
+
+        // incremental encode
+        if (strcmp(argv[i], "-incremental") == 0)
+            incremental = true;
+
+        // transport stream output
+        if (strcmp(argv[i], "-ts") == 0)
+            tsForce = true;
+
+        // the remaining switches take a value
+        if (i + 1 >= argc)
+            break;
+
         // input file
-        if (strncmp (argv[i], "-i", 2) == 0)
+        if (strcmp(argv[i], "-i") == 0)
         {
             strcat(input, argv[i+1]);
             argCheck++;
         }
 
+        // playlist, instead of the input file
+        if (strcmp(argv[i], "-playlist") == 0)
+        {
+            strcat(playlistFile, argv[i+1]);
+            argCheck++;
+        }
+
         // output file
-        if (strncmp (argv[i], "-o", 2) == 0 )
+        if (strcmp(argv[i], "-o") == 0)
         {
             strcat(output, argv[i+1]);
             argCheck++;
         }
 
-		// config file
-        if (strncmp(argv[i], "-c", 2) == 0 )
+		// config file, several for a sweep
+        if (strcmp(argv[i], "-c") == 0)
         {
-            strcat(configFile, argv[i+1]);
-            argCheck++;
+            if (numConfigs == 0)
+            {
+                strcat(configFile, argv[i+1]);
+                argCheck++;
+            }
+            if (numConfigs == LADDER_MAX_RENDITIONS)
+            {
+                fprintf(stderr, "Too many configuration files, at most %d\n", LADDER_MAX_RENDITIONS);
+                return 1;
+            }
+            configs[numConfigs++] = argv[i+1];
+        }
+
+        // chunked mode, sessions per device
+        if (strcmp(argv[i], "-p") == 0)
+        {
+            sessionsPerDevice = atoi(argv[i+1]);
+            if (sessionsPerDevice == 0)
+            {
+                fprintf(stderr, "Invalid number of sessions per device %s\n", argv[i+1]);
+                return 1;
+            }
+        }
+
+        // farm coordinator, TCP port
+        if (strcmp(argv[i], "-farm") == 0)
+        {
+            farmPort = atoi(argv[i+1]);
+            if (farmPort == 0 || farmPort > 65535)
+            {
+                fprintf(stderr, "Invalid port %s\n", argv[i+1]);
+                return 1;
+            }
+        }
+
+        // farm, local worker processes
+        if (strcmp(argv[i], "-w") == 0)
+            localWorkers = atoi(argv[i+1]);
+
+        // farm worker, coordinator address
+        if (strcmp(argv[i], "-worker") == 0)
+            strcat(workerOf, argv[i+1]);
+
+        // job list
+        if (strcmp(argv[i], "-jobs") == 0)
+            strcat(jobList, argv[i+1]);
+
+        // ladder
+        if (strcmp(argv[i], "-ladder") == 0)
+            strcat(ladderFile, argv[i+1]);
+
+        // keyframe list
+        if (strcmp(argv[i], "-k") == 0)
+            strcat(keyframeFile, argv[i+1]);
+
+        // smart cut of an encoded stream
+        if (strcmp(argv[i], "-cut") == 0)
+            strcat(cutFile, argv[i+1]);
+        if (strcmp(argv[i], "-from") == 0)
+            strcat(cutSource, argv[i+1]);
+
+        // frame index next to the output
+        if (strcmp(argv[i], "-index") == 0)
+            strncat(indexFormat, argv[i+1], sizeof(indexFormat) - 1);
+
+        // control pipe & request sent to it
+        if (strcmp(argv[i], "-control") == 0)
+            strcat(controlName, argv[i+1]);
+        if (strcmp(argv[i], "-send") == 0)
+            strncat(controlCommand, argv[i+1], sizeof(controlCommand) - 1);
+
+        // encoder backend
+        if (strcmp(argv[i], "-b") == 0)
+        {
+            backend = findBackend(backends, argv[i+1]);
+            if (backend == NULL)
+            {
+                fprintf(stderr, "Unknown encoder backend %s\n", argv[i+1]);
+                return 1;
+            }
         }
     }
 
-    if(argCheck != 3)
+    // A change for a running encode
+    if (controlCommand[0])
+    {
+        if (controlName[0] == 0)
+        {
+            fprintf(stderr, "-send needs the -control name of the encode\n");
+            return 1;
+        }
+        return controlSend(controlName, controlCommand) ? 0 : 1;
+    }
+
+    if (stopDaemon)
+        return daemonSubmit(input, output, configFile, true) ? 0 : 1;
+
+    if(argCheck != 3 && workerOf[0] == 0 && jobList[0] == 0 && !daemonMode &&
+            (ladderFile[0] == 0 || input[0] == 0))
     {
         showHelp();
         return 1;
     }
 
-	// Init Avisync
-	if (!AVS_Init(input))
+    // The stream goes to the standard output, the messages to stderr
+    if (strcmp(output, "-") == 0)
+    {
+        if (submit || farmPort || ladderFile[0] || numConfigs > 1 || incremental || resume)
+        {
+            fprintf(stderr, "-o - needs the single session, chunked, live or smart cut encode\n");
+            return 1;
+        }
+        if (!outputRedirectStdout())
+            return 1;
+    }
+
+    // The daemon encodes it
+    if (submit)
+        return daemonSubmit(input, output, configFile, false) ? 0 : 1;
+
+	// Currently the OpenEncode support is only for vista and w7
+    if(backend == &vceBackend && GetWindowsVersion() < 6 && farmPort == 0)
+    {
+        puts("Error : Unsupported OS! Vista/Win7 required.\n");
         return 1;
+    }
+
+    OVDeviceHandle deviceHandle;
+    unsigned int numDevices;
+    EncoderDevice *devices;
+    bool status;
+
+    // Farm worker: the coordinator sends the script & the configuration
+    if (workerOf[0])
+    {
+        devices = openDevices(&deviceHandle, configFile[0] ? configFile : NULL, false, useCache, &numDevices);
+        if (devices == NULL)
+            return 1;
+
+        status = farmWorker(workerOf, backend, &devices[0]);
+        status = closeDevices(devices, numDevices, &deviceHandle) && status;
+        return status ? 0 : 1;
+    }
+
+    // Daemon: the contexts of every device are kept until -stop
+    if (daemonMode)
+    {
+        devices = openDevices(&deviceHandle, configFile[0] ? configFile : NULL, true, useCache, &numDevices);
+        if (devices == NULL)
+            return 1;
+
+        status = daemonServe(backend, devices, numDevices);
+        status = closeDevices(devices, numDevices, &deviceHandle) && status;
+        return status ? 0 : 1;
+    }
+
+    // Job list: the jobs share the contexts of every device
+    if (jobList[0])
+    {
+        devices = openDevices(&deviceHandle, configFile[0] ? configFile : NULL, true, useCache, &numDevices);
+        if (devices == NULL)
+            return 1;
 
+        timer.start();
+        status = schedEncodeProcess(jobList, backend, devices, numDevices);
+        timer.stop();
+        fprintf(stderr, "\nJobs finished in %f s\n", timer.getElapsedTime());
+
+        status = closeDevices(devices, numDevices, &deviceHandle) && status;
+        return status ? 0 : 1;
+    }
+
+    // Playlist: the first script is opened at startup, the others while encoding
+    if (playlistFile[0])
+    {
+        if (!playlistLoad(&playlist, playlistFile))
+            return 1;
+        strcat(input, playlist.entries[0].file);
+    }
+
+	// Init Avisync: the script is evaluated while the encoder is initialized
+    Timer startupTimer;
+    startupTimer.start();
+    hThreadAvsInit = CreateThread(NULL, 0, threadAvsInit, input, 0, 0);
 
     // load configuration
+    Timer phaseTimer;
+    phaseTimer.start();
     OvConfigCtrl configCtrl;
     OvConfigCtrl *pConfigCtrl = (OvConfigCtrl*) &configCtrl;
     memset (pConfigCtrl, 0, sizeof (OvConfigCtrl));
 
-    if (!loadConfig(pConfigCtrl, configFile))
+    // the renditions of a ladder have their own
+    if (ladderFile[0] == 0 && !loadConfig(pConfigCtrl, configFile))
         return 1;
+    if (configFile[0])
+    {
+        outputInit(configFile);
+        mp4Init(configFile);
+        tsInit(configFile);
+        segmentInit(configFile);
+        rewriteInit(configFile);
+    }
+    double configTime = phaseTimer.getElapsedTime();
+
+    // Query for the device information:
+    // This function fills the device handle with number of devices available and devices ids.
+    // The farm coordinator does not encode, its workers do.
+    phaseTimer.start();
+    numDevices = 0;
+    devices = NULL;
+    memset(&deviceHandle, 0, sizeof(OVDeviceHandle));
+    if (farmPort == 0)
+    {
+        devices = openDevices(&deviceHandle, configFile,
+                              sessionsPerDevice > 0 || ladderFile[0] || numConfigs > 1 || incremental,
+                              useCache, &numDevices);
+        if (devices == NULL)
+            return 1;
+    }
+    double devicesTime = phaseTimer.getElapsedTime();
+
+    // The session needs the resolution of the clip
+    phaseTimer.start();
+    WaitForSingleObject(hThreadAvsInit, INFINITE);
+    CloseHandle(hThreadAvsInit);
+    double waitTime = phaseTimer.getElapsedTime();
+    if (!avsInitStatus)
+        return 1;
+
+    fprintf(stderr, "Startup     script %.3f s, config %.3f s, devices %.3f s%s, waited %.3f s, total %.3f s\n",
+            avsInitTime, configTime, devicesTime, deviceHandle.cached ? " (cached)" : "",
+            waitTime, startupTimer.getElapsedTime());
+
+    // Check the size of the picture against the capabilities of the device
+    unsigned int numMBs = ((info->width + 15) / 16) * ((info->height + 15) / 16);
+    if (ladderFile[0] == 0 && deviceHandle.caps && deviceHandle.caps[0].max_picture_size_in_MB &&
+            numMBs > deviceHandle.caps[0].max_picture_size_in_MB)
+    {
+        fprintf(stderr, "The picture has %u macroblocks, the encoder supports up to %u\n",
+                numMBs, deviceHandle.caps[0].max_picture_size_in_MB);
+        return 1;
+    }
 
-	pConfigCtrl->rateControl.encRateControlFrameRateNumerator = info->fps_numerator;
-	pConfigCtrl->rateControl.encRateControlFrameRateDenominator = info->fps_denominator;
+    avsSetConfig(pConfigCtrl, info);
 
-	if (info->height % 16)
-		pConfigCtrl->pictControl.encCropBottomOffset = (((info->height / 16) + 1) * 16 -  info->height) >> 1;
+    // The frames of the stream grow as the scripts of the playlist are opened
+    if (playlist.count)
+    {
+        if (sessionsPerDevice || farmPort || ladderFile[0] || numConfigs > 1 || liveMode || incremental ||
+                cutFile[0] || twoPassMode || resume)
+        {
+            fprintf(stderr, "The playlist is a single session encode, without -p, -farm, -ladder, sweeps,\n"
+                            "-live, -incremental, -cut, -2pass or -resume\n");
+            return 1;
+        }
+        playlistStart(&playlist);
+        fprintf(stderr, "Playlist    %d scripts\n", playlist.count);
+    }
 
     // Make sure the surface is byte aligned
-    alignedSurfaceWidth = ((info->width + (256 - 1)) & ~(256 - 1));
-    alignedSurfaceHeight = (true) ? (info->height + 31) & ~31 : (info->height + 15) & ~15;
+    EncoderSession session;
+    setSessionFormat(&session, info->width, info->height);
+    session.backend = backend;
+    alignedSurfaceWidth = session.pitch;
+    alignedSurfaceHeight = session.alignedHeight;
 
 	// frame size in memory: NV12 is 3/2
-    hostPtrSize = alignedSurfaceHeight * alignedSurfaceWidth * 3 / 2;
-    //unsigned int frameSize = info->width * info->height * 3 / 2;
+    hostPtrSize = session.frameSize;
+
+	bool singleSession = sessionsPerDevice == 0 && farmPort == 0 && ladderFile[0] == 0 && numConfigs < 2 &&
+                         !liveMode && !incremental && cutFile[0] == 0;
+
+    // Smart cut: one session, for the frames before the first IDR of each range
+    if (cutFile[0] && (cutSource[0] == 0 || sessionsPerDevice || farmPort || ladderFile[0] || numConfigs > 1 ||
+                       liveMode || twoPassMode || resume || incremental))
+    {
+        fprintf(stderr, "The smart cut needs -from, and cannot be used with -p, -farm, -ladder, sweeps,\n"
+                        "-live, -2pass, -resume or -incremental\n");
+        return 1;
+    }
+
+    // Incremental: like the chunked mode, on the GOPs that changed
+    if (incremental && (farmPort || ladderFile[0] || numConfigs > 1 || liveMode || twoPassMode || resume))
+    {
+        fprintf(stderr, "The incremental mode cannot be used with -farm, -ladder, sweeps, -live, -2pass or -resume\n");
+        return 1;
+    }
+
+    // Live mode: one session, the frames of the script as they come
+    if (liveMode)
+    {
+        if (sessionsPerDevice || farmPort || ladderFile[0] || numConfigs > 1 || twoPassMode)
+        {
+            fprintf(stderr, "The live mode is a single session encode, without -p, -farm, -ladder, sweeps or -2pass\n");
+            return 1;
+        }
+        liveInit(configFile);
+    }
+
+    // Control pipe, changes applied between frames
+    memset(&control, 0, sizeof(Control));
+    if (controlName[0])
+    {
+        if (!singleSession && !liveMode)
+        {
+            fprintf(stderr, "The control pipe needs the single session encode or the live mode\n");
+            return 1;
+        }
+        // the second pass sets the bitrate of every segment from the first one
+        if (twoPassMode)
+        {
+            fprintf(stderr, "The control pipe cannot be used with -2pass\n");
+            return 1;
+        }
+        if (!controlStart(&control, controlName))
+            return 1;
+    }
+
+    // MP4 output: muxed by the single session encode, with the audio as 16 bit PCM
+    bool mp4Output = mp4IsOutput(output);
+    if (mp4Output)
+    {
+        if (!singleSession || resume)
+        {
+            fprintf(stderr, "The MP4 output needs the single session encode, without -resume\n");
+            return 1;
+        }
+        if (mp4Config.audio && playlist.count == 0 && avs_has_audio(info) && info->sample_type != AVS_SAMPLE_INT16)
+        {
+            fprintf(stderr, "Converting audio to 16 bit.\n");
+            clip = avisynth_filter(clip, env, "ConvertAudioTo16bit");
+            info = avs_get_video_info(clip);
+        }
+    }
+
+    // Transport stream: muxed by the single session or the live encode
+    bool tsOutput = tsIsOutput(output);
+    if (tsOutput && ((!singleSession && !liveMode) || resume || mp4Output))
+    {
+        fprintf(stderr, "The transport stream needs the single session or the live encode, without -resume\n"
+                        "or an MP4 output\n");
+        return 1;
+    }
+
+    // UDP is paced by the frames of the live encode, the arena of the single session sends bursts
+    if (outputIsUdp(output) && !liveMode)
+    {
+        fprintf(stderr, "udp:// is only an output of the live encode, with -live\n");
+        return 1;
+    }
+
+    // HLS & DASH: fragmented MP4 segments of the single session encode
+    bool segmented = segmentIsOutput(output);
+    if (segmented && (!singleSession || resume || tsOutput || playlist.count))
+    {
+        fprintf(stderr, "The HLS & DASH segments need the single session encode of a script, without -resume\n"
+                        "or -ts\n");
+        return 1;
+    }
+
+    // Resume: the output is cut at the last checkpoint & encoded again from its frame
+    if (resume)
+    {
+        if (!singleSession)
+        {
+            fprintf(stderr, "Only the single session encode can be resumed\n");
+            return 1;
+        }
+        if (!journalLast(output, info, &firstFrame, &firstOffset) || !journalTruncate(output, firstOffset))
+            return 1;
+        fprintf(stderr, "Resuming    frame %u, %.0f bytes kept\n", firstFrame, (double)firstOffset);
+    }
+    if (singleSession && playlist.count == 0 && strcmp(output, "-") != 0 && !mp4Output && !tsOutput &&
+            !segmented && !journalOpen(&journal, output, info, resume))
+        return 1;
+
+    // Frame index of the Annex-B output
+    memset(&nalIndex, 0, sizeof(NalIndex));
+    if (indexFormat[0])
+    {
+        if (strcmp(indexFormat, "bin") != 0 && strcmp(indexFormat, "csv") != 0)
+        {
+            fprintf(stderr, "The index is bin or csv\n");
+            return 1;
+        }
+        if ((!singleSession && !liveMode) || resume || mp4Output || tsOutput || segmented ||
+                strcmp(output, "-") == 0)
+        {
+            fprintf(stderr, "The index needs the single session or the live encode to an Annex-B file, without -resume\n");
+            return 1;
+        }
+        if (!indexOpen(&nalIndex, output, strcmp(indexFormat, "csv") == 0, info))
+            return 1;
+    }
+
+    // Two pass: the first pass, then the bitrate of every segment
+    memset(&twoPass, 0, sizeof(TwoPassStats));
+    if (twoPassMode)
+    {
+        if (!singleSession || pConfigCtrl->rateControl.encRateControlMethod == 0)
+        {
+            fprintf(stderr, "The two pass mode needs the single session encode & a rate control method\n");
+            return 1;
+        }
+
+        puts("First pass...\n");
+        if (!twoPassAnalyze(&session, &devices[0], pConfigCtrl, &twoPass))
+            return 1;
+        twoPassAllocate(&twoPass, pConfigCtrl);
+    }
+
+    // Keyframe list, from -k & the [keyframes] section of the config file
+    if (singleSession || ladderFile[0] || numConfigs > 1)
+    {
+        if (!keyframeLoad(&keyframes, keyframeFile[0] ? keyframeFile : NULL,
+                          configFile[0] ? configFile : NULL,
+                          playlist.count ? KEYFRAME_NONE : info->num_frames))
+            return 1;
+
+        // segments: an IDR where each one starts, unless the list has its own
+        if (segmented && keyframes.count == 0)
+        {
+            unsigned int segmentFrames = segmentLength(pConfigCtrl, info);
+            for (unsigned int frame = 0; frame < (unsigned)info->num_frames; frame += segmentFrames)
+                keyframeAdd(&keyframes, frame);
+        }
+        if (keyframes.count)
+            fprintf(stderr, "Keyframes   %u\n", keyframes.count);
+    }
+    else if (keyframeFile[0])
+    {
+        fprintf(stderr, "The keyframe list needs the single session encode, a sweep or a ladder\n");
+        return 1;
+    }
+
+    // Lookahead, the frames are decided before they are encoded
+    memset(&lookahead, 0, sizeof(Lookahead));
+    if (singleSession && lookaheadInit(configFile))
+    {
+        if (playlist.count)
+        {
+            fprintf(stderr, "The lookahead cannot be used with a playlist\n");
+            return 1;
+        }
+        if (!lookaheadCreate(&lookahead, info->width, info->height, info->num_frames - firstFrame, pConfigCtrl))
+            return 1;
+        // the adaptive QP sends the QP of every frame from the configured one
+        if (controlName[0] && lookahead.fixedQP && lookahead.config.qpStrength)
+        {
+            fprintf(stderr, "The control pipe cannot be used with the adaptive QP of the lookahead, qpStrength=0\n");
+            return 1;
+        }
+        fprintf(stderr, "Lookahead   %u frames%s\n", lookahead.config.frames,
+                lookahead.fixedQP && lookahead.config.qpStrength ? ", adaptive QP" : "");
+    }
 
     // Init Buffer
     frameBuffer = newBuffer();
@@ -496,66 +1200,107 @@ int main(int argc, char* argv[])
 		frameBuffer->keys[i] =  _aligned_malloc(hostPtrSize, 32);
 	}*/
 
-    // Query for the device information:
-    // This function fills the device handle with number of devices available and devices ids.
-    OVDeviceHandle deviceHandle;
-    puts("Initializing Encoder...\n");
-    bool status = getDevice(&deviceHandle);
-    if (status == false)
-        return 1;
-
-    // Check deviceHandle.numDevices for number of devices and choose the device on
-    // which user wants to create the encoder. In this case device 0 is choosen.
-    unsigned int deviceId = deviceHandle.deviceInfo[0].device_id;
-
-    // Create the encoder context on the device specified by deviceID
-    OPContextHandle oveContext;
-    encodeCreate(&oveContext, deviceId, &deviceHandle);
-    OVEncodeHandle encodeHandle;
-    clDeviceID = reinterpret_cast<cl_device_id>(deviceId);
-
 	// Threads
-	hThreadAvsDec = CreateThread(NULL, 0, threadAvsDec, 0, 0, 0);
-    hThreadMonitor = CreateThread(NULL, 0, threadMonitor, 0, 0, 0);
-    SetThreadPriority(hThreadMonitor, THREAD_PRIORITY_IDLE);
+	if (singleSession)
+		hThreadAvsDec = CreateThread(NULL, 0, threadAvsDec, 0, 0, 0);
+    if (!liveMode && cutFile[0] == 0)
+    {
+        hThreadMonitor = CreateThread(NULL, 0, threadMonitor, 0, 0, 0);
+        SetThreadPriority(hThreadMonitor, THREAD_PRIORITY_IDLE);
+    }
+
+    // The GOP index of an incremental encode describes the output it wrote, not this one
+    if (!incremental && !ladderFile[0] && numConfigs <= 1 && strcmp(output, "-") != 0)
+    {
+        char gopsFile[MAX_PATH];
+        snprintf(gopsFile, MAX_PATH, "%s.gops", output);
+        remove(gopsFile);
+    }
 
     // Create, initialize & encode a file
     puts("Encoding...\n");
     timer.start();
-    status = encodeProcess(&encodeHandle, output, oveContext, deviceId, pConfigCtrl);
+    if (farmPort)
+        status = farmEncodeProcess(input, output, pConfigCtrl, (unsigned short)farmPort,
+                                   localWorkers, backend->name, configFile, &currentFrame);
+    else if (liveMode)
+        status = liveEncodeProcess(&session, &devices[0], output, pConfigCtrl, &currentFrame);
+    else if (ladderFile[0])
+        status = ladderEncodeProcess(&session, devices, numDevices, ladderFile, &currentFrame);
+    else if (numConfigs > 1)
+        status = sweepEncodeProcess(&session, devices, numDevices, configs, numConfigs, output, &currentFrame);
+    else if (cutFile[0])
+        status = cutProcess(&session, &devices[0], cutSource, cutFile, output, pConfigCtrl);
+    else if (incremental)
+        status = incrEncodeProcess(&session, devices, numDevices, sessionsPerDevice ? sessionsPerDevice : 1,
+                                   output, pConfigCtrl, &currentFrame);
+    else if (sessionsPerDevice)
+        status = chunkEncodeProcess(&session, devices, numDevices, sessionsPerDevice,
+                                    output, pConfigCtrl, &currentFrame);
+    else
+        status = encodeProcess(&session, &devices[0], output, pConfigCtrl);
     timer.stop();
+    if (playlist.failed)
+        status = false;
     if (status == false)
+    {
+        indexClose(&nalIndex, currentFrame);
         return 1;
+    }
 
 	fprintf(stderr, "\nEncoding complete in %f s\n", timer.getElapsedTime());
+	if (journal.fj && currentFrame < (unsigned)info->num_frames)
+		fprintf(stderr, "Stopped at frame %u, -resume continues from the last checkpoint\n", currentFrame);
+	journalClose(&journal, currentFrame >= (unsigned)info->num_frames);
+	bool indexed = indexClose(&nalIndex, currentFrame);
+	if (lookahead.config.frames)
+		fprintf(stderr, "Scene cuts  %u\n", lookahead.sceneCuts);
 
 	/* CloseThreads */
-	TerminateThread(hThreadAvsDec, 0);
-    CloseHandle(hThreadAvsDec);
+	if (singleSession)
+	{
+		TerminateThread(hThreadAvsDec, 0);
+		CloseHandle(hThreadAvsDec);
+	}
+
+	if (!liveMode && cutFile[0] == 0)
+	{
+		TerminateThread(hThreadMonitor, 0);
+		CloseHandle(hThreadMonitor);
+	}
 
-	TerminateThread(hThreadMonitor, 0);
-    CloseHandle(hThreadMonitor);
+	lookaheadDestroy(&lookahead);
+	twoPassDestroy(&twoPass);
+	keyframeFree(&keyframes);
+	controlStop(&control);
+	playlistFree(&playlist);
 
 	// Free avs resources
 	avs_release_clip(clip);
     avs_delete_script_environment(env);
 
-    // Free the resources used by the encoder session
-    status = encodeClose(&encodeHandle);
-    if (status == false)
-        return 1;
-
-    // Destroy the encoder context
-    status = encodeDestroy(oveContext);
+    // Free the resources used by the encoder session, the other modes have their own
+    if (singleSession)
+    {
+        status = backend->releaseSession(&session);
+        if (status == false)
+            return 1;
+    }
 
-    // Free memory used for deviceInfo.
-    delete [] deviceHandle.deviceInfo;
+    // Destroy the encoder contexts
+    status = closeDevices(devices, numDevices, &deviceHandle);
 
     if (status == false)
         return 1;
+    if (!indexed)
+    {
+        fprintf(stderr, "The index of %s is incomplete\n", output);
+        return 1;
+    }
 
     // All done
-    fprintf(stderr, "Output written to %s \n", output);
+    if (singleSession)
+        fprintf(stderr, "Output written to %s \n", output);
     return 0;
 }
 
@@ -6,17 +6,40 @@
 *******************************************************************************/
 
 #include <stdio.h>
+#include <stddef.h>
 
 // Input surface used for encoder
 #define MAX_INPUT_SURFACE	1
 
+// Devices & their capabilities cached on disk
+#define DEVICE_CACHE_FILE   "AvsVCEh264.devices"
+#define DEVICE_CACHE_MAGIC  0x48435644
+#define DEVICE_CACHE_MAX    16
+
 typedef struct OVDeviceHandle
 {
     ovencode_device_info *deviceInfo;
     unsigned int numDevices;
     cl_platform_id platform;
+    OVE_ENCODE_CAPS_H264 *caps;     // capabilities of each device, filled by encodeCreate
+    bool cached;                    // deviceInfo & caps read from the cache
 } OVDeviceHandle;
 
+// Content of the cache file. It is valid while the platform version & the
+// name and driver of every GPU are the same.
+typedef struct DeviceCache
+{
+    unsigned int            magic;
+    unsigned int            size;
+    char                    platform[128];
+    unsigned int            numGpus;
+    char                    gpus[DEVICE_CACHE_MAX][128];
+    unsigned int            numDevices;
+    unsigned int            gpuIndex[DEVICE_CACHE_MAX];  // device_id is only valid in one process
+    ovencode_device_info    deviceInfo[DEVICE_CACHE_MAX];
+    OVE_ENCODE_CAPS_H264    caps[DEVICE_CACHE_MAX];
+} DeviceCache;
+
 // Encoder Hanlde for sharing context between create process and destroy
 typedef struct OVEncodeHandle
 {
@@ -141,13 +164,136 @@ bool getDeviceInfo(ovencode_device_info **deviceInfo, unsigned int *numDevices)
 }
 
 
+/*******************************************************************************
+ *  @fn     deviceCacheKey
+ *  @brief  Fills the part of the cache that identifies the platform & the GPUs
+ *  @param[in] platform : Platform id
+ *  @param[out] cache   : Cache, its key is filled
+ *  @param[out] gpus    : Ids of the GPUs in this process
+ *  @return bool : true if successful; otherwise false.
+ ******************************************************************************/
+bool deviceCacheKey(cl_platform_id platform, DeviceCache *cache, cl_device_id *gpus)
+{
+    memset(cache, 0, sizeof(DeviceCache));
+    cache->magic = DEVICE_CACHE_MAGIC;
+    cache->size = sizeof(DeviceCache);
+    clGetPlatformInfo(platform, CL_PLATFORM_VERSION, sizeof(cache->platform) - 1, cache->platform, NULL);
+
+    if (clGetDeviceIDs(platform, CL_DEVICE_TYPE_GPU, DEVICE_CACHE_MAX, gpus, &cache->numGpus) != CL_SUCCESS)
+        return false;
+    if (cache->numGpus > DEVICE_CACHE_MAX)
+        cache->numGpus = DEVICE_CACHE_MAX;
+
+    // name & driver version, separated by a 0
+    for (unsigned int i = 0; i < cache->numGpus; i++)
+    {
+        clGetDeviceInfo(gpus[i], CL_DEVICE_NAME, 64, cache->gpus[i], NULL);
+        unsigned int size = strlen(cache->gpus[i]) + 1;
+        clGetDeviceInfo(gpus[i], CL_DRIVER_VERSION, 127 - size, cache->gpus[i] + size, NULL);
+    }
+    return true;
+}
+
+
+// Path of the cache file, in the temporary folder
+void deviceCachePath(char *path)
+{
+    if (GetTempPath(MAX_PATH - sizeof(DEVICE_CACHE_FILE), path) == 0)
+        path[0] = 0;
+    strcat(path, DEVICE_CACHE_FILE);
+}
+
+
+/*******************************************************************************
+ *  @fn     readDeviceCache
+ *  @brief  Fills the devices & capabilities from the cache if it is valid
+ *  @param[in/out] deviceHandle : Hanlde for the device information, with the platform
+ *  @return bool : true if the cache was used; otherwise false.
+ ******************************************************************************/
+bool readDeviceCache(OVDeviceHandle *deviceHandle)
+{
+    DeviceCache key, cache;
+    cl_device_id gpus[DEVICE_CACHE_MAX];
+    if (!deviceCacheKey(deviceHandle->platform, &key, gpus))
+        return false;
+
+    char path[MAX_PATH];
+    deviceCachePath(path);
+    FILE *fr = fopen(path, "rb");
+    if (fr == NULL)
+        return false;
+    bool valid = fread(&cache, sizeof(DeviceCache), 1, fr) == 1 &&
+                 memcmp(&cache, &key, offsetof(DeviceCache, numDevices)) == 0 &&
+                 cache.numDevices > 0 && cache.numDevices <= DEVICE_CACHE_MAX;
+    fclose(fr);
+
+    for (unsigned int i = 0; valid && i < cache.numDevices; i++)
+        valid = cache.gpuIndex[i] < cache.numGpus;
+    if (!valid)
+        return false;
+
+    deviceHandle->numDevices = cache.numDevices;
+    deviceHandle->deviceInfo = new ovencode_device_info[cache.numDevices];
+    deviceHandle->caps = new OVE_ENCODE_CAPS_H264[cache.numDevices];
+    for (unsigned int i = 0; i < cache.numDevices; i++)
+    {
+        deviceHandle->deviceInfo[i] = cache.deviceInfo[i];
+        deviceHandle->deviceInfo[i].device_id = (unsigned int)(intptr_t)gpus[cache.gpuIndex[i]];
+        deviceHandle->caps[i] = cache.caps[i];
+    }
+    deviceHandle->cached = true;
+    return true;
+}
+
+
+/*******************************************************************************
+ *  @fn     writeDeviceCache
+ *  @brief  Saves the devices & the capabilities read by encodeCreate
+ *  @param[in] deviceHandle : Hanlde for the device information
+ ******************************************************************************/
+void writeDeviceCache(OVDeviceHandle *deviceHandle)
+{
+    DeviceCache cache;
+    cl_device_id gpus[DEVICE_CACHE_MAX];
+    if (deviceHandle->caps == NULL || deviceHandle->numDevices > DEVICE_CACHE_MAX ||
+            !deviceCacheKey(deviceHandle->platform, &cache, gpus))
+        return;
+
+    cache.numDevices = deviceHandle->numDevices;
+    for (unsigned int i = 0; i < cache.numDevices; i++)
+    {
+        cache.gpuIndex[i] = DEVICE_CACHE_MAX;
+        for (unsigned int g = 0; g < cache.numGpus; g++)
+        {
+            if ((unsigned int)(intptr_t)gpus[g] == deviceHandle->deviceInfo[i].device_id)
+                cache.gpuIndex[i] = g;
+        }
+        // not a GPU of the platform, or without capabilities: nothing to cache
+        if (cache.gpuIndex[i] == DEVICE_CACHE_MAX || deviceHandle->caps[i].max_picture_size_in_MB == 0)
+            return;
+        cache.deviceInfo[i] = deviceHandle->deviceInfo[i];
+        cache.caps[i] = deviceHandle->caps[i];
+    }
+
+    char path[MAX_PATH];
+    deviceCachePath(path);
+    FILE *fw = fopen(path, "wb");
+    if (fw)
+    {
+        fwrite(&cache, sizeof(DeviceCache), 1, fw);
+        fclose(fw);
+    }
+}
+
+
 /*******************************************************************************
  *  @fn     getDevice
  *  @brief  returns the platform and devices found
  *  @param[in/out] deviceHandle : Hanlde for the device information
+ *  @param[in] useCache         : Read the devices from the cache if it is valid
  *  @return bool : true if successful; otherwise false.
  ******************************************************************************/
-bool getDevice(OVDeviceHandle *deviceHandle)
+bool getDevice(OVDeviceHandle *deviceHandle, bool useCache = false)
 {
     bool status;
 
@@ -157,6 +303,12 @@ bool getDevice(OVDeviceHandle *deviceHandle)
     if (status == false)
         return false;
 
+    // The devices were probed by a previous run
+    deviceHandle->caps = NULL;
+    deviceHandle->cached = false;
+    if (useCache && readDeviceCache(deviceHandle))
+        return true;
+
     // Check for GPU
     cl_device_type dType = CL_DEVICE_TYPE_GPU;
     status = gpuCheck(deviceHandle->platform, &dType);
@@ -170,6 +322,11 @@ bool getDevice(OVDeviceHandle *deviceHandle)
     // Memory for deviceInfo gets allocated inside the getDeviceInfo function
     // depending on numDevices. This needs to be freed after the usage.
     status = getDeviceInfo(&deviceHandle->deviceInfo,&deviceHandle->numDevices);
+    if (status)
+    {
+        deviceHandle->caps = new OVE_ENCODE_CAPS_H264[deviceHandle->numDevices];
+        memset(deviceHandle->caps, 0, sizeof(OVE_ENCODE_CAPS_H264) * deviceHandle->numDevices);
+    }
 
     return status;
 }
@@ -253,11 +410,19 @@ bool encodeCreate(OPContextHandle *oveContext, unsigned int deviceId, OVDeviceHa
         return false;
     }
 
-    // 2. Read the device capabilities.
+    // 2. Read the device capabilities, unless they come from the cache.
     // Device capabilities should be used to validate against the configuration set by the user for the codec
+    if (deviceHandle->cached)
+        return(0);
+
     OVE_ENCODE_CAPS encodeCaps;
     OVE_ENCODE_CAPS_H264 encode_cap_full;
     encodeCaps.caps.encode_cap_full = (OVE_ENCODE_CAPS_H264 *)&encode_cap_full;
+    for (unsigned int d = 0; deviceHandle->caps && d < deviceHandle->numDevices; d++)
+    {
+        if (deviceHandle->deviceInfo[d].device_id == deviceId)
+            encodeCaps.caps.encode_cap_full = &deviceHandle->caps[d];
+    }
     status = getDeviceCap(*oveContext, deviceId, &encodeCaps);
 
     if(!status)
@@ -273,24 +438,37 @@ bool encodeCreate(OPContextHandle *oveContext, unsigned int deviceId, OVDeviceHa
 /*******************************************************************************
  *  @fn     setEncodeConfig
  *  @brief  This function sets the encoder configuration by using user supplied configuration information from .cfg file
- *  @param[in] session : Encoder session for which encoder configuration to be set
- *  @param[in] pConfig : pointer to the user configuration from .cfg file
+ *  @param[in] session    : Encoder session for which encoder configuration to be set
+ *  @param[in] pConfig    : pointer to the user configuration from .cfg file
+ *  @param[in] configMask : ENC_CONFIG_* blocks to send
  *  @return bool : true if successful; otherwise false.
  ******************************************************************************/
-bool setEncodeConfig(ove_session session, OvConfigCtrl *pConfig)
+bool setEncodeConfig(ove_session session, OvConfigCtrl *pConfig, unsigned int configMask = ENC_CONFIG_ALL)
 {
-    unsigned int numOfConfigBuffers = 4;
+    unsigned int numOfConfigBuffers = 0;
     OVE_CONFIG oveConfig[4];
 
     // send configuration values for this session
-    oveConfig[0].config.pPictureControl     = &(pConfig->pictControl);
-    oveConfig[0].configType                 = OVE_CONFIG_TYPE_PICTURE_CONTROL;
-    oveConfig[1].config.pRateControl        = &(pConfig->rateControl);
-    oveConfig[1].configType                 = OVE_CONFIG_TYPE_RATE_CONTROL;
-    oveConfig[2].config.pMotionEstimation   = &(pConfig->meControl);
-    oveConfig[2].configType                 = OVE_CONFIG_TYPE_MOTION_ESTIMATION;
-    oveConfig[3].config.pRDO                = &(pConfig->rdoControl);
-    oveConfig[3].configType                 = OVE_CONFIG_TYPE_RDO;
+    if (configMask & ENC_CONFIG_PICTURE)
+    {
+        oveConfig[numOfConfigBuffers].config.pPictureControl   = &(pConfig->pictControl);
+        oveConfig[numOfConfigBuffers++].configType             = OVE_CONFIG_TYPE_PICTURE_CONTROL;
+    }
+    if (configMask & ENC_CONFIG_RATE)
+    {
+        oveConfig[numOfConfigBuffers].config.pRateControl      = &(pConfig->rateControl);
+        oveConfig[numOfConfigBuffers++].configType             = OVE_CONFIG_TYPE_RATE_CONTROL;
+    }
+    if (configMask & ENC_CONFIG_ME)
+    {
+        oveConfig[numOfConfigBuffers].config.pMotionEstimation = &(pConfig->meControl);
+        oveConfig[numOfConfigBuffers++].configType             = OVE_CONFIG_TYPE_MOTION_ESTIMATION;
+    }
+    if (configMask & ENC_CONFIG_RDO)
+    {
+        oveConfig[numOfConfigBuffers].config.pRDO              = &(pConfig->rdoControl);
+        oveConfig[numOfConfigBuffers++].configType             = OVE_CONFIG_TYPE_RDO;
+    }
 
     if (!(OVresult)OVEncodeSendConfig(session, numOfConfigBuffers, oveConfig))
     {
@@ -421,3 +599,188 @@ bool encodeDestroy(OPContextHandle oveContext)
     }
     return true;
 }
+
+
+/*******************************************************************************
+ * VCE backend: encoderBackend interface on top of OpenVideo\OVEncode
+ ******************************************************************************/
+typedef struct VceSession
+{
+    OVEncodeHandle   handle;
+    OPEventHandle    events[MAX_INPUT_SURFACE]; // pending tasks, oldest first
+    unsigned int     numEvents;
+    unsigned int     numSubmitted;
+} VceSession;
+
+
+bool vceCreateSession(EncoderSession *session, EncoderDevice *device, OvConfigCtrl *pConfig)
+{
+    cl_int err;
+    VceSession *vce = new VceSession;
+    memset(vce, 0, sizeof(VceSession));
+    session->priv = vce;
+    session->maxInFlight = MAX_INPUT_SURFACE;
+
+    // Create an OVE Session (Platform context, id, mode, profile, format, ...)
+    // encode task priority. FOR POSSIBLY LOW LATENCY OVE_ENCODE_TASK_PRIORITY_LEVEL2 */
+    vce->handle.session = OVEncodeCreateSession(device->context, device->deviceId,
+                                pConfig->encodeMode, pConfig->profileLevel,
+                                pConfig->pictFormat, session->width,
+                                session->height, pConfig->priority);
+
+    if (vce->handle.session == NULL)
+    {
+        fprintf(stderr, "OVEncodeCreateSession failed.\n");
+        return false;
+    }
+
+    // Create a command queue
+    cl_device_id clDevice = reinterpret_cast<cl_device_id>(device->deviceId);
+    vce->handle.clCmdQueue = clCreateCommandQueue((cl_context)device->context, clDevice, 0, &err);
+    if(err != CL_SUCCESS)
+    {
+        fprintf(stderr, "Create command queue failed! Error :%d\n", err);
+        return false;
+    }
+
+    for(int i = 0; i < MAX_INPUT_SURFACE; i++)
+    {
+        vce->handle.inputSurfaces[i] = clCreateBuffer((cl_context)device->context, CL_MEM_READ_WRITE,
+                                                      session->frameSize, NULL, &err);
+        if (err != CL_SUCCESS)
+        {
+            fprintf(stderr, "clCreateBuffer returned error %d\n", err);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+bool vceSendConfig(EncoderSession *session, OvConfigCtrl *pConfig, unsigned int configMask)
+{
+    return setEncodeConfig(((VceSession*)session->priv)->handle.session, pConfig, configMask);
+}
+
+
+bool vceSubmit(EncoderSession *session, const BYTE *frame,
+               OVE_ENCODE_PARAMETERS_H264 *pictureParameter, unsigned int *taskId)
+{
+    VceSession *vce = (VceSession*)session->priv;
+    if (vce->numEvents == MAX_INPUT_SURFACE)
+    {
+        fputs("vceSubmit: all input surfaces are in use\n", stderr);
+        return false;
+    }
+
+    OPMemHandle inputSurface = vce->handle.inputSurfaces[vce->numSubmitted % MAX_INPUT_SURFACE];
+    cl_command_queue queue = vce->handle.clCmdQueue;
+
+    cl_int status;
+    cl_event inMapEvt, unmapEvent;
+    void* mapPtr = clEnqueueMapBuffer(queue, (cl_mem)inputSurface, CL_TRUE,
+                                      CL_MAP_READ | CL_MAP_WRITE, 0,
+                                      session->frameSize, 0, NULL, &inMapEvt, &status);
+    clFlush(queue);
+    waitForEvent(inMapEvt);
+    clReleaseEvent(inMapEvt);
+
+    //Read into the input surface buffer
+    memcpy((BYTE*)mapPtr, frame, session->frameSize);
+
+    clEnqueueUnmapMemObject(queue, (cl_mem)inputSurface, mapPtr, 0, NULL, &unmapEvent);
+    clFlush(queue);
+    waitForEvent(unmapEvent);
+    clReleaseEvent(unmapEvent);
+
+    // use the input surface buffer as our Picture
+    OVE_INPUT_DESCRIPTION encodeTaskInputBuffer;
+    encodeTaskInputBuffer.bufferType = OVE_BUFFER_TYPE_PICTURE;
+    encodeTaskInputBuffer.buffer.pPicture = (OVE_SURFACE_HANDLE) inputSurface;
+
+    // Encode a single picture.
+    OPEventHandle event;
+    OVresult res = OVEncodeTask(vce->handle.session, 1, &encodeTaskInputBuffer,
+                                pictureParameter, taskId, 0, NULL, &event);
+    if (!res)
+    {
+        fprintf(stderr, "OVEncodeTask returned error %d\n", res);
+        return false;
+    }
+
+    vce->events[vce->numEvents++] = event;
+    vce->numSubmitted++;
+    return true;
+}
+
+
+bool vceQuery(EncoderSession *session, OVE_OUTPUT_DESCRIPTION *taskDescription)
+{
+    VceSession *vce = (VceSession*)session->priv;
+    if (vce->numEvents == 0)
+        return false;
+
+    // Wait for the oldest task to complete
+    OPEventHandle event = vce->events[0];
+    vce->numEvents--;
+    memmove(vce->events, vce->events + 1, vce->numEvents * sizeof(OPEventHandle));
+
+    // the event is released whether the wait succeeds or not
+    cl_int err = clWaitForEvents(1, (cl_event*)&(event));
+    if (event)
+        clReleaseEvent((cl_event) event);
+    if (err != CL_SUCCESS)
+    {
+        fprintf(stderr, "clWaitForEvents returned error %d\n", err);
+        return false;
+    }
+
+    // Query output
+    unsigned int numTaskDescriptionsReturned = 0;
+    OVresult res = OVEncodeQueryTaskDescription(vce->handle.session, 1,
+                                                &numTaskDescriptionsReturned, taskDescription);
+    if (!res)
+    {
+        fprintf(stderr, "OVEncodeQueryTaskDescription returned error %d\n", res);
+        return false;
+    }
+
+    #ifdef DEBUG
+    if (numTaskDescriptionsReturned > 1)
+        fprintf(stderr, "Warning: numTaskDescriptions returned: %d\n", numTaskDescriptionsReturned);
+    #endif
+
+    return true;
+}
+
+
+bool vceReleaseTask(EncoderSession *session, unsigned int taskId)
+{
+    return OVEncodeReleaseTask(((VceSession*)session->priv)->handle.session, taskId);
+}
+
+
+bool vceReleaseSession(EncoderSession *session)
+{
+    VceSession *vce = (VceSession*)session->priv;
+    if (vce == NULL)
+        return true;
+
+    bool status = encodeClose(&vce->handle);
+    delete vce;
+    session->priv = NULL;
+    return status;
+}
+
+
+const EncoderBackend vceBackend =
+{
+    "vce",
+    vceCreateSession,
+    vceSendConfig,
+    vceSubmit,
+    vceQuery,
+    vceReleaseTask,
+    vceReleaseSession
+};
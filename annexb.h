@@ -0,0 +1,105 @@
+/*******************************************************************************
+* This file is part of AvsVCEh264.
+* Contains functions for scanning Annex-B H.264 byte streams
+*
+* Copyright (C) 2013 David Gonzlez Garca <davidgg666@gmail.com>
+*******************************************************************************/
+#ifndef ANNEXB_H
+#define ANNEXB_H
+
+// nal_unit_type values
+#define NAL_SLICE		1
+#define NAL_IDR			5
+#define NAL_SEI			6
+#define NAL_SPS			7
+#define NAL_PPS			8
+#define NAL_AUD			9
+
+// One NAL unit of a byte stream
+typedef struct AnnexbNal
+{
+    const BYTE   *data;     // start code
+    unsigned int size;      // bytes, start code included
+    unsigned int header;    // start code length, offset of the NAL header
+    BYTE         type;      // nal_unit_type
+} AnnexbNal;
+
+
+/*******************************************************************************
+ *  @fn     annexbFindStartCode
+ *  @brief  Looks for the next 00 00 01 start code
+ *  @param[in] data : Byte stream
+ *  @param[in] pos  : Position where the search starts
+ *  @param[in] size : Byte stream size
+ *  @return unsigned int : position of the start code or size if not found.
+ ******************************************************************************/
+unsigned int annexbFindStartCode(const BYTE *data, unsigned int pos, unsigned int size)
+{
+    for (; pos + 3 <= size; pos++)
+    {
+        if (data[pos + 2] > 1)
+            pos += 2;   // no start code can end before pos + 3
+        else if (data[pos] == 0 && data[pos + 1] == 0 && data[pos + 2] == 1)
+            return pos;
+    }
+    return size;
+}
+
+
+/*******************************************************************************
+ *  @fn     annexbNextNal
+ *  @brief  Returns the NAL unit that starts at or after *pos. A 4 byte start
+ *          code (zero_byte) is kept with the NAL unit it precedes.
+ *  @param[in] data     : Byte stream
+ *  @param[in] size     : Byte stream size
+ *  @param[in/out] pos  : Search position, moved past the returned NAL unit
+ *  @param[out] nal     : NAL unit found
+ *  @return bool : true if a NAL unit was found; otherwise false.
+ ******************************************************************************/
+bool annexbNextNal(const BYTE *data, unsigned int size, unsigned int *pos, AnnexbNal *nal)
+{
+    unsigned int start = annexbFindStartCode(data, *pos, size);
+    if (start + 3 >= size)
+        return false;
+
+    unsigned int header = start + 3;
+    if (start > *pos && data[start - 1] == 0)
+        start--;
+
+    unsigned int end = annexbFindStartCode(data, header, size);
+    if (end < size && data[end - 1] == 0)
+        end--;
+
+    nal->data = data + start;
+    nal->size = end - start;
+    nal->header = header - start;
+    nal->type = data[header] & 0x1F;
+    *pos = end;
+    return true;
+}
+
+
+/*******************************************************************************
+ *  @fn     annexbIsIdr
+ *  @brief  Tells if the access unit of a frame is an IDR picture, from the type
+ *          of its first slice. Only the NAL units before it are scanned.
+ *  @param[in] data : Byte stream of one frame
+ *  @param[in] size : Byte stream size
+ *  @return bool : true if its first slice is an IDR slice; otherwise false.
+ ******************************************************************************/
+bool annexbIsIdr(const BYTE *data, unsigned int size)
+{
+    unsigned int pos = annexbFindStartCode(data, 0, size);
+    while (pos + 3 < size)
+    {
+        BYTE type = data[pos + 3] & 0x1F;
+        if (type == NAL_IDR)
+            return true;
+        if (type == NAL_SLICE)
+            return false;
+        pos = annexbFindStartCode(data, pos + 3, size);
+    }
+    return false;
+}
+
+#endif
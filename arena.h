@@ -0,0 +1,225 @@
+/*******************************************************************************
+* This file is part of AvsVCEh264.
+* Contains the bitstream arena: the output of every task is copied into large
+* recycled chunks, so the task can be released as soon as it is queried, and
+* the full chunks are written to the output by a writer thread. The encoder
+* only waits for the disk or the pipe when queueMB of the [output] section
+* are waiting to be written.
+*
+* Copyright (C) 2013 David Gonzlez Garca <davidgg666@gmail.com>
+*******************************************************************************/
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_CHUNK_SIZE    (4 << 20)
+
+typedef struct ArenaChunk
+{
+    BYTE                *data;
+    unsigned int        size;
+    unsigned int        capacity;
+    struct ArenaChunk   *next;
+} ArenaChunk;
+
+typedef struct BitstreamArena
+{
+    OutputFile          *out;
+    ArenaChunk          *current;       // being filled by the encoder
+    ArenaChunk          *queue;         // full, written in order
+    ArenaChunk          *queueTail;
+    ArenaChunk          *spare;         // written, ready to be filled again
+    int                 numChunks;
+    int                 maxChunks;      // the encoder waits for the writer beyond this
+    volatile LONG       pending;        // chunks queued or being written
+    volatile LONG       stop;
+    volatile LONG       failed;
+    CRITICAL_SECTION    lock;
+    HANDLE              wake;           // a chunk was queued, or stop
+    HANDLE              recycled;       // a chunk was written
+    HANDLE              thread;
+} BitstreamArena;
+
+
+// Writes the queued chunks in order & gives them back to the encoder
+DWORD WINAPI arenaWriterThread(LPVOID param)
+{
+    BitstreamArena *arena = (BitstreamArena*)param;
+
+    for (;;)
+    {
+        EnterCriticalSection(&arena->lock);
+        ArenaChunk *chunk = arena->queue;
+        if (chunk)
+        {
+            arena->queue = chunk->next;
+            if (arena->queue == NULL)
+                arena->queueTail = NULL;
+        }
+        LeaveCriticalSection(&arena->lock);
+
+        if (chunk == NULL)
+        {
+            if (arena->stop)
+                break;
+            WaitForSingleObject(arena->wake, INFINITE);
+            continue;
+        }
+
+        if (!arena->failed && !outputWrite(arena->out, chunk->data, chunk->size))
+        {
+            fprintf(stderr, "\nError writing the output file\n");
+            InterlockedExchange(&arena->failed, 1);
+        }
+
+        chunk->size = 0;
+        EnterCriticalSection(&arena->lock);
+        chunk->next = arena->spare;
+        arena->spare = chunk;
+        LeaveCriticalSection(&arena->lock);
+        InterlockedDecrement(&arena->pending);
+        SetEvent(arena->recycled);
+    }
+
+    return 0;
+}
+
+
+/*******************************************************************************
+ *  @fn     arenaOpen
+ *  @brief  Starts the writer thread of an output
+ *  @param[out] arena : Arena
+ *  @param[in] out    : Output, only used by the writer until arenaFlush or arenaClose
+ ******************************************************************************/
+void arenaOpen(BitstreamArena *arena, OutputFile *out)
+{
+    memset(arena, 0, sizeof(BitstreamArena));
+    arena->out = out;
+    arena->maxChunks = outputConfig.queueMB / (ARENA_CHUNK_SIZE >> 20);
+    InitializeCriticalSection(&arena->lock);
+    arena->wake = CreateEvent(NULL, FALSE, FALSE, NULL);
+    arena->recycled = CreateEvent(NULL, FALSE, FALSE, NULL);
+    arena->thread = CreateThread(NULL, 0, arenaWriterThread, arena, 0, NULL);
+}
+
+
+// Queues the chunk being filled for writing
+static void arenaQueue(BitstreamArena *arena)
+{
+    ArenaChunk *chunk = arena->current;
+    if (chunk == NULL || chunk->size == 0)
+        return;
+
+    arena->current = NULL;
+    chunk->next = NULL;
+    InterlockedIncrement(&arena->pending);
+    EnterCriticalSection(&arena->lock);
+    if (arena->queueTail)
+        arena->queueTail->next = chunk;
+    else
+        arena->queue = chunk;
+    arena->queueTail = chunk;
+    LeaveCriticalSection(&arena->lock);
+    SetEvent(arena->wake);
+}
+
+
+/*******************************************************************************
+ *  @fn     arenaAppend
+ *  @brief  Copies the output of a task to the arena. A full chunk is queued
+ *          for writing, the next one is a written one or a new one, and the
+ *          caller only waits when maxChunks are queued.
+ *  @param[in/out] arena : Arena
+ *  @param[in] data      : Annex-B data
+ *  @param[in] size      : Bytes
+ *  @return bool : false if the output could not be written; otherwise true.
+ ******************************************************************************/
+bool arenaAppend(BitstreamArena *arena, const BYTE *data, unsigned int size)
+{
+    ArenaChunk *chunk = arena->current;
+    if (chunk && chunk->size + size > chunk->capacity)
+    {
+        arenaQueue(arena);
+        chunk = NULL;
+    }
+
+    while (chunk == NULL)
+    {
+        EnterCriticalSection(&arena->lock);
+        chunk = arena->spare;
+        if (chunk)
+            arena->spare = chunk->next;
+        LeaveCriticalSection(&arena->lock);
+
+        if (chunk == NULL && arena->numChunks < arena->maxChunks)
+        {
+            chunk = (ArenaChunk*) calloc(1, sizeof(ArenaChunk));
+            arena->numChunks++;
+        }
+        if (chunk == NULL)
+            WaitForSingleObject(arena->recycled, INFINITE);
+    }
+
+    // a frame larger than a chunk gets a chunk of its size
+    if (chunk->capacity < size || chunk->data == NULL)
+    {
+        chunk->capacity = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+        free(chunk->data);
+        chunk->data = (BYTE*) malloc(chunk->capacity);
+    }
+
+    memcpy(chunk->data + chunk->size, data, size);
+    chunk->size += size;
+    arena->current = chunk;
+    return !arena->failed;
+}
+
+
+/*******************************************************************************
+ *  @fn     arenaFlush
+ *  @brief  Queues the chunk being filled & waits until every chunk is written,
+ *          the output can then be used by the caller
+ *  @param[in/out] arena : Arena
+ *  @return bool : false if the output could not be written; otherwise true.
+ ******************************************************************************/
+bool arenaFlush(BitstreamArena *arena)
+{
+    arenaQueue(arena);
+    while (arena->pending > 0)
+        WaitForSingleObject(arena->recycled, INFINITE);
+    return !arena->failed;
+}
+
+
+/*******************************************************************************
+ *  @fn     arenaClose
+ *  @brief  Writes what is left, stops the writer & frees the chunks
+ *  @param[in/out] arena : Arena
+ *  @return bool : false if the output could not be written; otherwise true.
+ ******************************************************************************/
+bool arenaClose(BitstreamArena *arena)
+{
+    bool status = arenaFlush(arena);
+
+    InterlockedExchange(&arena->stop, 1);
+    SetEvent(arena->wake);
+    WaitForSingleObject(arena->thread, INFINITE);
+    CloseHandle(arena->thread);
+    CloseHandle(arena->wake);
+    CloseHandle(arena->recycled);
+    DeleteCriticalSection(&arena->lock);
+
+    while (arena->spare)
+    {
+        ArenaChunk *chunk = arena->spare;
+        arena->spare = chunk->next;
+        free(chunk->data);
+        free(chunk);
+    }
+    return status;
+}
+
+#endif
@@ -13,6 +13,17 @@ AVS_ScriptEnvironment *env;
 AVS_Clip *clip;
 const AVS_VideoInfo *info = 0;
 
+// Serializes the access to the clips when several threads read frames
+CRITICAL_SECTION avsLock;
+
+// A script opened in its own environment, one per job when several are encoded
+typedef struct AvsSource
+{
+    AVS_ScriptEnvironment *env;
+    AVS_Clip              *clip;
+    const AVS_VideoInfo   *info;
+} AvsSource;
+
 AVS_Clip* avisynth_filter(AVS_Clip *clip, AVS_ScriptEnvironment *env, const char *filter)
 {
     AVS_Value val_clip, val_array, val_return;
@@ -31,6 +42,31 @@ AVS_Clip* avisynth_filter(AVS_Clip *clip, AVS_ScriptEnvironment *env, const char
     return clip;
 }
 
+// Frames first to end - 1 of a clip, the clip is not released
+AVS_Clip* avisynth_trim(AVS_Clip *clip, AVS_ScriptEnvironment *env, int first, int end)
+{
+    AVS_Value val_args[3], val_array, val_return;
+
+    // a negative length, Trim(clip, first, 0) would mean until the last frame
+    val_args[0] = avs_new_value_clip(clip);
+    val_args[1] = avs_new_value_int(first);
+    val_args[2] = avs_new_value_int(first - end);
+    val_array = avs_new_value_array(val_args, 3);
+    val_return = avs_invoke(env, "Trim", val_array, 0);
+
+    AVS_Clip *trimmed = 0;
+    if (avs_is_clip(val_return))
+        trimmed = avs_take_clip(val_return, env);
+    else
+        fprintf(stderr, "Trim(%d, %d) failed.\n", first, first - end);
+
+    avs_release_value(val_array);
+    avs_release_value(val_args[0]);
+    avs_release_value(val_return);
+
+    return trimmed;
+}
+
 AVS_Clip* avisynth_source(char *file, AVS_ScriptEnvironment *env)
 {
     AVS_Clip *clip;
@@ -56,27 +92,35 @@ AVS_Clip* avisynth_source(char *file, AVS_ScriptEnvironment *env)
 }
 
 
-bool AVS_Init(char *inFile)
+/*******************************************************************************
+ *  @fn     avsImport
+ *  @brief  Opens a script in the environment of source, converting it to yv12
+ *  @param[in/out] source : Clip, with the environment set
+ *  @param[in] inFile     : Avisynth script
+ *  @return bool : true if successful; otherwise false.
+ ******************************************************************************/
+bool avsImport(AvsSource *source, char *inFile)
 {
-	env = avs_create_script_environment(AVISYNTH_INTERFACE_VERSION);
-    clip = avisynth_source(inFile, env);
+    source->clip = avisynth_source(inFile, source->env);
+    if (source->clip == 0)
+        return false;
 
-    info = avs_get_video_info(clip);
+    source->info = avs_get_video_info(source->clip);
 
-    if (!avs_has_video(info))
+    if (!avs_has_video(source->info))
     {
         fprintf(stderr, "Clip has no video.\n");
         return false;
     }
 
     // ensure video is yv12
-    if (avs_has_video(info) && !avs_is_yv12(info))
+    if (avs_has_video(source->info) && !avs_is_yv12(source->info))
     {
         fprintf(stderr, "Converting video to yv12.\n");
-        clip = avisynth_filter(clip, env, "ConvertToYV12");
-        info = avs_get_video_info(clip);
+        source->clip = avisynth_filter(source->clip, source->env, "ConvertToYV12");
+        source->info = avs_get_video_info(source->clip);
 
-        if (!avs_is_yv12(info))
+        if (!avs_is_yv12(source->info))
         {
         	fprintf(stderr, "Failed to convert video to yv12.\n");
             return false;
@@ -86,3 +130,124 @@ bool AVS_Init(char *inFile)
     return true;
 }
 
+
+// Opens a script in its own environment
+bool avsOpen(AvsSource *source, char *inFile)
+{
+	source->env = avs_create_script_environment(AVISYNTH_INTERFACE_VERSION);
+    return avsImport(source, inFile);
+}
+
+
+void avsClose(AvsSource *source)
+{
+    if (source->clip)
+        avs_release_clip(source->clip);
+    if (source->env)
+        avs_delete_script_environment(source->env);
+    memset(source, 0, sizeof(AvsSource));
+}
+
+
+// Opens the clip of the single encode in the globals
+bool AVS_Init(char *inFile)
+{
+    InitializeCriticalSection(&avsLock);
+
+    AvsSource source;
+    memset(&source, 0, sizeof(AvsSource));
+    bool status = avsOpen(&source, inFile);
+    env = source.env;
+    clip = source.clip;
+    info = source.info;
+    return status;
+}
+
+
+
+/*******************************************************************************
+ *  @fn     avsFrameToNV12
+ *  @brief  Converts a yv12 frame to the NV12 layout of the encoder input:
+ *          vi->height rows of luma followed by the interleaved chroma rows
+ *  @param[in] frame : Avisynth frame
+ *  @param[out] dst  : NV12 frame
+ *  @param[in] pitch : Bytes per row of dst
+ *  @param[in] vi    : Video info of the clip of the frame
+ ******************************************************************************/
+void avsFrameToNV12(AVS_VideoFrame *frame, BYTE *dst, unsigned int pitch, const AVS_VideoInfo *vi)
+{
+    const BYTE *pYplane = avs_get_read_ptr_p(frame, AVS_PLANAR_Y);
+    const BYTE *pUplane = avs_get_read_ptr_p(frame, AVS_PLANAR_U);
+    const BYTE *pVplane = avs_get_read_ptr_p(frame, AVS_PLANAR_V);
+
+    // Y plane
+    unsigned int pitchY = avs_get_pitch_p(frame, AVS_PLANAR_Y);
+    for (int h = 0; h < vi->height; h++)
+    {
+        memcpy(dst, pYplane, vi->width);
+        dst += pitch;
+        pYplane += pitchY;
+    }
+
+    // UV planes
+    unsigned int pitchUV = avs_get_pitch_p(frame, AVS_PLANAR_U);
+    unsigned int uiHalfHeight = vi->height >> 1;
+    unsigned int uiHalfWidth  = vi->width >> 1; //chromaWidth
+    for (unsigned int h = 0; h < uiHalfHeight; h++)
+    {
+        for (unsigned int i = 0; i < uiHalfWidth; ++i)
+        {
+            dst[i*2]     = pUplane[i];
+            dst[i*2 + 1] = pVplane[i];
+        }
+        dst += pitch;
+        pUplane += pitchUV;
+        pVplane += pitchUV;
+    }
+}
+
+
+/*******************************************************************************
+ *  @fn     avsSourceFrameNV12
+ *  @brief  Reads frame n of a clip as NV12, can be called from any thread
+ *  @param[in] source : Clip
+ *  @param[in] n      : Frame number
+ *  @param[out] dst   : NV12 frame
+ *  @param[in] pitch  : Bytes per row of dst
+ ******************************************************************************/
+void avsSourceFrameNV12(AvsSource *source, int n, BYTE *dst, unsigned int pitch)
+{
+    EnterCriticalSection(&avsLock);
+    AVS_VideoFrame *frame = avs_get_frame(source->clip, n);
+    LeaveCriticalSection(&avsLock);
+
+    avsFrameToNV12(frame, dst, pitch, source->info);
+
+    EnterCriticalSection(&avsLock);
+    avs_release_frame(frame);
+    LeaveCriticalSection(&avsLock);
+}
+
+
+// Frame n of the clip in the globals
+void avsGetFrameNV12(int n, BYTE *dst, unsigned int pitch)
+{
+    AvsSource source = {env, clip, info};
+    avsSourceFrameNV12(&source, n, dst, pitch);
+}
+
+
+/*******************************************************************************
+ *  @fn     avsSetConfig
+ *  @brief  Completes the configuration with the frame rate & cropping of a clip
+ *  @param[in/out] pConfig : OvConfigCtrl
+ *  @param[in] vi          : Video info of the clip
+ ******************************************************************************/
+void avsSetConfig(OvConfigCtrl *pConfig, const AVS_VideoInfo *vi)
+{
+	pConfig->rateControl.encRateControlFrameRateNumerator = vi->fps_numerator;
+	pConfig->rateControl.encRateControlFrameRateDenominator = vi->fps_denominator;
+
+	if (vi->height % 16)
+		pConfig->pictControl.encCropBottomOffset = (((vi->height / 16) + 1) * 16 -  vi->height) >> 1;
+}
@@ -0,0 +1,194 @@
+/*******************************************************************************
+* This file is part of AvsVCEh264.
+* Contains the journal of the single session encode: at IDR frames, at most
+* once a second, the frame number & the size of the output before it are
+* written to output.journal, both files flushed to the disk first. -resume
+* truncates the output at the last checkpoint & encodes again from that frame.
+*
+* Journal, one text line per record:
+*  AvsVCEh264 journal frames width height
+*  frame offset
+*  ...
+*
+* Copyright (C) 2013 David Gonzlez Garca <davidgg666@gmail.com>
+*******************************************************************************/
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <stdio.h>
+#include <io.h>
+
+#define CHECKPOINT_MIN_MS   1000    // between two checkpoints
+
+typedef struct Journal
+{
+    FILE            *fj;
+    char            fileName[MAX_PATH];
+    DWORD           lastTick;
+    unsigned int    checkpoints;
+} Journal;
+
+// Journal of the single session encode, when open
+Journal journal;
+
+
+// Flushes a file to the disk
+bool journalSync(FILE *f)
+{
+    return fflush(f) == 0 && _commit(_fileno(f)) == 0;
+}
+
+
+/*******************************************************************************
+ *  @fn     journalLast
+ *  @brief  Reads the last checkpoint of the journal of an output
+ *  @param[in] outFile : Output file
+ *  @param[in] vi      : Video info of the clip, must be the one journaled
+ *  @param[out] frame  : First frame to encode again
+ *  @param[out] offset : Size of the output to keep
+ *  @return bool : true if there is a checkpoint; otherwise false.
+ ******************************************************************************/
+bool journalLast(char *outFile, const AVS_VideoInfo *vi, unsigned int *frame, uint64 *offset)
+{
+    char fileName[MAX_PATH];
+    snprintf(fileName, MAX_PATH, "%s.journal", outFile);
+    FILE *fj = fopen(fileName, "r");
+    if (fj == NULL)
+    {
+        fprintf(stderr, "There is no journal %s to resume\n", fileName);
+        return false;
+    }
+
+    char line[255];
+    int frames = 0, width = 0, height = 0;
+    bool status = fgets(line, sizeof(line), fj) &&
+                  sscanf(line, "AvsVCEh264 journal %d %d %d", &frames, &width, &height) == 3;
+    if (!status || frames != vi->num_frames || width != vi->width || height != vi->height)
+    {
+        fprintf(stderr, "The journal %s is not of this clip\n", fileName);
+        fclose(fj);
+        return false;
+    }
+
+    // a record cut by the crash has no end of line
+    status = false;
+    while (fgets(line, sizeof(line), fj))
+    {
+        unsigned int f;
+        double o;   // exact to 2^53 bytes, MSVCRT has no %llu
+        if (strchr(line, '\n') && sscanf(line, "%u %lf", &f, &o) == 2)
+        {
+            *frame = f;
+            *offset = (uint64)o;
+            status = true;
+        }
+    }
+    fclose(fj);
+
+    if (!status)
+        fprintf(stderr, "The journal %s has no checkpoint\n", fileName);
+    return status;
+}
+
+
+/*******************************************************************************
+ *  @fn     journalTruncate
+ *  @brief  Cuts the output at the offset of a checkpoint
+ *  @param[in] outFile : Output file
+ *  @param[in] offset  : Size to keep
+ *  @return bool : true if successful; otherwise false.
+ ******************************************************************************/
+bool journalTruncate(char *outFile, uint64 offset)
+{
+    HANDLE file = CreateFile(outFile, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING,
+                             FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        fprintf(stderr, "Error opening the output file %s\n", outFile);
+        return false;
+    }
+
+    LARGE_INTEGER size, position;
+    position.QuadPart = offset;
+    bool status = GetFileSizeEx(file, &size) && (uint64)size.QuadPart >= offset;
+    if (!status)
+        fprintf(stderr, "The output file %s is shorter than its journal\n", outFile);
+    else
+        status = SetFilePointerEx(file, position, NULL, FILE_BEGIN) && SetEndOfFile(file);
+
+    CloseHandle(file);
+    return status;
+}
+
+
+/*******************************************************************************
+ *  @fn     journalOpen
+ *  @brief  Starts the journal of an output, or continues it when resuming
+ *  @param[out] journal : Journal
+ *  @param[in] outFile  : Output file
+ *  @param[in] vi       : Video info of the clip
+ *  @param[in] resume   : Keeps the records of the previous run
+ *  @return bool : true if successful; otherwise false.
+ ******************************************************************************/
+bool journalOpen(Journal *journal, char *outFile, const AVS_VideoInfo *vi, bool resume)
+{
+    memset(journal, 0, sizeof(Journal));
+    snprintf(journal->fileName, MAX_PATH, "%s.journal", outFile);
+    journal->fj = fopen(journal->fileName, resume ? "a" : "w");
+    if (journal->fj == NULL)
+    {
+        fprintf(stderr, "Error opening the journal %s\n", journal->fileName);
+        return false;
+    }
+
+    if (!resume)
+        fprintf(journal->fj, "AvsVCEh264 journal %d %d %d\n", vi->num_frames, vi->width, vi->height);
+    return journalSync(journal->fj);
+}
+
+
+// Tells if the next checkpoint would be recorded, the previous one is old enough
+inline bool journalDue(Journal *journal)
+{
+    return journal->checkpoints == 0 || GetTickCount() - journal->lastTick >= CHECKPOINT_MIN_MS;
+}
+
+
+/*******************************************************************************
+ *  @fn     journalCheckpoint
+ *  @brief  Records that the output can be cut at offset & encoded again from
+ *          frame, an IDR. Skipped if the previous one is too recent.
+ *  @param[in] journal : Journal
+ *  @param[in] out     : Output, flushed to the disk before the record
+ *  @param[in] frame   : IDR frame about to be written
+ *  @param[in] offset  : Size of the output before it
+ ******************************************************************************/
+void journalCheckpoint(Journal *journal, OutputFile *out, unsigned int frame, uint64 offset)
+{
+    DWORD tick = GetTickCount();
+    if (!journalDue(journal))
+        return;
+
+    if (!outputFlush(out, true))
+        return;
+    fprintf(journal->fj, "%u %.0f\n", frame, (double)offset);
+    journalSync(journal->fj);
+
+    journal->lastTick = tick;
+    journal->checkpoints++;
+}
+
+
+// Closes the journal, it is deleted when the encode is complete
+void journalClose(Journal *journal, bool complete)
+{
+    if (journal->fj == NULL)
+        return;
+
+    fclose(journal->fj);
+    if (complete)
+        remove(journal->fileName);
+    journal->fj = NULL;
+}
+
+#endif
@@ -0,0 +1,480 @@
+/*******************************************************************************
+* This file is part of AvsVCEh264.
+* Contains the chunked mode: the clip is split in GOP aligned segments,
+* preferably at scene cuts, that are encoded concurrently on several sessions
+* and devices and then stitched in order into one stream.
+*
+* Copyright (C) 2013 David Gonzlez Garca <davidgg666@gmail.com>
+*******************************************************************************/
+#ifndef CHUNKED_H
+#define CHUNKED_H
+
+#define CHUNK_MAX_SESSIONS          64
+#define CHUNK_SEGMENTS_PER_SESSION  4   // more segments than sessions balance the load
+#define CHUNK_MIN_SECONDS           4   // shortest segment
+#define CHUNK_SAMPLE_STEP           8   // luma subsampling of the scene cut scan
+#define CHUNK_CUT_THRESHOLD         24  // mean luma difference of a scene cut
+#define CHUNK_AHEAD_PER_SESSION     2   // segments encoded ahead of the stream, in memory
+
+typedef struct ChunkSegment
+{
+    int           first;        // first frame
+    int           end;          // one past the last frame
+    int           encoded;      // frames encoded
+    BYTE          *data;        // Annex-B output
+    unsigned int  size;
+    unsigned int  capacity;
+    volatile LONG done;         // 1 when finished, -1 if it failed
+} ChunkSegment;
+
+typedef struct ChunkJob
+{
+    EncoderSession  format;     // frame format & backend of every session
+    OvConfigCtrl    *pConfig;
+    ChunkSegment    *segments;
+    int             numSegments;
+    volatile LONG   nextSegment;
+    volatile LONG   written;    // segments written to the stream
+    LONG            ahead;      // segments taken past the written ones, at most
+    volatile LONG   framesDone;
+    volatile LONG   stop;       // stops the workers, user request or failure
+    volatile LONG   failed;
+} ChunkJob;
+
+typedef struct ChunkWorker
+{
+    ChunkJob        *job;
+    EncoderDevice   *device;
+} ChunkWorker;
+
+// Last parameter sets written to the stitched stream
+typedef struct ChunkHeaders
+{
+    BYTE            *nal[2];    // SPS, PPS
+    unsigned int    size[2];
+} ChunkHeaders;
+
+
+/*******************************************************************************
+ *  @fn     chunkLumaSample
+ *  @brief  Reads a subsampled copy of the luma plane of frame n
+ *  @param[in] n    : Frame number
+ *  @param[out] dst : Samples, one every CHUNK_SAMPLE_STEP pixels & rows
+ ******************************************************************************/
+void chunkLumaSample(int n, BYTE *dst)
+{
+    EnterCriticalSection(&avsLock);
+    AVS_VideoFrame *frame = avs_get_frame(clip, n);
+    LeaveCriticalSection(&avsLock);
+
+    const BYTE *pYplane = avs_get_read_ptr_p(frame, AVS_PLANAR_Y);
+    unsigned int pitch = avs_get_pitch_p(frame, AVS_PLANAR_Y);
+    for (int y = 0; y < info->height; y += CHUNK_SAMPLE_STEP)
+    {
+        for (int x = 0; x < info->width; x += CHUNK_SAMPLE_STEP)
+            *dst++ = pYplane[y * pitch + x];
+    }
+
+    EnterCriticalSection(&avsLock);
+    avs_release_frame(frame);
+    LeaveCriticalSection(&avsLock);
+}
+
+
+/*******************************************************************************
+ *  @fn     chunkFindCut
+ *  @brief  Looks for a scene cut in a window of frames: the frame that differs
+ *          most from the previous one, if it stands out from the rest
+ *  @param[in] from : First frame of the window, > 0
+ *  @param[in] to   : Last frame of the window
+ *  @return int : the first frame of the new scene or -1 if there is no cut.
+ ******************************************************************************/
+int chunkFindCut(int from, int to)
+{
+    unsigned int cols = (info->width + CHUNK_SAMPLE_STEP - 1) / CHUNK_SAMPLE_STEP;
+    unsigned int rows = (info->height + CHUNK_SAMPLE_STEP - 1) / CHUNK_SAMPLE_STEP;
+    unsigned int samples = cols * rows;
+    BYTE *prev = (BYTE*) malloc(samples);
+    BYTE *cur = (BYTE*) malloc(samples);
+
+    int cut = -1;
+    double cutDiff = 0, sumDiff = 0;
+    chunkLumaSample(from - 1, prev);
+    for (int n = from; n <= to; n++)
+    {
+        chunkLumaSample(n, cur);
+
+        unsigned int sad = 0;
+        for (unsigned int i = 0; i < samples; i++)
+            sad += abs(cur[i] - prev[i]);
+
+        double diff = sad / (double)samples;
+        sumDiff += diff;
+        if (diff > cutDiff)
+        {
+            cutDiff = diff;
+            cut = n;
+        }
+
+        BYTE *tmp = prev;
+        prev = cur;
+        cur = tmp;
+    }
+    free(prev);
+    free(cur);
+
+    // A cut must be a clear peak among the differences of the window
+    double others = to > from ? (sumDiff - cutDiff) / (to - from) : 0;
+    if (cutDiff < CHUNK_CUT_THRESHOLD || cutDiff < 3 * others)
+        return -1;
+    return cut;
+}
+
+
+/*******************************************************************************
+ *  @fn     chunkPlan
+ *  @brief  Splits the clip in segments. With encIDRPeriod the splits are on
+ *          multiples of it, so the GOP structure is the one of a single session
+ *          encode; otherwise they are moved to a scene cut found near them.
+ *  @param[in/out] job       : Job to fill with the segments
+ *  @param[in] numSessions   : Sessions that will encode the segments
+ ******************************************************************************/
+void chunkPlan(ChunkJob *job, unsigned int numSessions)
+{
+    int frames = info->num_frames;
+    int fps = info->fps_numerator / info->fps_denominator;
+    if (fps < 1)
+        fps = 1;
+
+    int idrPeriod = job->pConfig->pictControl.encIDRPeriod;
+    int minLength = CHUNK_MIN_SECONDS * fps;
+    if (idrPeriod > 0)
+        minLength = (minLength + idrPeriod - 1) / idrPeriod * idrPeriod;
+
+    // scene cut search window around each split, +-1 s
+    int window = idrPeriod > 0 ? 0 : fps;
+
+    int numSegments = numSessions * CHUNK_SEGMENTS_PER_SESSION;
+    if (frames / minLength < numSegments)
+        numSegments = frames / minLength;
+    if (numSegments < 1)
+        numSegments = 1;
+
+    job->segments = new ChunkSegment[numSegments];
+    memset(job->segments, 0, sizeof(ChunkSegment) * numSegments);
+    job->numSegments = 0;
+
+    int prev = 0;
+    for (int i = 1; i <= numSegments; i++)
+    {
+        int split = (int)((int64)frames * i / numSegments);
+        if (i < numSegments)
+        {
+            if (idrPeriod > 0)
+            {
+                split = (split + idrPeriod / 2) / idrPeriod * idrPeriod;
+            }
+            else
+            {
+                int cut = chunkFindCut(split - window, split + window < frames ? split + window : frames - 1);
+                if (cut >= 0)
+                    split = cut;
+            }
+            if (split <= prev || split >= frames)
+                continue;
+        }
+
+        ChunkSegment *segment = &job->segments[job->numSegments++];
+        segment->first = prev;
+        segment->end = split;
+        prev = split;
+    }
+}
+
+
+// Appends encoded data to a segment
+bool chunkAppend(ChunkSegment *segment, const BYTE *data, unsigned int size)
+{
+    if (segment->size + size > segment->capacity)
+    {
+        unsigned int capacity = (segment->size + size) * 2;
+        BYTE *grown = (BYTE*) realloc(segment->data, capacity);
+        if (grown == NULL)
+            return false;
+        segment->data = grown;
+        segment->capacity = capacity;
+    }
+    memcpy(segment->data + segment->size, data, size);
+    segment->size += size;
+    return true;
+}
+
+
+/*******************************************************************************
+ *  @fn     chunkEncodeSegment
+ *  @brief  Encodes the frames of a segment on a new session, so it starts with
+ *          an IDR and SPS/PPS and the IDR period of the session starts at it
+ *  @param[in] format         : Frame format & backend of the session
+ *  @param[in] device         : Device on which the session is created
+ *  @param[in] pConfig        : OvConfigCtrl
+ *  @param[in/out] segment    : Segment to encode, gets the output
+ *  @param[in] stop           : Stops the encoding when set
+ *  @param[in/out] framesDone : Incremented for every frame encoded
+ *  @return bool : true if successful; otherwise false.
+ ******************************************************************************/
+bool chunkEncodeSegment(EncoderSession *format, EncoderDevice *device, OvConfigCtrl *pConfig,
+                        ChunkSegment *segment, volatile LONG *stop, volatile LONG *framesDone)
+{
+    const EncoderBackend *encoder = format->backend;
+
+	OVE_OUTPUT_DESCRIPTION taskDescriptionList = {sizeof(OVE_OUTPUT_DESCRIPTION), 0, OVE_TASK_STATUS_NONE, 0, 0};
+
+    OVE_ENCODE_PARAMETERS_H264 pictureParameter;
+	memset(&pictureParameter, 0, sizeof(OVE_ENCODE_PARAMETERS_H264));
+	pictureParameter.size = sizeof(OVE_ENCODE_PARAMETERS_H264);
+	pictureParameter.pictureStructure = OVE_PICTURE_STRUCTURE_H264_FRAME;
+	pictureParameter.forceRefreshMap = (OVE_BOOL)true;
+
+    EncoderSession session = *format;
+    bool ok = encoder->createSession(&session, device, pConfig);
+    if (ok && !encoder->sendConfig(&session, pConfig, ENC_CONFIG_ALL))
+    {
+        fprintf(stderr, "OVEncodeSendConfig returned error\n");
+        ok = false;
+    }
+
+    BYTE *frameData = (BYTE*) malloc(session.frameSize);
+    for (int f = segment->first; ok && f < segment->end && !*stop; f++)
+    {
+        avsGetFrameNV12(f, frameData, session.pitch);
+
+        pictureParameter.insertSPS = (OVE_BOOL)(f == segment->first);
+        pictureParameter.forcePicType = f == segment->first ? OVE_PICTURE_TYPE_H264_IDR : OVE_PICTURE_TYPE_H264_NONE;
+
+        unsigned int iTaskID;
+        ok = encoder->submit(&session, frameData, &pictureParameter, &iTaskID) &&
+             encoder->query(&session, &taskDescriptionList);
+
+        bool stored = true;
+        if (ok && taskDescriptionList.status == OVE_TASK_STATUS_COMPLETE &&
+                taskDescriptionList.size_of_bitstream_data > 0)
+        {
+            stored = chunkAppend(segment, (BYTE*)taskDescriptionList.bitstream_data,
+                                 taskDescriptionList.size_of_bitstream_data);
+        }
+        if (ok)
+            releaseQueried(&session, &taskDescriptionList);
+        if (!stored)
+        {
+            fprintf(stderr, "Not enough memory for the output of frames %d-%d\n", segment->first, segment->end - 1);
+            ok = false;
+        }
+
+        segment->encoded++;
+        InterlockedIncrement(framesDone);
+    }
+    free(frameData);
+
+    encoder->releaseSession(&session);
+    if (!ok)
+        fprintf(stderr, "Encoding of frames %d-%d failed\n", segment->first, segment->end - 1);
+    return ok;
+}
+
+
+/*******************************************************************************
+ *  @fn     chunkWorkerThread
+ *  @brief  Encodes segments on one device until there are none left. A
+ *          segment is only started when it is close enough to the stream
+ *          written, so the segments kept in memory are bounded.
+ ******************************************************************************/
+DWORD WINAPI chunkWorkerThread(LPVOID param)
+{
+    ChunkWorker *worker = (ChunkWorker*)param;
+    ChunkJob *job = worker->job;
+
+    for (;;)
+    {
+        LONG s = InterlockedIncrement(&job->nextSegment) - 1;
+        if (s >= job->numSegments || job->stop)
+            break;
+        while (s >= job->written + job->ahead && !job->stop)
+            Sleep(20);
+        if (job->stop)
+            break;
+
+        ChunkSegment *segment = &job->segments[s];
+        bool ok = chunkEncodeSegment(&job->format, worker->device, job->pConfig,
+                                     segment, &job->stop, &job->framesDone);
+        if (!ok)
+        {
+            InterlockedExchange(&job->failed, 1);
+            InterlockedExchange(&job->stop, 1);
+        }
+        InterlockedExchange(&segment->done, ok ? 1 : -1);
+    }
+
+    return 0;
+}
+
+
+/*******************************************************************************
+ *  @fn     chunkWriteSegment
+ *  @brief  Writes a segment to the stitched stream. The SPS & PPS of its first
+ *          access unit are dropped when they repeat the last ones written.
+ *  @param[in] fw          : Output file
+ *  @param[in] segment     : Encoded segment
+ *  @param[in/out] headers : Last parameter sets written
+ *  @return bool : true if successful; otherwise false.
+ ******************************************************************************/
+bool chunkWriteSegment(FILE *fw, ChunkSegment *segment, ChunkHeaders *headers)
+{
+    unsigned int pos = 0;
+    bool firstAU = true;
+    AnnexbNal nal;
+
+    while (annexbNextNal(segment->data, segment->size, &pos, &nal))
+    {
+        if (nal.type == NAL_SLICE || nal.type == NAL_IDR)
+            firstAU = false;
+
+        if (nal.type == NAL_SPS || nal.type == NAL_PPS)
+        {
+            // compare from the NAL header, the start code length may differ
+            int i = nal.type - NAL_SPS;
+            unsigned int size = nal.size - nal.header;
+            if (firstAU && headers->nal[i] && headers->size[i] == size &&
+                    memcmp(headers->nal[i], nal.data + nal.header, size) == 0)
+                continue;
+
+            BYTE *copy = (BYTE*) realloc(headers->nal[i], size);
+            if (copy == NULL)
+                return false;
+            headers->nal[i] = copy;
+            memcpy(headers->nal[i], nal.data + nal.header, size);
+            headers->size[i] = size;
+        }
+
+        if (fwrite(nal.data, 1, nal.size, fw) != nal.size)
+            return false;
+    }
+    return true;
+}
+
+
+/*******************************************************************************
+ *  @fn     chunkEncodeProcess
+ *  @brief  Encodes the clip in segments on several sessions & devices and
+ *          stitches the segments in order as they are finished
+ *  @param[in] format            : Frame format & backend of the sessions
+ *  @param[in] devices           : Devices on which the sessions are created
+ *  @param[in] numDevices        : Number of devices
+ *  @param[in] sessionsPerDevice : Concurrent sessions on each device
+ *  @param[out] outFile          : output encoded H.264 video file
+ *  @param[in] pConfig           : OvConfigCtrl
+ *  @param[out] progress         : Frames encoded so far, updated while encoding
+ *  @return bool : true if successful; otherwise false.
+ ******************************************************************************/
+bool chunkEncodeProcess(EncoderSession *format, EncoderDevice *devices, unsigned int numDevices,
+                        unsigned int sessionsPerDevice, char *outFile, OvConfigCtrl *pConfig,
+                        unsigned int *progress)
+{
+    ChunkJob job;
+    memset(&job, 0, sizeof(ChunkJob));
+    job.format = *format;
+    job.pConfig = pConfig;
+
+    unsigned int numSessions = numDevices * sessionsPerDevice;
+    if (numSessions > CHUNK_MAX_SESSIONS)
+        numSessions = CHUNK_MAX_SESSIONS;
+
+    chunkPlan(&job, numSessions);
+    if ((unsigned)job.numSegments < numSessions)
+        numSessions = job.numSegments;
+    job.ahead = numSessions * CHUNK_AHEAD_PER_SESSION;
+    fprintf(stderr, "Chunked     %d segments, %u sessions on %u devices\n",
+            job.numSegments, numSessions, numDevices < numSessions ? numDevices : numSessions);
+
+    // Output file handle
+    FILE *fw = outputFopen(outFile, "wb");
+    if (fw == NULL)
+    {
+        printf("Error opening the output file %s\n", outFile);
+        delete [] job.segments;
+        return false;
+    }
+
+    // Sessions are spread over the devices
+    ChunkWorker workers[CHUNK_MAX_SESSIONS];
+    HANDLE threads[CHUNK_MAX_SESSIONS];
+    for (unsigned int i = 0; i < numSessions; i++)
+    {
+        workers[i].job = &job;
+        workers[i].device = &devices[i % numDevices];
+        threads[i] = CreateThread(NULL, 0, chunkWorkerThread, &workers[i], 0, NULL);
+    }
+
+    // Stitch the segments in order
+    ChunkHeaders headers;
+    memset(&headers, 0, sizeof(ChunkHeaders));
+    bool status = true;
+    int next = 0;
+    while (next < job.numSegments)
+    {
+        *progress = job.framesDone;
+        if (GetAsyncKeyState(VK_F8))
+            InterlockedExchange(&job.stop, 1);
+
+        ChunkSegment *segment = &job.segments[next];
+        if (segment->done == 0)
+        {
+            // every worker has quit, the segment will not be encoded
+            if (job.stop && WaitForMultipleObjects(numSessions, threads, TRUE, 0) == WAIT_OBJECT_0 &&
+                    segment->done == 0)
+                break;
+            Sleep(50);
+            continue;
+        }
+        if (segment->done < 0 || job.failed)
+        {
+            status = false;
+            break;
+        }
+
+        if (!chunkWriteSegment(fw, segment, &headers))
+        {
+            fprintf(stderr, "Error writing the output file %s\n", outFile);
+            status = false;
+            break;
+        }
+        free(segment->data);
+        segment->data = NULL;
+        next++;
+        InterlockedExchange(&job.written, next);
+
+        // a segment left unfinished ends the stream
+        if (segment->encoded < segment->end - segment->first)
+            break;
+    }
+
+    InterlockedExchange(&job.stop, 1);
+    WaitForMultipleObjects(numSessions, threads, TRUE, INFINITE);
+    for (unsigned int i = 0; i < numSessions; i++)
+        CloseHandle(threads[i]);
+    *progress = job.framesDone;
+    if (job.failed)
+        status = false;
+
+    // Free memory resources
+    for (int i = 0; i < job.numSegments; i++)
+        free(job.segments[i].data);
+    delete [] job.segments;
+    free(headers.nal[0]);
+    free(headers.nal[1]);
+    if (fclose(fw) != 0)
+        status = false;
+
+    return status;
+}
+
+#endif
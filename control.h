@@ -0,0 +1,341 @@
+/*******************************************************************************
+* This file is part of AvsVCEh264.
+* Contains the control pipe of a running encode: rate control, QP & IDR period
+* changes applied at the next frame, or at an IDR, without restarting it.
+*
+* Protocol, one text line per message, on \\.\pipe\<name>:
+*  client -> encoder : keyword value ... [idr], keywords bitrate, peak, qpI,
+*                      qpP, qpB & idrPeriod. idr applies the change on a
+*                      forced IDR with SPS/PPS.
+*  encoder -> client : OK frame, the first frame encoded with the change
+*                      | ERROR message
+*
+* Copyright (C) 2013 David Gonzlez Garca <davidgg666@gmail.com>
+*******************************************************************************/
+#ifndef CONTROL_H
+#define CONTROL_H
+
+#define CONTROL_PIPE_PREFIX "\\\\.\\pipe\\"
+#define CONTROL_TIMEOUT_MS  10000   // a request not applied by then is refused
+
+#define CONTROL_BITRATE     0x01
+#define CONTROL_PEAK        0x02
+#define CONTROL_QP_I        0x04
+#define CONTROL_QP_P        0x08
+#define CONTROL_QP_B        0x10
+#define CONTROL_IDR_PERIOD  0x20
+
+typedef struct ControlRequest
+{
+    unsigned int    fields;         // CONTROL_* given
+    unsigned int    bitrate;
+    unsigned int    peak;
+    unsigned int    qpI;
+    unsigned int    qpP;
+    unsigned int    qpB;
+    unsigned int    idrPeriod;
+    bool            idr;            // applied on a forced IDR
+    unsigned int    frame;          // first frame encoded with it
+    bool            ok;
+} ControlRequest;
+
+typedef struct Control
+{
+    char            pipeName[MAX_PATH];
+    HANDLE          thread;
+    HANDLE          applied;        // set by the encoder when it took the request
+    CRITICAL_SECTION lock;
+    ControlRequest  request;
+    volatile LONG   pending;        // request waiting for the next frame
+    volatile LONG   stop;
+} Control;
+
+// Control pipe of the single session & live encodes, when enabled
+Control control;
+
+
+/*******************************************************************************
+ *  @fn     controlParse
+ *  @brief  Reads a request: keyword value pairs & the idr flag
+ *  @param[in] line     : Request line
+ *  @param[out] request : Request
+ *  @param[out] error   : Reason of the failure, 255 chars
+ *  @return bool : true if successful; otherwise false.
+ ******************************************************************************/
+bool controlParse(char *line, ControlRequest *request, char *error)
+{
+    memset(request, 0, sizeof(ControlRequest));
+    char keyword[255], value[255];
+    char *p = line;
+
+    while (schedNextToken(&p, keyword))
+    {
+        if (strcmp(keyword, "idr") == 0)
+        {
+            request->idr = true;
+            continue;
+        }
+        if (!schedNextToken(&p, value))
+        {
+            sprintf(error, "%s needs a value", keyword);
+            return false;
+        }
+
+        unsigned int uVal = (unsigned int)atoi(value);
+        bool qp = strncmp(keyword, "qp", 2) == 0;
+        if (qp && uVal > 51)
+        {
+            sprintf(error, "%s out of range 0-51", keyword);
+            return false;
+        }
+
+        if (strcmp(keyword, "bitrate") == 0 && uVal > 0)
+        {
+            request->bitrate = uVal;
+            request->fields |= CONTROL_BITRATE;
+        }
+        else if (strcmp(keyword, "peak") == 0 && uVal > 0)
+        {
+            request->peak = uVal;
+            request->fields |= CONTROL_PEAK;
+        }
+        else if (strcmp(keyword, "qpI") == 0)
+        {
+            request->qpI = uVal;
+            request->fields |= CONTROL_QP_I;
+        }
+        else if (strcmp(keyword, "qpP") == 0)
+        {
+            request->qpP = uVal;
+            request->fields |= CONTROL_QP_P;
+        }
+        else if (strcmp(keyword, "qpB") == 0)
+        {
+            request->qpB = uVal;
+            request->fields |= CONTROL_QP_B;
+        }
+        else if (strcmp(keyword, "idrPeriod") == 0)
+        {
+            request->idrPeriod = uVal;
+            request->fields |= CONTROL_IDR_PERIOD;
+        }
+        else
+        {
+            sprintf(error, "unknown or invalid %.100s %.100s", keyword, value);
+            return false;
+        }
+    }
+
+    if (request->fields == 0 && !request->idr)
+    {
+        sprintf(error, "nothing to change");
+        return false;
+    }
+    return true;
+}
+
+
+/*******************************************************************************
+ *  @fn     controlApply
+ *  @brief  Applies the pending request before a frame is submitted. Called by
+ *          the encoder loop when control.pending is set.
+ *  @param[in] ctrl     : Control
+ *  @param[in] session  : Encoder session
+ *  @param[in/out] pConfig : OvConfigCtrl, changed & sent
+ *  @param[in] frame    : Frame about to be submitted
+ *  @param[in/out] idr  : The frame is forced to IDR, set if the request needs it
+ *  @return bool : false if the session failed. A refused change is undone
+ *                 and reported to the client, the encode goes on.
+ ******************************************************************************/
+bool controlApply(Control *ctrl, EncoderSession *session, OvConfigCtrl *pConfig, unsigned int frame, bool *idr)
+{
+    EnterCriticalSection(&ctrl->lock);
+    ControlRequest *request = &ctrl->request;
+
+    // withdrawn meanwhile
+    if (!ctrl->pending)
+    {
+        LeaveCriticalSection(&ctrl->lock);
+        return true;
+    }
+
+    OvConfigCtrl previous = *pConfig;
+    unsigned int configMask = 0;
+    if (request->fields & CONTROL_BITRATE)
+        pConfig->rateControl.encRateControlTargetBitRate = request->bitrate;
+    if (request->fields & CONTROL_PEAK)
+        pConfig->rateControl.encRateControlPeakBitRate = request->peak;
+    if (request->fields & CONTROL_QP_I)
+        pConfig->rateControl.encQP_I = request->qpI;
+    if (request->fields & CONTROL_QP_P)
+        pConfig->rateControl.encQP_P = request->qpP;
+    if (request->fields & CONTROL_QP_B)
+        pConfig->rateControl.encQP_B = request->qpB;
+    if (request->fields & (CONTROL_BITRATE | CONTROL_PEAK | CONTROL_QP_I | CONTROL_QP_P | CONTROL_QP_B))
+        configMask |= ENC_CONFIG_RATE;
+    if (request->fields & CONTROL_IDR_PERIOD)
+    {
+        pConfig->pictControl.encIDRPeriod = request->idrPeriod;
+        configMask |= ENC_CONFIG_PICTURE;
+    }
+
+    request->ok = configMask == 0 || session->backend->sendConfig(session, pConfig, configMask);
+    request->frame = frame;
+    if (request->ok && request->idr)
+        *idr = true;
+
+    // the refused change is undone, the encode goes on with the previous configuration
+    bool sessionOk = true;
+    if (!request->ok)
+    {
+        *pConfig = previous;
+        sessionOk = session->backend->sendConfig(session, pConfig, configMask);
+    }
+
+    InterlockedExchange(&ctrl->pending, 0);
+    LeaveCriticalSection(&ctrl->lock);
+    SetEvent(ctrl->applied);
+
+    if (!sessionOk)
+        fprintf(stderr, "OVEncodeSendConfig returned error\n");
+    return sessionOk;
+}
+
+
+// Serves the clients of the control pipe, one at a time
+DWORD WINAPI controlThread(LPVOID param)
+{
+    Control *ctrl = (Control*)param;
+    char line[1024], error[255];
+
+    while (!ctrl->stop)
+    {
+        HANDLE pipe = CreateNamedPipe(ctrl->pipeName, PIPE_ACCESS_DUPLEX,
+                                      PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT,
+                                      1, 4096, 4096, 0, NULL);
+        if (pipe == INVALID_HANDLE_VALUE)
+        {
+            fprintf(stderr, "CreateNamedPipe failed, error %lu\n", GetLastError());
+            break;
+        }
+
+        bool connected = ConnectNamedPipe(pipe, NULL) || GetLastError() == ERROR_PIPE_CONNECTED;
+        while (connected && !ctrl->stop && pipeReadLine(pipe, line, sizeof(line)))
+        {
+            ControlRequest request;
+            if (!controlParse(line, &request, error))
+            {
+                pipeWriteLine(pipe, "ERROR %s", error);
+                continue;
+            }
+
+            EnterCriticalSection(&ctrl->lock);
+            ctrl->request = request;
+            ResetEvent(ctrl->applied);
+            InterlockedExchange(&ctrl->pending, 1);
+            LeaveCriticalSection(&ctrl->lock);
+
+            bool applied = WaitForSingleObject(ctrl->applied, CONTROL_TIMEOUT_MS) == WAIT_OBJECT_0;
+
+            EnterCriticalSection(&ctrl->lock);
+            // the encode is paused or over, the request is withdrawn
+            if (!applied && ctrl->pending)
+                InterlockedExchange(&ctrl->pending, 0);
+            else
+                applied = true;
+            request = ctrl->request;
+            LeaveCriticalSection(&ctrl->lock);
+
+            if (!applied)
+                pipeWriteLine(pipe, "ERROR not applied, no frame encoded for %u ms", CONTROL_TIMEOUT_MS);
+            else if (!request.ok)
+                pipeWriteLine(pipe, "ERROR the encoder refused it at frame %u", request.frame);
+            else
+            {
+                fprintf(stderr, "\nControl: %s at frame %u\n", line, request.frame);
+                pipeWriteLine(pipe, "OK %u", request.frame);
+            }
+        }
+
+        FlushFileBuffers(pipe);
+        DisconnectNamedPipe(pipe);
+        CloseHandle(pipe);
+    }
+    return 0;
+}
+
+
+// Opens the control pipe \\.\pipe\name
+bool controlStart(Control *ctrl, char *name)
+{
+    memset(ctrl, 0, sizeof(Control));
+    snprintf(ctrl->pipeName, MAX_PATH, "%s%s", CONTROL_PIPE_PREFIX, name);
+    InitializeCriticalSection(&ctrl->lock);
+    ctrl->applied = CreateEvent(NULL, TRUE, FALSE, NULL);
+    ctrl->thread = CreateThread(NULL, 0, controlThread, ctrl, 0, NULL);
+    fprintf(stderr, "Control     %s\n", ctrl->pipeName);
+    return ctrl->thread != NULL;
+}
+
+
+void controlStop(Control *ctrl)
+{
+    if (ctrl->thread == NULL)
+        return;
+
+    // wakes up the thread waiting for a connection, a connected client is cut
+    InterlockedExchange(&ctrl->stop, 1);
+    HANDLE wake = CreateFile(ctrl->pipeName, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+    if (wake != INVALID_HANDLE_VALUE)
+        CloseHandle(wake);
+    if (WaitForSingleObject(ctrl->thread, 1000) != WAIT_OBJECT_0)
+        TerminateThread(ctrl->thread, 0);
+    CloseHandle(ctrl->thread);
+    CloseHandle(ctrl->applied);
+    DeleteCriticalSection(&ctrl->lock);
+    ctrl->thread = NULL;
+}
+
+
+/*******************************************************************************
+ *  @fn     controlSend
+ *  @brief  Sends a request to the control pipe of a running encode & shows
+ *          the frame at which it was applied
+ *  @param[in] name    : Pipe name given to -control
+ *  @param[in] command : Request, keyword value ... [idr]
+ *  @return bool : true if it was applied; otherwise false.
+ ******************************************************************************/
+bool controlSend(char *name, char *command)
+{
+    char pipeName[MAX_PATH];
+    snprintf(pipeName, MAX_PATH, "%s%s", CONTROL_PIPE_PREFIX, name);
+
+    HANDLE pipe = INVALID_HANDLE_VALUE;
+    for (int retry = 0; retry < 10 && pipe == INVALID_HANDLE_VALUE; retry++)
+    {
+        pipe = CreateFile(pipeName, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+        if (pipe == INVALID_HANDLE_VALUE)
+            WaitNamedPipe(pipeName, 1000);
+    }
+    if (pipe == INVALID_HANDLE_VALUE)
+    {
+        fprintf(stderr, "No encode is listening on %s\n", pipeName);
+        return false;
+    }
+
+    char line[1024];
+    bool status = pipeWriteLine(pipe, "%s", command) && pipeReadLine(pipe, line, sizeof(line));
+    if (status)
+    {
+        unsigned int frame;
+        status = sscanf(line, "OK %u", &frame) == 1;
+        if (status)
+            fprintf(stderr, "Applied at frame %u\n", frame);
+        else
+            fprintf(stderr, "%s\n", line);
+    }
+    CloseHandle(pipe);
+    return status;
+}
+
+#endif
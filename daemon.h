@@ -0,0 +1,551 @@
+/*******************************************************************************
+* This file is part of AvsVCEh264.
+* Contains the encode daemon: a long-lived process that keeps the device
+* contexts, the Avisynth environment & a pool of sessions warm, and encodes
+* the jobs sent to it over a named pipe.
+*
+* Protocol, one text line per message:
+*  client -> daemon : ENCODE "input.avs" "output.264" "config.ini" | SHUTDOWN
+*  daemon -> client : FRAMES total, PROGRESS frames (every 250 ms),
+*                     then DONE frames seconds | ERROR message
+*
+* Copyright (C) 2013 David Gonzlez Garca <davidgg666@gmail.com>
+*******************************************************************************/
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include <stdarg.h>
+
+#define DAEMON_PIPE         "\\\\.\\pipe\\AvsVCEh264"
+#define DAEMON_POOL_SIZE    32      // sessions kept, busy or idle
+#define DAEMON_PROGRESS_MS  250
+#define DAEMON_MAX_LINE     (3 * MAX_PATH + 64)     // ENCODE & three quoted paths
+
+enum PoolState
+{
+    POOL_FREE,
+    POOL_IDLE,
+    POOL_BUSY
+};
+
+// A session of the pool, reused by the jobs with the same size & configuration
+typedef struct PoolSession
+{
+    int             state;
+    EncoderSession  session;
+    OvConfigCtrl    config;
+    EncoderDevice   *device;
+    DWORD           lastUsed;
+} PoolSession;
+
+typedef struct Daemon
+{
+    const EncoderBackend    *backend;
+    EncoderDevice           *devices;
+    unsigned int            numDevices;
+    AVS_ScriptEnvironment   *env;       // shared by the jobs, used under avsLock
+    PoolSession             pool[DAEMON_POOL_SIZE];
+    CRITICAL_SECTION        poolLock;
+    volatile LONG           clients;
+    volatile LONG           stop;
+    HANDLE                  stopEvent;  // set with stop, ends the wait for a connection
+} Daemon;
+
+typedef struct DaemonClient
+{
+    Daemon          *daemon;
+    HANDLE          pipe;
+} DaemonClient;
+
+
+// Reads or writes on a pipe, opened for overlapped I/O or not, until it is done
+static bool pipeTransfer(HANDLE pipe, HANDLE event, void *data, DWORD size, bool write)
+{
+    OVERLAPPED overlapped;
+    memset(&overlapped, 0, sizeof(OVERLAPPED));
+    overlapped.hEvent = event;
+    DWORD done = 0;
+    BOOL ok = write ? WriteFile(pipe, data, size, &done, &overlapped) :
+                      ReadFile(pipe, data, size, &done, &overlapped);
+    if (!ok && GetLastError() == ERROR_IO_PENDING)
+        ok = GetOverlappedResult(pipe, &overlapped, &done, TRUE);
+    return ok && done == size;
+}
+
+
+// Writes a formatted line to a pipe, a line too long is not written
+bool pipeWriteLine(HANDLE pipe, const char *format, ...)
+{
+    char line[DAEMON_MAX_LINE];
+    va_list args;
+    va_start(args, format);
+    int size = vsnprintf(line, sizeof(line) - 1, format, args);
+    va_end(args);
+    if (size < 0 || size > (int)sizeof(line) - 2)
+    {
+        fprintf(stderr, "Pipe line too long, not sent\n");
+        return false;
+    }
+    line[size++] = '\n';
+
+    HANDLE event = CreateEvent(NULL, TRUE, FALSE, NULL);
+    bool ok = pipeTransfer(pipe, event, line, size, true);
+    CloseHandle(event);
+    return ok;
+}
+
+
+// Reads a line from a pipe, without the end of line
+bool pipeReadLine(HANDLE pipe, char *line, unsigned int size)
+{
+    HANDLE event = CreateEvent(NULL, TRUE, FALSE, NULL);
+    unsigned int n = 0;
+    char c;
+    while (pipeTransfer(pipe, event, &c, 1, false))
+    {
+        if (c == '\n')
+        {
+            line[n] = 0;
+            CloseHandle(event);
+            return true;
+        }
+        if (c != '\r' && n < size - 1)
+            line[n++] = c;
+    }
+    CloseHandle(event);
+    return false;
+}
+
+
+// Gives a session back to the pool, a session that failed is destroyed
+void poolRelease(Daemon *daemon, PoolSession *entry, bool ok)
+{
+    if (!ok)
+        daemon->backend->releaseSession(&entry->session);
+
+    EnterCriticalSection(&daemon->poolLock);
+    entry->lastUsed = GetTickCount();
+    entry->state = ok ? POOL_IDLE : POOL_FREE;
+    LeaveCriticalSection(&daemon->poolLock);
+}
+
+
+/*******************************************************************************
+ *  @fn     poolAcquire
+ *  @brief  Takes an idle session of the pool with the same size & configuration,
+ *          or creates one on the least busy device, replacing the session idle
+ *          for the longest time if the pool is full
+ *  @param[in] daemon  : Daemon
+ *  @param[in] format  : Frame format
+ *  @param[in] pConfig : OvConfigCtrl
+ *  @return PoolSession* : the session or NULL if failed.
+ ******************************************************************************/
+PoolSession *poolAcquire(Daemon *daemon, EncoderSession *format, OvConfigCtrl *pConfig)
+{
+    EnterCriticalSection(&daemon->poolLock);
+
+    PoolSession *entry = NULL, *oldest = NULL, *unused = NULL;
+    unsigned int busy[CHUNK_MAX_SESSIONS] = {0};
+    for (int i = 0; i < DAEMON_POOL_SIZE; i++)
+    {
+        PoolSession *p = &daemon->pool[i];
+        if (p->state == POOL_FREE)
+        {
+            if (unused == NULL)
+                unused = p;
+            continue;
+        }
+        busy[p->device - daemon->devices] += p->state == POOL_BUSY;
+
+        if (p->state != POOL_IDLE)
+            continue;
+        if (entry == NULL && p->session.width == format->width && p->session.height == format->height &&
+                memcmp(&p->config, pConfig, sizeof(OvConfigCtrl)) == 0)
+            entry = p;
+        if (oldest == NULL || p->lastUsed < oldest->lastUsed)
+            oldest = p;
+    }
+
+    bool create = false;
+    if (entry == NULL)
+    {
+        entry = unused ? unused : oldest;
+        create = entry != NULL;
+    }
+    if (entry)
+    {
+        if (create && entry == oldest)
+            daemon->backend->releaseSession(&entry->session);
+
+        unsigned int d = 0;
+        for (unsigned int i = 1; i < daemon->numDevices; i++)
+        {
+            if (busy[i] < busy[d])
+                d = i;
+        }
+        entry->state = POOL_BUSY;
+        if (create)
+            entry->device = &daemon->devices[d];
+    }
+
+    LeaveCriticalSection(&daemon->poolLock);
+
+    if (entry == NULL)
+    {
+        fprintf(stderr, "Session pool full\n");
+        return NULL;
+    }
+
+    if (create)
+    {
+        entry->session = *format;
+        entry->config = *pConfig;
+        bool ok = daemon->backend->createSession(&entry->session, entry->device, pConfig);
+        if (ok && !daemon->backend->sendConfig(&entry->session, pConfig, ENC_CONFIG_ALL))
+        {
+            fprintf(stderr, "OVEncodeSendConfig returned error\n");
+            ok = false;
+        }
+        if (!ok)
+        {
+            daemon->backend->releaseSession(&entry->session);
+            EnterCriticalSection(&daemon->poolLock);
+            entry->state = POOL_FREE;
+            LeaveCriticalSection(&daemon->poolLock);
+            return NULL;
+        }
+    }
+    // a reused session starts its rate control again, not from the previous job
+    else if (!daemon->backend->sendConfig(&entry->session, pConfig, ENC_CONFIG_RATE))
+    {
+        fprintf(stderr, "OVEncodeSendConfig returned error\n");
+        poolRelease(daemon, entry, false);
+        return NULL;
+    }
+    return entry;
+}
+
+
+/*******************************************************************************
+ *  @fn     daemonEncode
+ *  @brief  Encodes a job on a session of the pool, streaming the progress
+ *  @param[in] daemon     : Daemon
+ *  @param[in] pipe       : Client connection
+ *  @param[in] input      : Avisynth script
+ *  @param[in] output     : Output file
+ *  @param[in] configFile : User configuration file name
+ *  @return bool : true if successful; otherwise false.
+ ******************************************************************************/
+bool daemonEncode(Daemon *daemon, HANDLE pipe, char *input, char *output, char *configFile)
+{
+    AvsSource source;
+    memset(&source, 0, sizeof(AvsSource));
+    source.env = daemon->env;
+
+    EnterCriticalSection(&avsLock);
+    bool ok = avsImport(&source, input);
+    LeaveCriticalSection(&avsLock);
+    if (!ok)
+    {
+        if (source.clip)
+            avs_release_clip(source.clip);
+        pipeWriteLine(pipe, "ERROR cannot open %s", input);
+        return false;
+    }
+
+    OvConfigCtrl config;
+    memset(&config, 0, sizeof(OvConfigCtrl));
+    ok = loadConfig(&config, configFile);
+    avsSetConfig(&config, source.info);
+
+    EncoderSession format;
+    setSessionFormat(&format, source.info->width, source.info->height);
+    format.backend = daemon->backend;
+
+    FILE *fw = ok ? fopen(output, "wb") : NULL;
+    PoolSession *entry = fw ? poolAcquire(daemon, &format, &config) : NULL;
+    if (entry == NULL)
+    {
+        pipeWriteLine(pipe, "ERROR %s", !ok ? "invalid configuration" : fw ? "no encoder session" : "cannot open the output");
+        if (fw)
+            fclose(fw);
+        EnterCriticalSection(&avsLock);
+        avs_release_clip(source.clip);
+        LeaveCriticalSection(&avsLock);
+        return false;
+    }
+
+    EncoderSession *session = &entry->session;
+    const EncoderBackend *encoder = daemon->backend;
+	OVE_OUTPUT_DESCRIPTION taskDescriptionList = {sizeof(OVE_OUTPUT_DESCRIPTION), 0, OVE_TASK_STATUS_NONE, 0, 0};
+
+    // A session of the pool continues a previous stream: the job starts on an IDR
+    OVE_ENCODE_PARAMETERS_H264 pictureParameter;
+	memset(&pictureParameter, 0, sizeof(OVE_ENCODE_PARAMETERS_H264));
+	pictureParameter.size = sizeof(OVE_ENCODE_PARAMETERS_H264);
+	pictureParameter.pictureStructure = OVE_PICTURE_STRUCTURE_H264_FRAME;
+	pictureParameter.forceRefreshMap = (OVE_BOOL)true;
+
+    Timer jobTimer;
+    jobTimer.start();
+    DWORD lastProgress = GetTickCount();
+    ok = pipeWriteLine(pipe, "FRAMES %d", source.info->num_frames);
+
+    BYTE *frameData = (BYTE*) malloc(session->frameSize);
+    bool written = true;
+    int f;
+    for (f = 0; ok && written && f < source.info->num_frames; f++)
+    {
+        avsSourceFrameNV12(&source, f, frameData, session->pitch);
+
+        pictureParameter.insertSPS = (OVE_BOOL)(f == 0);
+        pictureParameter.forcePicType = f == 0 ? OVE_PICTURE_TYPE_H264_IDR : OVE_PICTURE_TYPE_H264_NONE;
+
+        unsigned int iTaskID;
+        ok = encoder->submit(session, frameData, &pictureParameter, &iTaskID) &&
+             encoder->query(session, &taskDescriptionList);
+
+        if (ok && taskDescriptionList.status == OVE_TASK_STATUS_COMPLETE &&
+                taskDescriptionList.size_of_bitstream_data > 0)
+        {
+            written = fwrite(taskDescriptionList.bitstream_data, 1, taskDescriptionList.size_of_bitstream_data, fw) ==
+                      taskDescriptionList.size_of_bitstream_data;
+        }
+        if (ok)
+            releaseQueried(session, &taskDescriptionList);
+
+        // the client has gone when the progress can not be written
+        if (ok && written && GetTickCount() - lastProgress >= DAEMON_PROGRESS_MS)
+        {
+            lastProgress = GetTickCount();
+            if (!pipeWriteLine(pipe, "PROGRESS %d", f + 1))
+                break;
+        }
+    }
+    free(frameData);
+    if (fclose(fw) != 0)
+        written = false;
+    jobTimer.stop();
+
+    // an interrupted stream would leave frames in the session
+    bool complete = ok && f == source.info->num_frames;
+    poolRelease(daemon, entry, complete);
+
+    EnterCriticalSection(&avsLock);
+    avs_release_clip(source.clip);
+    LeaveCriticalSection(&avsLock);
+
+    if (complete && written)
+        return pipeWriteLine(pipe, "DONE %d %f", f, jobTimer.getElapsedTime());
+    if (!written)
+        pipeWriteLine(pipe, "ERROR cannot write the output at frame %d", f);
+    else
+        pipeWriteLine(pipe, "ERROR encoding stopped at frame %d", f);
+    return false;
+}
+
+
+// Serves the requests of one client
+DWORD WINAPI daemonClientThread(LPVOID param)
+{
+    DaemonClient *client = (DaemonClient*)param;
+    Daemon *daemon = client->daemon;
+    char line[DAEMON_MAX_LINE], command[255], input[MAX_PATH], output[MAX_PATH], configFile[MAX_PATH];
+
+    while (pipeReadLine(client->pipe, line, sizeof(line)))
+    {
+        char *p = line;
+        if (!schedNextToken(&p, command))
+            continue;
+
+        if (strcmp(command, "ENCODE") == 0)
+        {
+            if (schedNextToken(&p, input, MAX_PATH) && schedNextToken(&p, output, MAX_PATH) &&
+                    schedNextToken(&p, configFile, MAX_PATH))
+            {
+                fprintf(stderr, "Encoding %s\n", input);
+                daemonEncode(daemon, client->pipe, input, output, configFile);
+            }
+            else
+            {
+                pipeWriteLine(client->pipe, "ERROR expected ENCODE input output config");
+            }
+        }
+        else if (strcmp(command, "SHUTDOWN") == 0)
+        {
+            InterlockedExchange(&daemon->stop, 1);
+            SetEvent(daemon->stopEvent);
+            pipeWriteLine(client->pipe, "DONE 0 0");
+            break;
+        }
+        else
+        {
+            pipeWriteLine(client->pipe, "ERROR unknown command %s", command);
+        }
+    }
+
+    FlushFileBuffers(client->pipe);
+    DisconnectNamedPipe(client->pipe);
+    CloseHandle(client->pipe);
+    InterlockedDecrement(&daemon->clients);
+    delete client;
+    return 0;
+}
+
+
+/*******************************************************************************
+ *  @fn     daemonServe
+ *  @brief  Serves the clients of the named pipe until one sends SHUTDOWN, the
+ *          jobs running then are finished
+ *  @param[in] backend    : Encoder backend
+ *  @param[in] devices    : Devices, with their contexts created
+ *  @param[in] numDevices : Number of devices
+ *  @return bool : true if successful; otherwise false.
+ ******************************************************************************/
+bool daemonServe(const EncoderBackend *backend, EncoderDevice *devices, unsigned int numDevices)
+{
+    Daemon *daemon = new Daemon;
+    memset(daemon, 0, sizeof(Daemon));
+    daemon->backend = backend;
+    daemon->devices = devices;
+    daemon->numDevices = numDevices < CHUNK_MAX_SESSIONS ? numDevices : CHUNK_MAX_SESSIONS;
+    daemon->env = avs_create_script_environment(AVISYNTH_INTERFACE_VERSION);
+    daemon->stopEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    InitializeCriticalSection(&daemon->poolLock);
+    InitializeCriticalSection(&avsLock);
+
+    // The connection is waited for with the stop event, SHUTDOWN ends it at any time
+    HANDLE connectEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    fprintf(stderr, "Listening on %s\n", DAEMON_PIPE);
+    bool status = true;
+    while (!daemon->stop)
+    {
+        HANDLE pipe = CreateNamedPipe(DAEMON_PIPE, PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED,
+                                      PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT,
+                                      PIPE_UNLIMITED_INSTANCES, 4096, 4096, 0, NULL);
+        if (pipe == INVALID_HANDLE_VALUE)
+        {
+            fprintf(stderr, "CreateNamedPipe failed, error %lu\n", GetLastError());
+            status = false;
+            break;
+        }
+
+        OVERLAPPED overlapped;
+        memset(&overlapped, 0, sizeof(OVERLAPPED));
+        overlapped.hEvent = connectEvent;
+        ResetEvent(connectEvent);
+        bool connected = ConnectNamedPipe(pipe, &overlapped) != 0;
+        if (!connected && GetLastError() == ERROR_PIPE_CONNECTED)
+            connected = true;
+        else if (!connected && GetLastError() == ERROR_IO_PENDING)
+        {
+            HANDLE events[2] = {connectEvent, daemon->stopEvent};
+            DWORD unused;
+            if (WaitForMultipleObjects(2, events, FALSE, INFINITE) == WAIT_OBJECT_0)
+            {
+                connected = GetOverlappedResult(pipe, &overlapped, &unused, FALSE) != 0;
+            }
+            else
+            {
+                CancelIo(pipe);
+                GetOverlappedResult(pipe, &overlapped, &unused, TRUE);
+            }
+        }
+        if (!connected || daemon->stop)
+        {
+            CloseHandle(pipe);
+            continue;
+        }
+
+        DaemonClient *client = new DaemonClient;
+        client->daemon = daemon;
+        client->pipe = pipe;
+        InterlockedIncrement(&daemon->clients);
+        CloseHandle(CreateThread(NULL, 0, daemonClientThread, client, 0, NULL));
+    }
+
+    CloseHandle(connectEvent);
+
+    // Wait for the jobs that were running
+    while (daemon->clients > 0)
+        Sleep(50);
+
+    for (int i = 0; i < DAEMON_POOL_SIZE; i++)
+    {
+        if (daemon->pool[i].state != POOL_FREE)
+            backend->releaseSession(&daemon->pool[i].session);
+    }
+    avs_delete_script_environment(daemon->env);
+    DeleteCriticalSection(&daemon->poolLock);
+    DeleteCriticalSection(&avsLock);
+    CloseHandle(daemon->stopEvent);
+    delete daemon;
+    return status;
+}
+
+
+/*******************************************************************************
+ *  @fn     daemonSubmit
+ *  @brief  Sends a job to the daemon & shows its progress
+ *  @param[in] input      : Avisynth script
+ *  @param[in] output     : Output file
+ *  @param[in] configFile : User configuration file name
+ *  @param[in] shutdown   : Sends SHUTDOWN instead of a job
+ *  @return bool : true if successful; otherwise false.
+ ******************************************************************************/
+bool daemonSubmit(char *input, char *output, char *configFile, bool shutdown)
+{
+    HANDLE pipe = INVALID_HANDLE_VALUE;
+    for (int retry = 0; retry < 10 && pipe == INVALID_HANDLE_VALUE; retry++)
+    {
+        pipe = CreateFile(DAEMON_PIPE, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+        if (pipe == INVALID_HANDLE_VALUE)
+            WaitNamedPipe(DAEMON_PIPE, 1000);
+    }
+    if (pipe == INVALID_HANDLE_VALUE)
+    {
+        fprintf(stderr, "The daemon is not running\n");
+        return false;
+    }
+
+    // The daemon has its own working directory
+    char paths[3][MAX_PATH];
+    GetFullPathName(input, MAX_PATH, paths[0], NULL);
+    GetFullPathName(output, MAX_PATH, paths[1], NULL);
+    GetFullPathName(configFile, MAX_PATH, paths[2], NULL);
+
+    bool status = shutdown ? pipeWriteLine(pipe, "SHUTDOWN") :
+                  pipeWriteLine(pipe, "ENCODE \"%s\" \"%s\" \"%s\"", paths[0], paths[1], paths[2]);
+
+    char line[1024];
+    unsigned int frames = 0, total = 0;
+    bool done = false;
+    while (status && !done && pipeReadLine(pipe, line, sizeof(line)))
+    {
+        if (sscanf(line, "FRAMES %u", &total) == 1)
+            continue;
+        if (sscanf(line, "PROGRESS %u", &frames) == 1 && total > 0)
+        {
+            fprintf(stderr, "\r%u%%\t%u/%u", frames * 100 / total, frames, total);
+            continue;
+        }
+
+        double seconds;
+        done = true;
+        if (sscanf(line, "DONE %u %lf", &frames, &seconds) == 2)
+        {
+            if (!shutdown)
+                fprintf(stderr, "\r100%%\t%u/%u  Fps: %3.3f\n", frames, total, seconds > 0 ? frames / seconds : 0.0);
+        }
+        else
+        {
+            fprintf(stderr, "\n%s\n", line);
+            status = false;
+        }
+    }
+
+    CloseHandle(pipe);
+    return status && done;
+}
+
+#endif
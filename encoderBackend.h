@@ -0,0 +1,123 @@
+/*******************************************************************************
+* This file is part of AvsVCEh264.
+* Contains the encoder backend interface used by the encoding pipeline
+*
+* Copyright (C) 2013 David Gonzlez Garca <davidgg666@gmail.com>
+*******************************************************************************/
+#ifndef ENCODERBACKEND_H
+#define ENCODERBACKEND_H
+
+#include <stdio.h>
+#include <string.h>
+
+// Configuration blocks that can be (re)sent to a session
+#define ENC_CONFIG_PICTURE	0x1
+#define ENC_CONFIG_RATE		0x2
+#define ENC_CONFIG_ME		0x4
+#define ENC_CONFIG_RDO		0x8
+#define ENC_CONFIG_ALL		(ENC_CONFIG_PICTURE | ENC_CONFIG_RATE | ENC_CONFIG_ME | ENC_CONFIG_RDO)
+
+// Device on which a session is created. Backends without hardware ignore it.
+typedef struct EncoderDevice
+{
+    OPContextHandle context;    // encoder context (cl_context)
+    unsigned int    deviceId;   // OpenVideo device id
+} EncoderDevice;
+
+struct EncoderBackend;
+
+// One encoding session. The caller fills the frame format, the backend the rest.
+typedef struct EncoderSession
+{
+    const struct EncoderBackend *backend;
+    void         *priv;          // backend private data
+    unsigned int width;          // picture size
+    unsigned int height;
+    unsigned int pitch;          // NV12 input layout: bytes per row
+    unsigned int alignedHeight;  // rows of the luma plane
+    unsigned int frameSize;      // bytes of one NV12 input frame
+    unsigned int maxInFlight;    // tasks that may be submitted before a query
+} EncoderSession;
+
+/*******************************************************************************
+ * Encoder backend: the operations encodeProcess needs from an encoder.
+ *  createSession : creates the session for session->width x session->height
+ *  sendConfig    : sends the configuration blocks selected by configMask
+ *  submit        : submits one NV12 frame, returns the task id
+ *  query         : waits for the oldest submitted task and describes its output
+ *  releaseTask   : gives back the output of a queried task
+ *  releaseSession: destroys the session and its resources
+ * All of them return true if successful; otherwise false.
+ ******************************************************************************/
+typedef struct EncoderBackend
+{
+    const char *name;
+    bool (*createSession)(EncoderSession *session, EncoderDevice *device, OvConfigCtrl *pConfig);
+    bool (*sendConfig)(EncoderSession *session, OvConfigCtrl *pConfig, unsigned int configMask);
+    bool (*submit)(EncoderSession *session, const BYTE *frame,
+                   OVE_ENCODE_PARAMETERS_H264 *pictureParameter, unsigned int *taskId);
+    bool (*query)(EncoderSession *session, OVE_OUTPUT_DESCRIPTION *taskDescription);
+    bool (*releaseTask)(EncoderSession *session, unsigned int taskId);
+    bool (*releaseSession)(EncoderSession *session);
+} EncoderBackend;
+
+
+/*******************************************************************************
+ *  @fn     setSessionFormat
+ *  @brief  Fills the NV12 input layout of a session for the given picture size
+ *  @param[out] session : Session to fill
+ *  @param[in] width    : Picture width
+ *  @param[in] height   : Picture height
+ ******************************************************************************/
+void setSessionFormat(EncoderSession *session, unsigned int width, unsigned int height)
+{
+    memset(session, 0, sizeof(EncoderSession));
+    session->width = width;
+    session->height = height;
+
+    // Make sure the surface is byte aligned
+    session->pitch = ((width + (256 - 1)) & ~(256 - 1));
+    session->alignedHeight = (height + 31) & ~31;
+
+    // frame size in memory: NV12 is 3/2
+    session->frameSize = session->alignedHeight * session->pitch * 3 / 2;
+    session->maxInFlight = 1;
+}
+
+
+/*******************************************************************************
+ *  @fn     releaseQueried
+ *  @brief  Gives back a queried task whatever its status, a failed one holds
+ *          an output slot too, and marks the description as released
+ *  @param[in] session             : Session of the task
+ *  @param[in/out] taskDescription : Description returned by query
+ *  @return bool : true if successful; otherwise false.
+ ******************************************************************************/
+bool releaseQueried(EncoderSession *session, OVE_OUTPUT_DESCRIPTION *taskDescription)
+{
+    if (taskDescription->status == OVE_TASK_STATUS_NONE)
+        return true;
+
+    taskDescription->status = OVE_TASK_STATUS_NONE;
+    return session->backend->releaseTask(session, taskDescription->taskID);
+}
+
+
+/*******************************************************************************
+ *  @fn     findBackend
+ *  @brief  Looks up a backend by name in a NULL terminated list
+ *  @param[in] backends : List of available backends
+ *  @param[in] name     : Backend name
+ *  @return const EncoderBackend* : the backend or NULL if not found.
+ ******************************************************************************/
+const EncoderBackend *findBackend(const EncoderBackend **backends, const char *name)
+{
+    for (int i = 0; backends[i]; i++)
+    {
+        if (strcmp(backends[i]->name, name) == 0)
+            return backends[i];
+    }
+    return NULL;
+}
+
+#endif
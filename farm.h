@@ -0,0 +1,759 @@
+/*******************************************************************************
+* This file is part of AvsVCEh264.
+* Contains the encode farm: a coordinator splits the clip in frame ranges that
+* worker processes, local or on other machines, encode with Trim of the same
+* script. Workers connect to the coordinator over TCP.
+*
+* Protocol: every message is a FarmMsg header followed by size bytes of payload.
+*  worker -> coordinator : FARM_HELLO, FARM_PROGRESS (first = frames encoded),
+*                          FARM_RESULT (Annex-B stream), FARM_FAILED
+*  coordinator -> worker : FARM_JOB (OvConfigCtrl & script path), FARM_CANCEL,
+*                          FARM_DONE
+* Both sides are x86, the header is sent as is.
+*
+* Copyright (C) 2013 David Gonzlez Garca <davidgg666@gmail.com>
+*******************************************************************************/
+#ifndef FARM_H
+#define FARM_H
+
+#define FARM_MAGIC          0x4D524146  // "FARM"
+#define FARM_VERSION        1
+#define FARM_MAX_WORKERS    64
+#define FARM_PLAN_SESSIONS  8           // chunks are planned for at least 8 workers
+#define FARM_MAX_ATTEMPTS   4           // dispatches of a chunk before giving up
+#define FARM_SLOW_FACTOR    3           // slow chunk: this many times the average time
+#define FARM_TIMEOUT_MS     30000       // a worker silent for this long is gone
+#define FARM_IDLE_MS        120000      // the farm fails after this long without any worker
+#define FARM_PROGRESS_MS    1000
+#define FARM_MAX_PAYLOAD    0x40000000
+
+enum FarmMsgType
+{
+    FARM_HELLO = 1,
+    FARM_JOB,
+    FARM_PROGRESS,
+    FARM_RESULT,
+    FARM_FAILED,
+    FARM_CANCEL,
+    FARM_DONE
+};
+
+typedef struct FarmMsg
+{
+    unsigned int magic;
+    unsigned int type;
+    unsigned int chunk;         // chunk number, protocol version for FARM_HELLO
+    unsigned int first;         // first frame, frames encoded for FARM_PROGRESS
+    unsigned int end;           // one past the last frame
+    unsigned int size;          // payload bytes
+    unsigned int checksum;      // CRC-32 of the payload
+} FarmMsg;
+
+enum FarmChunkState
+{
+    FARM_CHUNK_PENDING,
+    FARM_CHUNK_RUNNING,
+    FARM_CHUNK_DONE
+};
+
+typedef struct FarmChunk
+{
+    ChunkSegment    segment;    // frame range & output
+    int             state;
+    int             running;    // workers encoding it
+    int             attempts;
+    DWORD           started;    // GetTickCount of the last dispatch
+    unsigned int    progress;   // frames encoded by the most advanced worker
+    unsigned int    checksum;
+} FarmChunk;
+
+typedef struct FarmJob
+{
+    OvConfigCtrl     *pConfig;
+    char             *script;
+    FarmChunk        *chunks;
+    int              numChunks;
+    int              chunksDone;
+    DWORD            doneMs;    // time spent on the chunks done
+    unsigned int     doneFrames;
+    CRITICAL_SECTION lock;
+    volatile LONG    stop;
+    volatile LONG    failed;
+    SOCKET           listener;
+    HANDLE           connections[FARM_MAX_WORKERS];
+    volatile LONG    numConnections;
+    volatile LONG    activeConnections;     // workers connected now
+} FarmJob;
+
+typedef struct FarmConnection
+{
+    FarmJob         *job;
+    SOCKET          sock;
+} FarmConnection;
+
+// Chunk being encoded by a worker
+typedef struct FarmTask
+{
+    EncoderSession  format;
+    EncoderDevice   *device;
+    OvConfigCtrl    config;
+    ChunkSegment    segment;
+    volatile LONG   stop;
+    volatile LONG   framesDone;
+    bool            ok;
+} FarmTask;
+
+unsigned int farmCrcTable[256];
+
+
+/*******************************************************************************
+ *  @fn     farmStartup
+ *  @brief  Initializes winsock & the checksum table
+ *  @return bool : true if successful; otherwise false.
+ ******************************************************************************/
+bool farmStartup()
+{
+    for (unsigned int i = 0; i < 256; i++)
+    {
+        unsigned int c = i;
+        for (int k = 0; k < 8; k++)
+            c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+        farmCrcTable[i] = c;
+    }
+
+    WSADATA wsaData;
+    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0)
+    {
+        fprintf(stderr, "WSAStartup failed\n");
+        return false;
+    }
+    return true;
+}
+
+
+// CRC-32 of a buffer
+unsigned int farmChecksum(const BYTE *data, unsigned int size)
+{
+    unsigned int c = 0xFFFFFFFF;
+    for (unsigned int i = 0; i < size; i++)
+        c = farmCrcTable[(c ^ data[i]) & 0xFF] ^ (c >> 8);
+    return c ^ 0xFFFFFFFF;
+}
+
+
+bool farmSendAll(SOCKET sock, const BYTE *data, unsigned int size)
+{
+    while (size > 0)
+    {
+        int sent = send(sock, (const char*)data, size, 0);
+        if (sent <= 0)
+            return false;
+        data += sent;
+        size -= sent;
+    }
+    return true;
+}
+
+
+bool farmRecvAll(SOCKET sock, BYTE *data, unsigned int size)
+{
+    while (size > 0)
+    {
+        int received = recv(sock, (char*)data, size, 0);
+        if (received <= 0)
+            return false;
+        data += received;
+        size -= received;
+    }
+    return true;
+}
+
+
+/*******************************************************************************
+ *  @fn     farmSend
+ *  @brief  Sends a message
+ *  @param[in] sock     : Connection
+ *  @param[in] type     : FarmMsgType
+ *  @param[in] chunk, first, end : FarmMsg fields
+ *  @param[in] payload  : Payload or NULL
+ *  @param[in] size     : Payload size
+ *  @return bool : true if successful; otherwise false.
+ ******************************************************************************/
+bool farmSend(SOCKET sock, unsigned int type, unsigned int chunk, unsigned int first,
+              unsigned int end, const BYTE *payload, unsigned int size)
+{
+    FarmMsg msg = {FARM_MAGIC, type, chunk, first, end, size, farmChecksum(payload, size)};
+    return farmSendAll(sock, (const BYTE*)&msg, sizeof(FarmMsg)) && farmSendAll(sock, payload, size);
+}
+
+
+/*******************************************************************************
+ *  @fn     farmRecv
+ *  @brief  Receives a message
+ *  @param[in] sock     : Connection
+ *  @param[out] msg     : Message header
+ *  @param[out] payload : Payload, to free by the caller, NULL if there is none
+ *  @return bool : true if successful; otherwise false.
+ ******************************************************************************/
+bool farmRecv(SOCKET sock, FarmMsg *msg, BYTE **payload)
+{
+    *payload = NULL;
+    if (!farmRecvAll(sock, (BYTE*)msg, sizeof(FarmMsg)) ||
+            msg->magic != FARM_MAGIC || msg->size > FARM_MAX_PAYLOAD)
+        return false;
+
+    if (msg->size == 0)
+        return true;
+
+    *payload = (BYTE*) malloc(msg->size);
+    if (*payload == NULL || !farmRecvAll(sock, *payload, msg->size))
+    {
+        free(*payload);
+        *payload = NULL;
+        return false;
+    }
+    return true;
+}
+
+
+// true if a message can be read without blocking
+bool farmReadable(SOCKET sock)
+{
+    fd_set readSet;
+    FD_ZERO(&readSet);
+    FD_SET(sock, &readSet);
+    struct timeval timeout = {0, 0};
+    return select(sock + 1, &readSet, NULL, NULL, &timeout) > 0;
+}
+
+
+/*******************************************************************************
+ * Coordinator
+ ******************************************************************************/
+
+/*******************************************************************************
+ *  @fn     farmNextChunk
+ *  @brief  Picks the chunk for an idle worker: a pending one, or else a slow
+ *          one that a second worker races
+ *  @param[in] job : Farm job
+ *  @return int : the chunk number or -1 if there is nothing to do.
+ ******************************************************************************/
+int farmNextChunk(FarmJob *job)
+{
+    EnterCriticalSection(&job->lock);
+
+    int next = -1;
+    DWORD now = GetTickCount();
+    for (int i = 0; i < job->numChunks && next < 0; i++)
+    {
+        if (job->chunks[i].state == FARM_CHUNK_PENDING)
+            next = i;
+    }
+    for (int i = 0; i < job->numChunks && next < 0 && job->doneFrames > 0; i++)
+    {
+        FarmChunk *chunk = &job->chunks[i];
+        double expected = job->doneMs / (double)job->doneFrames * (chunk->segment.end - chunk->segment.first);
+        if (chunk->state == FARM_CHUNK_RUNNING && chunk->running == 1 &&
+                now - chunk->started > FARM_SLOW_FACTOR * expected)
+            next = i;
+    }
+
+    if (next >= 0)
+    {
+        FarmChunk *chunk = &job->chunks[next];
+        if (chunk->running == 0)
+            chunk->started = now;
+        chunk->state = FARM_CHUNK_RUNNING;
+        chunk->running++;
+        chunk->attempts++;
+    }
+
+    LeaveCriticalSection(&job->lock);
+    return next;
+}
+
+
+/*******************************************************************************
+ *  @fn     farmChunkDone
+ *  @brief  Keeps the output of a chunk, unless another worker finished it first
+ *  @return bool : true if the chunk took the data; otherwise false.
+ ******************************************************************************/
+bool farmChunkDone(FarmJob *job, int c, BYTE *data, unsigned int size, unsigned int checksum)
+{
+    EnterCriticalSection(&job->lock);
+
+    FarmChunk *chunk = &job->chunks[c];
+    bool taken = chunk->state != FARM_CHUNK_DONE;
+    chunk->running--;
+    if (taken)
+    {
+        unsigned int frames = chunk->segment.end - chunk->segment.first;
+        chunk->state = FARM_CHUNK_DONE;
+        chunk->segment.data = data;
+        chunk->segment.size = size;
+        chunk->segment.encoded = frames;
+        chunk->progress = frames;
+        chunk->checksum = checksum;
+        job->chunksDone++;
+        job->doneMs += GetTickCount() - chunk->started;
+        job->doneFrames += frames;
+    }
+
+    LeaveCriticalSection(&job->lock);
+    return taken;
+}
+
+
+// A worker gave up a chunk: it goes back to the queue
+void farmChunkFailed(FarmJob *job, int c)
+{
+    EnterCriticalSection(&job->lock);
+
+    FarmChunk *chunk = &job->chunks[c];
+    chunk->running--;
+    if (chunk->state != FARM_CHUNK_DONE && chunk->running == 0)
+    {
+        if (chunk->attempts >= FARM_MAX_ATTEMPTS)
+        {
+            fprintf(stderr, "Frames %d-%d failed %d times\n", chunk->segment.first,
+                    chunk->segment.end - 1, chunk->attempts);
+            InterlockedExchange(&job->failed, 1);
+            InterlockedExchange(&job->stop, 1);
+        }
+        chunk->state = FARM_CHUNK_PENDING;
+        chunk->progress = 0;
+    }
+
+    LeaveCriticalSection(&job->lock);
+}
+
+
+// Serves one worker until there is nothing left to do
+DWORD WINAPI farmConnectionThread(LPVOID param)
+{
+    FarmConnection *conn = (FarmConnection*)param;
+    FarmJob *job = conn->job;
+    FarmMsg msg;
+    BYTE *payload;
+
+    // a worker reports progress every second, silence means it is gone
+    DWORD timeout = FARM_TIMEOUT_MS;
+    setsockopt(conn->sock, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
+
+    bool alive = farmRecv(conn->sock, &msg, &payload) && msg.type == FARM_HELLO && msg.chunk == FARM_VERSION;
+    free(payload);
+
+    // FARM_JOB payload: the configuration & the script path
+    unsigned int jobSize = sizeof(OvConfigCtrl) + strlen(job->script) + 1;
+    BYTE *jobData = (BYTE*) malloc(jobSize);
+    memcpy(jobData, job->pConfig, sizeof(OvConfigCtrl));
+    strcpy((char*)jobData + sizeof(OvConfigCtrl), job->script);
+
+    while (alive && !job->stop)
+    {
+        int c = farmNextChunk(job);
+        if (c < 0)
+        {
+            Sleep(250);
+            continue;
+        }
+
+        FarmChunk *chunk = &job->chunks[c];
+        alive = farmSend(conn->sock, FARM_JOB, c, chunk->segment.first, chunk->segment.end, jobData, jobSize);
+
+        bool ok = false, cancelled = false;
+        while (alive)
+        {
+            alive = farmRecv(conn->sock, &msg, &payload) && msg.chunk == (unsigned)c;
+            if (alive && msg.type == FARM_PROGRESS)
+            {
+                EnterCriticalSection(&job->lock);
+                if (msg.first > chunk->progress)
+                    chunk->progress = msg.first;
+                bool finished = chunk->state == FARM_CHUNK_DONE;
+                LeaveCriticalSection(&job->lock);
+
+                // finished by another worker or stopped
+                if (!cancelled && (finished || job->stop))
+                {
+                    alive = farmSend(conn->sock, FARM_CANCEL, c, 0, 0, NULL, 0);
+                    cancelled = true;
+                }
+                free(payload);
+                continue;
+            }
+
+            if (alive && msg.type == FARM_RESULT)
+            {
+                ok = farmChecksum(payload, msg.size) == msg.checksum;
+                if (!ok)
+                    fprintf(stderr, "Frames %d-%d: checksum mismatch\n", chunk->segment.first, chunk->segment.end - 1);
+                else if (farmChunkDone(job, c, payload, msg.size, msg.checksum))
+                    payload = NULL;
+            }
+            free(payload);
+            break;
+        }
+
+        if (!ok)
+            farmChunkFailed(job, c);
+    }
+
+    if (alive)
+        farmSend(conn->sock, FARM_DONE, 0, 0, 0, NULL, 0);
+    closesocket(conn->sock);
+    InterlockedDecrement(&job->activeConnections);
+    free(jobData);
+    delete conn;
+    return 0;
+}
+
+
+// Accepts workers until the listening socket is closed
+DWORD WINAPI farmAcceptThread(LPVOID param)
+{
+    FarmJob *job = (FarmJob*)param;
+
+    for (;;)
+    {
+        SOCKET sock = accept(job->listener, NULL, NULL);
+        if (sock == INVALID_SOCKET)
+            break;
+
+        if (job->numConnections == FARM_MAX_WORKERS)
+        {
+            closesocket(sock);
+            continue;
+        }
+
+        FarmConnection *conn = new FarmConnection;
+        conn->job = job;
+        conn->sock = sock;
+        InterlockedIncrement(&job->activeConnections);
+        job->connections[job->numConnections] = CreateThread(NULL, 0, farmConnectionThread, conn, 0, NULL);
+        InterlockedIncrement(&job->numConnections);
+    }
+    return 0;
+}
+
+
+// Starts a worker process on this machine, with the backend & the config file of the coordinator
+bool farmSpawnWorker(unsigned short port, const char *backendName, const char *configFile, PROCESS_INFORMATION *pi)
+{
+    char exe[MAX_PATH];
+    char cmd[2 * MAX_PATH + 64];
+    GetModuleFileName(NULL, exe, MAX_PATH);
+    int length = sprintf(cmd, "\"%s\" -worker 127.0.0.1:%u -b %s", exe, port, backendName);
+    if (configFile && configFile[0])
+        snprintf(cmd + length, sizeof(cmd) - length, " -c \"%s\"", configFile);
+
+    STARTUPINFO si;
+    memset(&si, 0, sizeof(STARTUPINFO));
+    si.cb = sizeof(STARTUPINFO);
+    return CreateProcess(NULL, cmd, NULL, NULL, FALSE, 0, NULL, NULL, &si, pi) != 0;
+}
+
+
+/*******************************************************************************
+ *  @fn     farmEncodeProcess
+ *  @brief  Coordinator: dispatches the chunks of the clip to the workers that
+ *          connect, then verifies and concatenates their output
+ *  @param[in] script       : Avisynth script, its path must be valid for the workers
+ *  @param[out] outFile     : output encoded H.264 video file
+ *  @param[in] pConfig      : OvConfigCtrl
+ *  @param[in] port         : TCP port the workers connect to
+ *  @param[in] localWorkers : Worker processes to start on this machine
+ *  @param[in] backendName  : Encoder backend of the local workers
+ *  @param[in] configFile   : Config file of the local workers, or NULL
+ *  @param[out] progress    : Frames encoded so far, updated while encoding
+ *  @return bool : true if successful; otherwise false.
+ ******************************************************************************/
+bool farmEncodeProcess(char *script, char *outFile, OvConfigCtrl *pConfig, unsigned short port,
+                       unsigned int localWorkers, const char *backendName, const char *configFile,
+                       unsigned int *progress)
+{
+    if (!farmStartup())
+        return false;
+
+    FarmJob job;
+    memset(&job, 0, sizeof(FarmJob));
+    job.pConfig = pConfig;
+    job.script = script;
+    InitializeCriticalSection(&job.lock);
+
+    // Same frame ranges as the chunked mode
+    ChunkJob plan;
+    memset(&plan, 0, sizeof(ChunkJob));
+    plan.pConfig = pConfig;
+    chunkPlan(&plan, localWorkers > FARM_PLAN_SESSIONS ? localWorkers : FARM_PLAN_SESSIONS);
+    job.numChunks = plan.numSegments;
+    job.chunks = new FarmChunk[job.numChunks];
+    memset(job.chunks, 0, sizeof(FarmChunk) * job.numChunks);
+    for (int i = 0; i < job.numChunks; i++)
+        job.chunks[i].segment = plan.segments[i];
+    delete [] plan.segments;
+
+    // Listen on every interface, remote workers connect with -worker host:port
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    job.listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (job.listener == INVALID_SOCKET ||
+            bind(job.listener, (struct sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR ||
+            listen(job.listener, SOMAXCONN) == SOCKET_ERROR)
+    {
+        fprintf(stderr, "Cannot listen on port %u\n", port);
+        delete [] job.chunks;
+        WSACleanup();
+        return false;
+    }
+    fprintf(stderr, "Farm        %d chunks, listening on port %u\n", job.numChunks, port);
+
+    HANDLE hThreadAccept = CreateThread(NULL, 0, farmAcceptThread, &job, 0, NULL);
+
+    PROCESS_INFORMATION workers[FARM_MAX_WORKERS];
+    unsigned int numWorkers = 0;
+    for (unsigned int i = 0; i < localWorkers && i < FARM_MAX_WORKERS; i++)
+    {
+        if (farmSpawnWorker(port, backendName, configFile, &workers[numWorkers]))
+            numWorkers++;
+        else
+            fprintf(stderr, "Cannot start a local worker\n");
+    }
+
+    // Wait for the chunks, as long as there are workers
+    DWORD idleSince = GetTickCount();
+    while (!job.stop)
+    {
+        if (GetAsyncKeyState(VK_F8))
+            InterlockedExchange(&job.stop, 1);
+
+        if (job.activeConnections > 0)
+            idleSince = GetTickCount();
+        else if (GetTickCount() - idleSince >= FARM_IDLE_MS)
+        {
+            fprintf(stderr, "\nNo worker connected for %u s\n", FARM_IDLE_MS / 1000);
+            InterlockedExchange(&job.failed, 1);
+            InterlockedExchange(&job.stop, 1);
+        }
+
+        EnterCriticalSection(&job.lock);
+        unsigned int frames = 0;
+        for (int i = 0; i < job.numChunks; i++)
+            frames += job.chunks[i].progress;
+        *progress = frames;
+        if (job.chunksDone == job.numChunks)
+            InterlockedExchange(&job.stop, 1);
+        LeaveCriticalSection(&job.lock);
+
+        Sleep(250);
+    }
+
+    // No more workers, the connected ones are told to quit
+    closesocket(job.listener);
+    WaitForSingleObject(hThreadAccept, INFINITE);
+    CloseHandle(hThreadAccept);
+    if (job.numConnections > 0)
+        WaitForMultipleObjects(job.numConnections, job.connections, TRUE, INFINITE);
+    for (int i = 0; i < job.numConnections; i++)
+        CloseHandle(job.connections[i]);
+
+    for (unsigned int i = 0; i < numWorkers; i++)
+    {
+        if (WaitForSingleObject(workers[i].hProcess, 5000) != WAIT_OBJECT_0)
+            TerminateProcess(workers[i].hProcess, 1);
+        CloseHandle(workers[i].hProcess);
+        CloseHandle(workers[i].hThread);
+    }
+
+    // Verify & concatenate the chunks done, in order
+    bool status = !job.failed;
+    FILE *fw = status ? fopen(outFile, "wb") : NULL;
+    if (status && fw == NULL)
+    {
+        printf("Error opening the output file %s\n", outFile);
+        status = false;
+    }
+
+    ChunkHeaders headers;
+    memset(&headers, 0, sizeof(ChunkHeaders));
+    for (int i = 0; status && i < job.numChunks && job.chunks[i].state == FARM_CHUNK_DONE; i++)
+    {
+        FarmChunk *chunk = &job.chunks[i];
+        if (farmChecksum(chunk->segment.data, chunk->segment.size) != chunk->checksum)
+        {
+            fprintf(stderr, "Frames %d-%d are corrupted\n", chunk->segment.first, chunk->segment.end - 1);
+            status = false;
+            break;
+        }
+        if (!chunkWriteSegment(fw, &chunk->segment, &headers))
+        {
+            fprintf(stderr, "Error writing the output file %s\n", outFile);
+            status = false;
+        }
+    }
+
+    // Free memory resources
+    if (fw && fclose(fw) != 0)
+        status = false;
+    for (int i = 0; i < job.numChunks; i++)
+        free(job.chunks[i].segment.data);
+    delete [] job.chunks;
+    free(headers.nal[0]);
+    free(headers.nal[1]);
+    DeleteCriticalSection(&job.lock);
+    WSACleanup();
+
+    return status;
+}
+
+
+/*******************************************************************************
+ * Worker
+ ******************************************************************************/
+
+DWORD WINAPI farmTaskThread(LPVOID param)
+{
+    FarmTask *task = (FarmTask*)param;
+    task->ok = chunkEncodeSegment(&task->format, task->device, &task->config,
+                                  &task->segment, &task->stop, &task->framesDone);
+    return 0;
+}
+
+
+// Connects to host:port
+SOCKET farmConnect(const char *address)
+{
+    char host[256];
+    strncpy(host, address, sizeof(host) - 1);
+    host[sizeof(host) - 1] = 0;
+    char *colon = strrchr(host, ':');
+    if (colon == NULL)
+        return INVALID_SOCKET;
+    *colon = 0;
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((unsigned short)atoi(colon + 1));
+    addr.sin_addr.s_addr = inet_addr(host);
+    if (addr.sin_addr.s_addr == INADDR_NONE)
+    {
+        struct hostent *he = gethostbyname(host);
+        if (he == NULL)
+            return INVALID_SOCKET;
+        memcpy(&addr.sin_addr, he->h_addr, sizeof(addr.sin_addr));
+    }
+
+    SOCKET sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (sock != INVALID_SOCKET && connect(sock, (struct sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR)
+    {
+        closesocket(sock);
+        sock = INVALID_SOCKET;
+    }
+    return sock;
+}
+
+
+/*******************************************************************************
+ *  @fn     farmWorker
+ *  @brief  Worker: encodes the chunks sent by a coordinator until it is done.
+ *          The script is opened once, every chunk is a Trim of it.
+ *  @param[in] address : Coordinator, host:port
+ *  @param[in] backend : Encoder backend
+ *  @param[in] device  : Device on which the sessions are created
+ *  @return bool : true if successful; otherwise false.
+ ******************************************************************************/
+bool farmWorker(const char *address, const EncoderBackend *backend, EncoderDevice *device)
+{
+    if (!farmStartup())
+        return false;
+
+    SOCKET sock = farmConnect(address);
+    if (sock == INVALID_SOCKET)
+    {
+        fprintf(stderr, "Cannot connect to %s\n", address);
+        WSACleanup();
+        return false;
+    }
+
+    bool alive = farmSend(sock, FARM_HELLO, FARM_VERSION, 0, 0, NULL, 0);
+    AVS_Clip *source = NULL;
+    FarmMsg msg;
+    BYTE *payload;
+
+    while (alive && farmRecv(sock, &msg, &payload))
+    {
+        if (msg.type != FARM_JOB || msg.size <= sizeof(OvConfigCtrl))
+        {
+            free(payload);
+            break;  // FARM_DONE
+        }
+        payload[msg.size - 1] = 0;
+
+        FarmTask task;
+        memset(&task, 0, sizeof(FarmTask));
+        memcpy(&task.config, payload, sizeof(OvConfigCtrl));
+
+        if (source == NULL && AVS_Init((char*)payload + sizeof(OvConfigCtrl)))
+            source = clip;
+
+        bool ok = false;
+        if (source)
+            clip = avisynth_trim(source, env, msg.first, msg.end);
+
+        if (source && clip)
+        {
+            info = avs_get_video_info(clip);
+            setSessionFormat(&task.format, info->width, info->height);
+            task.format.backend = backend;
+            task.device = device;
+            task.segment.end = info->num_frames;
+
+            // Report progress & listen for FARM_CANCEL while encoding
+            HANDLE hThreadTask = CreateThread(NULL, 0, farmTaskThread, &task, 0, NULL);
+            while (WaitForSingleObject(hThreadTask, FARM_PROGRESS_MS) == WAIT_TIMEOUT)
+            {
+                alive = alive && farmSend(sock, FARM_PROGRESS, msg.chunk, task.framesDone, msg.end, NULL, 0);
+                if (alive && farmReadable(sock))
+                {
+                    FarmMsg cancel;
+                    BYTE *cancelPayload;
+                    alive = farmRecv(sock, &cancel, &cancelPayload) && cancel.type == FARM_CANCEL;
+                    free(cancelPayload);
+                    InterlockedExchange(&task.stop, 1);
+                }
+                if (!alive)
+                    InterlockedExchange(&task.stop, 1);
+            }
+            CloseHandle(hThreadTask);
+
+            ok = task.ok && !task.stop && task.segment.encoded == info->num_frames;
+            avs_release_clip(clip);
+        }
+        clip = source;
+        if (clip)
+            info = avs_get_video_info(clip);
+
+        if (alive && ok)
+            alive = farmSend(sock, FARM_RESULT, msg.chunk, msg.first, msg.end, task.segment.data, task.segment.size);
+        else if (alive)
+            alive = farmSend(sock, FARM_FAILED, msg.chunk, msg.first, msg.end, NULL, 0);
+
+        free(task.segment.data);
+        free(payload);
+    }
+
+    closesocket(sock);
+    if (source)
+    {
+        avs_release_clip(source);
+        avs_delete_script_environment(env);
+    }
+    WSACleanup();
+    return true;
+}
+
+#endif
@@ -0,0 +1,631 @@
+/*******************************************************************************
+* This file is part of AvsVCEh264.
+* Contains the fragmented MP4 muxer of the single session encode: the access
+* units are converted to length prefixed samples as they come, and written in
+* moof/mdat fragments that start at the IDRs, with the 16 bit PCM audio of the
+* script as a second track. The output is written once, and only the frames of
+* the fragment being built are kept.
+*
+* Copyright (C) 2013 David Gonzlez Garca <davidgg666@gmail.com>
+*******************************************************************************/
+#ifndef FMP4_H
+#define FMP4_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ini.h"
+
+#define MP4_MAX_FRAGMENT_SIZE   (32 << 20)  // a fragment is closed beyond this, without an IDR
+
+// Sample flags of trun: sync sample, and depending on others
+#define MP4_SAMPLE_SYNC         0x02000000
+#define MP4_SAMPLE_NON_SYNC     0x01010000
+
+#define MP4_TRACK_VIDEO         1
+#define MP4_TRACK_AUDIO         2
+
+typedef struct Mp4Config
+{
+    unsigned int audio;             // the audio of the script is carried as PCM
+    unsigned int fragmentSeconds;   // longest fragment when the IDRs are far apart
+} Mp4Config;
+
+Mp4Config mp4Config = {1, 10};
+
+// Growing byte buffer the boxes are built in
+typedef struct Mp4Buffer
+{
+    BYTE            *data;
+    unsigned int    size;
+    unsigned int    capacity;
+} Mp4Buffer;
+
+typedef struct Mp4Muxer
+{
+    const AVS_VideoInfo *vi;
+    AVS_Clip        *audioClip;     // 16 bit PCM, NULL without audio
+    bool            started;        // ftyp & moov written
+    unsigned int    sequence;       // of the next fragment
+    unsigned int    firstFrame;     // of the fragment being built
+    unsigned int    maxFrames;      // per fragment, from fragmentSeconds
+    INT64           audioPos;       // samples written
+    Mp4Buffer       box;            // ftyp & moov, moof
+    Mp4Buffer       samples;        // video samples of the fragment
+    BYTE            *audio;
+    unsigned int    audioCapacity;
+    unsigned int    *sizes;         // per sample
+    BYTE            *sync;
+    unsigned int    count;          // samples of the fragment
+    unsigned int    capacity;
+} Mp4Muxer;
+
+
+static int mp4Handler(void* user, const char* section, const char* name, const char* value)
+{
+    Mp4Config *pMp4 = (Mp4Config*)user;
+    unsigned int uVal = (unsigned int)atoi(value);
+
+    if (strcmp(section, "mp4") != 0)
+        return 1;
+
+    if (strcmp(name, "audio") == 0)
+        pMp4->audio = uVal;
+    else if (strcmp(name, "fragmentSeconds") == 0)
+        pMp4->fragmentSeconds = uVal < 1 ? 1 : uVal;
+
+    return 1;
+}
+
+
+// Reads the [mp4] section of the configuration file
+void mp4Init(char *configFilename)
+{
+    ini_parse(configFilename, mp4Handler, &mp4Config);
+}
+
+
+// The output is muxed to MP4 when its name ends with .mp4 or .m4v
+bool mp4IsOutput(const char *fileName)
+{
+    size_t length = strlen(fileName);
+    return length > 4 && (_stricmp(fileName + length - 4, ".mp4") == 0 ||
+                          _stricmp(fileName + length - 4, ".m4v") == 0);
+}
+
+
+/*******************************************************************************
+ * Box writer
+ ******************************************************************************/
+static void mp4Reserve(Mp4Buffer *buf, unsigned int size)
+{
+    if (buf->size + size > buf->capacity)
+    {
+        while (buf->size + size > buf->capacity)
+            buf->capacity = buf->capacity ? buf->capacity * 2 : 4096;
+        buf->data = (BYTE*) realloc(buf->data, buf->capacity);
+    }
+}
+
+inline void mp4PutBytes(Mp4Buffer *buf, const void *data, unsigned int size)
+{
+    mp4Reserve(buf, size);
+    memcpy(buf->data + buf->size, data, size);
+    buf->size += size;
+}
+
+inline void mp4Put32At(Mp4Buffer *buf, unsigned int pos, unsigned int value)
+{
+    buf->data[pos]     = (BYTE)(value >> 24);
+    buf->data[pos + 1] = (BYTE)(value >> 16);
+    buf->data[pos + 2] = (BYTE)(value >> 8);
+    buf->data[pos + 3] = (BYTE)value;
+}
+
+inline void mp4Put32(Mp4Buffer *buf, unsigned int value)
+{
+    mp4Reserve(buf, 4);
+    mp4Put32At(buf, buf->size, value);
+    buf->size += 4;
+}
+
+inline void mp4Put16(Mp4Buffer *buf, unsigned int value)
+{
+    BYTE b[2] = {(BYTE)(value >> 8), (BYTE)value};
+    mp4PutBytes(buf, b, 2);
+}
+
+inline void mp4Put8(Mp4Buffer *buf, unsigned int value)
+{
+    BYTE b = (BYTE)value;
+    mp4PutBytes(buf, &b, 1);
+}
+
+inline void mp4Put64(Mp4Buffer *buf, uint64 value)
+{
+    mp4Put32(buf, (unsigned int)(value >> 32));
+    mp4Put32(buf, (unsigned int)value);
+}
+
+inline void mp4PutZeros(Mp4Buffer *buf, unsigned int count)
+{
+    mp4Reserve(buf, count);
+    memset(buf->data + buf->size, 0, count);
+    buf->size += count;
+}
+
+// Starts a box, its size is written by mp4End
+static unsigned int mp4Begin(Mp4Buffer *buf, const char *type)
+{
+    unsigned int start = buf->size;
+    mp4Put32(buf, 0);
+    mp4PutBytes(buf, type, 4);
+    return start;
+}
+
+// Starts a full box, with its version & flags
+static unsigned int mp4BeginFull(Mp4Buffer *buf, const char *type, unsigned int version, unsigned int flags)
+{
+    unsigned int start = mp4Begin(buf, type);
+    mp4Put32(buf, (version << 24) | flags);
+    return start;
+}
+
+inline void mp4End(Mp4Buffer *buf, unsigned int start)
+{
+    mp4Put32At(buf, start, buf->size - start);
+}
+
+// Unity transformation matrix of mvhd & tkhd
+static void mp4PutMatrix(Mp4Buffer *buf)
+{
+    static const unsigned int matrix[9] = {0x00010000, 0, 0, 0, 0x00010000, 0, 0, 0, 0x40000000};
+    for (int i = 0; i < 9; i++)
+        mp4Put32(buf, matrix[i]);
+}
+
+
+// tkhd, mdhd & hdlr of a track, the box of the media information is left open
+static unsigned int mp4BeginTrack(Mp4Buffer *buf, unsigned int trackId, unsigned int timescale,
+                                  const char *handler, const char *name, unsigned int width,
+                                  unsigned int height, unsigned int *mdia)
+{
+    unsigned int trak = mp4Begin(buf, "trak");
+
+    unsigned int box = mp4BeginFull(buf, "tkhd", 0, 3);    // enabled, in movie
+    mp4PutZeros(buf, 8);                                    // creation & modification time
+    mp4Put32(buf, trackId);
+    mp4PutZeros(buf, 4 + 4 + 8);                            // reserved, duration, reserved
+    mp4Put16(buf, 0);                                       // layer
+    mp4Put16(buf, 0);                                       // alternate group
+    mp4Put16(buf, trackId == MP4_TRACK_AUDIO ? 0x0100 : 0); // volume
+    mp4Put16(buf, 0);
+    mp4PutMatrix(buf);
+    mp4Put32(buf, width << 16);
+    mp4Put32(buf, height << 16);
+    mp4End(buf, box);
+
+    *mdia = mp4Begin(buf, "mdia");
+    box = mp4BeginFull(buf, "mdhd", 0, 0);
+    mp4PutZeros(buf, 8);
+    mp4Put32(buf, timescale);
+    mp4Put32(buf, 0);                                       // duration, in the fragments
+    mp4Put16(buf, 0x55C4);                                  // "und"
+    mp4Put16(buf, 0);
+    mp4End(buf, box);
+
+    box = mp4BeginFull(buf, "hdlr", 0, 0);
+    mp4Put32(buf, 0);
+    mp4PutBytes(buf, handler, 4);
+    mp4PutZeros(buf, 12);
+    mp4PutBytes(buf, name, (unsigned int)strlen(name) + 1);
+    mp4End(buf, box);
+
+    return trak;
+}
+
+
+// Empty sample tables of a fragmented track, after its sample description
+static void mp4PutTables(Mp4Buffer *buf)
+{
+    static const char *empty[4] = {"stts", "stsc", "stsz", "stco"};
+    for (int i = 0; i < 4; i++)
+    {
+        unsigned int box = mp4BeginFull(buf, empty[i], 0, 0);
+        if (i == 2)
+            mp4Put32(buf, 0);   // sample_size
+        mp4Put32(buf, 0);       // entry_count / sample_count
+        mp4End(buf, box);
+    }
+}
+
+static void mp4PutDinf(Mp4Buffer *buf)
+{
+    unsigned int dinf = mp4Begin(buf, "dinf");
+    unsigned int dref = mp4BeginFull(buf, "dref", 0, 0);
+    mp4Put32(buf, 1);
+    mp4End(buf, mp4BeginFull(buf, "url ", 0, 1));  // in the same file
+    mp4End(buf, dref);
+    mp4End(buf, dinf);
+}
+
+
+/*******************************************************************************
+ *  @fn     mp4PutVideoTrack
+ *  @brief  Writes the trak of the video, described by its first SPS & PPS
+ *  @param[in/out] buf : Box buffer
+ *  @param[in] vi      : Video info of the clip
+ *  @param[in] sps     : SPS, from its NAL header
+ *  @param[in] spsSize : Bytes
+ *  @param[in] pps     : PPS, from its NAL header
+ *  @param[in] ppsSize : Bytes
+ ******************************************************************************/
+static void mp4PutVideoTrack(Mp4Buffer *buf, const AVS_VideoInfo *vi, const BYTE *sps, unsigned int spsSize,
+                             const BYTE *pps, unsigned int ppsSize)
+{
+    unsigned int mdia;
+    unsigned int trak = mp4BeginTrack(buf, MP4_TRACK_VIDEO, vi->fps_numerator, "vide", "VideoHandler",
+                                      vi->width, vi->height, &mdia);
+    unsigned int minf = mp4Begin(buf, "minf");
+    unsigned int box = mp4BeginFull(buf, "vmhd", 0, 1);
+    mp4PutZeros(buf, 8);                    // graphicsmode & opcolor
+    mp4End(buf, box);
+    mp4PutDinf(buf);
+
+    unsigned int stbl = mp4Begin(buf, "stbl");
+    unsigned int stsd = mp4BeginFull(buf, "stsd", 0, 0);
+    mp4Put32(buf, 1);
+
+    unsigned int avc1 = mp4Begin(buf, "avc1");
+    mp4PutZeros(buf, 6);
+    mp4Put16(buf, 1);                       // data_reference_index
+    mp4PutZeros(buf, 16);
+    mp4Put16(buf, vi->width);
+    mp4Put16(buf, vi->height);
+    mp4Put32(buf, 0x00480000);              // 72 dpi
+    mp4Put32(buf, 0x00480000);
+    mp4Put32(buf, 0);
+    mp4Put16(buf, 1);                       // frame_count
+    mp4PutZeros(buf, 32);                   // compressorname
+    mp4Put16(buf, 0x0018);                  // depth
+    mp4Put16(buf, 0xFFFF);
+
+    box = mp4Begin(buf, "avcC");
+    mp4Put8(buf, 1);                        // configurationVersion
+    mp4Put8(buf, sps[1]);                   // profile, compatibility & level of the SPS
+    mp4Put8(buf, sps[2]);
+    mp4Put8(buf, sps[3]);
+    mp4Put8(buf, 0xFF);                     // 4 byte lengths
+    mp4Put8(buf, 0xE1);                     // one SPS
+    mp4Put16(buf, spsSize);
+    mp4PutBytes(buf, sps, spsSize);
+    mp4Put8(buf, 1);                        // one PPS
+    mp4Put16(buf, ppsSize);
+    mp4PutBytes(buf, pps, ppsSize);
+    if (sps[1] == 100 || sps[1] == 110 || sps[1] == 122 || sps[1] == 144)
+    {
+        mp4Put8(buf, 0xFC | 1);             // 4:2:0
+        mp4Put8(buf, 0xF8);                 // 8 bits
+        mp4Put8(buf, 0xF8);
+        mp4Put8(buf, 0);
+    }
+    mp4End(buf, box);
+    mp4End(buf, avc1);
+    mp4End(buf, stsd);
+
+    mp4PutTables(buf);
+    mp4End(buf, stbl);
+    mp4End(buf, minf);
+    mp4End(buf, mdia);
+    mp4End(buf, trak);
+}
+
+
+// trak of the 16 bit little endian PCM audio
+static void mp4PutAudioTrack(Mp4Buffer *buf, const AVS_VideoInfo *vi)
+{
+    unsigned int mdia;
+    unsigned int trak = mp4BeginTrack(buf, MP4_TRACK_AUDIO, vi->audio_samples_per_second, "soun", "SoundHandler",
+                                      0, 0, &mdia);
+    unsigned int minf = mp4Begin(buf, "minf");
+    unsigned int box = mp4BeginFull(buf, "smhd", 0, 0);
+    mp4Put32(buf, 0);                       // balance
+    mp4End(buf, box);
+    mp4PutDinf(buf);
+
+    unsigned int stbl = mp4Begin(buf, "stbl");
+    unsigned int stsd = mp4BeginFull(buf, "stsd", 0, 0);
+    mp4Put32(buf, 1);
+
+    box = mp4Begin(buf, "sowt");
+    mp4PutZeros(buf, 6);
+    mp4Put16(buf, 1);                       // data_reference_index
+    mp4PutZeros(buf, 8);
+    mp4Put16(buf, avs_audio_channels(vi));
+    mp4Put16(buf, 16);
+    mp4Put32(buf, 0);
+    // 16.16 samplerate, 0 above 65535 Hz: the timescale of the track has the rate
+    unsigned int rate = (unsigned int)vi->audio_samples_per_second;
+    mp4Put32(buf, rate <= 0xFFFF ? rate << 16 : 0);
+    mp4End(buf, box);
+    mp4End(buf, stsd);
+
+    mp4PutTables(buf);
+    mp4End(buf, stbl);
+    mp4End(buf, minf);
+    mp4End(buf, mdia);
+    mp4End(buf, trak);
+}
+
+
+/*******************************************************************************
+ *  @fn     mp4PutHeader
+ *  @brief  Writes the ftyp & moov of the output, with the trex of every track
+ *  @param[in/out] mux : Muxer
+ *  @param[in] sps     : SPS of the first access unit, from its NAL header
+ *  @param[in] spsSize : Bytes
+ *  @param[in] pps     : PPS of the first access unit, from its NAL header
+ *  @param[in] ppsSize : Bytes
+ ******************************************************************************/
+static void mp4PutHeader(Mp4Muxer *mux, const BYTE *sps, unsigned int spsSize, const BYTE *pps, unsigned int ppsSize)
+{
+    Mp4Buffer *buf = &mux->box;
+    unsigned int numTracks = mux->audioClip ? 2 : 1;
+
+    unsigned int box = mp4Begin(buf, "ftyp");
+    mp4PutBytes(buf, "isom", 4);
+    mp4Put32(buf, 0x200);
+    mp4PutBytes(buf, "isomiso6avc1mp41", 16);
+    mp4End(buf, box);
+
+    unsigned int moov = mp4Begin(buf, "moov");
+    box = mp4BeginFull(buf, "mvhd", 0, 0);
+    mp4PutZeros(buf, 8);
+    mp4Put32(buf, 1000);                    // timescale
+    mp4Put32(buf, 0);                       // duration, in the fragments
+    mp4Put32(buf, 0x00010000);              // rate
+    mp4Put16(buf, 0x0100);                  // volume
+    mp4PutZeros(buf, 10);
+    mp4PutMatrix(buf);
+    mp4PutZeros(buf, 24);
+    mp4Put32(buf, numTracks + 1);           // next_track_ID
+    mp4End(buf, box);
+
+    mp4PutVideoTrack(buf, mux->vi, sps, spsSize, pps, ppsSize);
+    if (mux->audioClip)
+        mp4PutAudioTrack(buf, mux->vi);
+
+    unsigned int mvex = mp4Begin(buf, "mvex");
+    for (unsigned int track = 1; track <= numTracks; track++)
+    {
+        box = mp4BeginFull(buf, "trex", 0, 0);
+        mp4Put32(buf, track);
+        mp4Put32(buf, 1);                   // default_sample_description_index
+        mp4PutZeros(buf, 12);               // duration, size & flags, in the fragments
+        mp4End(buf, box);
+    }
+    mp4End(buf, mvex);
+    mp4End(buf, moov);
+}
+
+
+/*******************************************************************************
+ *  @fn     mp4Open
+ *  @brief  Starts the muxer of a clip, the header is written with the first
+ *          access unit
+ *  @param[out] mux   : Muxer
+ *  @param[in] vi     : Video info of the clip
+ *  @param[in] clip   : Clip the audio is read from, 16 bit; NULL for no audio
+ ******************************************************************************/
+void mp4Open(Mp4Muxer *mux, const AVS_VideoInfo *vi, AVS_Clip *audioClip)
+{
+    memset(mux, 0, sizeof(Mp4Muxer));
+    mux->vi = vi;
+    mux->sequence = 1;
+    if (audioClip && mp4Config.audio && avs_has_audio(vi) && vi->sample_type == AVS_SAMPLE_INT16)
+        mux->audioClip = audioClip;
+    mux->maxFrames = (unsigned int)((uint64)mp4Config.fragmentSeconds * vi->fps_numerator / vi->fps_denominator);
+    if (mux->maxFrames < 1)
+        mux->maxFrames = 1;
+}
+
+
+/*******************************************************************************
+ *  @fn     mp4Fragment
+ *  @brief  Writes the samples of the fragment being built in a moof & mdat,
+ *          with the audio of the same frames
+ *  @param[in/out] mux   : Muxer
+ *  @param[in/out] arena : Arena of the output
+ *  @return bool : false if the output could not be written; otherwise true.
+ ******************************************************************************/
+static bool mp4Fragment(Mp4Muxer *mux, BitstreamArena *arena)
+{
+    if (mux->count == 0)
+        return true;
+
+    const AVS_VideoInfo *vi = mux->vi;
+
+    // audio up to the end of the last frame
+    unsigned int audioCount = 0;
+    unsigned int sampleSize = 0;
+    if (mux->audioClip)
+    {
+        INT64 end = avs_audio_samples_from_frames(vi, mux->firstFrame + mux->count);
+        if (end > vi->num_audio_samples)
+            end = vi->num_audio_samples;
+        audioCount = end > mux->audioPos ? (unsigned int)(end - mux->audioPos) : 0;
+        sampleSize = avs_bytes_per_audio_sample(vi);
+
+        if (audioCount * sampleSize > mux->audioCapacity)
+        {
+            mux->audioCapacity = audioCount * sampleSize;
+            mux->audio = (BYTE*) realloc(mux->audio, mux->audioCapacity);
+        }
+        EnterCriticalSection(&avsLock);
+        avs_get_audio(mux->audioClip, mux->audio, mux->audioPos, audioCount);
+        LeaveCriticalSection(&avsLock);
+    }
+
+    Mp4Buffer *buf = &mux->box;
+    buf->size = 0;
+    unsigned int moof = mp4Begin(buf, "moof");
+    unsigned int box = mp4BeginFull(buf, "mfhd", 0, 0);
+    mp4Put32(buf, mux->sequence++);
+    mp4End(buf, box);
+
+    // video: default-base-is-moof, the duration of a frame
+    unsigned int traf = mp4Begin(buf, "traf");
+    box = mp4BeginFull(buf, "tfhd", 0, 0x020008);
+    mp4Put32(buf, MP4_TRACK_VIDEO);
+    mp4Put32(buf, vi->fps_denominator);
+    mp4End(buf, box);
+    box = mp4BeginFull(buf, "tfdt", 1, 0);
+    mp4Put64(buf, (uint64)mux->firstFrame * vi->fps_denominator);
+    mp4End(buf, box);
+
+    box = mp4BeginFull(buf, "trun", 0, 0x000601);   // data offset, sample sizes & flags
+    mp4Put32(buf, mux->count);
+    unsigned int videoOffset = buf->size;
+    mp4Put32(buf, 0);
+    for (unsigned int i = 0; i < mux->count; i++)
+    {
+        mp4Put32(buf, mux->sizes[i]);
+        mp4Put32(buf, mux->sync[i] ? MP4_SAMPLE_SYNC : MP4_SAMPLE_NON_SYNC);
+    }
+    mp4End(buf, box);
+    mp4End(buf, traf);
+
+    // audio: every PCM sample is a sample of its own size & duration
+    unsigned int audioOffset = 0;
+    if (audioCount)
+    {
+        traf = mp4Begin(buf, "traf");
+        box = mp4BeginFull(buf, "tfhd", 0, 0x020038);
+        mp4Put32(buf, MP4_TRACK_AUDIO);
+        mp4Put32(buf, 1);
+        mp4Put32(buf, sampleSize);
+        mp4Put32(buf, MP4_SAMPLE_SYNC);
+        mp4End(buf, box);
+        box = mp4BeginFull(buf, "tfdt", 1, 0);
+        mp4Put64(buf, mux->audioPos);
+        mp4End(buf, box);
+
+        box = mp4BeginFull(buf, "trun", 0, 0x000001);
+        mp4Put32(buf, audioCount);
+        audioOffset = buf->size;
+        mp4Put32(buf, 0);
+        mp4End(buf, box);
+        mp4End(buf, traf);
+    }
+    mp4End(buf, moof);
+
+    // the offsets of the data in the mdat, from the start of the moof
+    unsigned int audioBytes = audioCount * sampleSize;
+    mp4Put32At(buf, videoOffset, buf->size + 8);
+    if (audioCount)
+        mp4Put32At(buf, audioOffset, buf->size + 8 + mux->samples.size);
+    mp4Put32(buf, 8 + mux->samples.size + audioBytes);
+    mp4PutBytes(buf, "mdat", 4);
+
+    bool status = arenaAppend(arena, buf->data, buf->size) &&
+                  arenaAppend(arena, mux->samples.data, mux->samples.size) &&
+                  (audioBytes == 0 || arenaAppend(arena, mux->audio, audioBytes));
+
+    mux->firstFrame += mux->count;
+    mux->audioPos += audioCount;
+    mux->count = 0;
+    mux->samples.size = 0;
+    return status;
+}
+
+
+/*******************************************************************************
+ *  @fn     mp4Append
+ *  @brief  Adds the access unit of the next frame. The header is written with
+ *          the first one, and the fragment being built is written before an
+ *          IDR, or when it is too long. The access unit delimiters are dropped.
+ *  @param[in/out] mux   : Muxer
+ *  @param[in/out] arena : Arena of the output
+ *  @param[in] data      : Annex-B access unit
+ *  @param[in] size      : Bytes
+ *  @return bool : false if the output could not be written; otherwise true.
+ ******************************************************************************/
+bool mp4Append(Mp4Muxer *mux, BitstreamArena *arena, const BYTE *data, unsigned int size)
+{
+    bool idr = annexbIsIdr(data, size);
+
+    if (!mux->started)
+    {
+        AnnexbNal nal, sps = {0}, pps = {0};
+        unsigned int pos = 0;
+        while (annexbNextNal(data, size, &pos, &nal))
+        {
+            if (nal.type == NAL_SPS && sps.data == NULL)
+                sps = nal;
+            else if (nal.type == NAL_PPS && pps.data == NULL)
+                pps = nal;
+        }
+        if (sps.data == NULL || pps.data == NULL || sps.size - sps.header < 4)
+        {
+            fprintf(stderr, "\nThe first frame has no SPS & PPS for the MP4 header\n");
+            return false;
+        }
+
+        mp4PutHeader(mux, sps.data + sps.header, sps.size - sps.header, pps.data + pps.header, pps.size - pps.header);
+        mux->started = true;
+        if (!arenaAppend(arena, mux->box.data, mux->box.size))
+            return false;
+    }
+
+    if (mux->count && (idr || mux->count >= mux->maxFrames || mux->samples.size + size > MP4_MAX_FRAGMENT_SIZE) &&
+            !mp4Fragment(mux, arena))
+        return false;
+
+    if (mux->count == mux->capacity)
+    {
+        mux->capacity = mux->capacity ? mux->capacity * 2 : 256;
+        mux->sizes = (unsigned int*) realloc(mux->sizes, mux->capacity * sizeof(unsigned int));
+        mux->sync = (BYTE*) realloc(mux->sync, mux->capacity);
+    }
+
+    // 4 byte lengths instead of the start codes
+    unsigned int start = mux->samples.size;
+    unsigned int pos = 0;
+    AnnexbNal nal;
+    while (annexbNextNal(data, size, &pos, &nal))
+    {
+        if (nal.type == NAL_AUD)
+            continue;
+        mp4Put32(&mux->samples, nal.size - nal.header);
+        mp4PutBytes(&mux->samples, nal.data + nal.header, nal.size - nal.header);
+    }
+    mux->sizes[mux->count] = mux->samples.size - start;
+    mux->sync[mux->count] = idr;
+    mux->count++;
+    return true;
+}
+
+
+/*******************************************************************************
+ *  @fn     mp4Close
+ *  @brief  Writes the last fragment & frees the muxer
+ *  @param[in/out] mux   : Muxer
+ *  @param[in/out] arena : Arena of the output
+ *  @return bool : false if the output could not be written; otherwise true.
+ ******************************************************************************/
+bool mp4Close(Mp4Muxer *mux, BitstreamArena *arena)
+{
+    bool status = mp4Fragment(mux, arena);
+
+    if (mux->started)
+        fprintf(stderr, "MP4         %u fragments%s\n", mux->sequence - 1, mux->audioClip ? ", PCM audio" : "");
+
+    free(mux->box.data);
+    free(mux->samples.data);
+    free(mux->audio);
+    free(mux->sizes);
+    free(mux->sync);
+    return status;
+}
+
+#endif
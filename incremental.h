@@ -0,0 +1,761 @@
+/*******************************************************************************
+* This file is part of AvsVCEh264.
+* Contains the incremental mode: every converted frame is hashed and the clip
+* is split in GOPs at frames chosen by their hash, so the same content gives
+* the same GOPs even when frames are inserted or removed before it. The GOPs
+* found in the index of the previous output are copied from it, only the
+* others are encoded, each one starting with an IDR and SPS/PPS. The GOPs
+* are the only IDRs: the periodic ones of the encoder are off and a GOP has
+* two frames or more, so two IDRs, which could share an idr_pic_id, never
+* follow each other where GOPs of different sessions or outputs meet.
+*
+* Index, output.264.gops: IncrIndexHeader, IncrIndexGop[numGops] and the
+* hash of every frame (uint64[numFrames]), in the order of the GOPs. The size
+* & write time of the output are kept in the header, the index is not used
+* for an output written again by another encode.
+*
+* Copyright (C) 2013 David Gonzlez Garca <davidgg666@gmail.com>
+*******************************************************************************/
+#ifndef INCREMENTAL_H
+#define INCREMENTAL_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define INCR_USE_SSE2
+#include <emmintrin.h>
+#endif
+
+#define INCR_MAGIC          0x53504F47  // "GOPS"
+#define INCR_VERSION        3
+#define INCR_MAX_FRAMES     (1 << 24)   // of an index, larger ones are damaged
+#define INCR_KEY_WORDS      1024        // hash key, repeated every 4096 bytes of a row
+#define INCR_GOP_SECONDS    2           // average GOP length without encIDRPeriod
+#define INCR_COPY_SIZE      (1 << 20)
+
+typedef struct IncrIndexHeader
+{
+    unsigned int    magic;
+    unsigned int    version;
+    unsigned int    width;
+    unsigned int    height;
+    uint64          configHash;     // configuration & backend of the encode
+    unsigned int    numGops;
+    unsigned int    numFrames;
+    uint64          outputSize;     // of the output it describes
+    uint64          outputTime;     // last write of the output, FILETIME
+} IncrIndexHeader;
+
+typedef struct IncrIndexGop
+{
+    unsigned int    first;          // first frame
+    unsigned int    frames;
+    uint64          hash;           // of the hashes of its frames
+    uint64          offset;         // position in the output
+    unsigned int    size;
+    unsigned int    number;         // position in the index, only used in memory
+} IncrIndexGop;
+
+typedef struct IncrGop
+{
+    IncrIndexGop    index;          // in the new output
+    int             previous;       // GOP of the previous output with the same frames, -1 if none
+} IncrGop;
+
+// GOPs encoded one after another on one session, to a temporary file read back in order
+typedef struct IncrRun
+{
+    int             firstGop;
+    int             endGop;
+    char            fileName[MAX_PATH];
+    FILE            *file;
+    uint64          size;
+    volatile LONG   done;           // 1 when finished, -1 if it failed
+} IncrRun;
+
+typedef struct IncrJob
+{
+    EncoderSession  format;
+    OvConfigCtrl    *pConfig;
+    char            *tempFile;      // the runs are next to it
+    IncrGop         *gops;
+    IncrRun         *runs;
+    int             numRuns;
+    volatile LONG   nextRun;
+    volatile LONG   framesDone;
+    volatile LONG   stop;
+    volatile LONG   failed;
+} IncrJob;
+
+typedef struct IncrWorker
+{
+    IncrJob         *job;
+    EncoderDevice   *device;
+} IncrWorker;
+
+static unsigned int incrKeys[INCR_KEY_WORDS];
+
+
+// 64 bit finalizer, every bit of h changes about half of the result
+static inline uint64 incrMix(uint64 h)
+{
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+
+// Fixed key of the row hash, the same on every run & machine
+void incrInitKeys()
+{
+    uint64 x = 0x9E3779B97F4A7C15ULL;
+    for (int i = 0; i < INCR_KEY_WORDS; i++)
+    {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        incrKeys[i] = (unsigned int)(x >> 32);
+    }
+}
+
+
+/*******************************************************************************
+ *  @fn     incrHashRow
+ *  @brief  NH hash of a row: the sum of (m0 + k0) * (m1 + k1) over its pairs
+ *          of 32 bit words, 4 words at a time with SSE2. The C code gives the
+ *          same result.
+ *  @param[in] row   : Pixels
+ *  @param[in] bytes : Row width
+ *  @return uint64 : hash
+ ******************************************************************************/
+uint64 incrHashRow(const BYTE *row, unsigned int bytes)
+{
+    uint64 sum = 0;
+    unsigned int i = 0;
+
+#ifdef INCR_USE_SSE2
+    __m128i acc = _mm_setzero_si128();
+    for (; i + 16 <= bytes; i += 16)
+    {
+        __m128i m = _mm_loadu_si128((const __m128i*)(row + i));
+        __m128i k = _mm_loadu_si128((const __m128i*)(incrKeys + (i / 4) % INCR_KEY_WORDS));
+        __m128i t = _mm_add_epi32(m, k);
+        acc = _mm_add_epi64(acc, _mm_mul_epu32(t, _mm_srli_epi64(t, 32)));
+    }
+    uint64 lanes[2];
+    _mm_storeu_si128((__m128i*)lanes, acc);
+    sum = lanes[0] + lanes[1];
+#endif
+
+    for (; i + 8 <= bytes; i += 8)
+    {
+        unsigned int m[2];
+        memcpy(m, row + i, 8);
+        unsigned int k = (i / 4) % INCR_KEY_WORDS;
+        sum += (uint64)(m[0] + incrKeys[k]) * (m[1] + incrKeys[k + 1]);
+    }
+
+    uint64 tail = 0;
+    for (; i < bytes; i++)
+        tail = (tail << 8) | row[i];
+    return sum + incrMix(tail + bytes);
+}
+
+
+// Hash of the visible pixels of an NV12 frame
+uint64 incrHashFrame(const BYTE *frame, unsigned int pitch, unsigned int width, unsigned int height)
+{
+    uint64 h = incrMix(((uint64)width << 32) | height);
+    for (unsigned int y = 0; y < height + height / 2; y++)
+        h = incrMix(h ^ incrHashRow(frame + y * pitch, width));
+    return h;
+}
+
+
+// FNV-1a of the configuration, a GOP is only reused with the same one
+uint64 incrConfigHash(OvConfigCtrl *pConfig, const char *backendName)
+{
+    uint64 h = 0xCBF29CE484222325ULL;
+    const BYTE *p = (const BYTE*)pConfig;
+    for (unsigned int i = 0; i < sizeof(OvConfigCtrl); i++)
+        h = (h ^ p[i]) * 0x100000001B3ULL;
+    for (; *backendName; backendName++)
+        h = (h ^ (BYTE)*backendName) * 0x100000001B3ULL;
+    return h;
+}
+
+
+/*******************************************************************************
+ *  @fn     incrPlan
+ *  @brief  Splits the frames in GOPs. A GOP ends before a frame whose hash is
+ *          a multiple of the average length, once it has half of it and two
+ *          frames, or at twice the average length.
+ *  @param[in] hashes    : Hash of every frame
+ *  @param[in] numFrames : Number of frames
+ *  @param[in] length    : Average GOP length
+ *  @param[out] gops     : GOPs, numFrames at most
+ *  @return int : number of GOPs.
+ ******************************************************************************/
+int incrPlan(uint64 *hashes, unsigned int numFrames, unsigned int length, IncrGop *gops)
+{
+    int numGops = 0;
+    unsigned int first = 0;
+    for (unsigned int f = 1; f <= numFrames; f++)
+    {
+        unsigned int frames = f - first;
+        bool split = f == numFrames || frames >= 2 * length ||
+                     (frames >= length / 2 && frames >= 2 && (hashes[f] >> 16) % length == 0);
+        if (!split)
+            continue;
+
+        IncrGop *gop = &gops[numGops++];
+        memset(gop, 0, sizeof(IncrGop));
+        gop->index.first = first;
+        gop->index.frames = frames;
+        gop->index.hash = 0;
+        for (unsigned int i = first; i < f; i++)
+            gop->index.hash = incrMix(gop->index.hash ^ hashes[i]);
+        gop->previous = -1;
+        first = f;
+    }
+    return numGops;
+}
+
+
+/*******************************************************************************
+ *  @fn     incrLoadIndex
+ *  @brief  Reads the index of the previous output
+ *  @param[in] fileName    : Index file
+ *  @param[out] header     : Header
+ *  @param[out] gops       : GOPs, to free
+ *  @param[out] hashes     : Frame hashes, to free
+ *  @return bool : true if there is a valid index; otherwise false.
+ ******************************************************************************/
+bool incrLoadIndex(char *fileName, IncrIndexHeader *header, IncrIndexGop **gops, uint64 **hashes)
+{
+    FILE *fr = fopen(fileName, "rb");
+    if (fr == NULL)
+        return false;
+
+    // the counts are bounded before the sizes are computed
+    bool status = fread(header, sizeof(IncrIndexHeader), 1, fr) == 1 &&
+                  header->magic == INCR_MAGIC && header->version == INCR_VERSION &&
+                  header->numFrames <= INCR_MAX_FRAMES && header->numGops <= header->numFrames;
+    *gops = NULL;
+    *hashes = NULL;
+    if (status)
+    {
+        *gops = (IncrIndexGop*) malloc(header->numGops * sizeof(IncrIndexGop) + 1);
+        *hashes = (uint64*) malloc(header->numFrames * sizeof(uint64) + 1);
+        status = *gops && *hashes &&
+                 fread(*gops, sizeof(IncrIndexGop), header->numGops, fr) == header->numGops &&
+                 fread(*hashes, sizeof(uint64), header->numFrames, fr) == header->numFrames;
+    }
+    fclose(fr);
+
+    if (!status)
+    {
+        free(*gops);
+        free(*hashes);
+        *gops = NULL;
+        *hashes = NULL;
+    }
+    return status;
+}
+
+
+// Size & last write time of a file, which an index is tied to
+bool incrFileStamp(HANDLE file, uint64 *size, uint64 *time)
+{
+    LARGE_INTEGER fileSize;
+    FILETIME writeTime;
+    if (!GetFileSizeEx(file, &fileSize) || !GetFileTime(file, NULL, NULL, &writeTime))
+        return false;
+    *size = fileSize.QuadPart;
+    *time = ((uint64)writeTime.dwHighDateTime << 32) | writeTime.dwLowDateTime;
+    return true;
+}
+
+
+/*******************************************************************************
+ *  @fn     incrCheckIndex
+ *  @brief  Tells if the index of the previous output can be trusted: it was
+ *          written with that output, as it is now, its GOPs have all its
+ *          frames and each one is inside the output
+ *  @param[in] previous : Previous output
+ *  @param[in] header   : Header of the index
+ *  @param[in] gops     : GOPs of the index
+ *  @return bool : true if the GOPs can be copied; otherwise false.
+ ******************************************************************************/
+bool incrCheckIndex(HANDLE previous, IncrIndexHeader *header, IncrIndexGop *gops)
+{
+    uint64 size, time;
+    if (!incrFileStamp(previous, &size, &time) || size != header->outputSize || time != header->outputTime)
+        return false;
+
+    uint64 frames = 0;
+    for (unsigned int i = 0; i < header->numGops; i++)
+    {
+        if (gops[i].frames == 0 || gops[i].offset > size || gops[i].size > size - gops[i].offset)
+            return false;
+        frames += gops[i].frames;
+    }
+    return frames == header->numFrames;
+}
+
+
+bool incrWriteIndex(char *fileName, IncrIndexHeader *header, IncrGop *gops, uint64 *hashes)
+{
+    FILE *fw = fopen(fileName, "wb");
+    if (fw == NULL)
+        return false;
+
+    bool status = fwrite(header, sizeof(IncrIndexHeader), 1, fw) == 1;
+    for (unsigned int i = 0; status && i < header->numGops; i++)
+        status = fwrite(&gops[i].index, sizeof(IncrIndexGop), 1, fw) == 1;
+    status = status && fwrite(hashes, sizeof(uint64), header->numFrames, fw) == header->numFrames;
+    return fclose(fw) == 0 && status;
+}
+
+
+static int incrCompareGops(const void *a, const void *b)
+{
+    uint64 x = ((const IncrIndexGop*)a)->hash, y = ((const IncrIndexGop*)b)->hash;
+    return x < y ? -1 : x > y;
+}
+
+
+// Appends encoded data to the file of a run
+inline bool incrAppend(IncrRun *run, const BYTE *data, unsigned int size)
+{
+    run->size += size;
+    return fwrite(data, 1, size, run->file) == size;
+}
+
+
+// Closes & deletes the file of a run
+void incrCloseRun(IncrRun *run)
+{
+    if (run->file == NULL)
+        return;
+    fclose(run->file);
+    remove(run->fileName);
+    run->file = NULL;
+}
+
+
+/*******************************************************************************
+ *  @fn     incrEncodeRun
+ *  @brief  Encodes the GOPs of a run on a new session, each one starting with
+ *          an IDR & SPS/PPS, and records where each one starts in the output
+ *  @param[in] job    : Job
+ *  @param[in] device : Device on which the session is created
+ *  @param[in/out] run: Run, gets the output
+ *  @return bool : true if successful; otherwise false.
+ ******************************************************************************/
+bool incrEncodeRun(IncrJob *job, EncoderDevice *device, IncrRun *run)
+{
+    const EncoderBackend *encoder = job->format.backend;
+
+	OVE_OUTPUT_DESCRIPTION taskDescriptionList = {sizeof(OVE_OUTPUT_DESCRIPTION), 0, OVE_TASK_STATUS_NONE, 0, 0};
+
+    OVE_ENCODE_PARAMETERS_H264 pictureParameter;
+	memset(&pictureParameter, 0, sizeof(OVE_ENCODE_PARAMETERS_H264));
+	pictureParameter.size = sizeof(OVE_ENCODE_PARAMETERS_H264);
+	pictureParameter.pictureStructure = OVE_PICTURE_STRUCTURE_H264_FRAME;
+	pictureParameter.forceRefreshMap = (OVE_BOOL)true;
+
+    // no IDR but the first frame of every GOP
+    OvConfigCtrl config = *job->pConfig;
+    config.pictControl.encIDRPeriod = 0;
+
+    EncoderSession session = job->format;
+    bool ok = encoder->createSession(&session, device, &config);
+    if (ok && !encoder->sendConfig(&session, &config, ENC_CONFIG_ALL))
+    {
+        fprintf(stderr, "OVEncodeSendConfig returned error\n");
+        ok = false;
+    }
+
+    // the GOPs wait on the disk, not in memory, until the output gets to them
+    snprintf(run->fileName, MAX_PATH, "%s.%d", job->tempFile, (int)(run - job->runs));
+    run->file = ok ? fopen(run->fileName, "w+b") : NULL;
+    if (ok && run->file == NULL)
+    {
+        fprintf(stderr, "Error creating %s\n", run->fileName);
+        ok = false;
+    }
+
+    BYTE *frameData = (BYTE*) malloc(session.frameSize);
+    for (int g = run->firstGop; ok && g < run->endGop && !job->stop; g++)
+    {
+        IncrGop *gop = &job->gops[g];
+        uint64 start = run->size;
+        unsigned int end = gop->index.first + gop->index.frames;
+        for (unsigned int f = gop->index.first; ok && f < end && !job->stop; f++)
+        {
+            avsGetFrameNV12(f, frameData, session.pitch);
+
+            pictureParameter.insertSPS = (OVE_BOOL)(f == gop->index.first);
+            pictureParameter.forcePicType = f == gop->index.first ? OVE_PICTURE_TYPE_H264_IDR : OVE_PICTURE_TYPE_H264_NONE;
+
+            unsigned int iTaskID;
+            ok = encoder->submit(&session, frameData, &pictureParameter, &iTaskID) &&
+                 encoder->query(&session, &taskDescriptionList);
+
+            bool written = true;
+            if (ok && taskDescriptionList.status == OVE_TASK_STATUS_COMPLETE &&
+                    taskDescriptionList.size_of_bitstream_data > 0)
+            {
+                written = incrAppend(run, (BYTE*)taskDescriptionList.bitstream_data,
+                                     taskDescriptionList.size_of_bitstream_data);
+            }
+            if (ok)
+                releaseQueried(&session, &taskDescriptionList);
+            if (!written)
+            {
+                fprintf(stderr, "Error writing %s\n", run->fileName);
+                ok = false;
+            }
+            InterlockedIncrement(&job->framesDone);
+        }
+        gop->index.size = (unsigned int)(run->size - start);
+    }
+    free(frameData);
+    if (ok && fflush(run->file) != 0)
+        ok = false;
+
+    encoder->releaseSession(&session);
+    if (!ok)
+        fprintf(stderr, "Encoding of GOPs %d-%d failed\n", run->firstGop, run->endGop - 1);
+    return ok && !job->stop;
+}
+
+
+// Encodes runs on one device until there are none left
+DWORD WINAPI incrWorkerThread(LPVOID param)
+{
+    IncrWorker *worker = (IncrWorker*)param;
+    IncrJob *job = worker->job;
+
+    for (;;)
+    {
+        LONG r = InterlockedIncrement(&job->nextRun) - 1;
+        if (r >= job->numRuns || job->stop)
+            break;
+
+        IncrRun *run = &job->runs[r];
+        bool ok = incrEncodeRun(job, worker->device, run);
+        if (!ok && !job->stop)
+        {
+            InterlockedExchange(&job->failed, 1);
+            InterlockedExchange(&job->stop, 1);
+        }
+        InterlockedExchange(&run->done, ok ? 1 : -1);
+    }
+
+    return 0;
+}
+
+
+// Copies the next size bytes of the file of a run
+bool incrCopyRun(IncrRun *run, unsigned int size, FILE *fw, BYTE *buffer)
+{
+    while (size > 0)
+    {
+        unsigned int chunk = size < INCR_COPY_SIZE ? size : INCR_COPY_SIZE;
+        if (fread(buffer, 1, chunk, run->file) != chunk || fwrite(buffer, 1, chunk, fw) != chunk)
+            return false;
+        size -= chunk;
+    }
+    return true;
+}
+
+
+// Copies size bytes at offset of the previous output
+bool incrCopy(HANDLE previous, uint64 offset, unsigned int size, FILE *fw, BYTE *buffer)
+{
+    LARGE_INTEGER position;
+    position.QuadPart = offset;
+    if (!SetFilePointerEx(previous, position, NULL, FILE_BEGIN))
+        return false;
+
+    while (size > 0)
+    {
+        DWORD read, chunk = size < INCR_COPY_SIZE ? size : INCR_COPY_SIZE;
+        if (!ReadFile(previous, buffer, chunk, &read, NULL) || read != chunk)
+            return false;
+        if (fwrite(buffer, 1, chunk, fw) != chunk)
+            return false;
+        size -= chunk;
+    }
+    return true;
+}
+
+
+/*******************************************************************************
+ *  @fn     incrEncodeProcess
+ *  @brief  Encodes the clip reusing the GOPs of the previous output whose
+ *          frames have the same hashes, the changed ones are encoded on
+ *          several sessions & devices. The new output is written to a
+ *          temporary file that replaces the previous one when complete.
+ *  @param[in] format            : Frame format & backend of the sessions
+ *  @param[in] devices           : Devices on which the sessions are created
+ *  @param[in] numDevices        : Number of devices
+ *  @param[in] sessionsPerDevice : Concurrent sessions on each device
+ *  @param[out] outFile          : output encoded H.264 video file
+ *  @param[in] pConfig           : OvConfigCtrl
+ *  @param[out] progress         : Frames hashed, then reused or encoded
+ *  @return bool : true if successful; otherwise false.
+ ******************************************************************************/
+bool incrEncodeProcess(EncoderSession *format, EncoderDevice *devices, unsigned int numDevices,
+                       unsigned int sessionsPerDevice, char *outFile, OvConfigCtrl *pConfig,
+                       unsigned int *progress)
+{
+    unsigned int numFrames = info->num_frames;
+    char indexFile[MAX_PATH], tempFile[MAX_PATH];
+    snprintf(indexFile, MAX_PATH, "%s.gops", outFile);
+    snprintf(tempFile, MAX_PATH, "%s.tmp", outFile);
+
+    // Hash of every frame
+    incrInitKeys();
+    uint64 *hashes = (uint64*) malloc(numFrames * sizeof(uint64) + 1);
+    IncrGop *gops = (IncrGop*) malloc(numFrames * sizeof(IncrGop) + 1);
+    if (hashes == NULL || gops == NULL)
+    {
+        fprintf(stderr, "Not enough memory for the hashes of %u frames\n", numFrames);
+        free(hashes);
+        free(gops);
+        return false;
+    }
+    BYTE *frameData = (BYTE*) malloc(format->frameSize);
+    for (unsigned int f = 0; f < numFrames; f++)
+    {
+        if (GetAsyncKeyState(VK_F8))
+        {
+            free(frameData);
+            free(hashes);
+            free(gops);
+            return false;
+        }
+        avsGetFrameNV12(f, frameData, format->pitch);
+        hashes[f] = incrHashFrame(frameData, format->pitch, info->width, info->height);
+        if (f % 100 == 0)
+            fprintf(stderr, "\rHashing     %u/%u", f, numFrames);
+    }
+    free(frameData);
+    fprintf(stderr, "\rHashing     %u/%u\n", numFrames, numFrames);
+
+    // GOPs, matched with the ones of the previous output
+    unsigned int length = pConfig->pictControl.encIDRPeriod;
+    if (length == 0)
+        length = INCR_GOP_SECONDS * info->fps_numerator / info->fps_denominator;
+    if (length < 2)
+        length = 2;
+    int numGops = incrPlan(hashes, numFrames, length, gops);
+
+    IncrIndexHeader header = {INCR_MAGIC, INCR_VERSION, (unsigned)info->width, (unsigned)info->height,
+                              incrConfigHash(pConfig, format->backend->name), 0, 0, 0, 0};
+    IncrIndexHeader previous;
+    IncrIndexGop *previousGops = NULL;
+    uint64 *previousHashes = NULL;
+    HANDLE previousOutput = INVALID_HANDLE_VALUE;
+    if (incrLoadIndex(indexFile, &previous, &previousGops, &previousHashes) &&
+            previous.configHash == header.configHash && previous.width == header.width &&
+            previous.height == header.height)
+        previousOutput = CreateFile(outFile, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                                    FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (previousOutput != INVALID_HANDLE_VALUE && !incrCheckIndex(previousOutput, &previous, previousGops))
+    {
+        fprintf(stderr, "The index %s does not match %s, every GOP is encoded\n", indexFile, outFile);
+        CloseHandle(previousOutput);
+        previousOutput = INVALID_HANDLE_VALUE;
+    }
+
+    unsigned int reusedFrames = 0;
+    if (previousOutput != INVALID_HANDLE_VALUE)
+    {
+        // the frame hashes of each GOP follow the previous ones
+        uint64 **gopHashes = (uint64**) malloc(previous.numGops * sizeof(uint64*) + 1);
+        IncrIndexGop *sorted = (IncrIndexGop*) malloc(previous.numGops * sizeof(IncrIndexGop) + 1);
+        unsigned int position = 0;
+        for (unsigned int i = 0; gopHashes && sorted && i < previous.numGops; i++)
+        {
+            previousGops[i].number = i;
+            gopHashes[i] = previousHashes + position;
+            position += previousGops[i].frames;
+        }
+        if (gopHashes && sorted)
+        {
+            memcpy(sorted, previousGops, previous.numGops * sizeof(IncrIndexGop));
+            qsort(sorted, previous.numGops, sizeof(IncrIndexGop), incrCompareGops);
+        }
+
+        for (int g = 0; gopHashes && sorted && g < numGops; g++)
+        {
+            IncrIndexGop key = gops[g].index;
+            IncrIndexGop *found = (IncrIndexGop*) bsearch(&key, sorted, previous.numGops,
+                                                          sizeof(IncrIndexGop), incrCompareGops);
+            if (found == NULL || found->frames != key.frames ||
+                    memcmp(gopHashes[found->number], hashes + key.first, key.frames * sizeof(uint64)) != 0)
+                continue;
+            gops[g].previous = found->number;
+            reusedFrames += key.frames;
+        }
+        free(sorted);
+        free(gopHashes);
+    }
+
+    // Runs of GOPs to encode, split so every session gets several
+    unsigned int numSessions = numDevices * sessionsPerDevice;
+    if (numSessions > CHUNK_MAX_SESSIONS)
+        numSessions = CHUNK_MAX_SESSIONS;
+    unsigned int encodeFrames = numFrames - reusedFrames;
+    unsigned int runLength = encodeFrames / (numSessions * CHUNK_SEGMENTS_PER_SESSION) + 1;
+    unsigned int minLength = CHUNK_MIN_SECONDS * info->fps_numerator / info->fps_denominator;
+    if (runLength < minLength)
+        runLength = minLength;
+
+    IncrJob job;
+    memset(&job, 0, sizeof(IncrJob));
+    job.format = *format;
+    job.pConfig = pConfig;
+    job.tempFile = tempFile;
+    job.gops = gops;
+    job.runs = (IncrRun*) calloc(numGops + 1, sizeof(IncrRun));
+    for (int g = 0; job.runs && g < numGops; g++)
+    {
+        if (gops[g].previous >= 0)
+            continue;
+        IncrRun *run = job.numRuns ? &job.runs[job.numRuns - 1] : NULL;
+        if (run == NULL || run->endGop != g ||
+                gops[g].index.first - gops[run->firstGop].index.first >= runLength)
+        {
+            run = &job.runs[job.numRuns++];
+            run->firstGop = g;
+        }
+        run->endGop = g + 1;
+    }
+
+    fprintf(stderr, "Incremental %d GOPs, %u of %u frames reused, %d runs to encode\n",
+            numGops, reusedFrames, numFrames, job.numRuns);
+
+    BYTE *buffer = (BYTE*) malloc(INCR_COPY_SIZE);
+    FILE *fw = job.runs && buffer ? fopen(tempFile, "wb") : NULL;
+    if (fw == NULL)
+    {
+        printf("Error opening the output file %s\n", tempFile);
+        job.failed = 1;
+    }
+
+    if (numSessions > (unsigned)job.numRuns)
+        numSessions = job.numRuns;
+    IncrWorker workers[CHUNK_MAX_SESSIONS];
+    HANDLE threads[CHUNK_MAX_SESSIONS];
+    for (unsigned int i = 0; fw && i < numSessions; i++)
+    {
+        workers[i].job = &job;
+        workers[i].device = &devices[i % numDevices];
+        threads[i] = CreateThread(NULL, 0, incrWorkerThread, &workers[i], 0, NULL);
+    }
+    if (fw == NULL)
+        numSessions = 0;
+
+    // Write the GOPs in order, copied or encoded
+    uint64 offset = 0;
+    unsigned int written = 0;
+    bool status = fw != NULL;
+    int r = 0;
+    for (int g = 0; status && g < numGops; g++)
+    {
+        IncrGop *gop = &gops[g];
+        if (gop->previous >= 0)
+        {
+            IncrIndexGop *source = &previousGops[gop->previous];
+            status = incrCopy(previousOutput, source->offset, source->size, fw, buffer);
+            gop->index.size = source->size;
+        }
+        else
+        {
+            IncrRun *run = &job.runs[r];
+            while (run->done == 0)
+            {
+                *progress = written + job.framesDone;
+                if (GetAsyncKeyState(VK_F8))
+                    InterlockedExchange(&job.stop, 1);
+                Sleep(50);
+            }
+            if (run->done > 0 && g == run->firstGop)
+                rewind(run->file);
+            status = run->done > 0 && incrCopyRun(run, gop->index.size, fw, buffer);
+            if (g + 1 == run->endGop)
+            {
+                incrCloseRun(run);
+                r++;
+            }
+        }
+        gop->index.offset = offset;
+        offset += gop->index.size;
+        if (gop->previous >= 0)
+            written += gop->index.frames;
+        *progress = written + job.framesDone;
+    }
+    if (!status)
+        InterlockedExchange(&job.stop, 1);
+
+    if (numSessions > 0)
+        WaitForMultipleObjects(numSessions, threads, TRUE, INFINITE);
+    for (unsigned int i = 0; i < numSessions; i++)
+        CloseHandle(threads[i]);
+    if (job.failed)
+        status = false;
+
+    if (previousOutput != INVALID_HANDLE_VALUE)
+        CloseHandle(previousOutput);
+    if (fw && fclose(fw) != 0)
+        status = false;
+
+    // The previous output is only replaced by a complete one, its index goes first,
+    // tied to the size & write time of the new output
+    header.numGops = numGops;
+    header.numFrames = numFrames;
+    if (status)
+    {
+        HANDLE result = CreateFile(tempFile, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                                   FILE_ATTRIBUTE_NORMAL, NULL);
+        status = result != INVALID_HANDLE_VALUE &&
+                 incrFileStamp(result, &header.outputSize, &header.outputTime);
+        if (result != INVALID_HANDLE_VALUE)
+            CloseHandle(result);
+    }
+    if (status)
+    {
+        remove(indexFile);
+        status = MoveFileEx(tempFile, outFile, MOVEFILE_REPLACE_EXISTING) &&
+                 incrWriteIndex(indexFile, &header, gops, hashes);
+        if (!status)
+            fprintf(stderr, "Error replacing %s\n", outFile);
+    }
+    else
+    {
+        remove(tempFile);
+        fprintf(stderr, "\nStopped, %s was left as it was\n", outFile);
+    }
+
+    for (int i = 0; job.runs && i < job.numRuns; i++)
+        incrCloseRun(&job.runs[i]);
+    free(job.runs);
+    free(buffer);
+    free(gops);
+    free(hashes);
+    free(previousGops);
+    free(previousHashes);
+    return status;
+}
+
+#endif
@@ -0,0 +1,199 @@
+/*******************************************************************************
+* This file is part of AvsVCEh264.
+* Contains the keyframe list: frames that must be IDRs with SPS/PPS, read from
+* a file given with -k or from the [keyframes] section of the config file.
+*
+* Copyright (C) 2013 David Gonzlez Garca <davidgg666@gmail.com>
+*******************************************************************************/
+#ifndef KEYFRAMES_H
+#define KEYFRAMES_H
+
+#include <stdlib.h>
+#include <string.h>
+#include "ini.h"
+
+#define KEYFRAME_NONE   0xFFFFFFFF  // after the last keyframe
+
+typedef struct KeyframeList
+{
+    unsigned int *frames;       // sorted, without duplicates
+    unsigned int count;
+    unsigned int capacity;
+} KeyframeList;
+
+// Keyframes of the encode
+KeyframeList keyframes = {NULL, 0, 0};
+
+
+// Adds a frame, keyframeLoad sorts them
+void keyframeAdd(KeyframeList *list, unsigned int frame)
+{
+    if (list->count == list->capacity)
+    {
+        list->capacity = list->capacity ? list->capacity * 2 : 64;
+        list->frames = (unsigned int*) realloc(list->frames, list->capacity * sizeof(unsigned int));
+    }
+    list->frames[list->count++] = frame;
+}
+
+
+// Separator of the frame numbers
+inline bool keyframeSeparator(char c)
+{
+    return c == ' ' || c == '\t' || c == ',' || c == '\r' || c == '\n';
+}
+
+
+/*******************************************************************************
+ *  @fn     keyframeParse
+ *  @brief  Adds the frame numbers of a text: unsigned decimal numbers separated
+ *          by spaces or commas, up to the end or a # or ; comment
+ *  @param[in/out] list : Keyframes
+ *  @param[in] text     : Text
+ *  @return bool : false if the text has anything else, like -5, 1.5 or
+ *                 00:01:30; the numbers before it are added.
+ ******************************************************************************/
+bool keyframeParse(KeyframeList *list, const char *text)
+{
+    while (*text && *text != '#' && *text != ';')
+    {
+        if (keyframeSeparator(*text))
+        {
+            text++;
+            continue;
+        }
+
+        unsigned int frame = 0;
+        const char *start = text;
+        for (; *text >= '0' && *text <= '9'; text++)
+        {
+            if (frame > (KEYFRAME_NONE - 1 - (*text - '0')) / 10)
+                return false;
+            frame = frame * 10 + (*text - '0');
+        }
+        if (text == start || (*text && *text != '#' && *text != ';' && !keyframeSeparator(*text)))
+            return false;
+        keyframeAdd(list, frame);
+    }
+    return true;
+}
+
+
+// [keyframes] section being read, the other lines of the file are not checked here
+typedef struct KeyframeSection
+{
+    KeyframeList    *list;
+    bool            invalid;
+} KeyframeSection;
+
+static int keyframeHandler(void* user, const char* section, const char* name, const char* value)
+{
+    KeyframeSection *pSection = (KeyframeSection*)user;
+    if (strcmp(section, "keyframes") != 0 || strcmp(name, "frames") != 0)
+        return 1;
+    if (keyframeParse(pSection->list, value))
+        return 1;
+    pSection->invalid = true;
+    return 0;
+}
+
+
+static int keyframeCompare(const void *a, const void *b)
+{
+    unsigned int x = *(const unsigned int*)a, y = *(const unsigned int*)b;
+    return x < y ? -1 : x > y;
+}
+
+
+// A line read by fgets ends with its newline, or the file ends; a longer line was split
+inline bool keyframeLineComplete(const char *line, FILE *fr)
+{
+    size_t length = strlen(line);
+    return (length && line[length - 1] == '\n') || feof(fr);
+}
+
+
+/*******************************************************************************
+ *  @fn     keyframeLoad
+ *  @brief  Reads the keyframes of a list file, one or more frame numbers per
+ *          line, and of the [keyframes] section of the config file:
+ *          frames = 0 1500 3000, continued on the next lines if indented.
+ *          Any other token fails with the number of its line.
+ *  @param[out] list      : Keyframes, sorted
+ *  @param[in] fileName   : Keyframe list file or NULL
+ *  @param[in] configFile : User configuration file name or NULL
+ *  @param[in] numFrames  : Frames of the clip, later keyframes are dropped
+ *  @return bool : true if successful; otherwise false.
+ ******************************************************************************/
+bool keyframeLoad(KeyframeList *list, char *fileName, char *configFile, unsigned int numFrames)
+{
+    if (fileName)
+    {
+        FILE *fr = fopen(fileName, "r");
+        if (fr == NULL)
+        {
+            fprintf(stderr, "Error opening the keyframe list %s\n", fileName);
+            return false;
+        }
+        char line[1024];
+        int lineNumber = 0;
+        while (fgets(line, sizeof(line), fr))
+        {
+            lineNumber++;
+            if (!keyframeLineComplete(line, fr))
+            {
+                fprintf(stderr, "Line %d of the keyframe list %s is too long\n", lineNumber, fileName);
+                fclose(fr);
+                return false;
+            }
+            if (!keyframeParse(list, line))
+            {
+                fprintf(stderr, "Invalid frame number in line %d of the keyframe list %s\n", lineNumber, fileName);
+                fclose(fr);
+                return false;
+            }
+        }
+        fclose(fr);
+    }
+    if (configFile)
+    {
+        KeyframeSection section = {list, false};
+        int line = ini_parse(configFile, keyframeHandler, &section);
+        if (section.invalid)
+        {
+            fprintf(stderr, "Invalid frame number in line %d of %s\n", line, configFile);
+            return false;
+        }
+    }
+    if (list->count == 0)
+        return true;
+
+    // the first frame is always one, so SPS/PPS start the stream
+    keyframeAdd(list, 0);
+    qsort(list->frames, list->count, sizeof(unsigned int), keyframeCompare);
+
+    unsigned int count = 0;
+    for (unsigned int i = 0; i < list->count && list->frames[i] < numFrames; i++)
+    {
+        if (count == 0 || list->frames[i] != list->frames[count - 1])
+            list->frames[count++] = list->frames[i];
+    }
+    list->count = count;
+    return true;
+}
+
+
+// Next keyframe from the position of a reader on, KEYFRAME_NONE after the last one
+inline unsigned int keyframeNext(KeyframeList *list, unsigned int *cursor)
+{
+    return *cursor < list->count ? list->frames[(*cursor)++] : KEYFRAME_NONE;
+}
+
+
+void keyframeFree(KeyframeList *list)
+{
+    free(list->frames);
+    memset(list, 0, sizeof(KeyframeList));
+}
+
+#endif
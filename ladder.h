@@ -0,0 +1,534 @@
+/*******************************************************************************
+* This file is part of AvsVCEh264.
+* Contains the ladder mode: the clip is decoded once and every frame is scaled
+* and encoded into several renditions at the same time, each one on its own
+* session with its own configuration and the IDRs on the same frames.
+* The sweep mode encodes the clip with several configurations the same way.
+*
+* Copyright (C) 2013 David Gonzlez Garca <davidgg666@gmail.com>
+*******************************************************************************/
+#ifndef LADDER_H
+#define LADDER_H
+
+#define LADDER_MAX_RENDITIONS   16
+#define LADDER_PREFETCH         8   // frames decoded ahead of the slowest rendition
+#define LADDER_IDR_SECONDS      2   // IDR period when the first configuration has none
+
+// Decoded frame shared by the renditions, freed by the last one that uses it
+typedef struct LadderFrame
+{
+    BYTE            *data;          // NV12 in the format of the clip
+    volatile LONG   refs;
+} LadderFrame;
+
+struct LadderJob;
+
+typedef struct LadderRendition
+{
+    struct LadderJob *job;
+    char            name[64];       // size or configuration, for the summary
+    unsigned int    width;
+    unsigned int    height;
+    char            output[255];
+    char            configFile[255];
+    ScaleFilter     filter;
+    OvConfigCtrl    config;
+    EncoderSession  session;
+    EncoderDevice   *device;
+    Scaler          scaler;
+    bool            scaled;         // the size differs from the clip
+    BYTE            *surface;       // scaled frame
+    FILE            *fw;
+    Buffer          *frames;        // LadderFrame* to encode
+    volatile LONG   encoded;
+    uint64          bytes;
+    double          startUs;
+    double          endUs;
+    bool            ready;          // session created
+    bool            writeFailed;    // the output is incomplete, no statistics are shown
+} LadderRendition;
+
+typedef struct LadderJob
+{
+    EncoderSession  format;         // frame format of the clip
+    LadderRendition renditions[LADDER_MAX_RENDITIONS];
+    int             numRenditions;
+    bool            alignIdr;       // forced IDRs on the same frames, otherwise the ones of each configuration
+    unsigned int    idrPeriod;      // frames, the one of the first rendition for all of them
+    volatile LONG   stop;           // user request or failure
+    volatile LONG   failed;
+} LadderJob;
+
+Timer ladderClock;
+
+
+// Releases a reference to a frame
+void ladderFrameRelease(LadderFrame *frame)
+{
+    if (InterlockedDecrement(&frame->refs) == 0)
+    {
+        free(frame->data);
+        free(frame);
+    }
+}
+
+
+/*******************************************************************************
+ *  @fn     ladderLoad
+ *  @brief  Reads the renditions of the ladder, one per line:
+ *          width height output.264 config.ini [bilinear|bicubic|lanczos]
+ *  @param[in] fileName : Ladder file
+ *  @param[out] job     : Job, gets the renditions
+ *  @return bool : true if successful; otherwise false.
+ ******************************************************************************/
+bool ladderLoad(char *fileName, LadderJob *job)
+{
+    FILE *fr = fopen(fileName, "r");
+    if (fr == NULL)
+    {
+        fprintf(stderr, "Error opening the ladder %s\n", fileName);
+        return false;
+    }
+
+    char line[1024], width[255], height[255], filter[255];
+    for (int lineNum = 1; fgets(line, sizeof(line), fr); lineNum++)
+    {
+        line[strcspn(line, "\r\n")] = 0;
+
+        char *p = line;
+        if (!schedNextToken(&p, width))
+            continue;
+
+        if (job->numRenditions == LADDER_MAX_RENDITIONS)
+        {
+            fprintf(stderr, "Too many renditions, at most %d\n", LADDER_MAX_RENDITIONS);
+            break;
+        }
+
+        LadderRendition *r = &job->renditions[job->numRenditions];
+        memset(r, 0, sizeof(LadderRendition));
+        r->filter = SCALE_BICUBIC;
+
+        if (!schedNextToken(&p, height) || !schedNextToken(&p, r->output) || !schedNextToken(&p, r->configFile))
+        {
+            fprintf(stderr, "%s:%d: expected width height output config [filter]\n", fileName, lineNum);
+            fclose(fr);
+            return false;
+        }
+        r->width = atoi(width);
+        r->height = atoi(height);
+        if (r->width < 16 || r->height < 16 || (r->width | r->height) & 1)
+        {
+            fprintf(stderr, "%s:%d: the size must be even and at least 16x16\n", fileName, lineNum);
+            fclose(fr);
+            return false;
+        }
+
+        if (schedNextToken(&p, filter))
+        {
+            if (strcmp(filter, "bilinear") == 0)
+                r->filter = SCALE_BILINEAR;
+            else if (strcmp(filter, "lanczos") == 0)
+                r->filter = SCALE_LANCZOS;
+            else if (strcmp(filter, "bicubic") != 0)
+            {
+                fprintf(stderr, "%s:%d: unknown filter %s\n", fileName, lineNum, filter);
+                fclose(fr);
+                return false;
+            }
+        }
+
+        r->job = job;
+        sprintf(r->name, "%ux%u", r->width, r->height);
+        job->numRenditions++;
+    }
+
+    fclose(fr);
+    if (job->numRenditions == 0)
+        fprintf(stderr, "The ladder %s has no renditions\n", fileName);
+    return job->numRenditions > 0;
+}
+
+
+/*******************************************************************************
+ *  @fn     ladderOpen
+ *  @brief  Opens the configuration, the output, the scaler & the session of a
+ *          rendition
+ *  @param[in/out] r    : Rendition
+ *  @param[in] vi       : Video info of the clip
+ *  @param[in] backend  : Encoder backend
+ *  @return bool : true if successful; otherwise false.
+ ******************************************************************************/
+bool ladderOpen(LadderRendition *r, const AVS_VideoInfo *vi, const EncoderBackend *backend)
+{
+    LadderJob *job = r->job;
+
+    memset(&r->config, 0, sizeof(OvConfigCtrl));
+    if (!loadConfig(&r->config, r->configFile))
+        return false;
+
+    // the frame rate of the clip, the cropping of the rendition
+    AVS_VideoInfo rvi = *vi;
+    rvi.width = r->width;
+    rvi.height = r->height;
+    avsSetConfig(&r->config, &rvi);
+
+    // the IDR period of the first rendition, for all of them: the IDRs stay aligned
+    if (job->alignIdr && job->idrPeriod == 0)
+    {
+        job->idrPeriod = r->config.pictControl.encIDRPeriod;
+        if (job->idrPeriod == 0)
+            job->idrPeriod = (LADDER_IDR_SECONDS * vi->fps_numerator + vi->fps_denominator / 2) / vi->fps_denominator;
+        if (job->idrPeriod == 0)
+            job->idrPeriod = 1;
+    }
+    if (job->alignIdr)
+    {
+        if (r->config.pictControl.encIDRPeriod && r->config.pictControl.encIDRPeriod != job->idrPeriod)
+            fprintf(stderr, "%s: encIDRPeriod %u replaced by the %u frames of the first rendition\n",
+                    r->configFile, r->config.pictControl.encIDRPeriod, job->idrPeriod);
+        r->config.pictControl.encIDRPeriod = job->idrPeriod;
+    }
+
+    setSessionFormat(&r->session, r->width, r->height);
+    r->session.backend = backend;
+
+    r->scaled = r->width != (unsigned)vi->width || r->height != (unsigned)vi->height;
+    if (r->scaled)
+    {
+        if (!scalerCreate(&r->scaler, r->filter, vi->width, vi->height, r->width, r->height))
+        {
+            fprintf(stderr, "Can't scale %dx%d to %ux%u\n", vi->width, vi->height, r->width, r->height);
+            return false;
+        }
+        r->surface = (BYTE*) malloc(r->session.frameSize);
+    }
+
+    r->fw = fopen(r->output, "wb");
+    if (r->fw == NULL)
+    {
+        printf("Error opening the output file %s\n", r->output);
+        return false;
+    }
+
+    r->ready = backend->createSession(&r->session, r->device, &r->config);
+    if (r->ready && !backend->sendConfig(&r->session, &r->config, ENC_CONFIG_ALL))
+    {
+        fprintf(stderr, "OVEncodeSendConfig returned error\n");
+        return false;
+    }
+    return r->ready;
+}
+
+
+/*******************************************************************************
+ *  @fn     ladderDecodeThread
+ *  @brief  Decodes every frame once and hands it to all the renditions,
+ *          staying at most LADDER_PREFETCH frames ahead of the slowest one
+ ******************************************************************************/
+DWORD WINAPI ladderDecodeThread(LPVOID param)
+{
+    LadderJob *job = (LadderJob*)param;
+
+    for (int f = 0; f < info->num_frames && !job->stop; f++)
+    {
+        for (int i = 0; i < job->numRenditions; i++)
+        {
+            Buffer *frames = job->renditions[i].frames;
+            while ((BYTE)(frames->write - frames->read) >= LADDER_PREFETCH && !job->stop)
+                Sleep(1);
+        }
+
+        LadderFrame *frame = (LadderFrame*) malloc(sizeof(LadderFrame));
+        frame->data = (BYTE*) malloc(job->format.frameSize);
+        frame->refs = job->numRenditions;
+        avsGetFrameNV12(f, frame->data, job->format.pitch);
+
+        for (int i = 0; i < job->numRenditions; i++)
+            BufferWrite(job->renditions[i].frames, (BufferType)frame);
+    }
+    return 0;
+}
+
+
+/*******************************************************************************
+ *  @fn     ladderEncodeThread
+ *  @brief  Scales & encodes the frames of one rendition. In a ladder frame n
+ *          is an IDR, with SPS/PPS, when it is a multiple of the IDR period.
+ ******************************************************************************/
+DWORD WINAPI ladderEncodeThread(LPVOID param)
+{
+    LadderRendition *r = (LadderRendition*)param;
+    LadderJob *job = r->job;
+    const EncoderBackend *encoder = r->session.backend;
+
+	OVE_OUTPUT_DESCRIPTION taskDescriptionList = {sizeof(OVE_OUTPUT_DESCRIPTION), 0, OVE_TASK_STATUS_NONE, 0, 0};
+
+    OVE_ENCODE_PARAMETERS_H264 pictureParameter;
+	memset(&pictureParameter, 0, sizeof(OVE_ENCODE_PARAMETERS_H264));
+	pictureParameter.size = sizeof(OVE_ENCODE_PARAMETERS_H264);
+	pictureParameter.pictureStructure = OVE_PICTURE_STRUCTURE_H264_FRAME;
+	pictureParameter.forceRefreshMap = (OVE_BOOL)true;
+
+    // the keyframes of the list are IDRs in every rendition
+    unsigned int keyframeCursor = 0;
+    unsigned int nextKeyframe = keyframeNext(&keyframes, &keyframeCursor);
+
+    for (unsigned int f = 0; f < (unsigned)info->num_frames && !job->stop; f++)
+    {
+        while (BufferIsEmpty(r->frames) && !job->stop)
+            Sleep(1);
+
+        BufferType pBuf = 0;
+        if (!BufferRead(r->frames, &pBuf))
+            break;
+        LadderFrame *frame = (LadderFrame*)pBuf;
+
+        const BYTE *input = frame->data;
+        if (r->scaled)
+        {
+            scaleNV12(&r->scaler, frame->data, job->format.pitch, r->surface, r->session.pitch);
+            input = r->surface;
+        }
+
+        bool idr = job->alignIdr && f % job->idrPeriod == 0;
+        if (f == nextKeyframe)
+        {
+            idr = true;
+            nextKeyframe = keyframeNext(&keyframes, &keyframeCursor);
+        }
+        pictureParameter.insertSPS = (OVE_BOOL)(idr || f == 0);
+        pictureParameter.forcePicType = idr ? OVE_PICTURE_TYPE_H264_IDR : OVE_PICTURE_TYPE_H264_NONE;
+
+        if (f == 0)
+            r->startUs = ladderClock.getInMicroSec();
+
+        unsigned int iTaskID;
+        bool ok = encoder->submit(&r->session, input, &pictureParameter, &iTaskID);
+        ladderFrameRelease(frame);
+        ok = ok && encoder->query(&r->session, &taskDescriptionList);
+        if (!ok)
+        {
+            fprintf(stderr, "\n%s: encoding failed at frame %u\n", r->output, f);
+            InterlockedExchange(&job->failed, 1);
+            InterlockedExchange(&job->stop, 1);
+            break;
+        }
+
+        bool written = true;
+        if (taskDescriptionList.status == OVE_TASK_STATUS_COMPLETE &&
+                taskDescriptionList.size_of_bitstream_data > 0)
+        {
+            written = fwrite(taskDescriptionList.bitstream_data, 1, taskDescriptionList.size_of_bitstream_data, r->fw) ==
+                      taskDescriptionList.size_of_bitstream_data;
+            if (written)
+                r->bytes += taskDescriptionList.size_of_bitstream_data;
+        }
+        releaseQueried(&r->session, &taskDescriptionList);
+        if (!written)
+        {
+            fprintf(stderr, "\n%s: cannot write the output at frame %u\n", r->output, f);
+            r->writeFailed = true;
+            InterlockedExchange(&job->failed, 1);
+            InterlockedExchange(&job->stop, 1);
+            break;
+        }
+        InterlockedIncrement(&r->encoded);
+        r->endUs = ladderClock.getInMicroSec();
+    }
+    return 0;
+}
+
+
+/*******************************************************************************
+ *  @fn     ladderRun
+ *  @brief  Opens the renditions of a job, encodes the clip in the globals into
+ *          them & shows the summary
+ *  @param[in] job        : Job, with the renditions
+ *  @param[in] format     : Frame format & backend of the clip
+ *  @param[in] devices    : Devices, with their contexts created
+ *  @param[in] numDevices : Number of devices, the renditions are spread over them
+ *  @param[out] progress  : Frames encoded by every rendition
+ *  @return bool : true if successful; otherwise false.
+ ******************************************************************************/
+bool ladderRun(LadderJob *job, EncoderSession *format, EncoderDevice *devices, unsigned int numDevices,
+               unsigned int *progress)
+{
+    job->format = *format;
+
+    bool status = true;
+    for (int i = 0; status && i < job->numRenditions; i++)
+    {
+        LadderRendition *r = &job->renditions[i];
+        r->device = &devices[i % numDevices];
+        r->frames = newBuffer();
+        status = ladderOpen(r, info, format->backend);
+        if (status)
+            fprintf(stderr, "Rendition %-2d %-12s %-8s %s\n", i + 1, r->name,
+                    !r->scaled ? "source" : r->filter == SCALE_BILINEAR ? "bilinear" :
+                    r->filter == SCALE_BICUBIC ? "bicubic" : "lanczos", r->output);
+    }
+
+    HANDLE threads[LADDER_MAX_RENDITIONS + 1];
+    int numThreads = 0;
+    if (status)
+    {
+        if (job->alignIdr)
+            fprintf(stderr, "Ladder      %d renditions, IDR every %u frames\n", job->numRenditions, job->idrPeriod);
+        ladderClock.start();
+        threads[numThreads++] = CreateThread(NULL, 0, ladderDecodeThread, job, 0, NULL);
+        for (int i = 0; i < job->numRenditions; i++)
+            threads[numThreads++] = CreateThread(NULL, 0, ladderEncodeThread, &job->renditions[i], 0, NULL);
+    }
+
+    // The progress is the one of the slowest rendition
+    for (bool running = numThreads > 0; running; )
+    {
+        running = WaitForMultipleObjects(numThreads, threads, TRUE, 250) == WAIT_TIMEOUT;
+        if (GetAsyncKeyState(VK_F8))
+            InterlockedExchange(&job->stop, 1);
+
+        unsigned int slowest = info->num_frames;
+        for (int i = 0; i < job->numRenditions; i++)
+        {
+            if ((unsigned)job->renditions[i].encoded < slowest)
+                slowest = job->renditions[i].encoded;
+        }
+        *progress = slowest;
+    }
+    for (int i = 0; i < numThreads; i++)
+        CloseHandle(threads[i]);
+    if (job->failed)
+        status = false;
+
+    // Speed & size of each rendition
+    if (numThreads)
+        fprintf(stderr, "\n");
+    double fps = info->fps_numerator / (double)info->fps_denominator;
+    for (int i = 0; i < job->numRenditions; i++)
+    {
+        LadderRendition *r = &job->renditions[i];
+        if (r->fw && fclose(r->fw) != 0)
+        {
+            fprintf(stderr, "%s: cannot write the output\n", r->output);
+            r->writeFailed = true;
+        }
+        r->fw = NULL;
+        if (numThreads && r->writeFailed)
+        {
+            fprintf(stderr, "Rendition %-2d %-12s write failed, %s is incomplete\n", i + 1, r->name, r->output);
+            status = false;
+        }
+        else if (numThreads)
+        {
+            double seconds = (r->endUs - r->startUs) / 1000000.0;
+            fprintf(stderr, "Rendition %-2d %-12s %6d frames %8.2f fps %12.0f bytes %10.2f kbps  %s%s\n",
+                    i + 1, r->name, (int)r->encoded, seconds > 0 ? r->encoded / seconds : 0.0, (double)r->bytes,
+                    r->encoded ? r->bytes * 8 * fps / r->encoded / 1000 : 0.0,
+                    r->encoded < info->num_frames ? "(incomplete) " : "", r->output);
+            if (r->encoded < info->num_frames)
+                status = false;
+        }
+
+        // Free the rendition resources, the frames left are released
+        BufferType pBuf;
+        while (r->frames && BufferRead(r->frames, &pBuf))
+            ladderFrameRelease((LadderFrame*)pBuf);
+        free(r->frames);
+        if (r->ready)
+            format->backend->releaseSession(&r->session);
+        scalerDestroy(&r->scaler);
+        free(r->surface);
+    }
+
+    return status;
+}
+
+
+/*******************************************************************************
+ *  @fn     ladderEncodeProcess
+ *  @brief  Encodes the clip in the globals into the renditions of a ladder
+ *  @param[in] format     : Frame format & backend of the clip
+ *  @param[in] devices    : Devices, with their contexts created
+ *  @param[in] numDevices : Number of devices, the renditions are spread over them
+ *  @param[in] ladderFile : Ladder file
+ *  @param[out] progress  : Frames encoded by every rendition
+ *  @return bool : true if successful; otherwise false.
+ ******************************************************************************/
+bool ladderEncodeProcess(EncoderSession *format, EncoderDevice *devices, unsigned int numDevices,
+                         char *ladderFile, unsigned int *progress)
+{
+    LadderJob *job = new LadderJob;
+    memset(job, 0, sizeof(LadderJob));
+    job->alignIdr = true;
+
+    bool status = ladderLoad(ladderFile, job) &&
+                  ladderRun(job, format, devices, numDevices, progress);
+
+    delete job;
+    return status;
+}
+
+
+/*******************************************************************************
+ *  @fn     sweepEncodeProcess
+ *  @brief  Encodes the clip in the globals with several configurations at the
+ *          same time, output.264 with speed.ini is written to output.speed.264
+ *  @param[in] format     : Frame format & backend of the clip
+ *  @param[in] devices    : Devices, with their contexts created
+ *  @param[in] numDevices : Number of devices, the sessions are spread over them
+ *  @param[in] configs    : Configuration files
+ *  @param[in] numConfigs : Number of configuration files
+ *  @param[in] outFile    : Output file name, gets the name of each configuration
+ *  @param[out] progress  : Frames encoded with every configuration
+ *  @return bool : true if successful; otherwise false.
+ ******************************************************************************/
+bool sweepEncodeProcess(EncoderSession *format, EncoderDevice *devices, unsigned int numDevices,
+                        char **configs, int numConfigs, char *outFile, unsigned int *progress)
+{
+    LadderJob *job = new LadderJob;
+    memset(job, 0, sizeof(LadderJob));
+
+    // output name: the extension goes after the name of the configuration
+    const char *ext = strrchr(outFile, '.');
+    if (ext == NULL || strchr(ext, '\\') || strchr(ext, '/'))
+        ext = outFile + strlen(outFile);
+
+    for (int i = 0; i < numConfigs && i < LADDER_MAX_RENDITIONS; i++)
+    {
+        LadderRendition *r = &job->renditions[job->numRenditions++];
+        r->job = job;
+        r->width = info->width;
+        r->height = info->height;
+        strcpy(r->configFile, configs[i]);
+
+        const char *base = configs[i];
+        if (strrchr(base, '\\'))
+            base = strrchr(base, '\\') + 1;
+        if (strrchr(base, '/'))
+            base = strrchr(base, '/') + 1;
+        int len = strcspn(base, ".");
+        snprintf(r->name, sizeof(r->name), "%.*s", len, base);
+        snprintf(r->output, sizeof(r->output), "%.*s.%s%s", (int)(ext - outFile), outFile, r->name, ext);
+
+        // two configurations with the same name would write the same output
+        for (int j = 0; j < i; j++)
+        {
+            if (_stricmp(job->renditions[j].name, r->name) == 0)
+            {
+                fprintf(stderr, "%s and %s both give the output %s, rename one\n",
+                        job->renditions[j].configFile, r->configFile, r->output);
+                delete job;
+                return false;
+            }
+        }
+    }
+    fprintf(stderr, "Sweep       %d configurations\n", job->numRenditions);
+
+    bool status = ladderRun(job, format, devices, numDevices, progress);
+
+    delete job;
+    return status;
+}
+
+#endif
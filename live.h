@@ -0,0 +1,408 @@
+/*******************************************************************************
+* This file is part of AvsVCEh264.
+* Contains the live mode: the script is read at its frame rate, as a capture
+* would deliver it, into a queue of one or two frames. Frames that wait too
+* long are dropped instead of delaying the next ones, and the latency from the
+* capture of every frame to its output is measured. Every frame is written as
+* soon as it is encoded, as Annex-B or as a transport stream.
+*
+* Copyright (C) 2013 David Gonzlez Garca <davidgg666@gmail.com>
+*******************************************************************************/
+#ifndef LIVE_H
+#define LIVE_H
+
+#include <stdlib.h>
+#include <string.h>
+#include "ini.h"
+
+#define LIVE_MAX_QUEUE      2                   // frames waiting for the encoder
+#define LIVE_BUFFERS        (LIVE_MAX_QUEUE + 2) // + the one captured & the one encoded
+#define LIVE_BIN_US         100                 // latency histogram resolution
+#define LIVE_BINS           10000               // up to 1 s, the last bin takes the rest
+
+typedef struct LiveConfig
+{
+    unsigned int queueDepth;         // 1 or 2 frames
+    unsigned int deadlineMs;         // frames older than this are dropped, 0 = two frame intervals
+    unsigned int intraRefresh;       // encForceIntraRefresh instead of periodic IDRs, 0 = IDRs of the config
+    unsigned int intraRefreshPeriod; // frames to refresh the whole picture
+    unsigned int pace;               // read the script at its frame rate, 0 = as fast as it is decoded
+} LiveConfig;
+
+LiveConfig liveConfig = {1, 0, 2, 30, 1};
+
+typedef struct LiveSlot
+{
+    BYTE            *data;          // NV12 in the format of the session
+    unsigned int    frame;          // number in the script
+    double          captureUs;
+} LiveSlot;
+
+typedef struct LiveLatency
+{
+    unsigned int    bins[LIVE_BINS + 1];
+    unsigned int    count;
+    double          sumUs;
+    double          maxUs;
+} LiveLatency;
+
+typedef struct Live
+{
+    LiveConfig      config;
+    EncoderSession  *session;
+    CRITICAL_SECTION lock;
+    HANDLE          ready;          // a frame was queued or the capture ended
+    LiveSlot        queue[LIVE_MAX_QUEUE];
+    unsigned int    head;
+    unsigned int    count;
+    BYTE            *free[LIVE_BUFFERS];
+    unsigned int    numFree;
+    unsigned int    captured;
+    unsigned int    dropped;        // replaced in the queue by a newer frame
+    unsigned int    late;           // older than the deadline when dequeued
+    volatile LONG   stop;
+    volatile LONG   ended;          // no more frames from the capture
+} Live;
+
+Timer liveClock;
+
+
+static int liveHandler(void* user, const char* section, const char* name, const char* value)
+{
+    LiveConfig *pLive = (LiveConfig*)user;
+    unsigned int uVal = (unsigned int)atoi(value);
+
+    if (strcmp(section, "live") != 0)
+        return 1;
+
+    if (strcmp(name, "queueDepth") == 0)
+        pLive->queueDepth = uVal < 1 ? 1 : uVal > LIVE_MAX_QUEUE ? LIVE_MAX_QUEUE : uVal;
+    else if (strcmp(name, "deadlineMs") == 0)
+        pLive->deadlineMs = uVal;
+    else if (strcmp(name, "intraRefresh") == 0)
+        pLive->intraRefresh = uVal;
+    else if (strcmp(name, "intraRefreshPeriod") == 0)
+        pLive->intraRefreshPeriod = uVal;
+    else if (strcmp(name, "pace") == 0)
+        pLive->pace = uVal;
+
+    return 1;
+}
+
+
+// Reads the [live] section of the configuration file
+void liveInit(char *configFilename)
+{
+    ini_parse(configFilename, liveHandler, &liveConfig);
+}
+
+
+void liveLatencyAdd(LiveLatency *latency, double us)
+{
+    unsigned int bin = (unsigned int)(us / LIVE_BIN_US);
+    latency->bins[bin > LIVE_BINS ? LIVE_BINS : bin]++;
+    latency->count++;
+    latency->sumUs += us;
+    if (us > latency->maxUs)
+        latency->maxUs = us;
+}
+
+
+// Latency in ms below which percent % of the frames are, to the histogram resolution
+double liveLatencyPercentile(LiveLatency *latency, unsigned int percent)
+{
+    if (latency->count == 0)
+        return 0;
+
+    uint64 target = ((uint64)latency->count * percent + 99) / 100;
+    uint64 sum = 0;
+    for (unsigned int bin = 0; bin < LIVE_BINS; bin++)
+    {
+        sum += latency->bins[bin];
+        if (sum >= target)
+            return ((bin + 1) * LIVE_BIN_US < latency->maxUs ? (bin + 1) * LIVE_BIN_US : latency->maxUs) * 0.001;
+    }
+    return latency->maxUs * 0.001;
+}
+
+
+/*******************************************************************************
+ *  @fn     liveCaptureThread
+ *  @brief  Reads the frames of the script, at its frame rate when paced, and
+ *          queues them. A full queue drops its oldest frame, the capture is
+ *          never held by the encoder.
+ *  @param[in] param : Live
+ ******************************************************************************/
+DWORD WINAPI liveCaptureThread(LPVOID param)
+{
+    Live *live = (Live*)param;
+    double frameUs = 1000000.0 * info->fps_denominator / info->fps_numerator;
+
+    for (unsigned int f = 0; f < (unsigned)info->num_frames && !live->stop; f++)
+    {
+        if (live->config.pace)
+        {
+            double wait = f * frameUs - liveClock.getInMicroSec();
+            if (wait > 1000)
+                Sleep((DWORD)(wait / 1000));
+        }
+
+        EnterCriticalSection(&live->lock);
+        BYTE *data = live->free[--live->numFree];
+        LeaveCriticalSection(&live->lock);
+
+        avsGetFrameNV12(f, data, live->session->pitch);
+        double captureUs = live->config.pace ? f * frameUs : liveClock.getInMicroSec();
+        if (captureUs < liveClock.getInMicroSec() - frameUs)
+            captureUs = liveClock.getInMicroSec();   // the script is slower than real time
+
+        EnterCriticalSection(&live->lock);
+        if (live->count == live->config.queueDepth)
+        {
+            live->free[live->numFree++] = live->queue[live->head].data;
+            live->head = (live->head + 1) % LIVE_MAX_QUEUE;
+            live->count--;
+            live->dropped++;
+        }
+        LiveSlot *slot = &live->queue[(live->head + live->count) % LIVE_MAX_QUEUE];
+        slot->data = data;
+        slot->frame = f;
+        slot->captureUs = captureUs;
+        live->count++;
+        live->captured++;
+        LeaveCriticalSection(&live->lock);
+        SetEvent(live->ready);
+    }
+
+    InterlockedExchange(&live->ended, 1);
+    SetEvent(live->ready);
+    return 0;
+}
+
+
+// Takes the oldest queued frame
+bool livePop(Live *live, LiveSlot *slot)
+{
+    EnterCriticalSection(&live->lock);
+    bool found = live->count > 0;
+    if (found)
+    {
+        *slot = live->queue[live->head];
+        live->head = (live->head + 1) % LIVE_MAX_QUEUE;
+        live->count--;
+    }
+    LeaveCriticalSection(&live->lock);
+    return found;
+}
+
+
+void liveRelease(Live *live, BYTE *data)
+{
+    EnterCriticalSection(&live->lock);
+    live->free[live->numFree++] = data;
+    LeaveCriticalSection(&live->lock);
+}
+
+
+/*******************************************************************************
+ *  @fn     liveEncodeProcess
+ *  @brief  Encodes the script as a live source with the lowest latency: a
+ *          queue of queueDepth frames, task priority level 2, intra refresh
+ *          instead of periodic IDRs and frames dropped past their deadline.
+ *          The frame count of the script is only an upper limit, F8 stops it.
+ *  @param[in] session  : Encoder session, with the frame format filled
+ *  @param[in] device   : Device on which the session is created
+ *  @param[out] outFile : Output H.264 file, flushed after every frame
+ *  @param[in] pConfig  : OvConfigCtrl
+ *  @param[out] progress: Frames encoded
+ *  @return bool : true if successful; otherwise false.
+ ******************************************************************************/
+bool liveEncodeProcess(EncoderSession *session, EncoderDevice *device, char *outFile,
+                       OvConfigCtrl *pConfig, unsigned int *progress)
+{
+    const EncoderBackend *encoder = session->backend;
+
+    Live *live = (Live*)calloc(1, sizeof(Live));
+    LiveLatency *latency = (LiveLatency*)calloc(1, sizeof(LiveLatency));
+    live->config = liveConfig;
+    live->session = session;
+
+    double frameUs = 1000000.0 * info->fps_denominator / info->fps_numerator;
+    double deadlineUs = live->config.deadlineMs ? live->config.deadlineMs * 1000.0 : 2 * frameUs;
+
+    // nothing waits behind the frame, intra refresh spreads the cost of the IDRs
+    pConfig->priority = OVE_ENCODE_TASK_PRIORITY_LEVEL2;
+    if (live->config.intraRefresh)
+    {
+        pConfig->pictControl.encForceIntraRefresh = live->config.intraRefresh;
+        pConfig->pictControl.encIDRPeriod = 0;
+    }
+
+    bool status = encoder->createSession(session, device, pConfig) &&
+                  encoder->sendConfig(session, pConfig, ENC_CONFIG_ALL);
+    if (!status)
+    {
+        fprintf(stderr, "Creating the live session failed\n");
+        free(latency);
+        free(live);
+        return false;
+    }
+
+    OutputFile output;
+    if (!outputOpen(&output, outFile, 0, 0))
+    {
+        encoder->releaseSession(session);
+        free(latency);
+        free(live);
+        return false;
+    }
+    TsMuxer ts;
+    bool tsOutput = tsIsOutput(outFile);
+    if (tsOutput)
+        tsOpen(&ts, info);
+    NalRewriter rewriter;
+    rewriteOpen(&rewriter, !tsOutput);
+    uint64 outputSize = 0;
+
+    fprintf(stderr, "Live        queue %u, deadline %.1f ms, %s\n", live->config.queueDepth,
+            deadlineUs * 0.001, live->config.intraRefresh ? "intra refresh" : "IDRs of the config");
+
+	OVE_OUTPUT_DESCRIPTION taskDescriptionList = {sizeof(OVE_OUTPUT_DESCRIPTION), 0, OVE_TASK_STATUS_NONE, 0, 0};
+
+    OVE_ENCODE_PARAMETERS_H264 pictureParameter;
+	memset(&pictureParameter, 0, sizeof(OVE_ENCODE_PARAMETERS_H264));
+	pictureParameter.size = sizeof(OVE_ENCODE_PARAMETERS_H264);
+	pictureParameter.pictureStructure = OVE_PICTURE_STRUCTURE_H264_FRAME;
+	pictureParameter.forceRefreshMap = (OVE_BOOL)true;
+	pictureParameter.forceIMBPeriod = live->config.intraRefresh ? live->config.intraRefreshPeriod : 0;
+
+    InitializeCriticalSection(&live->lock);
+    live->ready = CreateEvent(NULL, FALSE, FALSE, NULL);
+    for (int i = 0; i < LIVE_BUFFERS; i++)
+        live->free[live->numFree++] = (BYTE*)malloc(session->frameSize);
+
+    liveClock.start();
+    HANDLE hCapture = CreateThread(NULL, 0, liveCaptureThread, live, 0, NULL);
+    SetThreadPriority(hCapture, THREAD_PRIORITY_ABOVE_NORMAL);
+
+    unsigned int encoded = 0, lastEncoded = 0;
+    double lastShown = 0, lastLatencyUs = 0;
+    while (true)
+    {
+        if (GetAsyncKeyState(VK_F8))
+            break;
+
+        LiveSlot slot;
+        if (!livePop(live, &slot))
+        {
+            if (live->ended && live->count == 0)
+                break;
+            WaitForSingleObject(live->ready, 100);
+            continue;
+        }
+
+        // the encoder fell behind, the next frames are more useful
+        if (encoded > 0 && liveClock.getInMicroSec() - slot.captureUs > deadlineUs)
+        {
+            liveRelease(live, slot.data);
+            live->late++;
+            continue;
+        }
+
+        // only the first picture is forced, then the config, the intra refresh or the control pipe
+        bool idr = encoded == 0;
+        if (control.pending && !controlApply(&control, session, pConfig, slot.frame, &idr))
+        {
+            liveRelease(live, slot.data);
+            status = false;
+            break;
+        }
+        pictureParameter.insertSPS = (OVE_BOOL)idr;
+        pictureParameter.forcePicType = idr ? OVE_PICTURE_TYPE_H264_IDR : OVE_PICTURE_TYPE_H264_NONE;
+
+        unsigned int iTaskID;
+        status = encoder->submit(session, slot.data, &pictureParameter, &iTaskID);
+        liveRelease(live, slot.data);
+        status = status && encoder->query(session, &taskDescriptionList);
+        if (!status)
+        {
+            fprintf(stderr, "\nEncoding failed at frame %u\n", slot.frame);
+            break;
+        }
+
+		if (taskDescriptionList.status == OVE_TASK_STATUS_COMPLETE &&
+				taskDescriptionList.size_of_bitstream_data > 0)
+		{
+			BYTE *data = (BYTE*)taskDescriptionList.bitstream_data;
+			unsigned int size = taskDescriptionList.size_of_bitstream_data;
+			if (tsOutput)
+			{
+				tsMuxFrame(&ts, data, size, slot.frame);
+				status = outputWrite(&output, ts.data, ts.size);
+			}
+			else
+			{
+				rewriteFrame(&rewriter, data, size);
+				for (unsigned int i = 0; i < rewriter.count && status; i++)
+					status = outputWrite(&output, rewriter.fragments[i].data, rewriter.fragments[i].size);
+
+				// the index has the latency from the capture
+				if (nalIndex.fi)
+					indexFrame(&nalIndex, slot.frame, outputSize, rewriter.fragments, rewriter.count,
+					           liveClock.getInMicroSec() - slot.captureUs);
+				outputSize += rewriter.size;
+			}
+			status = status && outputFlush(&output, false);
+		}
+		releaseQueried(session, &taskDescriptionList);
+        if (!status)
+        {
+            fprintf(stderr, "\nError writing the output at frame %u\n", slot.frame);
+            break;
+        }
+
+        double now = liveClock.getInMicroSec();
+        lastLatencyUs = now - slot.captureUs;
+        liveLatencyAdd(latency, lastLatencyUs);
+        *progress = ++encoded;
+
+        if (now - lastShown >= 1000000)
+        {
+            fprintf(stderr, "\rFrames %u  Fps: %3.2f  Dropped: %u  Latency: %.1f ms  p99: %.1f ms   ",
+                    encoded, (encoded - lastEncoded) * 1000000.0 / (now - lastShown),
+                    live->dropped + live->late, lastLatencyUs * 0.001, liveLatencyPercentile(latency, 99));
+            lastShown = now;
+            lastEncoded = encoded;
+        }
+    }
+
+    InterlockedExchange(&live->stop, 1);
+    WaitForSingleObject(hCapture, INFINITE);
+    CloseHandle(hCapture);
+    if (tsOutput)
+        tsClose(&ts);
+    rewriteClose(&rewriter);
+    status = outputClose(&output) && status;
+    status = indexClose(&nalIndex, live->captured) && status;  // with the records of the frames dropped at the end
+
+    fprintf(stderr, "\nFrames      %u captured, %u encoded, %u dropped in the queue, %u past the deadline\n",
+            live->captured, encoded, live->dropped, live->late);
+    fprintf(stderr, "Latency     avg %.1f ms, p50 %.1f ms, p90 %.1f ms, p99 %.1f ms, max %.1f ms\n",
+            latency->count ? latency->sumUs * 0.001 / latency->count : 0,
+            liveLatencyPercentile(latency, 50), liveLatencyPercentile(latency, 90),
+            liveLatencyPercentile(latency, 99), latency->maxUs * 0.001);
+
+    for (unsigned int i = 0; i < live->numFree; i++)
+        free(live->free[i]);
+    for (unsigned int i = 0; i < live->count; i++)
+        free(live->queue[(live->head + i) % LIVE_MAX_QUEUE].data);
+    CloseHandle(live->ready);
+    DeleteCriticalSection(&live->lock);
+    encoder->releaseSession(session);
+    free(latency);
+    free(live);
+
+    return status;
+}
+
+#endif
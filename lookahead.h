@@ -0,0 +1,394 @@
+/*******************************************************************************
+* This file is part of AvsVCEh264.
+* Contains the lookahead of the single session encode: every converted frame
+* is measured on a downscaled copy of its luma (SAD to the previous frame,
+* 8x8 block variance and histogram difference). From a window of future
+* frames it places IDRs at scene cuts and, with fixed QP, a QP per frame.
+*
+* Copyright (C) 2013 David Gonzlez Garca <davidgg666@gmail.com>
+*******************************************************************************/
+#ifndef LOOKAHEAD_H
+#define LOOKAHEAD_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "ini.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define LOOKAHEAD_USE_SSE2
+#include <emmintrin.h>
+#endif
+
+#define LOOKAHEAD_MAX_FRAMES    64
+#define LOOKAHEAD_SCALE         4       // the luma is measured at 1/4 of its size
+#define LOOKAHEAD_BINS          64      // luma histogram bins
+#define LOOKAHEAD_HISTORY       4       // past frames of the average SAD
+
+typedef struct LookaheadConfig
+{
+    unsigned int frames;            // window, 0 disables the lookahead
+    unsigned int sceneCut;          // percent of the histogram that changes at a scene cut
+    unsigned int minIDRDistance;    // frames between a scene cut IDR and the previous IDR
+    unsigned int qpStrength;        // tenths of QP per doubling of the complexity, fixed QP only
+    unsigned int qpRange;           // largest QP change
+} LookaheadConfig;
+
+// Measures of a frame
+typedef struct LookaheadStats
+{
+    double sad;                     // mean absolute difference to the previous frame
+    double variance;                // mean variance of the 8x8 blocks
+    double histDelta;               // part of the histogram that changed, 0 to 1
+    double flashSad;                // mean absolute difference between the previous & next frames
+} LookaheadStats;
+
+// What the encoder does with a frame
+typedef struct LookaheadDecision
+{
+    bool            idr;
+    unsigned int    qpI;
+    unsigned int    qpP;
+} LookaheadDecision;
+
+typedef struct Lookahead
+{
+    LookaheadConfig     config;
+    unsigned int        width;          // downscaled luma
+    unsigned int        height;
+    unsigned int        pitch;
+    BYTE                *small[LOOKAHEAD_MAX_FRAMES + 2];   // downscaled luma of the recent frames
+    unsigned int        hist[2][LOOKAHEAD_BINS];
+    LookaheadStats      *stats;
+    LookaheadDecision   *decisions;
+    unsigned int        numFrames;
+    unsigned int        analyzed;       // frames measured
+    unsigned int        decided;        // frames with a decision
+    unsigned int        lastIdr;
+    unsigned int        sceneCuts;
+    unsigned int        qpI;            // QP of the configuration
+    unsigned int        qpP;
+    bool                fixedQP;
+} Lookahead;
+
+LookaheadConfig lookaheadConfig = {0, 40, 12, 20, 4};
+
+
+static int lookaheadHandler(void* user, const char* section, const char* name, const char* value)
+{
+    LookaheadConfig *pLookahead = (LookaheadConfig*)user;
+    unsigned int uVal = (unsigned int)atoi(value);
+
+    if (strcmp(section, "lookahead") != 0)
+        return 1;
+
+    if (strcmp(name, "frames") == 0)
+        pLookahead->frames = uVal > LOOKAHEAD_MAX_FRAMES ? LOOKAHEAD_MAX_FRAMES : uVal;
+    else if (strcmp(name, "sceneCut") == 0)
+        pLookahead->sceneCut = uVal;
+    else if (strcmp(name, "minIDRDistance") == 0)
+        pLookahead->minIDRDistance = uVal;
+    else if (strcmp(name, "qpStrength") == 0)
+        pLookahead->qpStrength = uVal;
+    else if (strcmp(name, "qpRange") == 0)
+        pLookahead->qpRange = uVal;
+
+    return 1;
+}
+
+
+/*******************************************************************************
+ *  @fn     lookaheadInit
+ *  @brief  Reads the [lookahead] section of the configuration file
+ *  @param[in] configFilename : User configuration file name
+ *  @return bool : true if the lookahead is enabled; otherwise false.
+ ******************************************************************************/
+bool lookaheadInit(char *configFilename)
+{
+    ini_parse(configFilename, lookaheadHandler, &lookaheadConfig);
+    return lookaheadConfig.frames > 0;
+}
+
+
+/*******************************************************************************
+ *  @fn     lookaheadCreate
+ *  @brief  Prepares the lookahead of a clip
+ *  @param[out] la      : Lookahead
+ *  @param[in] width    : Picture width
+ *  @param[in] height   : Picture height
+ *  @param[in] numFrames: Frames of the clip
+ *  @param[in] pConfig  : Configuration of the session, gives the QP
+ *  @return bool : false if the clip is too small to be downscaled
+ ******************************************************************************/
+bool lookaheadCreate(Lookahead *la, unsigned int width, unsigned int height, unsigned int numFrames,
+                     OvConfigCtrl *pConfig)
+{
+    memset(la, 0, sizeof(Lookahead));
+    if (width < LOOKAHEAD_SCALE || height < LOOKAHEAD_SCALE)
+    {
+        fprintf(stderr, "The lookahead needs a picture of %ux%u or more\n", LOOKAHEAD_SCALE, LOOKAHEAD_SCALE);
+        return false;
+    }
+    la->config = lookaheadConfig;
+    la->width = width / LOOKAHEAD_SCALE;
+    la->height = height / LOOKAHEAD_SCALE;
+    la->pitch = (la->width + 15) & ~15;
+    for (int i = 0; i < LOOKAHEAD_MAX_FRAMES + 2; i++)
+        la->small[i] = (BYTE*) calloc(la->pitch * la->height + 16, 1);
+
+    la->numFrames = numFrames;
+    la->stats = new LookaheadStats[numFrames];
+    la->decisions = new LookaheadDecision[numFrames];
+    memset(la->stats, 0, numFrames * sizeof(LookaheadStats));
+    la->qpI = pConfig->rateControl.encQP_I;
+    la->qpP = pConfig->rateControl.encQP_P;
+    la->fixedQP = pConfig->rateControl.encRateControlMethod == 0;
+    return true;
+}
+
+
+void lookaheadDestroy(Lookahead *la)
+{
+    for (int i = 0; i < LOOKAHEAD_MAX_FRAMES + 2; i++)
+        free(la->small[i]);
+    delete [] la->stats;
+    delete [] la->decisions;
+    memset(la, 0, sizeof(Lookahead));
+}
+
+
+// Downscaled luma of frame n
+inline BYTE *lookaheadSmall(Lookahead *la, unsigned int n)
+{
+    return la->small[n % (LOOKAHEAD_MAX_FRAMES + 2)];
+}
+
+
+/*******************************************************************************
+ *  @fn     lookaheadDownscale
+ *  @brief  Averages every 4x4 block of the luma into one sample
+ ******************************************************************************/
+void lookaheadDownscale(Lookahead *la, const BYTE *src, unsigned int srcPitch, BYTE *dst)
+{
+    for (unsigned int y = 0; y < la->height; y++)
+    {
+        const BYTE *r = src + y * LOOKAHEAD_SCALE * srcPitch;
+        BYTE *d = dst + y * la->pitch;
+        unsigned int x = 0;
+#ifdef LOOKAHEAD_USE_SSE2
+        // 16 source bytes give 4 samples: rows averaged, then pairs of columns twice
+        __m128i mask = _mm_set1_epi32(0xFF);
+        for (; x + 8 <= la->width; x += 8)
+        {
+            __m128i v[2];
+            for (int h = 0; h < 2; h++)
+            {
+                const BYTE *p = r + x * LOOKAHEAD_SCALE + h * 16;
+                __m128i a = _mm_avg_epu8(_mm_loadu_si128((const __m128i*)p),
+                                         _mm_loadu_si128((const __m128i*)(p + srcPitch)));
+                __m128i b = _mm_avg_epu8(_mm_loadu_si128((const __m128i*)(p + 2 * srcPitch)),
+                                         _mm_loadu_si128((const __m128i*)(p + 3 * srcPitch)));
+                a = _mm_avg_epu8(a, b);
+                a = _mm_avg_epu8(a, _mm_srli_si128(a, 1));
+                a = _mm_avg_epu8(a, _mm_srli_si128(a, 2));
+                v[h] = _mm_and_si128(a, mask);
+            }
+            __m128i p = _mm_packs_epi32(v[0], v[1]);
+            _mm_storel_epi64((__m128i*)(d + x), _mm_packus_epi16(p, p));
+        }
+#endif
+        for (; x < la->width; x++)
+        {
+            unsigned int sum = 0;
+            for (int j = 0; j < LOOKAHEAD_SCALE; j++)
+                for (int i = 0; i < LOOKAHEAD_SCALE; i++)
+                    sum += r[j * srcPitch + x * LOOKAHEAD_SCALE + i];
+            d[x] = (BYTE)((sum + 8) / 16);
+        }
+    }
+}
+
+
+// Mean absolute difference of two downscaled frames
+double lookaheadSad(Lookahead *la, const BYTE *a, const BYTE *b)
+{
+    uint64 total = 0;
+    for (unsigned int y = 0; y < la->height; y++)
+    {
+        const BYTE *pa = a + y * la->pitch;
+        const BYTE *pb = b + y * la->pitch;
+        unsigned int x = 0;
+#ifdef LOOKAHEAD_USE_SSE2
+        __m128i acc = _mm_setzero_si128();
+        for (; x + 16 <= la->width; x += 16)
+            acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadu_si128((const __m128i*)(pa + x)),
+                                                  _mm_loadu_si128((const __m128i*)(pb + x))));
+        total += _mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+#endif
+        for (; x < la->width; x++)
+            total += abs(pa[x] - pb[x]);
+    }
+    return total / (double)(la->width * la->height);
+}
+
+
+// Mean variance of the 8x8 blocks of a downscaled frame
+double lookaheadVariance(Lookahead *la, const BYTE *a)
+{
+    double total = 0;
+    unsigned int blocks = 0;
+    for (unsigned int by = 0; by + 8 <= la->height; by += 8)
+    {
+        for (unsigned int bx = 0; bx + 8 <= la->width; bx += 8)
+        {
+            unsigned int sum = 0, sqr = 0;
+#ifdef LOOKAHEAD_USE_SSE2
+            __m128i zero = _mm_setzero_si128();
+            __m128i s = zero, q = zero;
+            for (int y = 0; y < 8; y++)
+            {
+                __m128i row = _mm_loadl_epi64((const __m128i*)(a + (by + y) * la->pitch + bx));
+                s = _mm_add_epi64(s, _mm_sad_epu8(row, zero));
+                row = _mm_unpacklo_epi8(row, zero);
+                q = _mm_add_epi32(q, _mm_madd_epi16(row, row));
+            }
+            q = _mm_add_epi32(q, _mm_shuffle_epi32(q, 0x4E));
+            q = _mm_add_epi32(q, _mm_shuffle_epi32(q, 0xB1));
+            sum = _mm_cvtsi128_si32(s);
+            sqr = _mm_cvtsi128_si32(q);
+#else
+            for (int y = 0; y < 8; y++)
+            {
+                for (int x = 0; x < 8; x++)
+                {
+                    unsigned int v = a[(by + y) * la->pitch + bx + x];
+                    sum += v;
+                    sqr += v * v;
+                }
+            }
+#endif
+            total += (sqr - sum * sum / 64.0) / 64.0;
+            blocks++;
+        }
+    }
+    return blocks ? total / blocks : 0;
+}
+
+
+// Histogram of a downscaled frame
+void lookaheadHistogram(Lookahead *la, const BYTE *a, unsigned int *hist)
+{
+    memset(hist, 0, LOOKAHEAD_BINS * sizeof(unsigned int));
+    for (unsigned int y = 0; y < la->height; y++)
+    {
+        const BYTE *p = a + y * la->pitch;
+        for (unsigned int x = 0; x < la->width; x++)
+            hist[p[x] * LOOKAHEAD_BINS / 256]++;
+    }
+}
+
+
+/*******************************************************************************
+ *  @fn     lookaheadDecide
+ *  @brief  Picture type & QP of frame n, from the measures of the window
+ *          that follows it
+ ******************************************************************************/
+void lookaheadDecide(Lookahead *la, unsigned int n)
+{
+    LookaheadDecision *d = &la->decisions[n];
+    LookaheadStats *s = &la->stats[n];
+    d->idr = false;
+    d->qpI = la->qpI;
+    d->qpP = la->qpP;
+
+    // Scene cut: the histogram changes, the difference jumps above the recent
+    // average and it is not a flash: the next frame does not return to the
+    // previous one, nor this one to the frame before the previous one
+    if (n > 0 && n - la->lastIdr >= la->config.minIDRDistance)
+    {
+        double average = 0;
+        unsigned int count = 0;
+        for (unsigned int i = n - 1; i > 0 && count < LOOKAHEAD_HISTORY; i--, count++)
+            average += la->stats[i].sad;
+        average = count ? average / count : 0;
+
+        bool flash = (n + 1 < la->numFrames && s->flashSad < s->sad / 2) ||
+                     (n >= 2 && la->stats[n - 1].flashSad < s->sad / 2);
+        if (s->histDelta * 100 >= la->config.sceneCut && s->sad > 2 * average + 1 && !flash)
+        {
+            d->idr = true;
+            la->sceneCuts++;
+        }
+    }
+    if (n == 0 || d->idr)
+        la->lastIdr = n;
+
+    // QP: a frame more complex than the window gets a higher QP, a simpler
+    // one, that is a better reference, a lower one
+    if (!la->fixedQP || la->config.qpStrength == 0)
+        return;
+
+    unsigned int end = n + la->config.frames < la->numFrames ? n + la->config.frames : la->numFrames;
+    bool intra = n == la->lastIdr;
+    double window = 0;
+    for (unsigned int i = n; i < end; i++)
+        window += intra ? la->stats[i].variance : la->stats[i].sad;
+    window /= end - n;
+
+    double complexity = intra ? s->variance : s->sad;
+    double delta = la->config.qpStrength / 10.0 * log((complexity + 1) / (window + 1)) / log(2.0);
+    int range = (int)la->config.qpRange;
+    int offset = (int)floor(delta + 0.5);
+    offset = offset < -range ? -range : offset > range ? range : offset;
+
+    int qpI = (int)la->qpI + offset;
+    int qpP = (int)la->qpP + offset;
+    d->qpI = qpI < 0 ? 0 : qpI > 51 ? 51 : qpI;
+    d->qpP = qpP < 0 ? 0 : qpP > 51 ? 51 : qpP;
+}
+
+
+/*******************************************************************************
+ *  @fn     lookaheadAnalyze
+ *  @brief  Measures the next frame of the clip & decides the frames whose
+ *          window is complete
+ *  @param[in/out] la : Lookahead
+ *  @param[in] frame  : NV12 frame, the luma is used
+ *  @param[in] pitch  : Bytes per row of frame
+ ******************************************************************************/
+void lookaheadAnalyze(Lookahead *la, const BYTE *frame, unsigned int pitch)
+{
+    unsigned int n = la->analyzed++;
+    BYTE *cur = lookaheadSmall(la, n);
+    lookaheadDownscale(la, frame, pitch, cur);
+
+    LookaheadStats *s = &la->stats[n];
+    unsigned int *hist = la->hist[n & 1];
+    lookaheadHistogram(la, cur, hist);
+    s->variance = lookaheadVariance(la, cur);
+    if (n > 0)
+    {
+        unsigned int *prev = la->hist[(n - 1) & 1];
+        unsigned int moved = 0;
+        for (int i = 0; i < LOOKAHEAD_BINS; i++)
+            moved += abs((int)hist[i] - (int)prev[i]);
+        s->histDelta = moved / (2.0 * la->width * la->height);
+        s->sad = lookaheadSad(la, cur, lookaheadSmall(la, n - 1));
+    }
+    if (n > 1)
+        la->stats[n - 1].flashSad = lookaheadSad(la, cur, lookaheadSmall(la, n - 2));
+
+    // frame n - frames has its window now
+    while (la->decided + la->config.frames <= n)
+        lookaheadDecide(la, la->decided++);
+}
+
+
+// Decides the frames left at the end of the clip
+void lookaheadFlush(Lookahead *la)
+{
+    while (la->decided < la->analyzed)
+        lookaheadDecide(la, la->decided++);
+}
+
+#endif
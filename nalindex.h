@@ -0,0 +1,215 @@
+/*******************************************************************************
+* This file is part of AvsVCEh264.
+* Contains the frame index written next to an Annex-B output: the NAL headers
+* of every frame are read as it is copied to the output, so a seeker or a QC
+* tool finds any frame without scanning the stream.
+*
+* output.264.idx, little endian: a NalIndexHeader & a NalIndexRecord per frame,
+* record n at sizeof(NalIndexHeader) + n * recordSize. output.264.csv, with
+* -index csv: one text line per frame, with the same fields. A frame without
+* output, or dropped by the live encode, has a record of size 0 at the
+* position of the next frame.
+*
+* Copyright (C) 2013 David Gonzlez Garca <davidgg666@gmail.com>
+*******************************************************************************/
+#ifndef NALINDEX_H
+#define NALINDEX_H
+
+#include <stdio.h>
+#include <string.h>
+
+#define NAL_INDEX_MAGIC     0x5844494E  // "NIDX"
+#define NAL_INDEX_VERSION   1
+#define NAL_INDEX_IDR       1           // flags of a record
+
+typedef struct NalIndexHeader
+{
+    unsigned int    magic;
+    unsigned int    version;
+    unsigned int    recordSize;
+    unsigned int    fpsNumerator;
+    unsigned int    fpsDenominator;
+    unsigned int    count;          // records, written when closed
+} NalIndexHeader;
+
+typedef struct NalIndexRecord
+{
+    uint64          offset;         // of the access unit in the output
+    unsigned int    size;
+    unsigned int    frame;
+    unsigned int    nalTypes;       // bit n: a NAL unit of nal_unit_type n
+    unsigned int    flags;
+    unsigned int    latencyUs;      // from the submission of the frame to its output
+    unsigned int    reserved;
+} NalIndexRecord;
+
+typedef struct NalIndex
+{
+    FILE            *fi;
+    bool            csv;
+    NalIndexHeader  header;
+    uint64          offset;         // after the last access unit
+    unsigned int    idrs;
+    unsigned int    maxSize;
+    unsigned int    maxFrame;
+    bool            failed;         // a record or the header could not be written
+} NalIndex;
+
+// Index of the single session or live output, when open
+NalIndex nalIndex;
+
+
+/*******************************************************************************
+ *  @fn     indexOpen
+ *  @brief  Creates the index of an output, output.idx or output.csv
+ *  @param[out] index  : Index
+ *  @param[in] outFile : Output file
+ *  @param[in] csv     : Text instead of binary records
+ *  @param[in] vi      : Video info of the clip
+ *  @return bool : true if successful; otherwise false.
+ ******************************************************************************/
+bool indexOpen(NalIndex *index, char *outFile, bool csv, const AVS_VideoInfo *vi)
+{
+    memset(index, 0, sizeof(NalIndex));
+    char fileName[MAX_PATH];
+    snprintf(fileName, MAX_PATH, "%s.%s", outFile, csv ? "csv" : "idx");
+    index->fi = fopen(fileName, csv ? "w" : "wb");
+    if (index->fi == NULL)
+    {
+        fprintf(stderr, "Error creating the index %s\n", fileName);
+        return false;
+    }
+
+    index->csv = csv;
+    index->header.magic = NAL_INDEX_MAGIC;
+    index->header.version = NAL_INDEX_VERSION;
+    index->header.recordSize = sizeof(NalIndexRecord);
+    index->header.fpsNumerator = vi->fps_numerator;
+    index->header.fpsDenominator = vi->fps_denominator;
+    if (csv)
+        index->failed = fprintf(index->fi, "frame,offset,size,nal_types,idr,latency_us\n") < 0;
+    else
+        index->failed = fwrite(&index->header, sizeof(NalIndexHeader), 1, index->fi) != 1;
+    return true;
+}
+
+
+// Writes the record of a frame
+static void indexWrite(NalIndex *index, const NalIndexRecord *record)
+{
+    index->header.count++;
+    if (!index->csv)
+    {
+        if (fwrite(record, sizeof(NalIndexRecord), 1, index->fi) != 1)
+            index->failed = true;
+        return;
+    }
+
+    // the types in increasing order, as 5+7+8
+    char types[3 * 32 + 1] = {0};
+    for (int type = 0; type < 32; type++)
+    {
+        if (record->nalTypes & (1 << type))
+            sprintf(types + strlen(types), "%s%d", types[0] ? "+" : "", type);
+    }
+    if (fprintf(index->fi, "%u,%.0f,%u,%s,%u,%u\n", record->frame, (double)record->offset, record->size, types,
+                record->flags & NAL_INDEX_IDR, record->latencyUs) < 0)
+        index->failed = true;
+}
+
+
+// Writes empty records for the frames without output up to a frame, so record n stays frame n
+static void indexSkip(NalIndex *index, unsigned int frame, uint64 offset)
+{
+    NalIndexRecord record;
+    memset(&record, 0, sizeof(NalIndexRecord));
+    record.offset = offset;
+    while (index->header.count < frame)
+    {
+        record.frame = index->header.count;
+        indexWrite(index, &record);
+    }
+}
+
+
+/*******************************************************************************
+ *  @fn     indexFrame
+ *  @brief  Adds the access unit of a frame, with the types of its NAL units,
+ *          after empty records for the frames before it without one
+ *  @param[in/out] index : Index
+ *  @param[in] frame     : Frame number
+ *  @param[in] offset    : Position of the access unit in the output
+ *  @param[in] fragments : Annex-B access unit as it was written, split at NAL units
+ *  @param[in] count     : Fragments
+ *  @param[in] latencyUs : Encode latency of the frame
+ ******************************************************************************/
+void indexFrame(NalIndex *index, unsigned int frame, uint64 offset, const NalFragment *fragments,
+                unsigned int count, double latencyUs)
+{
+    NalIndexRecord record;
+    memset(&record, 0, sizeof(NalIndexRecord));
+    record.offset = offset;
+    record.frame = frame;
+    record.latencyUs = (unsigned int)latencyUs;
+
+    for (unsigned int i = 0; i < count; i++)
+    {
+        const BYTE *data = fragments[i].data;
+        unsigned int size = fragments[i].size;
+        for (unsigned int pos = annexbFindStartCode(data, 0, size); pos + 3 < size;
+                pos = annexbFindStartCode(data, pos + 3, size))
+            record.nalTypes |= 1 << (data[pos + 3] & 0x1F);
+        record.size += size;
+    }
+    unsigned int size = record.size;
+    if (record.nalTypes & (1 << NAL_IDR))
+    {
+        record.flags = NAL_INDEX_IDR;
+        index->idrs++;
+    }
+
+    if (size > index->maxSize)
+    {
+        index->maxSize = size;
+        index->maxFrame = frame;
+    }
+
+    indexSkip(index, frame, offset);
+    indexWrite(index, &record);
+    index->offset = offset + size;
+}
+
+
+/*******************************************************************************
+ *  @fn     indexClose
+ *  @brief  Writes the empty records of the last frames without output, the
+ *          number of records & closes the index. Called when the encode ends,
+ *          complete or not.
+ *  @param[in/out] index : Index
+ *  @param[in] numFrames : Frames submitted to the encoder
+ *  @return bool : true if successful; otherwise false.
+ ******************************************************************************/
+bool indexClose(NalIndex *index, unsigned int numFrames)
+{
+    if (index->fi == NULL)
+        return true;
+
+    indexSkip(index, numFrames, index->offset);
+
+    if (!index->csv)
+    {
+        if (fseek(index->fi, 0, SEEK_SET) != 0 ||
+                fwrite(&index->header, sizeof(NalIndexHeader), 1, index->fi) != 1)
+            index->failed = true;
+    }
+    bool status = fclose(index->fi) == 0 && !index->failed;
+    index->fi = NULL;
+
+    fprintf(stderr, "Index       %u frames, %u IDRs, largest frame %u bytes at frame %u\n",
+            index->header.count, index->idrs, index->maxSize, index->maxFrame);
+    if (!status)
+        fprintf(stderr, "Error writing the index\n");
+    return status;
+}
+
+#endif
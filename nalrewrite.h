@@ -0,0 +1,584 @@
+/*******************************************************************************
+* This file is part of AvsVCEh264.
+* Contains the NAL rewriter of the Annex-B output: an access unit delimiter
+* before every frame, and the SPS & PPS of the stream before every IDR that
+* has none. A frame is never rebuilt: the rewriter returns the pieces it is
+* written from, the inserted NAL units and the parts of the payload of the
+* encoder between them, which are copied once to the output as before.
+* It also gives another idr_pic_id to an IDR picture spliced right after an
+* IDR with the same one, for the streams written from several parts.
+*
+* Copyright (C) 2013 David Gonzlez Garca <davidgg666@gmail.com>
+*******************************************************************************/
+#ifndef NALREWRITE_H
+#define NALREWRITE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ini.h"
+
+#define REWRITE_MAX_PARAM       256     // bytes of a cached SPS or PPS, start code included
+#define REWRITE_MAX_FRAGMENTS   5       // AUD or the one of the frame, SPS, PPS & the rest
+
+typedef struct RewriteConfig
+{
+    unsigned int aud;           // an access unit delimiter starts every frame
+    unsigned int headers;       // the last SPS & PPS are repeated before every IDR
+} RewriteConfig;
+
+RewriteConfig rewriteConfig = {0, 0};
+
+// Piece of a frame as it is written
+typedef struct NalFragment
+{
+    const BYTE      *data;
+    unsigned int    size;
+} NalFragment;
+
+typedef struct NalRewriter
+{
+    BYTE            sps[REWRITE_MAX_PARAM];     // with a 4 byte start code
+    BYTE            pps[REWRITE_MAX_PARAM];
+    unsigned int    spsSize;
+    unsigned int    ppsSize;
+    NalFragment     fragments[REWRITE_MAX_FRAGMENTS];   // of the last frame
+    unsigned int    count;
+    unsigned int    size;                       // of the fragments
+    bool            shown;                      // the output is Annex-B, the stats are shown
+    unsigned int    auds;                       // NAL units inserted
+    unsigned int    headers;
+} NalRewriter;
+
+
+static int rewriteHandler(void* user, const char* section, const char* name, const char* value)
+{
+    RewriteConfig *pRewrite = (RewriteConfig*)user;
+    unsigned int uVal = (unsigned int)atoi(value);
+
+    if (strcmp(section, "rewrite") != 0)
+        return 1;
+
+    if (strcmp(name, "aud") == 0)
+        pRewrite->aud = uVal;
+    else if (strcmp(name, "headers") == 0)
+        pRewrite->headers = uVal;
+
+    return 1;
+}
+
+
+// Reads the [rewrite] section of the configuration file
+void rewriteInit(char *configFilename)
+{
+    ini_parse(configFilename, rewriteHandler, &rewriteConfig);
+}
+
+
+// Starts the rewriter of an output, only used for Annex-B: the muxers have their own AUDs & headers
+void rewriteOpen(NalRewriter *rw, bool annexb)
+{
+    memset(rw, 0, sizeof(NalRewriter));
+    rw->shown = annexb && (rewriteConfig.aud || rewriteConfig.headers);
+    if (rw->shown)
+        fprintf(stderr, "Rewrite     %s%s%s\n", rewriteConfig.aud ? "AUDs" : "",
+                rewriteConfig.aud && rewriteConfig.headers ? ", " : "",
+                rewriteConfig.headers ? "SPS/PPS before every IDR" : "");
+}
+
+
+// Keeps a parameter set of the stream, with a 4 byte start code
+static void rewriteCache(BYTE *cache, unsigned int *cacheSize, const AnnexbNal *nal)
+{
+    unsigned int size = nal->size - nal->header;
+    if (4 + size > REWRITE_MAX_PARAM)
+        return;
+    memcpy(cache, "\x00\x00\x00\x01", 4);
+    memcpy(cache + 4, nal->data + nal->header, size);
+    *cacheSize = 4 + size;
+}
+
+
+inline void rewriteAdd(NalRewriter *rw, const BYTE *data, unsigned int size)
+{
+    if (size == 0)
+        return;
+    rw->fragments[rw->count].data = data;
+    rw->fragments[rw->count].size = size;
+    rw->count++;
+    rw->size += size;
+}
+
+
+/*******************************************************************************
+ *  @fn     rewriteFrame
+ *  @brief  Splits the access unit of a frame in the fragments it is written
+ *          from, with the NAL units of the [rewrite] section. Only the NAL
+ *          units before the first slice are read, and the parameter sets
+ *          found there are cached for the next IDRs.
+ *  @param[in/out] rw : Rewriter, the fragments in fragments & count until the
+ *                      next frame, pointing to data or to the rewriter
+ *  @param[in] data   : Annex-B access unit
+ *  @param[in] size   : Bytes
+ ******************************************************************************/
+void rewriteFrame(NalRewriter *rw, const BYTE *data, unsigned int size)
+{
+    static const BYTE aud[6] = {0x00, 0x00, 0x00, 0x01, NAL_AUD, 0xF0};
+    rw->count = 0;
+    rw->size = 0;
+    if (!rewriteConfig.aud && !rewriteConfig.headers)
+    {
+        rewriteAdd(rw, data, size);
+        return;
+    }
+
+    unsigned int split = 0;     // end of the AUD of the frame, the headers go after it
+    bool hasAud = false, hasParams = false, idr = false;
+    unsigned int pos = 0;
+    AnnexbNal nal;
+    for (bool first = true; annexbNextNal(data, size, &pos, &nal); first = false)
+    {
+        if (nal.type == NAL_AUD && first)
+        {
+            hasAud = true;
+            split = pos;
+        }
+        else if (nal.type == NAL_SPS)
+        {
+            rewriteCache(rw->sps, &rw->spsSize, &nal);
+            hasParams = true;
+        }
+        else if (nal.type == NAL_PPS)
+        {
+            rewriteCache(rw->pps, &rw->ppsSize, &nal);
+            hasParams = true;
+        }
+        else if (nal.type == NAL_IDR || nal.type == NAL_SLICE)
+        {
+            idr = nal.type == NAL_IDR;
+            break;
+        }
+    }
+
+    if (rewriteConfig.aud && !hasAud)
+    {
+        rewriteAdd(rw, aud, sizeof(aud));
+        rw->auds++;
+    }
+    rewriteAdd(rw, data, split);
+    if (rewriteConfig.headers && idr && !hasParams && rw->spsSize && rw->ppsSize)
+    {
+        rewriteAdd(rw, rw->sps, rw->spsSize);
+        rewriteAdd(rw, rw->pps, rw->ppsSize);
+        rw->headers++;
+    }
+    rewriteAdd(rw, data + split, size - split);
+}
+
+
+// Shows the NAL units inserted
+void rewriteClose(NalRewriter *rw)
+{
+    if (rw->shown)
+        fprintf(stderr, "Rewrite     %u AUDs, %u SPS/PPS inserted\n", rw->auds, rw->headers);
+}
+
+
+/*******************************************************************************
+ * idr_pic_id of the IDR pictures spliced one after the other. Only the bits
+ * of the slice header up to idr_pic_id are read, and the new value is coded
+ * with the same number of bits modulo 8, so the rest of the slice keeps its
+ * bit alignment (the CABAC slice data starts on a byte).
+ ******************************************************************************/
+#define REWRITE_MAX_SPS         1024    // bytes of an SPS that can be read
+
+// Fields of the SPS that come before idr_pic_id in a slice header
+typedef struct RewriteSps
+{
+    unsigned int    log2MaxFrameNum;
+    bool            frameMbsOnly;
+    bool            separateColourPlane;
+} RewriteSps;
+
+// Bits of an RBSP, from the most significant bit of the first byte
+typedef struct RewriteBits
+{
+    const BYTE      *data;
+    unsigned int    size;       // bytes
+    unsigned int    pos;        // bits read, past size * 8 when the RBSP is too short
+} RewriteBits;
+
+
+static unsigned int rewriteReadBits(RewriteBits *b, unsigned int n)
+{
+    unsigned int value = 0;
+    for (; n > 0; n--, b->pos++)
+    {
+        unsigned int bit = b->pos < b->size * 8 ? (b->data[b->pos >> 3] >> (7 - (b->pos & 7))) & 1 : 0;
+        value = (value << 1) | bit;
+    }
+    return value;
+}
+
+
+// ue(v), a code longer than 32 bits ends the RBSP
+static unsigned int rewriteReadUE(RewriteBits *b)
+{
+    unsigned int zeros = 0;
+    while (b->pos < b->size * 8 && rewriteReadBits(b, 1) == 0)
+    {
+        if (++zeros == 32)
+        {
+            b->pos = b->size * 8 + 1;
+            return 0;
+        }
+    }
+    return (1u << zeros) - 1 + rewriteReadBits(b, zeros);
+}
+
+
+static int rewriteReadSE(RewriteBits *b)
+{
+    unsigned int k = rewriteReadUE(b);
+    return k & 1 ? (int)((k + 1) / 2) : -(int)(k / 2);
+}
+
+
+// Writes the n low bits of value at *pos of a zeroed buffer
+static void rewritePutBits(BYTE *dst, unsigned int *pos, unsigned int value, unsigned int n)
+{
+    for (; n > 0; n--, (*pos)++)
+    {
+        if ((value >> (n - 1)) & 1)
+            dst[*pos >> 3] |= 0x80 >> (*pos & 7);
+    }
+}
+
+
+// NAL unit payload to RBSP, the emulation prevention bytes removed
+static unsigned int rewriteUnescape(const BYTE *src, unsigned int size, BYTE *dst)
+{
+    unsigned int n = 0, zeros = 0;
+    for (unsigned int i = 0; i < size; i++)
+    {
+        if (zeros >= 2 && src[i] == 3)
+        {
+            zeros = 0;
+            continue;
+        }
+        dst[n++] = src[i];
+        zeros = src[i] == 0 ? zeros + 1 : 0;
+    }
+    return n;
+}
+
+
+// RBSP to NAL unit payload, dst has room for size * 3 / 2 + 1 bytes
+static unsigned int rewriteEscape(const BYTE *src, unsigned int size, BYTE *dst)
+{
+    unsigned int n = 0, zeros = 0;
+    for (unsigned int i = 0; i < size; i++)
+    {
+        if (zeros >= 2 && src[i] <= 3)
+        {
+            dst[n++] = 3;
+            zeros = 0;
+        }
+        dst[n++] = src[i];
+        zeros = src[i] == 0 ? zeros + 1 : 0;
+    }
+    if (n > 0 && dst[n - 1] == 0)
+        dst[n++] = 3;
+    return n;
+}
+
+
+/*******************************************************************************
+ *  @fn     rewriteParseSps
+ *  @brief  Reads the SPS fields that locate idr_pic_id in a slice header
+ *  @param[in] nal  : SPS, from its NAL header
+ *  @param[in] size : Bytes
+ *  @param[out] sps : Fields
+ *  @return bool : true if the SPS could be read; otherwise false.
+ ******************************************************************************/
+bool rewriteParseSps(const BYTE *nal, unsigned int size, RewriteSps *sps)
+{
+    BYTE rbsp[REWRITE_MAX_SPS];
+    if (size < 4 || size - 1 > REWRITE_MAX_SPS)
+        return false;
+    RewriteBits b = {rbsp, rewriteUnescape(nal + 1, size - 1, rbsp), 0};
+
+    unsigned int profile = rewriteReadBits(&b, 8);
+    rewriteReadBits(&b, 16);                // constraint flags, level_idc
+    rewriteReadUE(&b);                      // seq_parameter_set_id
+    sps->separateColourPlane = false;
+    if (profile == 100 || profile == 110 || profile == 122 || profile == 244 || profile == 44 ||
+            profile == 83 || profile == 86 || profile == 118 || profile == 128 || profile == 138 ||
+            profile == 139 || profile == 134 || profile == 135)
+    {
+        unsigned int chromaFormat = rewriteReadUE(&b);
+        if (chromaFormat == 3)
+            sps->separateColourPlane = rewriteReadBits(&b, 1) != 0;
+        rewriteReadUE(&b);                  // bit_depth_luma_minus8
+        rewriteReadUE(&b);                  // bit_depth_chroma_minus8
+        rewriteReadBits(&b, 1);             // qpprime_y_zero_transform_bypass_flag
+        if (rewriteReadBits(&b, 1))         // seq_scaling_matrix_present_flag
+        {
+            for (int i = 0; i < (chromaFormat != 3 ? 8 : 12); i++)
+            {
+                if (!rewriteReadBits(&b, 1))
+                    continue;
+                int last = 8, next = 8;
+                for (int j = 0; j < (i < 6 ? 16 : 64) && b.pos <= b.size * 8; j++)
+                {
+                    if (next != 0)
+                        next = (last + rewriteReadSE(&b) + 256) % 256;
+                    last = next == 0 ? last : next;
+                }
+            }
+        }
+    }
+    sps->log2MaxFrameNum = rewriteReadUE(&b) + 4;
+    unsigned int pocType = rewriteReadUE(&b);
+    if (pocType == 0)
+    {
+        rewriteReadUE(&b);                  // log2_max_pic_order_cnt_lsb_minus4
+    }
+    else if (pocType == 1)
+    {
+        rewriteReadBits(&b, 1);             // delta_pic_order_always_zero_flag
+        rewriteReadSE(&b);                  // offset_for_non_ref_pic
+        rewriteReadSE(&b);                  // offset_for_top_to_bottom_field
+        unsigned int cycle = rewriteReadUE(&b);
+        for (unsigned int i = 0; i < cycle && b.pos <= b.size * 8; i++)
+            rewriteReadSE(&b);
+    }
+    rewriteReadUE(&b);                      // max_num_ref_frames
+    rewriteReadBits(&b, 1);                 // gaps_in_frame_num_value_allowed_flag
+    rewriteReadUE(&b);                      // pic_width_in_mbs_minus1
+    rewriteReadUE(&b);                      // pic_height_in_map_units_minus1
+    sps->frameMbsOnly = rewriteReadBits(&b, 1) != 0;
+    return b.pos <= b.size * 8 && sps->log2MaxFrameNum <= 16;
+}
+
+
+// Moves to the idr_pic_id of an IDR slice, in its RBSP after the NAL header
+static bool rewriteSkipToIdrPicId(RewriteBits *b, const RewriteSps *sps)
+{
+    rewriteReadUE(b);                       // first_mb_in_slice
+    rewriteReadUE(b);                       // slice_type
+    rewriteReadUE(b);                       // pic_parameter_set_id
+    if (sps->separateColourPlane)
+        rewriteReadBits(b, 2);              // colour_plane_id
+    rewriteReadBits(b, sps->log2MaxFrameNum);   // frame_num
+    if (!sps->frameMbsOnly && rewriteReadBits(b, 1))
+        rewriteReadBits(b, 1);              // field_pic_flag, bottom_field_flag
+    return b->pos <= b->size * 8;
+}
+
+
+// SPS of an access unit from its NAL header, *sps is kept when it has none
+void rewriteFindSps(const BYTE *data, unsigned int size, const BYTE **sps, unsigned int *spsSize)
+{
+    unsigned int pos = 0;
+    AnnexbNal nal;
+    while (annexbNextNal(data, size, &pos, &nal))
+    {
+        if (nal.type == NAL_SPS)
+        {
+            *sps = nal.data + nal.header;
+            *spsSize = nal.size - nal.header;
+            return;
+        }
+        if (nal.type == NAL_SLICE || nal.type == NAL_IDR)
+            return;
+    }
+}
+
+
+// Fields of the SPS of an access unit, or of the given one when it has none
+static bool rewriteAccessUnitSps(const BYTE *data, unsigned int size, const BYTE *sps, unsigned int spsSize,
+                                 RewriteSps *fields)
+{
+    rewriteFindSps(data, size, &sps, &spsSize);
+    return sps && rewriteParseSps(sps, spsSize, fields);
+}
+
+
+/*******************************************************************************
+ *  @fn     rewritePictureEnd
+ *  @brief  End of the first access unit of an Annex-B buffer. The next one
+ *          starts at an AUD, at an SEI, SPS or PPS after a slice, or at a
+ *          slice with first_mb_in_slice 0 after another slice.
+ *  @param[in] data : Byte stream
+ *  @param[in] size : Bytes
+ *  @return unsigned int : bytes of the first access unit.
+ ******************************************************************************/
+unsigned int rewritePictureEnd(const BYTE *data, unsigned int size)
+{
+    unsigned int pos = 0;
+    bool slice = false;
+    AnnexbNal nal;
+    while (annexbNextNal(data, size, &pos, &nal))
+    {
+        bool isSlice = nal.type == NAL_SLICE || nal.type == NAL_IDR;
+        bool firstMb = isSlice && nal.size > nal.header + 1 && (nal.data[nal.header + 1] & 0x80);
+        if (slice && (nal.type == NAL_AUD || nal.type == NAL_SEI || nal.type == NAL_SPS ||
+                      nal.type == NAL_PPS || firstMb))
+            return (unsigned int)(nal.data - data);
+        slice = slice || isSlice;
+    }
+    return size;
+}
+
+
+/*******************************************************************************
+ *  @fn     rewriteGetIdrPicId
+ *  @brief  Reads the idr_pic_id of an access unit
+ *  @param[in] data    : Access unit
+ *  @param[in] size    : Bytes
+ *  @param[in] sps     : SPS in use when the access unit has none, from its NAL header
+ *  @param[in] spsSize : Bytes
+ *  @param[out] id     : idr_pic_id
+ *  @return bool : true if it is an IDR picture that could be read; otherwise false.
+ ******************************************************************************/
+bool rewriteGetIdrPicId(const BYTE *data, unsigned int size, const BYTE *sps, unsigned int spsSize,
+                        unsigned int *id)
+{
+    RewriteSps fields;
+    if (!rewriteAccessUnitSps(data, size, sps, spsSize, &fields))
+        return false;
+
+    unsigned int pos = 0;
+    AnnexbNal nal;
+    while (annexbNextNal(data, size, &pos, &nal))
+    {
+        if (nal.type == NAL_SLICE)
+            return false;
+        if (nal.type != NAL_IDR)
+            continue;
+
+        // the header fields before idr_pic_id fit in 32 bytes
+        BYTE rbsp[32];
+        unsigned int payload = nal.size - nal.header - 1;
+        RewriteBits b = {rbsp, rewriteUnescape(nal.data + nal.header + 1, payload < 32 ? payload : 32, rbsp), 0};
+        if (!rewriteSkipToIdrPicId(&b, &fields))
+            return false;
+        *id = rewriteReadUE(&b);
+        return b.pos <= b.size * 8;
+    }
+    return false;
+}
+
+
+/*******************************************************************************
+ *  @fn     rewriteOtherIdrPicId
+ *  @brief  Chooses a new idr_pic_id for a picture, different from the ones of
+ *          the IDRs around it and coded with the bits of the old one, or 8 more
+ *  @param[in] id       : idr_pic_id of the picture
+ *  @param[in] previous : idr_pic_id of the IDR before it
+ *  @param[in] next     : idr_pic_id of the IDR after it, or the previous one
+ *  @return unsigned int : new idr_pic_id.
+ ******************************************************************************/
+unsigned int rewriteOtherIdrPicId(unsigned int id, unsigned int previous, unsigned int next)
+{
+    // ue(v) of 2 * zeros + 1 bits: values 2^zeros - 1 to 2^(zeros + 1) - 2
+    unsigned int zeros = 0;
+    while ((id + 1) >> (zeros + 1))
+        zeros++;
+    unsigned int lengths[3] = {zeros, zeros + 4, zeros - 4};
+    for (int i = 0; i < 3; i++)
+    {
+        unsigned int z = lengths[i];
+        for (unsigned int v = (1u << z) - 1; z <= 16 && v < (2u << z) - 1 && v <= 65535; v++)
+        {
+            if (v != id && v != previous && v != next)
+                return v;
+        }
+    }
+    return id;
+}
+
+
+/*******************************************************************************
+ *  @fn     rewriteIdrPicture
+ *  @brief  Writes an IDR access unit with another idr_pic_id in every slice,
+ *          the other NAL units are copied
+ *  @param[in] data    : Access unit
+ *  @param[in] size    : Bytes
+ *  @param[in] sps     : SPS in use when the access unit has none, from its NAL header
+ *  @param[in] spsSize : Bytes
+ *  @param[in] id      : New idr_pic_id, from rewriteOtherIdrPicId
+ *  @param[out] out    : Access unit rewritten, REWRITE_IDR_SIZE(size) bytes
+ *  @return unsigned int : bytes written to out, 0 if failed.
+ ******************************************************************************/
+#define REWRITE_IDR_SIZE(size)  ((size) * 2 + 64)
+
+unsigned int rewriteIdrPicture(const BYTE *data, unsigned int size, const BYTE *sps, unsigned int spsSize,
+                               unsigned int id, BYTE *out)
+{
+    RewriteSps fields;
+    if (!rewriteAccessUnitSps(data, size, sps, spsSize, &fields))
+        return 0;
+
+    BYTE *rbsp = (BYTE*) malloc(size + 8);
+    BYTE *modified = (BYTE*) malloc(size + 8);
+    if (rbsp == NULL || modified == NULL)
+    {
+        free(rbsp);
+        free(modified);
+        return 0;
+    }
+
+    unsigned int written = 0, pos = 0;
+    bool ok = true;
+    AnnexbNal nal;
+    while (ok && annexbNextNal(data, size, &pos, &nal))
+    {
+        if (nal.type != NAL_IDR)
+        {
+            memcpy(out + written, nal.data, nal.size);
+            written += nal.size;
+            continue;
+        }
+
+        // header up to idr_pic_id, the new value, then the old bits from the old value on
+        RewriteBits b = {rbsp, rewriteUnescape(nal.data + nal.header + 1, nal.size - nal.header - 1, rbsp), 0};
+        ok = rewriteSkipToIdrPicId(&b, &fields);
+        unsigned int start = b.pos;
+        rewriteReadUE(&b);
+        if (!ok || b.pos > b.size * 8)
+        {
+            ok = false;
+            break;
+        }
+
+        unsigned int from = b.pos, to = 0, zeros = 0;
+        while ((id + 1) >> (zeros + 1))
+            zeros++;
+        memset(modified, 0, size + 8);
+        for (b.pos = 0; b.pos < start; )
+            rewritePutBits(modified, &to, rewriteReadBits(&b, 1), 1);
+        rewritePutBits(modified, &to, 0, zeros);
+        rewritePutBits(modified, &to, id + 1, zeros + 1);
+        for (b.pos = from; b.pos & 7; )
+            rewritePutBits(modified, &to, rewriteReadBits(&b, 1), 1);
+        if (to & 7)
+        {
+            ok = false;
+            break;
+        }
+        memcpy(modified + to / 8, rbsp + b.pos / 8, b.size - b.pos / 8);
+        unsigned int rbspSize = to / 8 + b.size - b.pos / 8;
+
+        memcpy(out + written, nal.data, nal.header + 1);
+        written += nal.header + 1;
+        written += rewriteEscape(modified, rbspSize, out + written);
+    }
+
+    free(rbsp);
+    free(modified);
+    return ok ? written : 0;
+}
+
+#endif
@@ -0,0 +1,409 @@
+/*******************************************************************************
+* This file is part of AvsVCEh264.
+* Contains the output file of the writer thread: the data is gathered into
+* large writes, the file is preallocated to the expected size and trimmed when
+* closed, and can be written without the system cache. "-" is the standard
+* output, written as it comes with the partial writes of a pipe completed.
+* udp://host:port sends the stream in datagrams of 7 transport stream packets.
+*
+* Copyright (C) 2013 David Gonzlez Garca <davidgg666@gmail.com>
+*******************************************************************************/
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <io.h>
+#include <fcntl.h>
+#include "ini.h"
+
+#define OUTPUT_WRITE_SIZE   (8 << 20)   // bytes gathered before a write to a file
+#define OUTPUT_SECTOR       4096        // alignment of the writes without the system cache
+#define OUTPUT_DATAGRAM     (7 * 188)   // bytes of a UDP datagram
+#define OUTPUT_UDP_BUFFER   (4 << 20)   // send buffer of the socket
+
+typedef struct OutputConfig
+{
+    unsigned int preallocate;   // reserve the size expected from the bitrate
+    unsigned int unbuffered;    // FILE_FLAG_NO_BUFFERING, whole sectors are written
+    unsigned int queueMB;       // output waiting for the disk before the encoder waits
+} OutputConfig;
+
+OutputConfig outputConfig = {1, 0, 64};
+
+typedef struct OutputFile
+{
+    HANDLE          handle;
+    HANDLE          tail;           // cached handle for the last partial sector, unbuffered only
+    bool            pipe;           // standard output
+    SOCKET          sock;           // udp://, INVALID_SOCKET otherwise
+    unsigned int    lost;           // datagrams the socket did not take
+    bool            unbuffered;
+    uint64          position;       // bytes written before the staged ones
+    uint64          allocated;      // size reserved when opened
+    BYTE            *staging;
+    unsigned int    staged;
+} OutputFile;
+
+// Standard output of the process, once the messages are sent to stderr
+int outputStdout = -1;
+
+
+static int outputHandler(void* user, const char* section, const char* name, const char* value)
+{
+    OutputConfig *pOutput = (OutputConfig*)user;
+    unsigned int uVal = (unsigned int)atoi(value);
+
+    if (strcmp(section, "output") != 0)
+        return 1;
+
+    if (strcmp(name, "preallocate") == 0)
+        pOutput->preallocate = uVal;
+    else if (strcmp(name, "unbuffered") == 0)
+        pOutput->unbuffered = uVal;
+    else if (strcmp(name, "queueMB") == 0)
+        pOutput->queueMB = uVal < 8 ? 8 : uVal;
+
+    return 1;
+}
+
+
+// Reads the [output] section of the configuration file
+void outputInit(char *configFilename)
+{
+    ini_parse(configFilename, outputHandler, &outputConfig);
+}
+
+
+/*******************************************************************************
+ *  @fn     outputRedirectStdout
+ *  @brief  Keeps the standard output for the stream & sends the messages
+ *          written to it to stderr, for -o -
+ *  @return bool : true if successful; otherwise false.
+ ******************************************************************************/
+bool outputRedirectStdout()
+{
+    fflush(stdout);
+    outputStdout = _dup(_fileno(stdout));
+    if (outputStdout < 0 || _dup2(_fileno(stderr), _fileno(stdout)) != 0)
+    {
+        fprintf(stderr, "Error redirecting the standard output\n");
+        return false;
+    }
+    _setmode(outputStdout, _O_BINARY);
+    return true;
+}
+
+
+// Opens an output as a stream, "-" is the standard output kept by outputRedirectStdout
+FILE *outputFopen(char *fileName, const char *mode)
+{
+    if (strcmp(fileName, "-") == 0)
+        return outputStdout >= 0 ? _fdopen(_dup(outputStdout), mode) : NULL;
+    return fopen(fileName, mode);
+}
+
+
+// udp://host:port
+bool outputIsUdp(const char *fileName)
+{
+    return strncmp(fileName, "udp://", 6) == 0;
+}
+
+
+// Connects a UDP socket to the host:port of udp://host:port
+static SOCKET outputConnectUdp(const char *address)
+{
+    char host[256];
+    strncpy(host, address + 6, sizeof(host) - 1);
+    host[sizeof(host) - 1] = 0;
+    char *colon = strrchr(host, ':');
+    WSADATA wsaData;
+    if (colon == NULL || WSAStartup(MAKEWORD(2, 2), &wsaData) != 0)
+        return INVALID_SOCKET;
+    *colon = 0;
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((unsigned short)atoi(colon + 1));
+    addr.sin_addr.s_addr = inet_addr(host);
+    if (addr.sin_addr.s_addr == INADDR_NONE)
+    {
+        struct hostent *he = gethostbyname(host);
+        if (he == NULL)
+            return INVALID_SOCKET;
+        memcpy(&addr.sin_addr, he->h_addr, sizeof(addr.sin_addr));
+    }
+
+    // the packets of a frame are sent in a burst
+    SOCKET sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    int sendBuffer = OUTPUT_UDP_BUFFER;
+    if (sock != INVALID_SOCKET)
+        setsockopt(sock, SOL_SOCKET, SO_SNDBUF, (const char*)&sendBuffer, sizeof(sendBuffer));
+    if (sock != INVALID_SOCKET && connect(sock, (struct sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR)
+    {
+        closesocket(sock);
+        sock = INVALID_SOCKET;
+    }
+    return sock;
+}
+
+
+// Sends whole datagrams, a missing receiver is not an error of the encode
+static unsigned int outputSendDatagrams(OutputFile *out, const BYTE *data, unsigned int size, bool partial)
+{
+    unsigned int sent = 0;
+    while (size - sent >= OUTPUT_DATAGRAM || (partial && sent < size))
+    {
+        int n = size - sent < OUTPUT_DATAGRAM ? size - sent : OUTPUT_DATAGRAM;
+        if (send(out->sock, (const char*)data + sent, n, 0) == SOCKET_ERROR)
+            out->lost++;
+        sent += n;
+    }
+    return sent;
+}
+
+
+// Expected size of an encode with a rate control, 0 if unknown
+uint64 outputEstimate(OvConfigCtrl *pConfig, const AVS_VideoInfo *vi)
+{
+    if (pConfig->rateControl.encRateControlMethod == 0 || vi->fps_numerator == 0)
+        return 0;
+
+    double seconds = vi->num_frames * (double)vi->fps_denominator / vi->fps_numerator;
+    return (uint64)(pConfig->rateControl.encRateControlTargetBitRate / 8.0 * seconds * 1.125);
+}
+
+
+// Writes all the bytes, a pipe may take them in several writes
+static bool outputWriteAll(HANDLE handle, const BYTE *data, unsigned int size)
+{
+    while (size > 0)
+    {
+        DWORD written = 0;
+        if (!WriteFile(handle, data, size, &written, NULL) || written == 0)
+            return false;
+        data += written;
+        size -= written;
+    }
+    return true;
+}
+
+
+bool outputClose(OutputFile *out);
+
+
+static bool outputSeek(HANDLE handle, uint64 offset)
+{
+    LARGE_INTEGER position;
+    position.QuadPart = offset;
+    return SetFilePointerEx(handle, position, NULL, FILE_BEGIN) != 0;
+}
+
+
+/*******************************************************************************
+ *  @fn     outputOpen
+ *  @brief  Opens the output file, or the standard output for "-"
+ *  @param[out] out     : Output
+ *  @param[in] fileName : Output file
+ *  @param[in] keep     : Bytes of an existing file kept, written after them
+ *  @param[in] estimate : Expected size, reserved if preallocate is set
+ *  @return bool : true if successful; otherwise false.
+ ******************************************************************************/
+bool outputOpen(OutputFile *out, char *fileName, uint64 keep, uint64 estimate)
+{
+    memset(out, 0, sizeof(OutputFile));
+    out->tail = INVALID_HANDLE_VALUE;
+    out->sock = INVALID_SOCKET;
+    if (outputIsUdp(fileName))
+    {
+        out->sock = outputConnectUdp(fileName);
+        if (out->sock == INVALID_SOCKET)
+        {
+            fprintf(stderr, "Error opening the UDP output %s\n", fileName);
+            return false;
+        }
+        out->staging = (BYTE*) malloc(OUTPUT_DATAGRAM);
+        return true;
+    }
+    if (strcmp(fileName, "-") == 0)
+    {
+        out->pipe = true;
+        out->handle = outputStdout >= 0 ? (HANDLE)_get_osfhandle(outputStdout) : INVALID_HANDLE_VALUE;
+        return out->handle != INVALID_HANDLE_VALUE;
+    }
+
+    out->unbuffered = outputConfig.unbuffered != 0;
+    DWORD flags = FILE_ATTRIBUTE_NORMAL | (out->unbuffered ? FILE_FLAG_NO_BUFFERING : FILE_FLAG_SEQUENTIAL_SCAN);
+    out->handle = CreateFile(fileName, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+                             keep ? OPEN_ALWAYS : CREATE_ALWAYS, flags, NULL);
+    if (out->handle != INVALID_HANDLE_VALUE && out->unbuffered)
+        out->tail = CreateFile(fileName, GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+                               OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (out->handle == INVALID_HANDLE_VALUE || (out->unbuffered && out->tail == INVALID_HANDLE_VALUE))
+    {
+        printf("Error opening the output file %s\n", fileName);
+        if (out->handle != INVALID_HANDLE_VALUE)
+            CloseHandle(out->handle);
+        return false;
+    }
+
+    // sector aligned, the bytes kept in the last sector are written again
+    out->staging = (BYTE*) _aligned_malloc(2 * OUTPUT_WRITE_SIZE, OUTPUT_SECTOR);
+    out->position = keep;
+    if (out->unbuffered)
+    {
+        out->position = keep & ~(uint64)(OUTPUT_SECTOR - 1);
+        out->staged = (unsigned int)(keep - out->position);
+        DWORD read = 0;
+        if (out->staged && (!outputSeek(out->handle, out->position) ||
+                !ReadFile(out->handle, out->staging, OUTPUT_SECTOR, &read, NULL) || read < out->staged))
+        {
+            fprintf(stderr, "Error reading the output file %s\n", fileName);
+            out->staged = 0;
+            outputClose(out);
+            return false;
+        }
+    }
+
+    if (outputConfig.preallocate && estimate > keep)
+    {
+        out->allocated = (estimate + OUTPUT_SECTOR - 1) & ~(uint64)(OUTPUT_SECTOR - 1);
+        if (!outputSeek(out->handle, out->allocated) || !SetEndOfFile(out->handle))
+            out->allocated = 0;
+    }
+    return outputSeek(out->handle, out->position);
+}
+
+
+// Writes the staged bytes, whole sectors of them without the system cache
+static bool outputWriteStaged(OutputFile *out)
+{
+    unsigned int size = out->unbuffered ? out->staged & ~(OUTPUT_SECTOR - 1) : out->staged;
+    if (size == 0)
+        return true;
+    if (!outputWriteAll(out->handle, out->staging, size))
+        return false;
+
+    out->position += size;
+    out->staged -= size;
+    memmove(out->staging, out->staging + size, out->staged);
+    return true;
+}
+
+
+/*******************************************************************************
+ *  @fn     outputWrite
+ *  @brief  Writes to the output, to a file in writes of OUTPUT_WRITE_SIZE
+ *  @param[in/out] out : Output
+ *  @param[in] data    : Bytes
+ *  @param[in] size    : Bytes
+ *  @return bool : true if successful; otherwise false.
+ ******************************************************************************/
+bool outputWrite(OutputFile *out, const BYTE *data, unsigned int size)
+{
+    if (out->pipe)
+        return outputWriteAll(out->handle, data, size);
+
+    // the datagram started by the last write is completed first
+    if (out->sock != INVALID_SOCKET)
+    {
+        if (out->staged)
+        {
+            unsigned int n = OUTPUT_DATAGRAM - out->staged < size ? OUTPUT_DATAGRAM - out->staged : size;
+            memcpy(out->staging + out->staged, data, n);
+            out->staged += n;
+            data += n;
+            size -= n;
+            out->staged -= outputSendDatagrams(out, out->staging, out->staged, false);
+        }
+        unsigned int sent = outputSendDatagrams(out, data, size, false);
+        memcpy(out->staging + out->staged, data + sent, size - sent);
+        out->staged += size - sent;
+        return true;
+    }
+
+    while (size > 0)
+    {
+        unsigned int n = 2 * OUTPUT_WRITE_SIZE - out->staged;
+        if (n > size)
+            n = size;
+        memcpy(out->staging + out->staged, data, n);
+        out->staged += n;
+        data += n;
+        size -= n;
+
+        if (out->staged >= OUTPUT_WRITE_SIZE && !outputWriteStaged(out))
+            return false;
+    }
+    return true;
+}
+
+
+/*******************************************************************************
+ *  @fn     outputFlush
+ *  @brief  Writes the staged bytes. Without the system cache, the last partial
+ *          sector is written through the cached handle & staged again. A UDP
+ *          output sends its last datagram, shorter.
+ *  @param[in/out] out : Output
+ *  @param[in] sync    : The file is also flushed to the disk
+ *  @return bool : true if successful; otherwise false.
+ ******************************************************************************/
+bool outputFlush(OutputFile *out, bool sync)
+{
+    if (out->pipe)
+        return true;
+    if (out->sock != INVALID_SOCKET)
+    {
+        out->staged -= outputSendDatagrams(out, out->staging, out->staged, true);
+        return true;
+    }
+
+    bool status = outputWriteStaged(out);
+    if (status && out->staged)
+        status = outputSeek(out->tail, out->position) &&
+                 outputWriteAll(out->tail, out->staging, out->staged);
+
+    if (status && sync)
+        status = FlushFileBuffers(out->handle) && (out->tail == INVALID_HANDLE_VALUE || FlushFileBuffers(out->tail));
+    return status;
+}
+
+
+/*******************************************************************************
+ *  @fn     outputClose
+ *  @brief  Writes what is left & trims the file to the bytes written
+ *  @param[in/out] out : Output
+ *  @return bool : true if successful; otherwise false.
+ ******************************************************************************/
+bool outputClose(OutputFile *out)
+{
+    if (out->pipe)
+        return true;
+    if (out->sock != INVALID_SOCKET)
+    {
+        outputFlush(out, false);
+        closesocket(out->sock);
+        free(out->staging);
+        if (out->lost)
+            fprintf(stderr, "UDP         %u datagrams not sent\n", out->lost);
+        return true;
+    }
+
+    bool status = outputFlush(out, false);
+    HANDLE handle = out->unbuffered ? out->tail : out->handle;
+    if (status && (out->allocated || out->staged))
+        status = outputSeek(handle, out->position + out->staged) && SetEndOfFile(handle);
+
+    if (out->tail != INVALID_HANDLE_VALUE)
+        CloseHandle(out->tail);
+    CloseHandle(out->handle);
+    _aligned_free(out->staging);
+    if (!status)
+        fprintf(stderr, "Error writing the output file\n");
+    return status;
+}
+
+#endif
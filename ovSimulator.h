@@ -0,0 +1,405 @@
+/*******************************************************************************
+* This file is part of AvsVCEh264.
+* Contains an OpenVideo encoder simulator implementing the encoder backend
+* interface. It models VCE latency and throughput and emits deterministic
+* placeholder Annex-B data, so the pipeline can run without a VCE card.
+*
+* Copyright (C) 2013 David Gonzlez Garca <davidgg666@gmail.com>
+*******************************************************************************/
+#ifndef OVSIMULATOR_H
+#define OVSIMULATOR_H
+
+#include <stdlib.h>
+#include <math.h>
+#include "ini.h"
+#include "timer.h"
+
+#define SIM_MAX_DEVICES		8
+#define SIM_MAX_TASKS		16
+
+typedef struct SimConfig
+{
+    unsigned int seed;          // seed of the payload and fault generators
+    unsigned int timeScale;     // percent of modelled time actually waited (100 = real time)
+    unsigned int numDevices;    // virtual devices reported by simGetDevice
+    unsigned int latencyUs;     // fixed pipeline latency of a task
+    unsigned int nsPerMB;       // engine time per macroblock at the reference preset
+    unsigned int faultSubmit;   // per mille of submits that fail
+    unsigned int faultTask;     // per mille of tasks that end with OVE_TASK_STATUS_FAILED
+    unsigned int stall;         // per mille of tasks delayed by stallMs
+    unsigned int stallMs;
+} SimConfig;
+
+// One virtual VCE engine, shared by all the sessions created on that device
+typedef struct SimEngine
+{
+    double busyUntilUs;
+    unsigned int tasks;
+} SimEngine;
+
+typedef struct SimTask
+{
+    unsigned int id;
+    unsigned int frame;
+    double       readyUs;
+    bool         idr;
+    bool         insertSPS;
+    bool         failed;
+} SimTask;
+
+typedef struct SimSession
+{
+    OvConfigCtrl config;            // last configuration sent
+    SimEngine    *engine;
+    unsigned int frameNum;          // frames submitted
+    unsigned int nextTaskId;
+    SimTask      tasks[SIM_MAX_TASKS];
+    unsigned int numTasks;
+    unsigned int faultState;        // fault generator state
+    BYTE         *output;
+    unsigned int outputCapacity;
+} SimSession;
+
+
+SimConfig simConfig = {1, 100, 1, 2000, 900, 0, 0, 0, 0};
+SimEngine simEngines[SIM_MAX_DEVICES];
+CRITICAL_SECTION simLock;
+Timer simClock;
+
+
+// xorshift32, never returns 0 for a non zero state
+inline unsigned int simRandom(unsigned int *state)
+{
+    unsigned int x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+
+static int simHandler(void* user, const char* section, const char* name, const char* value)
+{
+    SimConfig *pSim = (SimConfig*)user;
+    unsigned int uVal = (unsigned int)atoi(value);
+
+    if (strcmp(section, "simulator") != 0)
+        return 1;
+
+    if (strcmp(name, "seed") == 0)
+        pSim->seed = uVal ? uVal : 1;
+    else if (strcmp(name, "timeScale") == 0)
+        pSim->timeScale = uVal;
+    else if (strcmp(name, "devices") == 0)
+        pSim->numDevices = (uVal < 1) ? 1 : (uVal > SIM_MAX_DEVICES) ? SIM_MAX_DEVICES : uVal;
+    else if (strcmp(name, "latencyUs") == 0)
+        pSim->latencyUs = uVal;
+    else if (strcmp(name, "nsPerMB") == 0)
+        pSim->nsPerMB = uVal;
+    else if (strcmp(name, "faultSubmit") == 0)
+        pSim->faultSubmit = uVal;
+    else if (strcmp(name, "faultTask") == 0)
+        pSim->faultTask = uVal;
+    else if (strcmp(name, "stall") == 0)
+        pSim->stall = uVal;
+    else if (strcmp(name, "stallMs") == 0)
+        pSim->stallMs = uVal;
+
+    return 1;
+}
+
+
+/*******************************************************************************
+ *  @fn     simInit
+ *  @brief  Initializes the simulator, reading the [simulator] section of the
+ *          configuration file if there is one
+ *  @param[in] configFilename : User configuration file name or NULL
+ ******************************************************************************/
+void simInit(char *configFilename)
+{
+    if (configFilename)
+        ini_parse(configFilename, simHandler, &simConfig);
+
+    memset(simEngines, 0, sizeof(simEngines));
+    InitializeCriticalSection(&simLock);
+    simClock.start();
+}
+
+
+/*******************************************************************************
+ *  @fn     simGetDevice
+ *  @brief  Fills the device handle with the virtual devices of the simulator
+ *  @param[in/out] deviceHandle : Hanlde for the device information
+ *  @return bool : true if successful; otherwise false.
+ ******************************************************************************/
+bool simGetDevice(OVDeviceHandle *deviceHandle)
+{
+    deviceHandle->platform = NULL;
+    deviceHandle->numDevices = simConfig.numDevices;
+    deviceHandle->deviceInfo = new ovencode_device_info[deviceHandle->numDevices];
+    memset(deviceHandle->deviceInfo, 0, sizeof(ovencode_device_info) * deviceHandle->numDevices);
+
+    // Device ids start at 1, 0 means no device
+    for (unsigned int i = 0; i < deviceHandle->numDevices; i++)
+        deviceHandle->deviceInfo[i].device_id = i + 1;
+
+    return true;
+}
+
+
+/*******************************************************************************
+ *  @fn     simFrameTime
+ *  @brief  Engine time of one frame for the session resolution and preset.
+ *          Reference preset is balanced.ini: half & quarter pixel, 16x16
+ *          search range; I pictures skip motion estimation.
+ *  @return double : microseconds
+ ******************************************************************************/
+double simFrameTime(EncoderSession *session, OvConfigCtrl *pConfig, bool intra)
+{
+    unsigned int numMBs = ((session->width + 15) / 16) * ((session->height + 15) / 16);
+    OVE_CONFIG_MOTION_ESTIMATION *me = &pConfig->meControl;
+
+    double cost = 0.75;
+    if (!intra)
+    {
+        double area = (me->encSearchRangeX * me->encSearchRangeY) / 256.0;
+        cost = 0.55 + 0.20 * area;
+        cost += me->motionEstHalfPixel ? 0.10 : 0;
+        cost += me->motionEstQuarterPixel ? 0.15 : 0;
+
+        // each sub mode still evaluated by RDO
+        for (unsigned int m = 1; m < 8; m++)
+            cost += (me->encDisableSubMode & (1 << m)) ? 0 : 0.03;
+    }
+    if (pConfig->pictControl.cabacEnable)
+        cost += 0.05;
+
+    return numMBs * cost * simConfig.nsPerMB * 0.001;
+}
+
+
+/*******************************************************************************
+ *  @fn     simFrameBytes
+ *  @brief  Size of the coded picture from the rate control configuration
+ *  @return unsigned int : bytes of slice data
+ ******************************************************************************/
+unsigned int simFrameBytes(EncoderSession *session, OvConfigCtrl *pConfig, bool intra)
+{
+    OVE_CONFIG_RATE_CONTROL *rc = &pConfig->rateControl;
+    unsigned int numMBs = ((session->width + 15) / 16) * ((session->height + 15) / 16);
+    double bytes;
+
+    if (rc->encRateControlMethod == 0)
+    {
+        // Fixed QP: size halves every 6 QP steps
+        unsigned int qp = intra ? rc->encQP_I : rc->encQP_P;
+        bytes = numMBs * 48.0 * pow(2.0, (22.0 - qp) / 6.0) * (intra ? 1.0 : 0.3);
+    }
+    else
+    {
+        double fps = rc->encRateControlFrameRateNumerator /
+                     (double)(rc->encRateControlFrameRateDenominator ? rc->encRateControlFrameRateDenominator : 1);
+        bytes = rc->encRateControlTargetBitRate / (8.0 * (fps > 0 ? fps : 30)) * (intra ? 3.0 : 1.0);
+    }
+
+    return (bytes < 16) ? 16 : (unsigned int)bytes;
+}
+
+
+/*******************************************************************************
+ *  @fn     simWriteNal
+ *  @brief  Writes a placeholder NAL unit: start code, header and a payload
+ *          without zero bytes, so no emulation prevention is ever needed.
+ *  @return BYTE* : end of the written NAL unit
+ ******************************************************************************/
+BYTE *simWriteNal(BYTE *p, BYTE nalHeader, unsigned int payloadSize, unsigned int state)
+{
+    *p++ = 0; *p++ = 0; *p++ = 0; *p++ = 1;
+    *p++ = nalHeader;
+
+    state = state ? state : 1;
+    for (unsigned int i = 0; i < payloadSize; i++)
+        *p++ = (BYTE)(simRandom(&state) % 255 + 1);
+
+    return p;
+}
+
+
+bool simCreateSession(EncoderSession *session, EncoderDevice *device, OvConfigCtrl *pConfig)
+{
+    if (device->deviceId < 1 || device->deviceId > simConfig.numDevices)
+    {
+        fprintf(stderr, "Simulator: invalid device %u\n", device->deviceId);
+        return false;
+    }
+
+    SimSession *sim = new SimSession;
+    memset(sim, 0, sizeof(SimSession));
+    sim->config = *pConfig;
+    sim->engine = &simEngines[device->deviceId - 1];
+    sim->faultState = simConfig.seed * 2654435761u + device->deviceId;
+    if (sim->faultState == 0)
+        sim->faultState = 1;
+
+    session->priv = sim;
+    session->maxInFlight = SIM_MAX_TASKS;
+    return true;
+}
+
+
+bool simSendConfig(EncoderSession *session, OvConfigCtrl *pConfig, unsigned int configMask)
+{
+    SimSession *sim = (SimSession*)session->priv;
+
+    if (configMask & ENC_CONFIG_PICTURE)
+        sim->config.pictControl = pConfig->pictControl;
+    if (configMask & ENC_CONFIG_RATE)
+        sim->config.rateControl = pConfig->rateControl;
+    if (configMask & ENC_CONFIG_ME)
+        sim->config.meControl = pConfig->meControl;
+    if (configMask & ENC_CONFIG_RDO)
+        sim->config.rdoControl = pConfig->rdoControl;
+
+    return true;
+}
+
+
+bool simSubmit(EncoderSession *session, const BYTE *frame,
+               OVE_ENCODE_PARAMETERS_H264 *pictureParameter, unsigned int *taskId)
+{
+    SimSession *sim = (SimSession*)session->priv;
+
+    if (sim->numTasks == SIM_MAX_TASKS)
+    {
+        fputs("Simulator: too many tasks in flight\n", stderr);
+        return false;
+    }
+
+    if (simConfig.faultSubmit && simRandom(&sim->faultState) % 1000 < simConfig.faultSubmit)
+    {
+        fprintf(stderr, "Simulator: injected submit failure at frame %u\n", sim->frameNum);
+        return false;
+    }
+
+    SimTask *task = &sim->tasks[sim->numTasks++];
+    unsigned int idrPeriod = sim->config.pictControl.encIDRPeriod;
+    unsigned int headerSpacing = sim->config.pictControl.encHeaderInsertionSpacing;
+
+    task->id = sim->nextTaskId++;
+    task->frame = sim->frameNum;
+    task->idr = sim->frameNum == 0 ||
+                pictureParameter->forcePicType == OVE_PICTURE_TYPE_H264_IDR ||
+                (idrPeriod && sim->frameNum % idrPeriod == 0);
+    task->insertSPS = sim->frameNum == 0 || pictureParameter->insertSPS ||
+                      (headerSpacing && sim->frameNum % headerSpacing == 0);
+    task->failed = simConfig.faultTask && simRandom(&sim->faultState) % 1000 < simConfig.faultTask;
+
+    // Queue the picture on the shared engine
+    double frameTime = simFrameTime(session, &sim->config, task->idr);
+    if (simConfig.stall && simRandom(&sim->faultState) % 1000 < simConfig.stall)
+        frameTime += simConfig.stallMs * 1000.0;
+
+    EnterCriticalSection(&simLock);
+    double now = simClock.getInMicroSec();
+    double start = (sim->engine->busyUntilUs > now) ? sim->engine->busyUntilUs : now;
+    sim->engine->busyUntilUs = start + frameTime * simConfig.timeScale / 100.0;
+    sim->engine->tasks++;
+    task->readyUs = sim->engine->busyUntilUs + simConfig.latencyUs * simConfig.timeScale / 100.0;
+    LeaveCriticalSection(&simLock);
+
+    sim->frameNum++;
+    *taskId = task->id;
+    return true;
+}
+
+
+bool simQuery(EncoderSession *session, OVE_OUTPUT_DESCRIPTION *taskDescription)
+{
+    SimSession *sim = (SimSession*)session->priv;
+    if (sim->numTasks == 0)
+        return false;
+
+    SimTask task = sim->tasks[0];
+    sim->numTasks--;
+    memmove(sim->tasks, sim->tasks + 1, sim->numTasks * sizeof(SimTask));
+
+    // Wait for the task, sleeping while there is at least a millisecond left, then yielding
+    double remaining;
+    while ((remaining = task.readyUs - simClock.getInMicroSec()) > 0)
+        Sleep(remaining > 2000 ? (DWORD)(remaining / 1000) - 1 : 0);
+
+    taskDescription->taskID = task.id;
+    taskDescription->size_of_bitstream_data = 0;
+    taskDescription->bitstream_data = NULL;
+
+    if (task.failed)
+    {
+        fprintf(stderr, "Simulator: injected task failure at frame %u\n", task.frame);
+        taskDescription->status = OVE_TASK_STATUS_FAILED;
+        return true;
+    }
+
+    // Placeholder Annex-B output
+    unsigned int sliceSize = simFrameBytes(session, &sim->config, task.idr);
+    unsigned int size = sliceSize + 5 + (task.insertSPS ? 2 * (5 + 8) : 0);
+    if (size > sim->outputCapacity)
+    {
+        free(sim->output);
+        sim->outputCapacity = size + size / 2;
+        sim->output = (BYTE*) malloc(sim->outputCapacity);
+        if (sim->output == NULL)
+        {
+            sim->outputCapacity = 0;
+            fputs("Simulator: out of memory\n", stderr);
+            return false;
+        }
+    }
+
+    BYTE *p = sim->output;
+    if (task.insertSPS)
+    {
+        unsigned int paramState = simConfig.seed ^ (session->width << 16) ^ session->height;
+        p = simWriteNal(p, 0x67, 8, paramState);
+        p = simWriteNal(p, 0x68, 8, paramState + 1);
+    }
+    p = simWriteNal(p, task.idr ? 0x65 : 0x41, sliceSize,
+                    simConfig.seed ^ ((task.frame + 1) * 2654435761u));
+
+    taskDescription->status = OVE_TASK_STATUS_COMPLETE;
+    taskDescription->bitstream_data = sim->output;
+    taskDescription->size_of_bitstream_data = p - sim->output;
+    return true;
+}
+
+
+bool simReleaseTask(EncoderSession *session, unsigned int taskId)
+{
+    return true;
+}
+
+
+bool simReleaseSession(EncoderSession *session)
+{
+    SimSession *sim = (SimSession*)session->priv;
+    if (sim == NULL)
+        return true;
+
+    free(sim->output);
+    delete sim;
+    session->priv = NULL;
+    return true;
+}
+
+
+const EncoderBackend simBackend =
+{
+    "sim",
+    simCreateSession,
+    simSendConfig,
+    simSubmit,
+    simQuery,
+    simReleaseTask,
+    simReleaseSession
+};
+
+#endif
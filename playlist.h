@@ -0,0 +1,200 @@
+/*******************************************************************************
+* This file is part of AvsVCEh264.
+* Contains the playlist: several scripts with the same format encoded into one
+* stream by the single session encode. The next script is opened in its own
+* environment while the frames of the current one are read, and its frames
+* follow the last one of the current script without a gap.
+*
+* Copyright (C) 2013 David Gonzlez Garca <davidgg666@gmail.com>
+*******************************************************************************/
+#ifndef PLAYLIST_H
+#define PLAYLIST_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct PlaylistEntry
+{
+    char            file[255];
+    AvsSource       source;
+    unsigned int    first;          // first frame in the stream
+    bool            opened;
+} PlaylistEntry;
+
+typedef struct Playlist
+{
+    PlaylistEntry   *entries;
+    int             count;
+    int             current;        // script the frames are read from
+    HANDLE          opener;         // thread opening the script after it
+    AVS_VideoInfo   info;           // of the stream, frames of the scripts opened so far
+    volatile LONG   failed;
+} Playlist;
+
+// Scripts of the single session encode, none without -playlist
+Playlist playlist = {NULL, 0};
+
+
+/*******************************************************************************
+ *  @fn     playlistLoad
+ *  @brief  Reads the playlist, one script per line. Paths with spaces go
+ *          between double quotes and # starts a comment.
+ *  @param[out] list    : Playlist
+ *  @param[in] fileName : Playlist file
+ *  @return bool : true if successful; otherwise false.
+ ******************************************************************************/
+bool playlistLoad(Playlist *list, char *fileName)
+{
+    FILE *fr = fopen(fileName, "r");
+    if (fr == NULL)
+    {
+        fprintf(stderr, "Error opening the playlist %s\n", fileName);
+        return false;
+    }
+
+    memset(list, 0, sizeof(Playlist));
+    char line[1024], token[255];
+    while (fgets(line, sizeof(line), fr))
+    {
+        line[strcspn(line, "\r\n")] = 0;
+
+        char *p = line;
+        if (!schedNextToken(&p, token))
+            continue;
+
+        list->entries = (PlaylistEntry*) realloc(list->entries, (list->count + 1) * sizeof(PlaylistEntry));
+        PlaylistEntry *entry = &list->entries[list->count++];
+        memset(entry, 0, sizeof(PlaylistEntry));
+        strcpy(entry->file, token);
+    }
+    fclose(fr);
+
+    if (list->count == 0)
+    {
+        fprintf(stderr, "The playlist %s has no scripts\n", fileName);
+        return false;
+    }
+    return true;
+}
+
+
+// Opens a script in its own environment, the frames of the current one are still read
+DWORD WINAPI playlistOpenThread(LPVOID param)
+{
+    PlaylistEntry *entry = (PlaylistEntry*)param;
+    entry->opened = avsOpen(&entry->source, entry->file);
+    return 0;
+}
+
+
+// Starts opening the script after the current one, if any
+static void playlistOpenNext(Playlist *list)
+{
+    int next = list->current + 1;
+    list->opener = next < list->count ?
+                   CreateThread(NULL, 0, playlistOpenThread, &list->entries[next], 0, NULL) : NULL;
+}
+
+
+/*******************************************************************************
+ *  @fn     playlistStart
+ *  @brief  Takes the script opened at startup, in the globals, as the first
+ *          one & starts opening the second. The global info is replaced by
+ *          the one of the stream, whose frames grow as the scripts are opened.
+ *  @param[in/out] list : Playlist
+ ******************************************************************************/
+void playlistStart(Playlist *list)
+{
+    PlaylistEntry *entry = &list->entries[0];
+    entry->source.env = env;
+    entry->source.clip = clip;
+    entry->source.info = info;
+    entry->opened = true;
+
+    list->info = *info;
+    info = &list->info;
+    list->current = 0;
+    playlistOpenNext(list);
+}
+
+
+/*******************************************************************************
+ *  @fn     playlistFrameNV12
+ *  @brief  Reads frame n of the stream as NV12, from the script it belongs to.
+ *          Before the last frame of a script is returned the next one is
+ *          opened & its frames are added, so the encode does not end there.
+ *  @param[in/out] list : Playlist
+ *  @param[in] n        : Frame number in the stream, read in order
+ *  @param[out] dst     : NV12 frame
+ *  @param[in] pitch    : Bytes per row of dst
+ ******************************************************************************/
+void playlistFrameNV12(Playlist *list, unsigned int n, BYTE *dst, unsigned int pitch)
+{
+    PlaylistEntry *entry = &list->entries[list->current];
+    if (n >= entry->first + entry->source.info->num_frames)
+    {
+        // the first script belongs to the globals, they are released at the end
+        if (list->current > 0)
+            avsClose(&entry->source);
+        entry = &list->entries[++list->current];
+        playlistOpenNext(list);
+    }
+
+    avsSourceFrameNV12(&entry->source, n - entry->first, dst, pitch);
+
+    int next = list->current + 1;
+    if (n + 1 < entry->first + entry->source.info->num_frames || next >= list->count)
+        return;
+
+    WaitForSingleObject(list->opener, INFINITE);
+    CloseHandle(list->opener);
+    list->opener = NULL;
+
+    PlaylistEntry *following = &list->entries[next];
+    const AVS_VideoInfo *vi = following->source.info;
+    if (!following->opened)
+    {
+        fprintf(stderr, "\nError opening %s, the stream ends before it\n", following->file);
+        InterlockedExchange(&list->failed, 1);
+        return;
+    }
+    if (vi->width != list->info.width || vi->height != list->info.height ||
+            (uint64)vi->fps_numerator * list->info.fps_denominator !=
+            (uint64)list->info.fps_numerator * vi->fps_denominator)
+    {
+        fprintf(stderr, "\n%s is %dx%d at %u/%u fps, the playlist %dx%d at %u/%u fps, the stream ends before it\n",
+                following->file, vi->width, vi->height, vi->fps_numerator, vi->fps_denominator,
+                list->info.width, list->info.height, list->info.fps_numerator, list->info.fps_denominator);
+        InterlockedExchange(&list->failed, 1);
+        return;
+    }
+    // no frames would end the encode there, silently
+    if (vi->num_frames <= 0)
+    {
+        fprintf(stderr, "\n%s has no frames, the stream ends before it\n", following->file);
+        InterlockedExchange(&list->failed, 1);
+        return;
+    }
+
+    following->first = entry->first + entry->source.info->num_frames;
+    InterlockedExchangeAdd((volatile LONG*)&list->info.num_frames, vi->num_frames);
+}
+
+
+void playlistFree(Playlist *list)
+{
+    if (list->opener)
+    {
+        WaitForSingleObject(list->opener, INFINITE);
+        CloseHandle(list->opener);
+    }
+    if (list->count)
+        info = list->entries[0].source.info;
+    for (int i = 1; i < list->count; i++)
+        avsClose(&list->entries[i].source);
+    free(list->entries);
+    memset(list, 0, sizeof(Playlist));
+}
+
+#endif
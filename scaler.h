@@ -0,0 +1,369 @@
+/*******************************************************************************
+* This file is part of AvsVCEh264.
+* Contains the NV12 scalers of the ladder mode: separable bilinear, bicubic
+* and lanczos filters with fixed point coefficients, SSE2 row & column passes.
+*
+* Copyright (C) 2013 David Gonzlez Garca <davidgg666@gmail.com>
+*******************************************************************************/
+#ifndef SCALER_H
+#define SCALER_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SCALE_USE_SSE2
+#include <emmintrin.h>
+#endif
+
+#define SCALE_BITS      14      // coefficients add up to 1 << SCALE_BITS
+#define SCALE_ROW_BITS  8       // the row pass keeps 6 fractional bits
+#define SCALE_PI        3.14159265358979323846
+
+typedef enum ScaleFilter
+{
+    SCALE_BILINEAR,
+    SCALE_BICUBIC,
+    SCALE_LANCZOS
+} ScaleFilter;
+
+// Coefficients of one direction of a plane
+typedef struct ScaleBank
+{
+    unsigned int    length;     // coefficients of each output, a multiple of 8 for rows, of 2 for columns
+    int             *start;     // first source byte (rows) or row (columns) of each output
+    short           *coef;      // length coefficients of each output
+} ScaleBank;
+
+// One plane, luma or interleaved chroma
+typedef struct ScalePlane
+{
+    unsigned int    bytesPerSample;     // 1 luma, 2 chroma
+    unsigned int    srcWidth;           // samples
+    unsigned int    srcHeight;
+    unsigned int    dstWidth;
+    unsigned int    dstHeight;
+    unsigned int    border;             // samples replicated on each side of a source row
+    ScaleBank       rows;               // one output per byte of a destination row
+    ScaleBank       columns;            // one output per destination row
+} ScalePlane;
+
+typedef struct Scaler
+{
+    ScalePlane      luma;
+    ScalePlane      chroma;
+    BYTE            *row;               // source row with its borders
+    short           *temp;              // source rows scaled horizontally
+    unsigned int    tempPitch;          // shorts per row of temp
+    const short     **taps;             // rows of temp read by a destination row
+} Scaler;
+
+
+// Kernel of a filter, x in source samples
+double scaleKernel(ScaleFilter filter, double x)
+{
+    x = fabs(x);
+    switch (filter)
+    {
+    case SCALE_BILINEAR:
+        return x < 1 ? 1 - x : 0;
+
+    case SCALE_BICUBIC:     // Catmull-Rom
+        if (x < 1)
+            return 1.5 * x * x * x - 2.5 * x * x + 1;
+        if (x < 2)
+            return -0.5 * x * x * x + 2.5 * x * x - 4 * x + 2;
+        return 0;
+
+    default:                // lanczos, 3 lobes
+        if (x < 1e-6)
+            return 1;
+        if (x >= 3)
+            return 0;
+        return 3 * sin(SCALE_PI * x) * sin(SCALE_PI * x / 3) / (SCALE_PI * SCALE_PI * x * x);
+    }
+}
+
+
+/*******************************************************************************
+ *  @fn     scaleBankCreate
+ *  @brief  Computes the coefficients of a resampling from src to dst samples
+ *  @param[out] bank   : Coefficients
+ *  @param[in] filter  : Filter
+ *  @param[in] src     : Source samples
+ *  @param[in] dst     : Destination samples
+ *  @param[in] stride  : Bytes between samples of the source, 0 for columns
+ *  @param[in] offset  : Added to every start
+ ******************************************************************************/
+void scaleBankCreate(ScaleBank *bank, ScaleFilter filter, unsigned int src, unsigned int dst,
+                     unsigned int stride, int offset)
+{
+    double radius = filter == SCALE_BILINEAR ? 1 : filter == SCALE_BICUBIC ? 2 : 3;
+    double scale = src / (double)dst;
+    double stretch = scale > 1 ? scale : 1;     // the kernel is widened when downscaling
+    unsigned int taps = (unsigned int)ceil(2 * radius * stretch) + 1;
+
+    // rows: taps bytes apart by stride, padded for 8 bytes per step; columns: pairs of rows
+    bank->length = stride ? ((taps - 1) * stride + 8) & ~7 : (taps + 1) & ~1;
+    unsigned int outputs = stride ? dst * stride : dst;
+    bank->start = (int*) malloc(outputs * sizeof(int));
+    bank->coef = (short*) calloc(outputs * bank->length, sizeof(short));
+
+    double *weight = (double*) malloc(taps * sizeof(double));
+    short *coef = (short*) malloc(taps * sizeof(short));
+    for (unsigned int i = 0; i < dst; i++)
+    {
+        double center = (i + 0.5) * scale - 0.5;
+        int first = (int)floor(center - radius * stretch) + 1;
+
+        double sum = 0;
+        for (unsigned int t = 0; t < taps; t++)
+        {
+            weight[t] = scaleKernel(filter, (first + (int)t - center) / stretch);
+            sum += weight[t];
+        }
+
+        // fixed point, the rounding error goes to the largest tap
+        int total = 0;
+        unsigned int largest = 0;
+        for (unsigned int t = 0; t < taps; t++)
+        {
+            coef[t] = (short)floor(weight[t] / sum * (1 << SCALE_BITS) + 0.5);
+            total += coef[t];
+            if (coef[t] > coef[largest])
+                largest = t;
+        }
+        coef[largest] += (1 << SCALE_BITS) - total;
+
+        // every byte of a chroma sample has the same coefficients, the other ones are 0
+        for (unsigned int b = 0; b < (stride ? stride : 1); b++)
+        {
+            unsigned int o = stride ? i * stride + b : i;
+            bank->start[o] = first * (int)(stride ? stride : 1) + (int)b + offset;
+            for (unsigned int t = 0; t < taps; t++)
+                bank->coef[o * bank->length + t * (stride ? stride : 1)] = coef[t];
+        }
+    }
+    free(weight);
+    free(coef);
+}
+
+
+void scaleBankDestroy(ScaleBank *bank)
+{
+    free(bank->start);
+    free(bank->coef);
+}
+
+
+/*******************************************************************************
+ *  @fn     scaleRow
+ *  @brief  Horizontal pass: one row of bytes to outputs shorts with 6
+ *          fractional bits
+ ******************************************************************************/
+void scaleRow(const BYTE *src, short *dst, const ScaleBank *bank, unsigned int outputs)
+{
+    unsigned int i = 0;
+#ifdef SCALE_USE_SSE2
+    // four outputs at a time, their sums are transposed & added together
+    __m128i zero = _mm_setzero_si128();
+    __m128i round = _mm_set1_epi32(1 << (SCALE_ROW_BITS - 1));
+    for (; i + 4 <= outputs; i += 4)
+    {
+        __m128i acc[4];
+        for (int j = 0; j < 4; j++)
+        {
+            const BYTE *s = src + bank->start[i + j];
+            const short *c = bank->coef + (i + j) * bank->length;
+            acc[j] = zero;
+            for (unsigned int k = 0; k < bank->length; k += 8)
+            {
+                __m128i p = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(s + k)), zero);
+                acc[j] = _mm_add_epi32(acc[j], _mm_madd_epi16(p, _mm_loadu_si128((const __m128i*)(c + k))));
+            }
+        }
+        __m128i s01 = _mm_add_epi32(_mm_unpacklo_epi32(acc[0], acc[1]), _mm_unpackhi_epi32(acc[0], acc[1]));
+        __m128i s23 = _mm_add_epi32(_mm_unpacklo_epi32(acc[2], acc[3]), _mm_unpackhi_epi32(acc[2], acc[3]));
+        __m128i sum = _mm_add_epi32(_mm_unpacklo_epi64(s01, s23), _mm_unpackhi_epi64(s01, s23));
+        sum = _mm_srai_epi32(_mm_add_epi32(sum, round), SCALE_ROW_BITS);
+        _mm_storel_epi64((__m128i*)(dst + i), _mm_packs_epi32(sum, sum));
+    }
+#endif
+    for (; i < outputs; i++)
+    {
+        const BYTE *s = src + bank->start[i];
+        const short *c = bank->coef + i * bank->length;
+        int sum = 0;
+        for (unsigned int k = 0; k < bank->length; k++)
+            sum += s[k] * c[k];
+        dst[i] = (short)((sum + (1 << (SCALE_ROW_BITS - 1))) >> SCALE_ROW_BITS);
+    }
+}
+
+
+/*******************************************************************************
+ *  @fn     scaleColumns
+ *  @brief  Vertical pass: one destination row from taps rows of shorts
+ *  @param[in] rows  : Rows of the taps, an even number
+ *  @param[out] dst  : Destination row, written in steps of 8 bytes
+ *  @param[in] coef  : Coefficient of each row
+ *  @param[in] taps  : Number of rows
+ *  @param[in] width : Bytes of the row
+ ******************************************************************************/
+void scaleColumns(const short **rows, BYTE *dst, const short *coef, unsigned int taps, unsigned int width)
+{
+    const int shift = 2 * SCALE_BITS - SCALE_ROW_BITS;
+#ifdef SCALE_USE_SSE2
+    __m128i round = _mm_set1_epi32(1 << (shift - 1));
+    for (unsigned int x = 0; x < width; x += 8)
+    {
+        __m128i lo = round, hi = round;
+        for (unsigned int t = 0; t < taps; t += 2)
+        {
+            __m128i r0 = _mm_loadu_si128((const __m128i*)(rows[t] + x));
+            __m128i r1 = _mm_loadu_si128((const __m128i*)(rows[t + 1] + x));
+            __m128i c = _mm_set1_epi32((int)((unsigned int)(unsigned short)coef[t + 1] << 16 | (unsigned short)coef[t]));
+            lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi16(r0, r1), c));
+            hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi16(r0, r1), c));
+        }
+        __m128i p = _mm_packs_epi32(_mm_srai_epi32(lo, shift), _mm_srai_epi32(hi, shift));
+        _mm_storel_epi64((__m128i*)(dst + x), _mm_packus_epi16(p, p));
+    }
+#else
+    for (unsigned int x = 0; x < width; x++)
+    {
+        int sum = 1 << (shift - 1);
+        for (unsigned int t = 0; t < taps; t++)
+            sum += rows[t][x] * coef[t];
+        sum >>= shift;
+        dst[x] = (BYTE)(sum < 0 ? 0 : sum > 255 ? 255 : sum);
+    }
+#endif
+}
+
+
+// Coefficients of a plane
+void scalePlaneCreate(ScalePlane *plane, ScaleFilter filter, unsigned int bytesPerSample,
+                      unsigned int srcWidth, unsigned int srcHeight, unsigned int dstWidth, unsigned int dstHeight)
+{
+    plane->bytesPerSample = bytesPerSample;
+    plane->srcWidth = srcWidth;
+    plane->srcHeight = srcHeight;
+    plane->dstWidth = dstWidth;
+    plane->dstHeight = dstHeight;
+
+    // the taps of a row never reach further than the widest kernel
+    plane->border = (unsigned int)ceil(3.0 * srcWidth / dstWidth) + 8;
+    scaleBankCreate(&plane->rows, filter, srcWidth, dstWidth, bytesPerSample, plane->border * bytesPerSample);
+    scaleBankCreate(&plane->columns, filter, srcHeight, dstHeight, 0, 0);
+}
+
+
+void scalePlaneDestroy(ScalePlane *plane)
+{
+    scaleBankDestroy(&plane->rows);
+    scaleBankDestroy(&plane->columns);
+}
+
+
+/*******************************************************************************
+ *  @fn     scalePlane
+ *  @brief  Resamples a plane: every source row horizontally, then every
+ *          destination row vertically
+ ******************************************************************************/
+void scalePlane(Scaler *scaler, ScalePlane *plane, const BYTE *src, unsigned int srcPitch,
+                BYTE *dst, unsigned int dstPitch)
+{
+    unsigned int bps = plane->bytesPerSample;
+    unsigned int border = plane->border * bps;
+    unsigned int srcBytes = plane->srcWidth * bps;
+    unsigned int dstBytes = plane->dstWidth * bps;
+
+    for (unsigned int y = 0; y < plane->srcHeight; y++)
+    {
+        // the edge samples are repeated in the borders
+        const BYTE *s = src + y * srcPitch;
+        memcpy(scaler->row + border, s, srcBytes);
+        for (unsigned int b = 0; b < border; b++)
+        {
+            scaler->row[b] = s[b % bps];
+            scaler->row[border + srcBytes + b] = s[srcBytes - bps + b % bps];
+        }
+        scaleRow(scaler->row, scaler->temp + y * scaler->tempPitch, &plane->rows, dstBytes);
+    }
+
+    unsigned int taps = plane->columns.length;
+    for (unsigned int y = 0; y < plane->dstHeight; y++)
+    {
+        for (unsigned int t = 0; t < taps; t++)
+        {
+            int r = plane->columns.start[y] + (int)t;
+            r = r < 0 ? 0 : r >= (int)plane->srcHeight ? plane->srcHeight - 1 : r;
+            scaler->taps[t] = scaler->temp + r * scaler->tempPitch;
+        }
+        scaleColumns(scaler->taps, dst + y * dstPitch, plane->columns.coef + y * taps, taps, dstBytes);
+    }
+}
+
+
+/*******************************************************************************
+ *  @fn     scalerCreate
+ *  @brief  Prepares the scaling of NV12 frames, the sizes must be even
+ *  @param[out] scaler : Scaler
+ *  @param[in] filter  : Filter
+ *  @return bool : true if successful; otherwise false.
+ ******************************************************************************/
+bool scalerCreate(Scaler *scaler, ScaleFilter filter, unsigned int srcWidth, unsigned int srcHeight,
+                  unsigned int dstWidth, unsigned int dstHeight)
+{
+    memset(scaler, 0, sizeof(Scaler));
+    if (dstWidth < 16 || dstHeight < 16 || (dstWidth | dstHeight) & 1)
+        return false;
+
+    scalePlaneCreate(&scaler->luma, filter, 1, srcWidth, srcHeight, dstWidth, dstHeight);
+    scalePlaneCreate(&scaler->chroma, filter, 2, srcWidth / 2, srcHeight / 2, dstWidth / 2, dstHeight / 2);
+
+    // buffers for the larger plane: luma rows, chroma borders
+    unsigned int border = scaler->chroma.border * 2 > scaler->luma.border ? scaler->chroma.border * 2 : scaler->luma.border;
+    unsigned int taps = scaler->luma.columns.length > scaler->chroma.columns.length ?
+                        scaler->luma.columns.length : scaler->chroma.columns.length;
+    scaler->row = (BYTE*) malloc(srcWidth + 2 * border + 16);
+    scaler->tempPitch = (dstWidth + 15) & ~15;
+    scaler->temp = (short*) calloc(scaler->tempPitch * srcHeight, sizeof(short));
+    scaler->taps = (const short**) malloc(taps * sizeof(short*));
+    return true;
+}
+
+
+void scalerDestroy(Scaler *scaler)
+{
+    if (scaler->row == NULL)
+        return;
+    scalePlaneDestroy(&scaler->luma);
+    scalePlaneDestroy(&scaler->chroma);
+    free(scaler->row);
+    free(scaler->temp);
+    free(scaler->taps);
+    memset(scaler, 0, sizeof(Scaler));
+}
+
+
+/*******************************************************************************
+ *  @fn     scaleNV12
+ *  @brief  Scales a frame in the NV12 layout of the encoder input: the luma
+ *          rows followed by the interleaved chroma rows
+ *  @param[in] scaler   : Scaler
+ *  @param[in] src      : Source frame
+ *  @param[in] srcPitch : Bytes per row of src
+ *  @param[out] dst     : Destination frame
+ *  @param[in] dstPitch : Bytes per row of dst, at least the width rounded up to 8
+ ******************************************************************************/
+void scaleNV12(Scaler *scaler, const BYTE *src, unsigned int srcPitch, BYTE *dst, unsigned int dstPitch)
+{
+    scalePlane(scaler, &scaler->luma, src, srcPitch, dst, dstPitch);
+    scalePlane(scaler, &scaler->chroma, src + scaler->luma.srcHeight * srcPitch, srcPitch,
+               dst + scaler->luma.dstHeight * dstPitch, dstPitch);
+}
+
+#endif
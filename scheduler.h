@@ -0,0 +1,472 @@
+/*******************************************************************************
+* This file is part of AvsVCEh264.
+* Contains the job scheduler: several clips encoded at the same time on the
+* shared device contexts. The tasks of the sessions on a device are submitted
+* by weighted fair queuing, so each job gets a share of the engine
+* proportional to its weight.
+*
+* Copyright (C) 2013 David Gonzlez Garca <davidgg666@gmail.com>
+*******************************************************************************/
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#define SCHED_MAX_JOBS      64
+#define SCHED_PREFETCH      4   // frames decoded ahead of each job
+#define SCHED_DEVICE_DEPTH  4   // tasks in flight on a device
+
+typedef struct SchedJob
+{
+    char            input[255];
+    char            output[255];
+    char            configFile[255];
+    unsigned int    weight;         // share of the device
+    int             priority;       // OVE_ENCODE_TASK_PRIORITY, -1 for the one of the config file
+    AvsSource       source;
+    OvConfigCtrl    config;
+    EncoderSession  session;
+    EncoderDevice   *device;
+    FILE            *fw;
+    Buffer          *frames;        // NV12 frames decoded ahead
+    HANDLE          hThreadDec;
+    volatile LONG   *stop;
+    double          cost;           // macroblocks of a frame / weight
+    double          finish;         // virtual finish time of the last task submitted
+    unsigned int    submitted;
+    unsigned int    inFlight;
+    volatile LONG   encoded;
+    double          startUs;
+    double          endUs;
+    bool            ready;          // session created
+    bool            failed;
+} SchedJob;
+
+// Dispatches the tasks of the jobs of one device
+typedef struct SchedDevice
+{
+    EncoderDevice   *device;
+    SchedJob        *jobs[SCHED_MAX_JOBS];
+    int             numJobs;
+    SchedJob        *pending[SCHED_DEVICE_DEPTH];  // jobs of the tasks in flight, oldest first
+    int             numPending;
+    double          virtualTime;
+    volatile LONG   *stop;
+} SchedDevice;
+
+Timer schedClock;
+
+
+/*******************************************************************************
+ *  @fn     schedNextToken
+ *  @brief  Reads a space separated token, double quotes allow spaces in it
+ *  @param[in/out] p : Position in the line
+ *  @param[out] dst  : Token, at most size - 1 characters, the rest is dropped
+ *  @param[in] size  : Size of dst
+ *  @return bool : true if there was a token; otherwise false.
+ ******************************************************************************/
+bool schedNextToken(char **p, char *dst, int size = 255)
+{
+    char *s = *p;
+    while (*s == ' ' || *s == '\t')
+        s++;
+    if (*s == 0 || *s == '#')
+        return false;
+
+    int n = 0;
+    char end = ' ';
+    if (*s == '"')
+        end = *s++;
+    while (*s && *s != end && (end == '"' || *s != '\t'))
+    {
+        if (n < size - 1)
+            dst[n++] = *s;
+        s++;
+    }
+    if (*s == '"')
+        s++;
+    dst[n] = 0;
+    *p = s;
+    return true;
+}
+
+
+/*******************************************************************************
+ *  @fn     schedLoadJobs
+ *  @brief  Reads the job list, one job per line:
+ *          input.avs output.264 config.ini [weight [priority]]
+ *  @param[in] fileName : Job list
+ *  @param[out] jobs    : Jobs, SCHED_MAX_JOBS at most
+ *  @return int : the number of jobs or -1 if failed.
+ ******************************************************************************/
+int schedLoadJobs(char *fileName, SchedJob *jobs)
+{
+    FILE *fr = fopen(fileName, "r");
+    if (fr == NULL)
+    {
+        fprintf(stderr, "Error opening the job list %s\n", fileName);
+        return -1;
+    }
+
+    int numJobs = 0;
+    char line[1024], token[255];
+    for (int lineNum = 1; fgets(line, sizeof(line), fr); lineNum++)
+    {
+        line[strcspn(line, "\r\n")] = 0;
+
+        char *p = line;
+        if (!schedNextToken(&p, token))
+            continue;
+
+        if (numJobs == SCHED_MAX_JOBS)
+        {
+            fprintf(stderr, "Too many jobs, at most %d\n", SCHED_MAX_JOBS);
+            break;
+        }
+
+        SchedJob *job = &jobs[numJobs];
+        memset(job, 0, sizeof(SchedJob));
+        strcpy(job->input, token);
+        job->weight = 1;
+        job->priority = -1;
+
+        if (!schedNextToken(&p, job->output) || !schedNextToken(&p, job->configFile))
+        {
+            fprintf(stderr, "%s:%d: expected input output config [weight [priority]]\n", fileName, lineNum);
+            fclose(fr);
+            return -1;
+        }
+        if (schedNextToken(&p, token))
+            job->weight = atoi(token) > 0 ? atoi(token) : 1;
+        if (schedNextToken(&p, token))
+            job->priority = atoi(token);
+
+        numJobs++;
+    }
+
+    fclose(fr);
+    return numJobs;
+}
+
+
+// Decodes the frames of a job ahead of the encoder
+DWORD WINAPI schedDecodeThread(LPVOID param)
+{
+    SchedJob *job = (SchedJob*)param;
+
+    for (int f = 0; f < job->source.info->num_frames && !*job->stop; f++)
+    {
+        while ((BYTE)(job->frames->write - job->frames->read) >= SCHED_PREFETCH && !*job->stop)
+            Sleep(2);
+
+        BYTE *frameData  = (BYTE*) malloc(job->session.frameSize);
+        avsSourceFrameNV12(&job->source, f, frameData, job->session.pitch);
+        BufferWrite(job->frames, (BufferType)frameData);
+    }
+    return 0;
+}
+
+
+/*******************************************************************************
+ *  @fn     schedOpenJob
+ *  @brief  Opens the clip, the configuration, the output & the session of a job
+ *  @param[in/out] job : Job
+ *  @param[in] backend : Encoder backend
+ *  @return bool : true if successful; otherwise false.
+ ******************************************************************************/
+bool schedOpenJob(SchedJob *job, const EncoderBackend *backend)
+{
+    if (!avsOpen(&job->source, job->input))
+    {
+        fprintf(stderr, "Error opening %s\n", job->input);
+        return false;
+    }
+
+    memset(&job->config, 0, sizeof(OvConfigCtrl));
+    if (!loadConfig(&job->config, job->configFile))
+        return false;
+    avsSetConfig(&job->config, job->source.info);
+    if (job->priority >= 0)
+        job->config.priority = (OVE_ENCODE_TASK_PRIORITY)job->priority;
+
+    const AVS_VideoInfo *vi = job->source.info;
+    setSessionFormat(&job->session, vi->width, vi->height);
+    job->session.backend = backend;
+    job->cost = ((vi->width + 15) / 16) * ((vi->height + 15) / 16) / (double)job->weight;
+
+    job->fw = fopen(job->output, "wb");
+    if (job->fw == NULL)
+    {
+        printf("Error opening the output file %s\n", job->output);
+        return false;
+    }
+
+    job->ready = backend->createSession(&job->session, job->device, &job->config);
+    if (job->ready && !backend->sendConfig(&job->session, &job->config, ENC_CONFIG_ALL))
+    {
+        fprintf(stderr, "OVEncodeSendConfig returned error\n");
+        return false;
+    }
+    return job->ready;
+}
+
+
+/*******************************************************************************
+ *  @fn     schedPick
+ *  @brief  Weighted fair queuing: the job that can submit a frame and whose
+ *          next task has the smallest virtual finish time
+ *  @param[in] dev : Device
+ *  @return SchedJob* : the job or NULL if none can submit.
+ ******************************************************************************/
+SchedJob *schedPick(SchedDevice *dev)
+{
+    SchedJob *next = NULL;
+    double nextFinish = 0;
+
+    for (int i = 0; i < dev->numJobs; i++)
+    {
+        SchedJob *job = dev->jobs[i];
+        if (job->failed || job->inFlight >= job->session.maxInFlight ||
+                job->submitted >= (unsigned)job->source.info->num_frames || BufferIsEmpty(job->frames))
+            continue;
+
+        // a job that was idle starts at the current virtual time, it has no credit
+        double start = job->finish > dev->virtualTime ? job->finish : dev->virtualTime;
+        if (next == NULL || start + job->cost < nextFinish)
+        {
+            next = job;
+            nextFinish = start + job->cost;
+        }
+    }
+    return next;
+}
+
+
+// Writes the output of the oldest task in flight on a device
+void schedComplete(SchedDevice *dev)
+{
+    SchedJob *job = dev->pending[0];
+    dev->numPending--;
+    memmove(dev->pending, dev->pending + 1, dev->numPending * sizeof(SchedJob*));
+    job->inFlight--;
+    if (job->failed)
+        return;
+
+    const EncoderBackend *encoder = job->session.backend;
+	OVE_OUTPUT_DESCRIPTION taskDescriptionList = {sizeof(OVE_OUTPUT_DESCRIPTION), 0, OVE_TASK_STATUS_NONE, 0, 0};
+    if (!encoder->query(&job->session, &taskDescriptionList))
+    {
+        fprintf(stderr, "%s: query failed\n", job->input);
+        job->failed = true;
+        return;
+    }
+
+    if (taskDescriptionList.status == OVE_TASK_STATUS_COMPLETE &&
+            taskDescriptionList.size_of_bitstream_data > 0)
+    {
+        if (fwrite(taskDescriptionList.bitstream_data, 1, taskDescriptionList.size_of_bitstream_data, job->fw) !=
+                taskDescriptionList.size_of_bitstream_data)
+        {
+            fprintf(stderr, "%s: cannot write the output at frame %u\n", job->input, (unsigned int)job->encoded);
+            job->failed = true;
+        }
+    }
+    releaseQueried(&job->session, &taskDescriptionList);
+    if (job->failed)
+        return;
+
+    if (InterlockedIncrement(&job->encoded) == job->source.info->num_frames)
+        job->endUs = schedClock.getInMicroSec();
+}
+
+
+/*******************************************************************************
+ *  @fn     schedDeviceThread
+ *  @brief  Submits the frames of the jobs of a device in fair order, keeping
+ *          up to SCHED_DEVICE_DEPTH tasks in flight
+ ******************************************************************************/
+DWORD WINAPI schedDeviceThread(LPVOID param)
+{
+    SchedDevice *dev = (SchedDevice*)param;
+
+    OVE_ENCODE_PARAMETERS_H264 pictureParameter;
+	memset(&pictureParameter, 0, sizeof(OVE_ENCODE_PARAMETERS_H264));
+	pictureParameter.size = sizeof(OVE_ENCODE_PARAMETERS_H264);
+	pictureParameter.pictureStructure = OVE_PICTURE_STRUCTURE_H264_FRAME;
+	pictureParameter.forceRefreshMap = (OVE_BOOL)true;
+	pictureParameter.forcePicType = OVE_PICTURE_TYPE_H264_NONE;
+
+    while (!*dev->stop)
+    {
+        SchedJob *job = dev->numPending < SCHED_DEVICE_DEPTH ? schedPick(dev) : NULL;
+        if (job)
+        {
+            double start = job->finish > dev->virtualTime ? job->finish : dev->virtualTime;
+            job->finish = start + job->cost;
+            dev->virtualTime = start;
+
+            BufferType pBuf = 0;
+            BufferRead(job->frames, &pBuf);
+            pictureParameter.insertSPS = (OVE_BOOL)(job->submitted == 0);
+
+            unsigned int iTaskID;
+            bool submitted = job->session.backend->submit(&job->session, (BYTE*)pBuf, &pictureParameter, &iTaskID);
+            free(pBuf);
+            if (!submitted)
+            {
+                fprintf(stderr, "%s: submit failed at frame %u\n", job->input, job->submitted);
+                job->failed = true;
+                continue;
+            }
+
+            if (job->submitted++ == 0)
+                job->startUs = schedClock.getInMicroSec();
+            job->inFlight++;
+            dev->pending[dev->numPending++] = job;
+            continue;
+        }
+
+        if (dev->numPending > 0)
+        {
+            schedComplete(dev);
+            continue;
+        }
+
+        // nothing in flight: done, or waiting for the decoders
+        bool done = true;
+        for (int i = 0; i < dev->numJobs; i++)
+        {
+            if (!dev->jobs[i]->failed && dev->jobs[i]->encoded < dev->jobs[i]->source.info->num_frames)
+                done = false;
+        }
+        if (done)
+            break;
+        Sleep(1);
+    }
+
+    // drain the tasks still in flight after a stop
+    while (dev->numPending > 0)
+        schedComplete(dev);
+    return 0;
+}
+
+
+/*******************************************************************************
+ *  @fn     schedEncodeProcess
+ *  @brief  Encodes the jobs of a job list concurrently, the jobs are spread
+ *          over the devices and share them by weight
+ *  @param[in] jobList    : Job list file
+ *  @param[in] backend    : Encoder backend
+ *  @param[in] devices    : Devices, with their contexts created
+ *  @param[in] numDevices : Number of devices
+ *  @return bool : true if every job succeeded; otherwise false.
+ ******************************************************************************/
+bool schedEncodeProcess(char *jobList, const EncoderBackend *backend, EncoderDevice *devices, unsigned int numDevices)
+{
+    SchedJob *jobs = new SchedJob[SCHED_MAX_JOBS];
+    int numJobs = schedLoadJobs(jobList, jobs);
+    if (numJobs <= 0)
+    {
+        delete [] jobs;
+        return false;
+    }
+
+    InitializeCriticalSection(&avsLock);
+    schedClock.start();
+    volatile LONG stop = 0;
+
+    SchedDevice *devs = new SchedDevice[numDevices];
+    memset(devs, 0, sizeof(SchedDevice) * numDevices);
+    for (unsigned int d = 0; d < numDevices; d++)
+    {
+        devs[d].device = &devices[d];
+        devs[d].stop = &stop;
+    }
+
+    // Jobs are spread over the devices
+    bool status = true;
+    for (int i = 0; i < numJobs; i++)
+    {
+        SchedJob *job = &jobs[i];
+        SchedDevice *dev = &devs[i % numDevices];
+        job->device = dev->device;
+        job->stop = &stop;
+        job->frames = newBuffer();
+        if (!schedOpenJob(job, backend))
+        {
+            job->failed = true;
+            status = false;
+            continue;
+        }
+
+        fprintf(stderr, "Job %-3d %dx%d %d frames, weight %u, priority %d: %s\n", i + 1,
+                job->source.info->width, job->source.info->height, job->source.info->num_frames,
+                job->weight, (int)job->config.priority, job->input);
+        job->hThreadDec = CreateThread(NULL, 0, schedDecodeThread, job, 0, NULL);
+        dev->jobs[dev->numJobs++] = job;
+    }
+
+    HANDLE *threads = new HANDLE[numDevices];
+    for (unsigned int d = 0; d < numDevices; d++)
+        threads[d] = CreateThread(NULL, 0, schedDeviceThread, &devs[d], 0, NULL);
+
+    // Progress, all jobs together
+    while (WaitForMultipleObjects(numDevices, threads, TRUE, 1000) == WAIT_TIMEOUT)
+    {
+        if (GetAsyncKeyState(VK_F8))
+            InterlockedExchange(&stop, 1);
+
+        unsigned int frames = 0, finished = 0;
+        for (int i = 0; i < numJobs; i++)
+        {
+            frames += jobs[i].encoded;
+            finished += jobs[i].failed || (jobs[i].ready && jobs[i].encoded == jobs[i].source.info->num_frames);
+        }
+        fprintf(stderr, "\r%u/%d jobs  %u frames  Fps: %3.3f", finished, numJobs, frames,
+                frames * 1000000.0 / schedClock.getInMicroSec());
+    }
+    fprintf(stderr, "\n\n");
+    InterlockedExchange(&stop, 1);
+
+    // Throughput of each job
+    for (int i = 0; i < numJobs; i++)
+    {
+        SchedJob *job = &jobs[i];
+        if (job->hThreadDec)
+        {
+            WaitForSingleObject(job->hThreadDec, INFINITE);
+            CloseHandle(job->hThreadDec);
+        }
+        if (job->fw && fclose(job->fw) != 0)
+        {
+            fprintf(stderr, "%s: cannot write the output\n", job->output);
+            job->failed = true;
+        }
+        job->fw = NULL;
+
+        bool complete = job->ready && !job->failed && job->encoded == job->source.info->num_frames;
+        double end = complete ? job->endUs : schedClock.getInMicroSec();
+        double seconds = job->submitted ? (end - job->startUs) / 1000000.0 : 0;
+        fprintf(stderr, "Job %-3d %6d frames %9.2f s %9.2f fps  %s%s\n", i + 1, (int)job->encoded, seconds,
+                seconds > 0 ? job->encoded / seconds : 0.0, complete ? "" : "(incomplete) ", job->output);
+        status = status && complete;
+
+        // Free the job resources
+        BufferType pBuf;
+        while (BufferRead(job->frames, &pBuf))
+            free(pBuf);
+        free(job->frames);
+        if (job->ready)
+            backend->releaseSession(&job->session);
+        avsClose(&job->source);
+    }
+
+    for (unsigned int d = 0; d < numDevices; d++)
+        CloseHandle(threads[d]);
+    delete [] threads;
+    delete [] devs;
+    delete [] jobs;
+    DeleteCriticalSection(&avsLock);
+
+    return status;
+}
+
+#endif
@@ -0,0 +1,408 @@
+/*******************************************************************************
+* This file is part of AvsVCEh264.
+* Contains the HLS & DASH segmenter of the single session encode: the stream is
+* muxed as fragmented MP4 and cut at the first IDR after every segment
+* duration. Each segment is closed as soon as its last frame is encoded and the
+* playlist is rewritten with it, so the segments can be served while the clip
+* is still being encoded.
+*
+* output.m3u8 or output.mpd, next to output-init.mp4 with the moov of the
+* stream and output-00001.m4s, output-00002.m4s... with its fragments. Both
+* playlists point to the same CMAF segments, without audio. The segments are
+* only cut at the frames of the keyframe list, so they are all known, and the
+* longest one with them, when the encode starts.
+*
+* Copyright (C) 2013 David Gonzlez Garca <davidgg666@gmail.com>
+*******************************************************************************/
+#ifndef SEGMENTER_H
+#define SEGMENTER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "ini.h"
+#include "keyframes.h"
+
+#define SEGMENT_RENAME_TRIES    10      // the playlist may be open in the web server
+#define SEGMENT_RENAME_WAIT_MS  20
+
+typedef struct SegmentConfig
+{
+    unsigned int duration;      // seconds of a segment, longer when there is no IDR at its end
+} SegmentConfig;
+
+SegmentConfig segmentConfig = {6};
+
+typedef struct Segmenter
+{
+    const AVS_VideoInfo *vi;
+    bool            dash;               // .mpd, .m3u8 otherwise
+    char            playlist[MAX_PATH];
+    char            base[MAX_PATH];     // segment names without their suffix
+    const char      *name;              // the same without the path, for the URIs
+    char            codecs[16];         // avc1.PPCCLL of the first SPS
+    char            startTime[32];      // availabilityStartTime of the DASH MPD
+    unsigned int    segmentFrames;
+    const KeyframeList *keyframes;      // the frames where a segment can end
+    unsigned int    cursor;             // next of them
+    unsigned int    targetFrames;       // of the longest segment
+    Mp4Muxer        mux;
+    OutputFile      output;             // of the segment being written
+    BitstreamArena  arena;
+    bool            open;
+    unsigned int    firstFrame;         // of the segment being written
+    uint64          bytes;              // of its access units
+    unsigned int    *frames;            // of every segment written
+    unsigned int    count;
+    unsigned int    capacity;
+    unsigned int    maxFrames;
+    double          maxBitrate;
+} Segmenter;
+
+
+static int segmentHandler(void* user, const char* section, const char* name, const char* value)
+{
+    SegmentConfig *pSegment = (SegmentConfig*)user;
+    unsigned int uVal = (unsigned int)atoi(value);
+
+    if (strcmp(section, "segments") != 0)
+        return 1;
+
+    if (strcmp(name, "duration") == 0)
+        pSegment->duration = uVal < 1 ? 1 : uVal;
+
+    return 1;
+}
+
+
+// Reads the [segments] section of the configuration file
+void segmentInit(char *configFilename)
+{
+    ini_parse(configFilename, segmentHandler, &segmentConfig);
+}
+
+
+// The output is segmented when its name ends with .m3u8 (HLS) or .mpd (DASH)
+bool segmentIsOutput(const char *fileName)
+{
+    size_t length = strlen(fileName);
+    return (length > 5 && _stricmp(fileName + length - 5, ".m3u8") == 0) ||
+           (length > 4 && _stricmp(fileName + length - 4, ".mpd") == 0);
+}
+
+
+/*******************************************************************************
+ *  @fn     segmentLength
+ *  @brief  Frames of a segment: the configured duration, rounded up to a
+ *          multiple of encIDRPeriod when it is set, so the segments end on
+ *          the IDRs of the encoder
+ *  @param[in] pConfig : OvConfigCtrl
+ *  @param[in] vi      : Video info of the clip
+ *  @return unsigned int : Frames
+ ******************************************************************************/
+unsigned int segmentLength(OvConfigCtrl *pConfig, const AVS_VideoInfo *vi)
+{
+    unsigned int frames = (unsigned int)(((uint64)segmentConfig.duration * vi->fps_numerator +
+                                          vi->fps_denominator / 2) / vi->fps_denominator);
+    if (frames < 1)
+        frames = 1;
+
+    unsigned int idrPeriod = pConfig->pictControl.encIDRPeriod;
+    if (idrPeriod > 0)
+        frames = (frames + idrPeriod - 1) / idrPeriod * idrPeriod;
+    return frames;
+}
+
+
+/*******************************************************************************
+ *  @fn     segmentOpen
+ *  @brief  Starts the segmenter of an output, the init segment is written with
+ *          the first access unit. A segment ends at the first keyframe after
+ *          segmentFrames, which gives the longest one before any is encoded.
+ *  @param[out] seg      : Segmenter
+ *  @param[in] outFile   : Playlist, .m3u8 or .mpd
+ *  @param[in] vi        : Video info of the clip
+ *  @param[in] pConfig   : OvConfigCtrl, for the IDR period
+ *  @param[in] keyframes : Keyframes of the encode, forced to IDRs
+ ******************************************************************************/
+void segmentOpen(Segmenter *seg, char *outFile, const AVS_VideoInfo *vi, OvConfigCtrl *pConfig,
+                 const KeyframeList *keyframes)
+{
+    memset(seg, 0, sizeof(Segmenter));
+    seg->vi = vi;
+    size_t length = strlen(outFile);
+    seg->dash = _stricmp(outFile + length - 4, ".mpd") == 0;
+    seg->segmentFrames = segmentLength(pConfig, vi);
+    seg->keyframes = keyframes;
+    strcpy(seg->playlist, outFile);
+
+    // the segments as they will be cut, the first one is the one being written
+    unsigned int start = 0;
+    for (unsigned int i = 0; i < keyframes->count; i++)
+    {
+        if (keyframes->frames[i] < start + seg->segmentFrames)
+            continue;
+        if (keyframes->frames[i] - start > seg->targetFrames)
+            seg->targetFrames = keyframes->frames[i] - start;
+        start = keyframes->frames[i];
+    }
+    if ((unsigned)vi->num_frames - start > seg->targetFrames)
+        seg->targetFrames = vi->num_frames - start;
+
+    snprintf(seg->base, MAX_PATH, "%.*s", (int)(length - (seg->dash ? 4 : 5)), outFile);
+    seg->name = seg->base;
+    if (strrchr(seg->name, '\\'))
+        seg->name = strrchr(seg->name, '\\') + 1;
+    if (strrchr(seg->name, '/'))
+        seg->name = strrchr(seg->name, '/') + 1;
+
+    time_t now = time(NULL);
+    strftime(seg->startTime, sizeof(seg->startTime), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+
+    mp4Open(&seg->mux, vi, NULL);
+    fprintf(stderr, "Segments    %s, %u frames, at most %u\n", seg->dash ? "DASH" : "HLS",
+            seg->segmentFrames, seg->targetFrames);
+}
+
+
+/*******************************************************************************
+ *  @fn     segmentPlaylist
+ *  @brief  Writes the playlist of the segments written so far, to a temporary
+ *          file that replaces it, so a server never reads half of it
+ *  @param[in] seg      : Segmenter
+ *  @param[in] complete : The last segment is written
+ *  @return bool : true if successful; otherwise false.
+ ******************************************************************************/
+static bool segmentPlaylist(Segmenter *seg, bool complete)
+{
+    const AVS_VideoInfo *vi = seg->vi;
+    double frameTime = (double)vi->fps_denominator / vi->fps_numerator;
+
+    char tempFile[MAX_PATH];
+    snprintf(tempFile, MAX_PATH, "%s.tmp", seg->playlist);
+    FILE *fw = fopen(tempFile, "w");
+    if (fw == NULL)
+    {
+        fprintf(stderr, "\nError creating %s\n", tempFile);
+        return false;
+    }
+
+    if (!seg->dash)
+    {
+        // the target is the longest segment, known from the start, rounded as the EXTINF are
+        unsigned int target = (unsigned int)(seg->targetFrames * frameTime + 0.5);
+        if (target < segmentConfig.duration)
+            target = segmentConfig.duration;
+
+        fprintf(fw, "#EXTM3U\n#EXT-X-VERSION:7\n#EXT-X-TARGETDURATION:%u\n#EXT-X-MEDIA-SEQUENCE:0\n", target);
+        fprintf(fw, "#EXT-X-PLAYLIST-TYPE:EVENT\n#EXT-X-INDEPENDENT-SEGMENTS\n");
+        fprintf(fw, "#EXT-X-MAP:URI=\"%s-init.mp4\"\n", seg->name);
+        for (unsigned int i = 0; i < seg->count; i++)
+            fprintf(fw, "#EXTINF:%.3f,\n%s-%05u.m4s\n", seg->frames[i] * frameTime, seg->name, i + 1);
+        if (complete)
+            fprintf(fw, "#EXT-X-ENDLIST\n");
+    }
+    else
+    {
+        // dynamic while the segments are added, static once they are all there
+        unsigned int numFrames = 0;
+        for (unsigned int i = 0; i < seg->count; i++)
+            numFrames += seg->frames[i];
+
+        fprintf(fw, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                    "<MPD xmlns=\"urn:mpeg:dash:schema:mpd:2011\" profiles=\"urn:mpeg:dash:profile:isoff-live:2011\"\n"
+                    "     minBufferTime=\"PT%uS\" ", segmentConfig.duration);
+        if (complete)
+            fprintf(fw, "type=\"static\" mediaPresentationDuration=\"PT%.3fS\">\n", numFrames * frameTime);
+        else
+            fprintf(fw, "type=\"dynamic\" availabilityStartTime=\"%s\" minimumUpdatePeriod=\"PT%uS\">\n",
+                    seg->startTime, segmentConfig.duration);
+
+        fprintf(fw, "  <Period id=\"0\" start=\"PT0S\">\n"
+                    "    <AdaptationSet mimeType=\"video/mp4\" segmentAlignment=\"true\" startWithSAP=\"1\">\n"
+                    "      <Representation id=\"video\" codecs=\"%s\" width=\"%d\" height=\"%d\" frameRate=\"%u/%u\" "
+                    "bandwidth=\"%.0f\">\n",
+                seg->codecs, vi->width, vi->height, vi->fps_numerator, vi->fps_denominator, seg->maxBitrate);
+        fprintf(fw, "        <SegmentTemplate timescale=\"%u\" initialization=\"%s-init.mp4\" "
+                    "media=\"%s-$Number%%05d$.m4s\" startNumber=\"1\">\n"
+                    "          <SegmentTimeline>\n",
+                vi->fps_numerator, seg->name, seg->name);
+
+        // the segments of the same length in one S, repeated
+        uint64 start = 0;
+        for (unsigned int i = 0; i < seg->count; )
+        {
+            unsigned int repeat = 0;
+            while (i + repeat + 1 < seg->count && seg->frames[i + repeat + 1] == seg->frames[i])
+                repeat++;
+            uint64 duration = (uint64)seg->frames[i] * vi->fps_denominator;
+            fprintf(fw, "            <S t=\"%.0f\" d=\"%.0f\"", (double)start, (double)duration);
+            if (repeat)
+                fprintf(fw, " r=\"%u\"", repeat);
+            fprintf(fw, "/>\n");
+            start += duration * (repeat + 1);
+            i += repeat + 1;
+        }
+        fprintf(fw, "          </SegmentTimeline>\n"
+                    "        </SegmentTemplate>\n"
+                    "      </Representation>\n"
+                    "    </AdaptationSet>\n"
+                    "  </Period>\n"
+                    "</MPD>\n");
+    }
+
+    // a server reading the playlist can hold it for a moment; the segments
+    // keep going without one update, but not without the last one
+    bool status = fclose(fw) == 0;
+    bool replaced = false;
+    for (int i = 0; status && !replaced && i < SEGMENT_RENAME_TRIES; i++)
+    {
+        if (i > 0)
+            Sleep(SEGMENT_RENAME_WAIT_MS);
+        replaced = MoveFileEx(tempFile, seg->playlist, MOVEFILE_REPLACE_EXISTING) != 0;
+    }
+    if (!replaced)
+    {
+        remove(tempFile);
+        if (complete || !status)
+        {
+            fprintf(stderr, "\nError replacing %s\n", seg->playlist);
+            return false;
+        }
+        fprintf(stderr, "\nWarning: %s was not updated, it gets the segment with the next one\n", seg->playlist);
+    }
+    return true;
+}
+
+
+// Creates the file of the next segment
+static bool segmentStart(Segmenter *seg)
+{
+    char fileName[MAX_PATH];
+    snprintf(fileName, MAX_PATH, "%s-%05u.m4s", seg->base, seg->count + 1);
+    if (!outputOpen(&seg->output, fileName, 0, 0))
+        return false;
+
+    arenaOpen(&seg->arena, &seg->output);
+    seg->open = true;
+    seg->firstFrame = seg->mux.firstFrame;      // the frames left in the muxer are in this one
+    seg->bytes = 0;
+    return true;
+}
+
+
+// Closes the segment being written & adds it to the playlist
+static bool segmentFinish(Segmenter *seg, bool complete)
+{
+    const AVS_VideoInfo *vi = seg->vi;
+    bool status = (complete ? mp4Close(&seg->mux, &seg->arena) : mp4Fragment(&seg->mux, &seg->arena));
+    status = arenaClose(&seg->arena) && status;
+    status = outputClose(&seg->output) && status;
+    seg->open = false;
+    if (!status)
+        return false;
+
+    unsigned int frames = seg->mux.firstFrame - seg->firstFrame;
+    if (seg->count == seg->capacity)
+    {
+        seg->capacity = seg->capacity ? seg->capacity * 2 : 256;
+        seg->frames = (unsigned int*) realloc(seg->frames, seg->capacity * sizeof(unsigned int));
+    }
+    seg->frames[seg->count++] = frames;
+    if (frames > seg->maxFrames)
+        seg->maxFrames = frames;
+
+    double bitrate = frames ? seg->bytes * 8.0 * vi->fps_numerator / ((double)frames * vi->fps_denominator) : 0;
+    if (bitrate > seg->maxBitrate)
+        seg->maxBitrate = bitrate;
+
+    return segmentPlaylist(seg, complete);
+}
+
+
+/*******************************************************************************
+ *  @fn     segmentAppend
+ *  @brief  Adds the access unit of the next frame. The first one writes the
+ *          init segment, and an IDR ends the segment being written once it
+ *          is segmentFrames long.
+ *  @param[in/out] seg : Segmenter
+ *  @param[in] data    : Annex-B access unit
+ *  @param[in] size    : Bytes
+ *  @return bool : false if a segment or the playlist could not be written;
+ *                 otherwise true.
+ ******************************************************************************/
+bool segmentAppend(Segmenter *seg, const BYTE *data, unsigned int size)
+{
+    if (!seg->mux.started)
+    {
+        // avc1 with the profile, compatibility & level of the SPS
+        unsigned int pos = 0;
+        AnnexbNal nal;
+        while (annexbNextNal(data, size, &pos, &nal))
+        {
+            if (nal.type == NAL_SPS && nal.size - nal.header >= 4)
+            {
+                const BYTE *sps = nal.data + nal.header;
+                snprintf(seg->codecs, sizeof(seg->codecs), "avc1.%02X%02X%02X", sps[1], sps[2], sps[3]);
+                break;
+            }
+        }
+
+        // the header goes to the init segment, the frame stays in the muxer
+        char fileName[MAX_PATH];
+        snprintf(fileName, MAX_PATH, "%s-init.mp4", seg->base);
+        if (!outputOpen(&seg->output, fileName, 0, 0))
+            return false;
+        arenaOpen(&seg->arena, &seg->output);
+        bool status = mp4Append(&seg->mux, &seg->arena, data, size);
+        status = arenaClose(&seg->arena) && status;
+        status = outputClose(&seg->output) && status;
+        if (!status || !segmentStart(seg))
+            return false;
+        seg->bytes = size;
+        return true;
+    }
+
+    // only a keyframe ends a segment, the other IDRs would change the segments planned
+    unsigned int frame = seg->mux.firstFrame + seg->mux.count;
+    const KeyframeList *keyframes = seg->keyframes;
+    while (seg->cursor < keyframes->count && keyframes->frames[seg->cursor] < frame)
+        seg->cursor++;
+    bool keyframe = seg->cursor < keyframes->count && keyframes->frames[seg->cursor] == frame;
+    if (keyframe && frame - seg->firstFrame >= seg->segmentFrames &&
+            annexbIsIdr(data, size) && (!segmentFinish(seg, false) || !segmentStart(seg)))
+        return false;
+
+    seg->bytes += size;
+    return mp4Append(&seg->mux, &seg->arena, data, size);
+}
+
+
+/*******************************************************************************
+ *  @fn     segmentClose
+ *  @brief  Writes the last segment & the final playlist, and frees the
+ *          segmenter
+ *  @param[in/out] seg : Segmenter
+ *  @return bool : false if a segment or the playlist could not be written;
+ *                 otherwise true.
+ ******************************************************************************/
+bool segmentClose(Segmenter *seg)
+{
+    bool status = true;
+    if (seg->open)
+        status = segmentFinish(seg, true);
+    else
+    {
+        seg->mux.count = 0;     // no segment to write them to
+        mp4Close(&seg->mux, NULL);
+    }
+
+    if (seg->count)
+        fprintf(stderr, "Segments    %u written, longest %.3f s, %.0f kbps peak\n", seg->count,
+                (double)seg->maxFrames * seg->vi->fps_denominator / seg->vi->fps_numerator, seg->maxBitrate / 1000);
+    free(seg->frames);
+    return status;
+}
+
+#endif
@@ -0,0 +1,683 @@
+/*******************************************************************************
+* This file is part of AvsVCEh264.
+* Contains the smart cut: ranges of frames of an encoded stream are written to
+* a new one. Each range is copied byte for byte from its first IDR on, only
+* the frames before that IDR are encoded again from the script, starting with
+* an IDR and SPS/PPS. The SPS/PPS are written again where the copied and the
+* encoded parts would use different ones. An encoded part never ends on an
+* IDR, which could have the idr_pic_id of the copied IDR after it: it is
+* encoded again with the next GOP of the range. A range that ends on an IDR
+* is followed by the IDR of the next range: that one gets another
+* idr_pic_id when they share it.
+*
+* Copyright (C) 2013 David Gonzlez Garca <davidgg666@gmail.com>
+*******************************************************************************/
+#ifndef SMARTCUT_H
+#define SMARTCUT_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "nalrewrite.h"
+
+#define CUT_BLOCK_SIZE      (1 << 20)   // bytes of the stream scanned at a time
+#define CUT_COPY_SIZE       (1 << 30)   // bytes copied per incrCopy call
+
+// Access unit of the stream, one per frame
+typedef struct CutFrame
+{
+    uint64          offset;         // first byte in the stream
+    int             sps;            // parameter sets in use, index in CutStream.params
+    int             pps;
+    bool            idr;
+    bool            hasParams;      // its access unit carries both SPS & PPS
+} CutFrame;
+
+// Distinct SPS or PPS of the stream, from the NAL header
+typedef struct CutParamSet
+{
+    BYTE            *nal;
+    unsigned int    size;
+} CutParamSet;
+
+typedef struct CutStream
+{
+    HANDLE          file;
+    uint64          size;
+    CutFrame        *frames;
+    unsigned int    numFrames;
+    unsigned int    capacity;
+    CutParamSet     *params;
+    int             numParams;
+} CutStream;
+
+// Frames first to last, both included
+typedef struct CutRange
+{
+    unsigned int    first;
+    unsigned int    last;
+} CutRange;
+
+
+// Index of a parameter set in the table, added when it differs from the current one
+static int cutParamSet(CutStream *stream, int current, const BYTE *nal, unsigned int size)
+{
+    if (current >= 0 && stream->params[current].size == size &&
+            memcmp(stream->params[current].nal, nal, size) == 0)
+        return current;
+
+    stream->params = (CutParamSet*) realloc(stream->params, (stream->numParams + 1) * sizeof(CutParamSet));
+    CutParamSet *set = &stream->params[stream->numParams];
+    set->nal = (BYTE*) malloc(size);
+    memcpy(set->nal, nal, size);
+    set->size = size;
+    return stream->numParams++;
+}
+
+
+/*******************************************************************************
+ *  @fn     cutScan
+ *  @brief  Finds the access units of an Annex-B stream, reading it a block at a
+ *          time. A new one starts at an AUD, at an SEI, SPS or PPS after a
+ *          slice, or at a slice with first_mb_in_slice 0 after another slice.
+ *  @param[in] fileName : Encoded stream
+ *  @param[out] stream  : Access units & parameter sets, the file is kept open
+ *  @return bool : true if successful; otherwise false.
+ ******************************************************************************/
+bool cutScan(char *fileName, CutStream *stream)
+{
+    memset(stream, 0, sizeof(CutStream));
+    stream->file = CreateFile(fileName, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                              FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (stream->file == INVALID_HANDLE_VALUE)
+    {
+        fprintf(stderr, "Error opening the encoded stream %s\n", fileName);
+        return false;
+    }
+
+    BYTE *block = (BYTE*) malloc(CUT_BLOCK_SIZE);
+    uint64 base = 0;                // stream position of block[0]
+    unsigned int length = 0, from = 0;
+    uint64 auStart = 0;
+    bool auSlice = false, eof = false;
+    int sps = -1, pps = -1, auParams = 0;
+
+    while (!eof)
+    {
+        DWORD read = 0;
+        if (!ReadFile(stream->file, block + length, CUT_BLOCK_SIZE - length, &read, NULL))
+        {
+            fprintf(stderr, "Error reading the encoded stream %s\n", fileName);
+            free(block);
+            return false;
+        }
+        length += read;
+        eof = read == 0;
+
+        // the last bytes wait for the next block, a start code & NAL header may be cut
+        unsigned int limit = eof ? length : (length > 5 ? length - 5 : 0);
+        unsigned int pos = from;
+        while ((pos = annexbFindStartCode(block, pos, length)) < limit)
+        {
+            BYTE type = pos + 3 < length ? block[pos + 3] & 0x1F : 0;
+            bool firstMb = pos + 4 < length && (block[pos + 4] & 0x80);
+            uint64 offset = base + pos - (pos > 0 && block[pos - 1] == 0);
+
+            // the parameter sets are kept whole, they wait for the next block if cut
+            unsigned int end = length;
+            if (type == NAL_SPS || type == NAL_PPS)
+            {
+                end = annexbFindStartCode(block, pos + 3, length);
+                if (end == length && !eof)
+                    break;
+                while (end > pos + 3 && end < length && block[end - 1] == 0)
+                    end--;
+            }
+
+            bool newPicture = (type == NAL_SLICE || type == NAL_IDR) && firstMb;
+            if (auSlice && (type == NAL_AUD || type == NAL_SEI || type == NAL_SPS ||
+                            type == NAL_PPS || newPicture))
+            {
+                auStart = offset;
+                auSlice = false;
+                auParams = 0;
+            }
+
+            if (type == NAL_SPS || type == NAL_PPS)
+            {
+                if (type == NAL_SPS)
+                    sps = cutParamSet(stream, sps, block + pos + 3, end - pos - 3);
+                else
+                    pps = cutParamSet(stream, pps, block + pos + 3, end - pos - 3);
+                auParams |= type == NAL_SPS ? 1 : 2;
+            }
+            else if (newPicture && !auSlice)
+            {
+                if (stream->numFrames == stream->capacity)
+                {
+                    stream->capacity = stream->capacity ? stream->capacity * 2 : 4096;
+                    stream->frames = (CutFrame*) realloc(stream->frames, stream->capacity * sizeof(CutFrame));
+                }
+                CutFrame *frame = &stream->frames[stream->numFrames++];
+                frame->offset = auStart;
+                frame->sps = sps;
+                frame->pps = pps;
+                frame->idr = type == NAL_IDR;
+                frame->hasParams = auParams == 3;
+                auSlice = true;
+            }
+            pos += 3;
+        }
+
+        // keep the bytes not scanned, and the one before them for the zero_byte
+        unsigned int resume = pos < limit ? pos : limit;
+        unsigned int keep = resume > 0 ? resume - 1 : 0;
+        memmove(block, block + keep, length - keep);
+        base += keep;
+        length -= keep;
+        from = resume > 0 ? 1 : 0;
+    }
+    stream->size = base + length;
+
+    free(block);
+    return true;
+}
+
+
+void cutFree(CutStream *stream)
+{
+    if (stream->file && stream->file != INVALID_HANDLE_VALUE)
+        CloseHandle(stream->file);
+    for (int i = 0; i < stream->numParams; i++)
+        free(stream->params[i].nal);
+    free(stream->params);
+    free(stream->frames);
+    memset(stream, 0, sizeof(CutStream));
+}
+
+
+/*******************************************************************************
+ *  @fn     cutLoad
+ *  @brief  Reads the ranges of a cut list: two frame numbers per line, the
+ *          first & last frame kept, written in the order of the list
+ *  @param[in] fileName   : Cut list
+ *  @param[in] numFrames  : Frames of the stream
+ *  @param[out] numRanges : Ranges read
+ *  @return CutRange* : the ranges or NULL if failed.
+ ******************************************************************************/
+CutRange *cutLoad(char *fileName, unsigned int numFrames, int *numRanges)
+{
+    FILE *fr = fopen(fileName, "r");
+    if (fr == NULL)
+    {
+        fprintf(stderr, "Error opening the cut list %s\n", fileName);
+        return NULL;
+    }
+
+    // the frame numbers of a line are parsed as the keyframe list does
+    CutRange *ranges = NULL;
+    KeyframeList line;
+    memset(&line, 0, sizeof(KeyframeList));
+    char text[1024];
+    int count = 0, lineNumber = 0;
+    bool ok = true;
+    while (ok && fgets(text, sizeof(text), fr))
+    {
+        lineNumber++;
+        if (!keyframeLineComplete(text, fr))
+        {
+            fprintf(stderr, "Line %d of the cut list is too long\n", lineNumber);
+            ok = false;
+            break;
+        }
+        line.count = 0;
+        bool parsed = keyframeParse(&line, text);
+        if (parsed && line.count == 0)
+            continue;
+
+        if (!parsed || line.count != 2 || line.frames[0] > line.frames[1] || line.frames[1] >= numFrames)
+        {
+            fprintf(stderr, "Invalid range in line %d of the cut list, the stream has %u frames\n",
+                    lineNumber, numFrames);
+            ok = false;
+            break;
+        }
+        ranges = (CutRange*) realloc(ranges, (count + 1) * sizeof(CutRange));
+        ranges[count].first = line.frames[0];
+        ranges[count].last = line.frames[1];
+        count++;
+    }
+    fclose(fr);
+    keyframeFree(&line);
+
+    if (ok && count == 0)
+    {
+        fprintf(stderr, "The cut list %s has no ranges\n", fileName);
+        ok = false;
+    }
+    if (!ok)
+    {
+        free(ranges);
+        return NULL;
+    }
+    *numRanges = count;
+    return ranges;
+}
+
+
+// Records a parameter set of the stream as the last one written
+static bool cutSetHeader(ChunkHeaders *headers, int i, CutParamSet *set)
+{
+    BYTE *copy = (BYTE*) realloc(headers->nal[i], set->size);
+    if (copy == NULL)
+        return false;
+    headers->nal[i] = copy;
+    memcpy(headers->nal[i], set->nal, set->size);
+    headers->size[i] = set->size;
+    return true;
+}
+
+
+// Writes a parameter set with a 4 byte start code, unless it is the last one written
+static bool cutWriteParamSet(FILE *fw, ChunkHeaders *headers, int i, CutParamSet *set)
+{
+    static const BYTE startCode[4] = {0, 0, 0, 1};
+    if (headers->nal[i] && headers->size[i] == set->size &&
+            memcmp(headers->nal[i], set->nal, set->size) == 0)
+        return true;
+
+    return fwrite(startCode, 1, 4, fw) == 4 && fwrite(set->nal, 1, set->size, fw) == set->size &&
+           cutSetHeader(headers, i, set);
+}
+
+
+// Reads the access units of count frames from frame n of the stream, to free
+static BYTE *cutReadFrames(CutStream *stream, unsigned int n, unsigned int count, unsigned int *size)
+{
+    uint64 end = n + count < stream->numFrames ? stream->frames[n + count].offset : stream->size;
+    LARGE_INTEGER position;
+    position.QuadPart = stream->frames[n].offset;
+    *size = (unsigned int)(end - stream->frames[n].offset);
+
+    DWORD read = 0;
+    BYTE *data = (BYTE*) malloc(*size + 1);
+    if (data == NULL || !SetFilePointerEx(stream->file, position, NULL, FILE_BEGIN) ||
+            !ReadFile(stream->file, data, *size, &read, NULL) || read != *size)
+    {
+        free(data);
+        return NULL;
+    }
+    return data;
+}
+
+
+/*******************************************************************************
+ *  @fn     cutSpliceIdr
+ *  @brief  Rewrites an IDR access unit that follows an IDR with the same
+ *          idr_pic_id, with one that differs from both IDRs around it
+ *  @param[in] data     : Access unit
+ *  @param[in] size     : Bytes
+ *  @param[in] next     : Access unit after it, NULL if none
+ *  @param[in] nextSize : Bytes
+ *  @param[in] headers  : Last parameter sets written, the SPS in use
+ *  @param[in] lastId   : idr_pic_id of the IDR written before it
+ *  @param[out] out     : Access unit to write instead, to free, NULL if it is kept
+ *  @param[out] outSize : Bytes
+ *  @return bool : true if successful; otherwise false.
+ ******************************************************************************/
+static bool cutSpliceIdr(const BYTE *data, unsigned int size, const BYTE *next, unsigned int nextSize,
+                         ChunkHeaders *headers, unsigned int lastId, BYTE **out, unsigned int *outSize)
+{
+    *out = NULL;
+    const BYTE *sps = headers->nal[0];
+    unsigned int spsSize = headers->size[0];
+    rewriteFindSps(data, size, &sps, &spsSize);
+
+    unsigned int id, nextId = lastId;
+    if (!rewriteGetIdrPicId(data, size, sps, spsSize, &id) || id != lastId)
+        return true;
+    if (next && !rewriteGetIdrPicId(next, nextSize, sps, spsSize, &nextId))
+        nextId = lastId;
+
+    *out = (BYTE*) malloc(REWRITE_IDR_SIZE(size));
+    *outSize = *out ? rewriteIdrPicture(data, size, sps, spsSize, rewriteOtherIdrPicId(id, lastId, nextId), *out) : 0;
+    if (*outSize == 0)
+    {
+        fprintf(stderr, "The idr_pic_id of an IDR could not be rewritten\n");
+        free(*out);
+        *out = NULL;
+        return false;
+    }
+    return true;
+}
+
+
+// idr_pic_id of the last access unit of an encoded part, -1 if it is not an IDR
+static int cutLastIdrPicId(ChunkSegment *segment, ChunkHeaders *headers)
+{
+    unsigned int start = 0, end, id;
+    while ((end = start + rewritePictureEnd(segment->data + start, segment->size - start)) < segment->size)
+        start = end;
+    if (start >= segment->size ||
+            !rewriteGetIdrPicId(segment->data + start, segment->size - start, headers->nal[0], headers->size[0], &id))
+        return -1;
+    return (int)id;
+}
+
+
+/*******************************************************************************
+ *  @fn     cutEncode
+ *  @brief  Encodes frames first to end - 1 of the script on a session, the
+ *          first one as an IDR with SPS/PPS
+ *  @param[in] session     : Encoder session, created
+ *  @param[in] first       : First frame
+ *  @param[in] end         : One past the last frame
+ *  @param[in] frameData   : NV12 frame buffer
+ *  @param[out] segment    : Gets the output
+ *  @param[out] lastIdr    : The last frame was encoded as an IDR
+ *  @return bool : true if successful; otherwise false.
+ ******************************************************************************/
+bool cutEncode(EncoderSession *session, unsigned int first, unsigned int end, BYTE *frameData,
+               ChunkSegment *segment, bool *lastIdr)
+{
+    const EncoderBackend *encoder = session->backend;
+
+	OVE_OUTPUT_DESCRIPTION taskDescriptionList = {sizeof(OVE_OUTPUT_DESCRIPTION), 0, OVE_TASK_STATUS_NONE, 0, 0};
+
+    OVE_ENCODE_PARAMETERS_H264 pictureParameter;
+	memset(&pictureParameter, 0, sizeof(OVE_ENCODE_PARAMETERS_H264));
+	pictureParameter.size = sizeof(OVE_ENCODE_PARAMETERS_H264);
+	pictureParameter.pictureStructure = OVE_PICTURE_STRUCTURE_H264_FRAME;
+	pictureParameter.forceRefreshMap = (OVE_BOOL)true;
+
+    segment->size = 0;
+    for (unsigned int f = first; f < end; f++)
+    {
+        if (GetAsyncKeyState(VK_F8))
+            return false;
+
+        avsGetFrameNV12(f, frameData, session->pitch);
+
+        pictureParameter.insertSPS = (OVE_BOOL)(f == first);
+        pictureParameter.forcePicType = f == first ? OVE_PICTURE_TYPE_H264_IDR : OVE_PICTURE_TYPE_H264_NONE;
+
+        unsigned int iTaskID;
+        if (!encoder->submit(session, frameData, &pictureParameter, &iTaskID) ||
+                !encoder->query(session, &taskDescriptionList))
+        {
+            fprintf(stderr, "Encoding of frames %u-%u failed\n", first, end - 1);
+            return false;
+        }
+
+        bool stored = true;
+        if (taskDescriptionList.status == OVE_TASK_STATUS_COMPLETE &&
+                taskDescriptionList.size_of_bitstream_data > 0)
+        {
+            stored = chunkAppend(segment, (BYTE*)taskDescriptionList.bitstream_data,
+                                 taskDescriptionList.size_of_bitstream_data);
+            *lastIdr = annexbIsIdr((BYTE*)taskDescriptionList.bitstream_data,
+                                   taskDescriptionList.size_of_bitstream_data);
+        }
+        releaseQueried(session, &taskDescriptionList);
+        if (!stored)
+        {
+            fprintf(stderr, "Not enough memory for the output of frames %u-%u\n", first, end - 1);
+            return false;
+        }
+    }
+    return true;
+}
+
+
+/*******************************************************************************
+ *  @fn     cutProcess
+ *  @brief  Writes the ranges of a cut list of an encoded stream to a new one.
+ *          The frames of a range before its first IDR are encoded again from
+ *          the script, the rest of the range is copied.
+ *  @param[in] format     : Frame format & backend of the session
+ *  @param[in] device     : Device on which the session is created
+ *  @param[in] sourceFile : Stream encoded from the script
+ *  @param[in] cutFile    : Cut list
+ *  @param[out] outFile   : Output encoded H.264 video file
+ *  @param[in] pConfig    : OvConfigCtrl, the one of the stream
+ *  @return bool : true if successful; otherwise false.
+ ******************************************************************************/
+bool cutProcess(EncoderSession *format, EncoderDevice *device, char *sourceFile, char *cutFile,
+                char *outFile, OvConfigCtrl *pConfig)
+{
+    char sourcePath[MAX_PATH], outPath[MAX_PATH];
+    if (GetFullPathName(sourceFile, MAX_PATH, sourcePath, NULL) &&
+            GetFullPathName(outFile, MAX_PATH, outPath, NULL) && strcmp(sourcePath, outPath) == 0)
+    {
+        fprintf(stderr, "The output cannot be the encoded stream that is cut\n");
+        return false;
+    }
+
+    CutStream stream;
+    if (!cutScan(sourceFile, &stream))
+    {
+        cutFree(&stream);
+        return false;
+    }
+    if (stream.numFrames == 0 || !stream.frames[0].idr || stream.frames[0].sps < 0 || stream.frames[0].pps < 0)
+    {
+        fprintf(stderr, "%s does not start with SPS, PPS & an IDR\n", sourceFile);
+        cutFree(&stream);
+        return false;
+    }
+    if (stream.numFrames != (unsigned)info->num_frames)
+    {
+        fprintf(stderr, "%s has %u frames, the script %d: it was not encoded from it\n",
+                sourceFile, stream.numFrames, info->num_frames);
+        cutFree(&stream);
+        return false;
+    }
+
+    int numRanges;
+    CutRange *ranges = cutLoad(cutFile, stream.numFrames, &numRanges);
+    if (ranges == NULL)
+    {
+        cutFree(&stream);
+        return false;
+    }
+
+    FILE *fw = outputFopen(outFile, "wb");
+    if (fw == NULL)
+    {
+        printf("Error opening the output file %s\n", outFile);
+        free(ranges);
+        cutFree(&stream);
+        return false;
+    }
+
+    // The session is only created when a range does not start on an IDR
+    EncoderSession session = *format;
+    bool sessionCreated = false;
+    BYTE *frameData = NULL;
+    ChunkSegment segment;
+    memset(&segment, 0, sizeof(ChunkSegment));
+    ChunkHeaders headers;
+    memset(&headers, 0, sizeof(ChunkHeaders));
+    BYTE *buffer = (BYTE*) malloc(INCR_COPY_SIZE);
+
+    unsigned int encodedFrames = 0, copiedFrames = 0, paramChanges = 0, idrRewrites = 0;
+    int lastIdrPicId = -1;          // of the last picture written, -1 if it is not an IDR
+    uint64 copiedBytes = 0;
+    bool status = buffer != NULL;
+    for (int r = 0; status && r < numRanges; r++)
+    {
+        CutRange *range = &ranges[r];
+        unsigned int idr = range->first;
+        while (idr <= range->last && !stream.frames[idr].idr)
+            idr++;
+
+        // Frames before the first IDR of the range
+        if (idr > range->first)
+        {
+            if (!sessionCreated)
+            {
+                sessionCreated = status = session.backend->createSession(&session, device, pConfig);
+                if (status && !session.backend->sendConfig(&session, pConfig, ENC_CONFIG_ALL))
+                {
+                    fprintf(stderr, "OVEncodeSendConfig returned error\n");
+                    status = false;
+                }
+                frameData = (BYTE*) malloc(session.frameSize);
+            }
+
+            // an encoded part ending on an IDR, as a single frame, is encoded again up
+            // to the next IDR of the range, so two IDRs never follow each other there
+            bool lastIdr = false;
+            status = status && cutEncode(&session, range->first, idr, frameData, &segment, &lastIdr);
+            while (status && lastIdr && idr <= range->last)
+            {
+                idr++;
+                while (idr <= range->last && !stream.frames[idr].idr)
+                    idr++;
+                status = cutEncode(&session, range->first, idr, frameData, &segment, &lastIdr);
+            }
+            if (!status)
+                break;
+
+            // its first IDR follows the IDR that ends the previous range
+            if (lastIdrPicId >= 0)
+            {
+                BYTE *spliced = NULL;
+                unsigned int splicedSize = 0;
+                unsigned int first = rewritePictureEnd(segment.data, segment.size);
+                status = cutSpliceIdr(segment.data, first, first < segment.size ? segment.data + first : NULL,
+                                      segment.size - first, &headers, lastIdrPicId, &spliced, &splicedSize);
+                if (spliced)
+                {
+                    BYTE *data = (BYTE*) malloc(splicedSize + segment.size - first);
+                    if (data)
+                    {
+                        memcpy(data, spliced, splicedSize);
+                        memcpy(data + splicedSize, segment.data + first, segment.size - first);
+                        free(segment.data);
+                        segment.data = data;
+                        segment.size = segment.capacity = splicedSize + segment.size - first;
+                        idrRewrites++;
+                    }
+                    status = data != NULL;
+                    free(spliced);
+                }
+            }
+            if (!status || !chunkWriteSegment(fw, &segment, &headers))
+            {
+                fprintf(stderr, "Error writing the output file %s\n", outFile);
+                status = false;
+                break;
+            }
+            lastIdrPicId = cutLastIdrPicId(&segment, &headers);
+            encodedFrames += idr - range->first;
+        }
+
+        // The rest is copied, with the parameter sets in use at its IDR
+        if (idr <= range->last)
+        {
+            CutFrame *frame = &stream.frames[idr];
+            bool differ = false;
+            for (int i = 0; i < 2; i++)
+            {
+                CutParamSet *set = &stream.params[i == 0 ? frame->sps : frame->pps];
+                if (headers.nal[i] == NULL || headers.size[i] != set->size ||
+                        memcmp(headers.nal[i], set->nal, set->size) != 0)
+                    differ = true;
+            }
+            if (differ)
+            {
+                if (headers.nal[0])
+                    paramChanges++;
+                if (!frame->hasParams && (!cutWriteParamSet(fw, &headers, 0, &stream.params[frame->sps]) ||
+                                          !cutWriteParamSet(fw, &headers, 1, &stream.params[frame->pps])))
+                {
+                    fprintf(stderr, "Error writing the output file %s\n", outFile);
+                    status = false;
+                    break;
+                }
+            }
+
+            // its IDR follows the IDR that ends the previous range
+            uint64 start = frame->offset;
+            uint64 end = range->last + 1 < stream.numFrames ? stream.frames[range->last + 1].offset : stream.size;
+            int splicedId = -1;
+            if (lastIdrPicId >= 0)
+            {
+                unsigned int count = idr < range->last ? 2 : 1, size;
+                BYTE *frames = cutReadFrames(&stream, idr, count, &size);
+                unsigned int first = count == 2 ? (unsigned int)(stream.frames[idr + 1].offset - start) : size;
+                BYTE *spliced = NULL;
+                unsigned int splicedSize = 0, id;
+                status = frames && cutSpliceIdr(frames, first, count == 2 ? frames + first : NULL, size - first,
+                                                &headers, lastIdrPicId, &spliced, &splicedSize);
+                if (status && spliced)
+                {
+                    status = fwrite(spliced, 1, splicedSize, fw) == splicedSize;
+                    if (rewriteGetIdrPicId(spliced, splicedSize, headers.nal[0], headers.size[0], &id))
+                        splicedId = (int)id;
+                    start += first;
+                    idrRewrites++;
+                }
+                free(spliced);
+                free(frames);
+            }
+            for (uint64 offset = start; status && offset < end; offset += CUT_COPY_SIZE)
+            {
+                unsigned int size = (unsigned int)(end - offset < CUT_COPY_SIZE ? end - offset : CUT_COPY_SIZE);
+                status = incrCopy(stream.file, offset, size, fw, buffer);
+            }
+            if (!status)
+            {
+                fprintf(stderr, "Error copying frames %u-%u\n", idr, range->last);
+                break;
+            }
+
+            if (!cutSetHeader(&headers, 0, &stream.params[stream.frames[range->last].sps]) ||
+                    !cutSetHeader(&headers, 1, &stream.params[stream.frames[range->last].pps]))
+            {
+                status = false;
+                break;
+            }
+
+            // an IDR at the end of the range, the next range starts with another one
+            lastIdrPicId = range->last == idr ? splicedId : -1;
+            if (stream.frames[range->last].idr && lastIdrPicId < 0)
+            {
+                unsigned int size, id;
+                BYTE *last = cutReadFrames(&stream, range->last, 1, &size);
+                if (last && rewriteGetIdrPicId(last, size, headers.nal[0], headers.size[0], &id))
+                    lastIdrPicId = (int)id;
+                free(last);
+            }
+            copiedFrames += range->last + 1 - idr;
+            copiedBytes += end - frame->offset;
+        }
+
+        fprintf(stderr, "Range %-5d frames %u-%u, %u encoded, %u copied\n", r + 1, range->first,
+                range->last, idr - range->first, idr <= range->last ? range->last + 1 - idr : 0);
+    }
+
+    if (fclose(fw) != 0)
+        status = false;
+    if (sessionCreated)
+        session.backend->releaseSession(&session);
+
+    if (status)
+        fprintf(stderr, "Smart cut   %u frames, %u encoded, %u copied (%.1f MB), %u parameter set changes, "
+                "%u idr_pic_id rewritten\n", encodedFrames + copiedFrames, encodedFrames, copiedFrames,
+                copiedBytes / 1048576.0, paramChanges, idrRewrites);
+    else
+        fprintf(stderr, "\nStopped, %s is incomplete\n", outFile);
+
+    free(segment.data);
+    free(headers.nal[0]);
+    free(headers.nal[1]);
+    free(buffer);
+    free(frameData);
+    free(ranges);
+    cutFree(&stream);
+    return status;
+}
+
+#endif
@@ -0,0 +1,1417 @@
+/*******************************************************************************
+* This file is part of AvsVCEh264.
+* Contains a software H.264 encoder implementing the encoder backend interface,
+* used on machines without a VCE capable GPU.
+* Constrained baseline profile, intra 16x16 macroblocks, CAVLC, no deblocking,
+* SSE2 transform & quantization and one thread per slice.
+*
+* Copyright (C) 2013 David Gonzlez Garca <davidgg666@gmail.com>
+*******************************************************************************/
+#ifndef SWENCODER_H
+#define SWENCODER_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SW_USE_SSE2
+#include <emmintrin.h>
+#endif
+
+#define SW_MAX_SLICES		32
+#define SW_MAX_LEVEL		2047	// keeps every level codable without baseline escapes
+#define SW_RC_MIN_QP		10		// lowest QP the rate control goes down to, a fixed QP can be lower
+
+// Bit writer for RBSP data
+typedef struct SwBitWriter
+{
+    BYTE         *data;
+    unsigned int size;          // bytes written
+    unsigned int capacity;
+    uint64       cache;         // pending bits
+    unsigned int cacheBits;
+    bool         failed;        // out of memory, the bits that did not fit are lost
+} SwBitWriter;
+
+struct SwSession;
+
+typedef struct SwSlice
+{
+    struct SwSession *sw;
+    unsigned int firstMb;       // first macroblock of the slice
+    unsigned int endMb;         // one past the last macroblock
+    SwBitWriter  bw;
+    HANDLE       thread;        // worker of the slice, kept for the whole session
+    HANDLE       start;         // a picture is ready to be encoded, or stop
+    HANDLE       done;          // the slice of the picture is encoded
+} SwSlice;
+
+typedef struct SwSession
+{
+    OvConfigCtrl config;        // last configuration sent
+    unsigned int width;
+    unsigned int height;
+    unsigned int mbWidth;
+    unsigned int mbHeight;
+    unsigned int lumaStride;    // mbWidth * 16
+    unsigned int chromaStride;  // mbWidth * 8
+    BYTE         *srcY, *srcU, *srcV;   // padded copy of the input picture
+    BYTE         *recY, *recU, *recV;   // reconstructed picture, used for prediction
+    BYTE         *nzLuma;       // total coeffs of each luma 4x4 block, 16 per MB
+    BYTE         *nzChroma;     // total coeffs of each chroma AC block, 8 per MB
+    unsigned int numSlices;
+    SwSlice      slices[SW_MAX_SLICES];
+    unsigned int numWorkers;    // slices 1 to numWorkers have a worker, slice 0 is encoded by the caller
+    volatile LONG stop;
+
+    // Picture state
+    unsigned int frames;        // pictures encoded
+    unsigned int frameNum;      // frame_num of the next picture
+    unsigned int idrPicId;
+    unsigned int lastIdr;       // picture number of the last IDR
+    int          qp;            // QP of the current picture
+    int          qpChroma;
+    double       rcError;       // rate control: bits above the target so far
+
+    // Output of the last task
+    bool         hasOutput;
+    unsigned int taskId;
+    BYTE         *output;
+    unsigned int outputSize;
+    unsigned int outputCapacity;
+} SwSession;
+
+
+/*******************************************************************************
+ * Tables
+ ******************************************************************************/
+// zig-zag scan, raster position (x + 4 * y) of each coefficient
+static const BYTE swZigzag[16] = {0, 1, 4, 8, 5, 2, 3, 6, 9, 12, 13, 10, 7, 11, 14, 15};
+
+// luma 4x4 block coding order, raster position of each block in the macroblock
+static const BYTE swBlockRaster[16] = {0, 1, 4, 5, 2, 3, 6, 7, 8, 9, 12, 13, 10, 11, 14, 15};
+
+// 0: even row & column, 1: odd row & column, 2: others
+static const BYTE swPosClass[16] = {0, 2, 0, 2, 2, 1, 2, 1, 0, 2, 0, 2, 2, 1, 2, 1};
+static const int swQuantMF[6][3]  = {{13107, 5243, 8066}, {11916, 4660, 7490}, {10082, 4194, 6554},
+                                     {9362, 3647, 5825}, {8192, 3355, 5243}, {7282, 2893, 4559}};
+static const int swDequantV[6][3] = {{10, 16, 13}, {11, 18, 14}, {13, 20, 16},
+                                     {14, 23, 18}, {16, 25, 20}, {18, 29, 23}};
+
+static const BYTE swChromaQp[52] =
+{
+     0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19,
+    20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 29, 30, 31, 32, 32, 33, 34, 34, 35, 35,
+    36, 36, 37, 37, 37, 38, 38, 38, 39, 39, 39, 39
+};
+
+// coeff_token, index totalCoeff * 4 + trailingOnes, for 0<=nC<2, 2<=nC<4, 4<=nC<8, 8<=nC
+static const BYTE swCoeffTokenLen[4][68] =
+{
+    { 1, 0, 0, 0,  6, 2, 0, 0,  8, 6, 3, 0,  9, 8, 7, 5, 10, 9, 8, 6,
+     11,10, 9, 7, 13,11,10, 8, 13,13,11, 9, 13,13,13,10, 14,14,13,11,
+     14,14,14,13, 15,15,14,14, 15,15,15,14, 16,15,15,15, 16,16,16,15,
+     16,16,16,16, 16,16,16,16},
+    { 2, 0, 0, 0,  6, 2, 0, 0,  6, 5, 3, 0,  7, 6, 6, 4,  8, 6, 6, 4,
+      8, 7, 7, 5,  9, 8, 8, 6, 11, 9, 9, 6, 11,11,11, 7, 12,11,11, 9,
+     12,12,12,11, 12,12,12,11, 13,13,13,12, 13,13,13,13, 13,14,13,13,
+     14,14,14,13, 14,14,14,14},
+    { 4, 0, 0, 0,  6, 4, 0, 0,  6, 5, 4, 0,  6, 5, 5, 4,  7, 5, 5, 4,
+      7, 5, 5, 4,  7, 6, 6, 4,  7, 6, 6, 4,  8, 7, 7, 5,  8, 8, 7, 6,
+      9, 8, 8, 7,  9, 9, 8, 8,  9, 9, 9, 8, 10, 9, 9, 9, 10,10,10,10,
+     10,10,10,10, 10,10,10,10},
+    { 6, 0, 0, 0,  6, 6, 0, 0,  6, 6, 6, 0,  6, 6, 6, 6,  6, 6, 6, 6,
+      6, 6, 6, 6,  6, 6, 6, 6,  6, 6, 6, 6,  6, 6, 6, 6,  6, 6, 6, 6,
+      6, 6, 6, 6,  6, 6, 6, 6,  6, 6, 6, 6,  6, 6, 6, 6,  6, 6, 6, 6,
+      6, 6, 6, 6,  6, 6, 6, 6}
+};
+static const BYTE swCoeffTokenCode[4][68] =
+{
+    { 1, 0, 0, 0,  5, 1, 0, 0,  7, 4, 1, 0,  7, 6, 5, 3,  7, 6, 5, 3,
+      7, 6, 5, 4, 15, 6, 5, 4, 11,14, 5, 4,  8,10,13, 4, 15,14, 9, 4,
+     11,10,13,12, 15,14, 9,12, 11,10,13, 8, 15, 1, 9,12, 11,14,13, 8,
+      7,10, 9,12,  4, 6, 5, 8},
+    { 3, 0, 0, 0, 11, 2, 0, 0,  7, 7, 3, 0,  7,10, 9, 5,  7, 6, 5, 4,
+      4, 6, 5, 6,  7, 6, 5, 8, 15, 6, 5, 4, 11,14,13, 4, 15,10, 9, 4,
+     11,14,13,12,  8,10, 9, 8, 15,14,13,12, 11,10, 9,12,  7,11, 6, 8,
+      9, 8,10, 1,  7, 6, 5, 4},
+    {15, 0, 0, 0, 15,14, 0, 0, 11,15,13, 0,  8,12,14,12, 15,10,11,11,
+     11, 8, 9,10,  9,14,13, 9,  8,10, 9, 8, 15,14,13,13, 11,14,10,12,
+     15,10,13,12, 11,14, 9,12,  8,10,13, 8, 13, 7, 9,12,  9,12,11,10,
+      5, 8, 7, 6,  1, 4, 3, 2},
+    { 3, 0, 0, 0,  0, 1, 0, 0,  4, 5, 6, 0,  8, 9,10,11, 12,13,14,15,
+     16,17,18,19, 20,21,22,23, 24,25,26,27, 28,29,30,31, 32,33,34,35,
+     36,37,38,39, 40,41,42,43, 44,45,46,47, 48,49,50,51, 52,53,54,55,
+     56,57,58,59, 60,61,62,63}
+};
+
+// coeff_token for chroma DC (nC == -1)
+static const BYTE swChromaDcTokenLen[20]  = {2, 0, 0, 0, 6, 1, 0, 0, 6, 6, 3, 0, 6, 7, 7, 6, 6, 8, 8, 7};
+static const BYTE swChromaDcTokenCode[20] = {1, 0, 0, 0, 7, 1, 0, 0, 4, 6, 1, 0, 3, 3, 2, 5, 2, 3, 2, 0};
+
+// total_zeros, index [totalCoeff - 1][totalZeros]
+static const BYTE swTotalZerosLen[15][16] =
+{
+    {1, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 9},
+    {3, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 6, 6, 6, 6},
+    {4, 3, 3, 3, 4, 4, 3, 3, 4, 5, 5, 6, 5, 6},
+    {5, 3, 4, 4, 3, 3, 3, 4, 3, 4, 5, 5, 5},
+    {4, 4, 4, 3, 3, 3, 3, 3, 4, 5, 4, 5},
+    {6, 5, 3, 3, 3, 3, 3, 3, 4, 3, 6},
+    {6, 5, 3, 3, 3, 2, 3, 4, 3, 6},
+    {6, 4, 5, 3, 2, 2, 3, 3, 6},
+    {6, 6, 4, 2, 2, 3, 2, 5},
+    {5, 5, 3, 2, 2, 2, 4},
+    {4, 4, 3, 3, 1, 3},
+    {4, 4, 2, 1, 3},
+    {3, 3, 1, 2},
+    {2, 2, 1},
+    {1, 1}
+};
+static const BYTE swTotalZerosCode[15][16] =
+{
+    {1, 3, 2, 3, 2, 3, 2, 3, 2, 3, 2, 3, 2, 3, 2, 1},
+    {7, 6, 5, 4, 3, 5, 4, 3, 2, 3, 2, 3, 2, 1, 0},
+    {5, 7, 6, 5, 4, 3, 4, 3, 2, 3, 2, 1, 1, 0},
+    {3, 7, 5, 4, 6, 5, 4, 3, 3, 2, 2, 1, 0},
+    {5, 4, 3, 7, 6, 5, 4, 3, 2, 1, 1, 0},
+    {1, 1, 7, 6, 5, 4, 3, 2, 1, 1, 0},
+    {1, 1, 5, 4, 3, 3, 2, 1, 1, 0},
+    {1, 1, 1, 3, 3, 2, 2, 1, 0},
+    {1, 0, 1, 3, 2, 1, 1, 1},
+    {1, 0, 1, 3, 2, 1, 1},
+    {0, 1, 1, 2, 1, 3},
+    {0, 1, 1, 1, 1},
+    {0, 1, 1, 1},
+    {0, 1, 1},
+    {0, 1}
+};
+static const BYTE swChromaDcZerosLen[3][4]  = {{1, 2, 3, 3}, {1, 2, 2, 0}, {1, 1, 0, 0}};
+static const BYTE swChromaDcZerosCode[3][4] = {{1, 1, 1, 0}, {1, 1, 0, 0}, {1, 0, 0, 0}};
+
+// run_before, index [min(zerosLeft, 7) - 1][runBefore]
+static const BYTE swRunLen[7][15] =
+{
+    {1, 1}, {1, 2, 2}, {2, 2, 2, 2}, {2, 2, 2, 3, 3}, {2, 2, 3, 3, 3, 3},
+    {2, 3, 3, 3, 3, 3, 3}, {3, 3, 3, 3, 3, 3, 3, 4, 5, 6, 7, 8, 9, 10, 11}
+};
+static const BYTE swRunCode[7][15] =
+{
+    {1, 0}, {1, 1, 0}, {3, 2, 1, 0}, {3, 2, 1, 1, 0}, {3, 2, 3, 2, 1, 0},
+    {3, 0, 1, 3, 2, 5, 4}, {7, 6, 5, 4, 3, 2, 1, 1, 1, 1, 1, 1, 1, 1, 1}
+};
+
+
+/*******************************************************************************
+ * Bit writer
+ ******************************************************************************/
+inline void swPutByte(SwBitWriter *bw, BYTE b)
+{
+    if (bw->size == bw->capacity)
+    {
+        unsigned int capacity = bw->capacity ? bw->capacity * 2 : 4096;
+        BYTE *data = bw->failed ? NULL : (BYTE*) realloc(bw->data, capacity);
+        if (data == NULL)
+        {
+            bw->failed = true;
+            return;
+        }
+        bw->data = data;
+        bw->capacity = capacity;
+    }
+    bw->data[bw->size++] = b;
+}
+
+inline void swPutBits(SwBitWriter *bw, unsigned int value, unsigned int n)
+{
+    bw->cache = (bw->cache << n) | (value & (((uint64)1 << n) - 1));
+    bw->cacheBits += n;
+    while (bw->cacheBits >= 8)
+    {
+        bw->cacheBits -= 8;
+        swPutByte(bw, (BYTE)(bw->cache >> bw->cacheBits));
+    }
+}
+
+inline void swPutUE(SwBitWriter *bw, unsigned int value)
+{
+    unsigned int x = value + 1, len = 0;
+    for (unsigned int t = x; t; t >>= 1)
+        len++;
+    swPutBits(bw, 0, len - 1);
+    swPutBits(bw, x, len);
+}
+
+inline void swPutSE(SwBitWriter *bw, int value)
+{
+    swPutUE(bw, value > 0 ? 2 * value - 1 : -2 * value);
+}
+
+inline void swResetBits(SwBitWriter *bw)
+{
+    bw->size = 0;
+    bw->cache = 0;
+    bw->cacheBits = 0;
+    bw->failed = false;
+}
+
+// rbsp_trailing_bits()
+inline void swPutTrailingBits(SwBitWriter *bw)
+{
+    swPutBits(bw, 1, 1);
+    if (bw->cacheBits)
+        swPutBits(bw, 0, 8 - bw->cacheBits);
+}
+
+
+/*******************************************************************************
+ *  @fn     swWriteNal
+ *  @brief  Writes an Annex-B NAL unit, inserting emulation prevention bytes
+ *  @param[out] dst      : Destination, at least 5 + size * 3 / 2 bytes
+ *  @param[in] nalHeader : nal_ref_idc and nal_unit_type byte
+ *  @param[in] rbsp      : NAL payload
+ *  @param[in] size      : Payload size
+ *  @return BYTE* : end of the written NAL unit
+ ******************************************************************************/
+BYTE *swWriteNal(BYTE *dst, BYTE nalHeader, const BYTE *rbsp, unsigned int size)
+{
+    *dst++ = 0; *dst++ = 0; *dst++ = 0; *dst++ = 1;
+    *dst++ = nalHeader;
+
+    unsigned int zeros = 0;
+    for (unsigned int i = 0; i < size; i++)
+    {
+        if (zeros == 2 && rbsp[i] <= 3)
+        {
+            *dst++ = 3;
+            zeros = 0;
+        }
+        *dst++ = rbsp[i];
+        zeros = rbsp[i] ? 0 : zeros + 1;
+    }
+    return dst;
+}
+
+
+/*******************************************************************************
+ * Transform & quantization
+ ******************************************************************************/
+#ifdef SW_USE_SSE2
+// Transposes two side by side 4x4 blocks of 16 bit values
+static inline void swTranspose4x4Pair(__m128i &r0, __m128i &r1, __m128i &r2, __m128i &r3)
+{
+    __m128i a = _mm_unpacklo_epi16(r0, r1);
+    __m128i b = _mm_unpacklo_epi16(r2, r3);
+    __m128i c = _mm_unpackhi_epi16(r0, r1);
+    __m128i d = _mm_unpackhi_epi16(r2, r3);
+    __m128i e0 = _mm_unpacklo_epi32(a, b);
+    __m128i e1 = _mm_unpackhi_epi32(a, b);
+    __m128i f0 = _mm_unpacklo_epi32(c, d);
+    __m128i f1 = _mm_unpackhi_epi32(c, d);
+    r0 = _mm_unpacklo_epi64(e0, f0);
+    r1 = _mm_unpackhi_epi64(e0, f0);
+    r2 = _mm_unpacklo_epi64(e1, f1);
+    r3 = _mm_unpackhi_epi64(e1, f1);
+}
+
+// Vertical pass of the forward core transform
+static inline void swDctPass(__m128i &r0, __m128i &r1, __m128i &r2, __m128i &r3)
+{
+    __m128i s03 = _mm_add_epi16(r0, r3);
+    __m128i d03 = _mm_sub_epi16(r0, r3);
+    __m128i s12 = _mm_add_epi16(r1, r2);
+    __m128i d12 = _mm_sub_epi16(r1, r2);
+    r0 = _mm_add_epi16(s03, s12);
+    r2 = _mm_sub_epi16(s03, s12);
+    r1 = _mm_add_epi16(_mm_slli_epi16(d03, 1), d12);
+    r3 = _mm_sub_epi16(d03, _mm_slli_epi16(d12, 1));
+}
+#endif
+
+
+/*******************************************************************************
+ *  @fn     swForward4x4Pair
+ *  @brief  Forward core transform of two horizontally adjacent 4x4 blocks
+ *  @param[in] res    : Residual of the left block, 4 rows of 8 values
+ *  @param[in] stride : Residual stride
+ *  @param[out] outA  : Coefficients of the left block, raster order
+ *  @param[out] outB  : Coefficients of the right block, raster order
+ ******************************************************************************/
+static void swForward4x4Pair(const short *res, int stride, short *outA, short *outB)
+{
+#ifdef SW_USE_SSE2
+    __m128i r0 = _mm_loadu_si128((const __m128i*)(res));
+    __m128i r1 = _mm_loadu_si128((const __m128i*)(res + stride));
+    __m128i r2 = _mm_loadu_si128((const __m128i*)(res + 2 * stride));
+    __m128i r3 = _mm_loadu_si128((const __m128i*)(res + 3 * stride));
+
+    // W = Cf * X * Cf', applying the vertical pass to X' and then to (Cf * X')'
+    swTranspose4x4Pair(r0, r1, r2, r3);
+    swDctPass(r0, r1, r2, r3);
+    swTranspose4x4Pair(r0, r1, r2, r3);
+    swDctPass(r0, r1, r2, r3);
+
+    _mm_storel_epi64((__m128i*)(outA),      r0);
+    _mm_storel_epi64((__m128i*)(outA + 4),  r1);
+    _mm_storel_epi64((__m128i*)(outA + 8),  r2);
+    _mm_storel_epi64((__m128i*)(outA + 12), r3);
+    _mm_storel_epi64((__m128i*)(outB),      _mm_unpackhi_epi64(r0, r0));
+    _mm_storel_epi64((__m128i*)(outB + 4),  _mm_unpackhi_epi64(r1, r1));
+    _mm_storel_epi64((__m128i*)(outB + 8),  _mm_unpackhi_epi64(r2, r2));
+    _mm_storel_epi64((__m128i*)(outB + 12), _mm_unpackhi_epi64(r3, r3));
+#else
+    for (int blk = 0; blk < 2; blk++)
+    {
+        short *out = blk ? outB : outA;
+        int t[16];
+
+        // rows
+        for (int i = 0; i < 4; i++)
+        {
+            const short *x = res + i * stride + blk * 4;
+            int s03 = x[0] + x[3], d03 = x[0] - x[3];
+            int s12 = x[1] + x[2], d12 = x[1] - x[2];
+            t[i * 4 + 0] = s03 + s12;
+            t[i * 4 + 1] = 2 * d03 + d12;
+            t[i * 4 + 2] = s03 - s12;
+            t[i * 4 + 3] = d03 - 2 * d12;
+        }
+
+        // columns
+        for (int j = 0; j < 4; j++)
+        {
+            int s03 = t[j] + t[12 + j], d03 = t[j] - t[12 + j];
+            int s12 = t[4 + j] + t[8 + j], d12 = t[4 + j] - t[8 + j];
+            out[j]      = (short)(s03 + s12);
+            out[4 + j]  = (short)(2 * d03 + d12);
+            out[8 + j]  = (short)(s03 - s12);
+            out[12 + j] = (short)(d03 - 2 * d12);
+        }
+    }
+#endif
+}
+
+
+/*******************************************************************************
+ *  @fn     swQuant4x4
+ *  @brief  Quantizes a 4x4 block in place: (|w| * mf + bias) >> qbits
+ *  @param[in/out] coef : Coefficients, raster order
+ *  @param[in] mf       : Multiplication factor of each position
+ *  @param[in] bias     : Rounding offset
+ *  @param[in] qbits    : Shift
+ *  @return bool : true if any level is not zero.
+ ******************************************************************************/
+static bool swQuant4x4(short *coef, const short *mf, int bias, int qbits)
+{
+#ifdef SW_USE_SSE2
+    __m128i vbias = _mm_set1_epi32(bias);
+    __m128i shift = _mm_cvtsi32_si128(qbits);
+    __m128i maxLevel = _mm_set1_epi16(SW_MAX_LEVEL);
+    __m128i nz = _mm_setzero_si128();
+
+    for (int i = 0; i < 16; i += 8)
+    {
+        __m128i w = _mm_loadu_si128((const __m128i*)(coef + i));
+        __m128i m = _mm_loadu_si128((const __m128i*)(mf + i));
+        __m128i sign = _mm_srai_epi16(w, 15);
+        __m128i a = _mm_sub_epi16(_mm_xor_si128(w, sign), sign);
+        __m128i lo = _mm_mullo_epi16(a, m);
+        __m128i hi = _mm_mulhi_epu16(a, m);
+        __m128i p0 = _mm_srl_epi32(_mm_add_epi32(_mm_unpacklo_epi16(lo, hi), vbias), shift);
+        __m128i p1 = _mm_srl_epi32(_mm_add_epi32(_mm_unpackhi_epi16(lo, hi), vbias), shift);
+        __m128i l = _mm_min_epi16(_mm_packs_epi32(p0, p1), maxLevel);
+        nz = _mm_or_si128(nz, l);
+        _mm_storeu_si128((__m128i*)(coef + i), _mm_sub_epi16(_mm_xor_si128(l, sign), sign));
+    }
+    return _mm_movemask_epi8(_mm_cmpeq_epi16(nz, _mm_setzero_si128())) != 0xFFFF;
+#else
+    bool nz = false;
+    for (int i = 0; i < 16; i++)
+    {
+        int w = coef[i];
+        int l = ((w < 0 ? -w : w) * mf[i] + bias) >> qbits;
+        if (l > SW_MAX_LEVEL)
+            l = SW_MAX_LEVEL;
+        coef[i] = (short)(w < 0 ? -l : l);
+        nz |= l != 0;
+    }
+    return nz;
+#endif
+}
+
+
+// Quantization of a DC coefficient, after its Hadamard transform
+static inline short swQuantDC(int w, int mf, int bias, int qbits)
+{
+    int l = ((w < 0 ? -w : w) * mf + 2 * bias) >> (qbits + 1);
+    if (l > SW_MAX_LEVEL)
+        l = SW_MAX_LEVEL;
+    return (short)(w < 0 ? -l : l);
+}
+
+
+// 4x4 Hadamard transform, in place
+static void swHadamard4x4(int *d)
+{
+    int t[16];
+    for (int i = 0; i < 4; i++)
+    {
+        int *x = d + i * 4;
+        int s01 = x[0] + x[1], d01 = x[0] - x[1];
+        int s23 = x[2] + x[3], d23 = x[2] - x[3];
+        t[i * 4 + 0] = s01 + s23;
+        t[i * 4 + 1] = s01 - s23;
+        t[i * 4 + 2] = d01 - d23;
+        t[i * 4 + 3] = d01 + d23;
+    }
+    for (int j = 0; j < 4; j++)
+    {
+        int s01 = t[j] + t[4 + j], d01 = t[j] - t[4 + j];
+        int s23 = t[8 + j] + t[12 + j], d23 = t[8 + j] - t[12 + j];
+        d[j]      = s01 + s23;
+        d[4 + j]  = s01 - s23;
+        d[8 + j]  = d01 - d23;
+        d[12 + j] = d01 + d23;
+    }
+}
+
+
+/*******************************************************************************
+ *  @fn     swInverse4x4Add
+ *  @brief  Inverse transform of a dequantized 4x4 block added to the prediction
+ *  @param[in] d       : Dequantized coefficients, raster order
+ *  @param[in] pred    : Prediction
+ *  @param[in] pstride : Prediction stride
+ *  @param[out] dst    : Reconstructed pixels
+ *  @param[in] dstride : Destination stride
+ ******************************************************************************/
+static void swInverse4x4Add(const int *d, const BYTE *pred, int pstride, BYTE *dst, int dstride)
+{
+    int f[16];
+    for (int i = 0; i < 4; i++)
+    {
+        const int *x = d + i * 4;
+        int e0 = x[0] + x[2], e1 = x[0] - x[2];
+        int e2 = (x[1] >> 1) - x[3], e3 = x[1] + (x[3] >> 1);
+        f[i * 4 + 0] = e0 + e3;
+        f[i * 4 + 1] = e1 + e2;
+        f[i * 4 + 2] = e1 - e2;
+        f[i * 4 + 3] = e0 - e3;
+    }
+    for (int j = 0; j < 4; j++)
+    {
+        int g0 = f[j] + f[8 + j], g1 = f[j] - f[8 + j];
+        int g2 = (f[4 + j] >> 1) - f[12 + j], g3 = f[4 + j] + (f[12 + j] >> 1);
+        int h[4] = {g0 + g3, g1 + g2, g1 - g2, g0 - g3};
+        for (int i = 0; i < 4; i++)
+        {
+            int v = pred[i * pstride + j] + ((h[i] + 32) >> 6);
+            dst[i * dstride + j] = (BYTE)(v < 0 ? 0 : v > 255 ? 255 : v);
+        }
+    }
+}
+
+
+/*******************************************************************************
+ * CAVLC
+ ******************************************************************************/
+
+/*******************************************************************************
+ *  @fn     swResidualBlock
+ *  @brief  Writes residual_block_cavlc()
+ *  @param[in] bw          : Bit writer
+ *  @param[in] level       : Levels in scan order
+ *  @param[in] maxNumCoeff : 4, 15 or 16
+ *  @param[in] nC          : coeff_token table selector, -1 for chroma DC
+ *  @return int : TotalCoeff of the block.
+ ******************************************************************************/
+static int swResidualBlock(SwBitWriter *bw, const short *level, int maxNumCoeff, int nC)
+{
+    int levels[16], runs[16];
+    int totalCoeff = 0, last = -1;
+
+    // Levels & runs from the highest frequency down
+    for (int i = maxNumCoeff - 1; i >= 0; i--)
+    {
+        if (level[i])
+        {
+            if (last < 0)
+                last = i;
+            levels[totalCoeff] = level[i];
+            runs[totalCoeff++] = 0;
+        }
+        else if (totalCoeff)
+        {
+            runs[totalCoeff - 1]++;
+        }
+    }
+
+    int trailingOnes = 0;
+    while (trailingOnes < totalCoeff && trailingOnes < 3 &&
+           (levels[trailingOnes] == 1 || levels[trailingOnes] == -1))
+        trailingOnes++;
+
+    // coeff_token
+    int token = totalCoeff * 4 + trailingOnes;
+    if (nC == -1)
+    {
+        swPutBits(bw, swChromaDcTokenCode[token], swChromaDcTokenLen[token]);
+    }
+    else
+    {
+        int table = nC < 2 ? 0 : nC < 4 ? 1 : nC < 8 ? 2 : 3;
+        swPutBits(bw, swCoeffTokenCode[table][token], swCoeffTokenLen[table][token]);
+    }
+
+    if (totalCoeff == 0)
+        return 0;
+
+    // trailing_ones_sign_flag
+    for (int i = 0; i < trailingOnes; i++)
+        swPutBits(bw, levels[i] < 0, 1);
+
+    // level_prefix & level_suffix
+    int suffixLength = (totalCoeff > 10 && trailingOnes < 3) ? 1 : 0;
+    for (int i = trailingOnes; i < totalCoeff; i++)
+    {
+        int lv = levels[i];
+        int levelCode = lv > 0 ? 2 * lv - 2 : -2 * lv - 1;
+        if (i == trailingOnes && trailingOnes < 3)
+            levelCode -= 2;
+
+        if (suffixLength == 0)
+        {
+            if (levelCode < 14)
+            {
+                swPutBits(bw, 1, levelCode + 1);
+            }
+            else if (levelCode < 30)
+            {
+                swPutBits(bw, 1, 15);
+                swPutBits(bw, levelCode - 14, 4);
+            }
+            else
+            {
+                swPutBits(bw, 1, 16);
+                swPutBits(bw, levelCode - 30, 12);
+            }
+        }
+        else
+        {
+            if (levelCode < (15 << suffixLength))
+            {
+                swPutBits(bw, 1, (levelCode >> suffixLength) + 1);
+                swPutBits(bw, levelCode, suffixLength);
+            }
+            else
+            {
+                swPutBits(bw, 1, 16);
+                swPutBits(bw, levelCode - (15 << suffixLength), 12);
+            }
+        }
+
+        if (suffixLength == 0)
+            suffixLength = 1;
+        if ((lv < 0 ? -lv : lv) > (3 << (suffixLength - 1)) && suffixLength < 6)
+            suffixLength++;
+    }
+
+    // total_zeros
+    int totalZeros = last + 1 - totalCoeff;
+    if (totalCoeff < maxNumCoeff)
+    {
+        if (nC == -1)
+            swPutBits(bw, swChromaDcZerosCode[totalCoeff - 1][totalZeros], swChromaDcZerosLen[totalCoeff - 1][totalZeros]);
+        else
+            swPutBits(bw, swTotalZerosCode[totalCoeff - 1][totalZeros], swTotalZerosLen[totalCoeff - 1][totalZeros]);
+    }
+
+    // run_before
+    int zerosLeft = totalZeros;
+    for (int i = 0; i < totalCoeff - 1 && zerosLeft > 0; i++)
+    {
+        int table = (zerosLeft > 7 ? 7 : zerosLeft) - 1;
+        swPutBits(bw, swRunCode[table][runs[i]], swRunLen[table][runs[i]]);
+        zerosLeft -= runs[i];
+    }
+
+    return totalCoeff;
+}
+
+
+// nC of a luma 4x4 block, from the left and top blocks of the same slice
+static int swLumaNC(SwSession *sw, unsigned int mbAddr, int blk, bool left, bool top)
+{
+    int bx = blk & 3, by = blk >> 2;
+    int nA = -1, nB = -1;
+
+    if (bx > 0)
+        nA = sw->nzLuma[mbAddr * 16 + blk - 1];
+    else if (left)
+        nA = sw->nzLuma[(mbAddr - 1) * 16 + blk + 3];
+
+    if (by > 0)
+        nB = sw->nzLuma[mbAddr * 16 + blk - 4];
+    else if (top)
+        nB = sw->nzLuma[(mbAddr - sw->mbWidth) * 16 + blk + 12];
+
+    if (nA >= 0 && nB >= 0)
+        return (nA + nB + 1) >> 1;
+    return nA >= 0 ? nA : nB >= 0 ? nB : 0;
+}
+
+
+// nC of a chroma AC block, blk is the raster position in the 2x2 block grid
+static int swChromaNC(SwSession *sw, unsigned int mbAddr, int plane, int blk, bool left, bool top)
+{
+    const BYTE *nz = sw->nzChroma + plane * 4;
+    int bx = blk & 1, by = blk >> 1;
+    int nA = -1, nB = -1;
+
+    if (bx > 0)
+        nA = nz[mbAddr * 8 + blk - 1];
+    else if (left)
+        nA = nz[(mbAddr - 1) * 8 + blk + 1];
+
+    if (by > 0)
+        nB = nz[mbAddr * 8 + blk - 2];
+    else if (top)
+        nB = nz[(mbAddr - sw->mbWidth) * 8 + blk + 2];
+
+    if (nA >= 0 && nB >= 0)
+        return (nA + nB + 1) >> 1;
+    return nA >= 0 ? nA : nB >= 0 ? nB : 0;
+}
+
+
+/*******************************************************************************
+ * Macroblock
+ ******************************************************************************/
+
+// Chroma DC prediction of one 8x8 block (intra_chroma_pred_mode 0)
+static void swPredictChroma(const BYTE *rec, int stride, bool left, bool top, BYTE *pred)
+{
+    for (int blk = 0; blk < 4; blk++)
+    {
+        int bx = (blk & 1) * 4, by = (blk >> 1) * 4;
+        int sumTop = 0, sumLeft = 0;
+        for (int i = 0; i < 4; i++)
+        {
+            if (top)
+                sumTop += rec[-stride + bx + i];
+            if (left)
+                sumLeft += rec[(by + i) * stride - 1];
+        }
+
+        int dc = 128;
+        if (blk == 0 || blk == 3)
+        {
+            if (top && left)
+                dc = (sumTop + sumLeft + 4) >> 3;
+            else if (left)
+                dc = (sumLeft + 2) >> 2;
+            else if (top)
+                dc = (sumTop + 2) >> 2;
+        }
+        else if (blk == 1)
+        {
+            dc = top ? (sumTop + 2) >> 2 : left ? (sumLeft + 2) >> 2 : 128;
+        }
+        else
+        {
+            dc = left ? (sumLeft + 2) >> 2 : top ? (sumTop + 2) >> 2 : 128;
+        }
+
+        for (int y = 0; y < 4; y++)
+            memset(pred + (by + y) * 8 + bx, dc, 4);
+    }
+}
+
+
+/*******************************************************************************
+ *  @fn     swEncodeChroma
+ *  @brief  Transforms, quantizes & reconstructs one chroma plane of a macroblock
+ *  @param[out] dcLevel : Quantized DC levels (chroma DC scan)
+ *  @param[out] acLevel : Quantized AC levels, raster order per 4x4 block
+ *  @return int : 2 if there are AC levels, 1 if only DC levels, otherwise 0.
+ ******************************************************************************/
+static int swEncodeChroma(SwSession *sw, const BYTE *src, BYTE *rec, bool left, bool top,
+                          const short *mf, short *dcLevel, short acLevel[4][16])
+{
+    int stride = sw->chromaStride;
+    int qp = sw->qpChroma, qbits = 15 + qp / 6, bias = (1 << qbits) / 3;
+    BYTE pred[64];
+    short res[64];
+
+    swPredictChroma(rec, stride, left, top, pred);
+    for (int y = 0; y < 8; y++)
+        for (int x = 0; x < 8; x++)
+            res[y * 8 + x] = src[y * stride + x] - pred[y * 8 + x];
+
+    swForward4x4Pair(res, 8, acLevel[0], acLevel[1]);
+    swForward4x4Pair(res + 32, 8, acLevel[2], acLevel[3]);
+
+    // DC: 2x2 Hadamard
+    int d0 = acLevel[0][0], d1 = acLevel[1][0], d2 = acLevel[2][0], d3 = acLevel[3][0];
+    dcLevel[0] = swQuantDC(d0 + d1 + d2 + d3, mf[0], bias, qbits);
+    dcLevel[1] = swQuantDC(d0 - d1 + d2 - d3, mf[0], bias, qbits);
+    dcLevel[2] = swQuantDC(d0 + d1 - d2 - d3, mf[0], bias, qbits);
+    dcLevel[3] = swQuantDC(d0 - d1 - d2 + d3, mf[0], bias, qbits);
+
+    bool ac = false;
+    for (int blk = 0; blk < 4; blk++)
+    {
+        acLevel[blk][0] = 0;
+        ac |= swQuant4x4(acLevel[blk], mf, bias, qbits);
+        acLevel[blk][0] = 0;
+    }
+
+    // Reconstruction
+    int ls = 16 * swDequantV[qp % 6][0];
+    int c0 = dcLevel[0], c1 = dcLevel[1], c2 = dcLevel[2], c3 = dcLevel[3];
+    int f[4] = {c0 + c1 + c2 + c3, c0 - c1 + c2 - c3, c0 + c1 - c2 - c3, c0 - c1 - c2 + c3};
+    for (int blk = 0; blk < 4; blk++)
+    {
+        int d[16];
+        d[0] = ((f[blk] * ls) << (qp / 6)) >> 5;
+        for (int i = 1; i < 16; i++)
+            d[i] = (acLevel[blk][i] * swDequantV[qp % 6][swPosClass[i]]) << (qp / 6);
+
+        int off = (blk >> 1) * 4 * 8 + (blk & 1) * 4;
+        swInverse4x4Add(d, pred + off, 8, rec + (blk >> 1) * 4 * stride + (blk & 1) * 4, stride);
+    }
+
+    if (ac)
+        return 2;
+    return (dcLevel[0] | dcLevel[1] | dcLevel[2] | dcLevel[3]) ? 1 : 0;
+}
+
+
+/*******************************************************************************
+ *  @fn     swEncodeMacroblock
+ *  @brief  Encodes one I_16x16 macroblock: prediction, transform, quantization,
+ *          reconstruction and CAVLC macroblock_layer()
+ *  @param[in] slice  : Slice being encoded
+ *  @param[in] mbAddr : Macroblock address
+ *  @param[in] mfLuma, mfChroma : Quantization factors of each position
+ ******************************************************************************/
+static void swEncodeMacroblock(SwSlice *slice, unsigned int mbAddr, const short *mfLuma, const short *mfChroma)
+{
+    SwSession *sw = slice->sw;
+    SwBitWriter *bw = &slice->bw;
+    unsigned int mbx = mbAddr % sw->mbWidth, mby = mbAddr / sw->mbWidth;
+    bool left = mbx > 0 && mbAddr - 1 >= slice->firstMb;
+    bool top = mby > 0 && mbAddr - sw->mbWidth >= slice->firstMb;
+    int qp = sw->qp, qbits = 15 + qp / 6, bias = (1 << qbits) / 3;
+    int ls = sw->lumaStride;
+
+    const BYTE *src = sw->srcY + mby * 16 * ls + mbx * 16;
+    BYTE *rec = sw->recY + mby * 16 * ls + mbx * 16;
+
+    // Intra 16x16 prediction: vertical (0), horizontal (1) or DC (2)
+    BYTE pred[3][256];
+    int sad[3] = {-1, -1, 0};
+    int sumTop = 0, sumLeft = 0;
+    for (int i = 0; i < 16; i++)
+    {
+        if (top)
+            sumTop += rec[-ls + i];
+        if (left)
+            sumLeft += rec[i * ls - 1];
+    }
+    int dc = (top && left) ? (sumTop + sumLeft + 16) >> 5 : left ? (sumLeft + 8) >> 4 :
+             top ? (sumTop + 8) >> 4 : 128;
+    memset(pred[2], dc, 256);
+    for (int y = 0; y < 16; y++)
+    {
+        if (top)
+            memcpy(pred[0] + y * 16, rec - ls, 16);
+        if (left)
+            memset(pred[1] + y * 16, rec[y * ls - 1], 16);
+    }
+
+    int predMode = 2;
+    for (int m = 0; m < 3; m++)
+    {
+        if ((m == 0 && !top) || (m == 1 && !left))
+            continue;
+        sad[m] = 0;
+        for (int y = 0; y < 16; y++)
+            for (int x = 0; x < 16; x++)
+                sad[m] += abs(src[y * ls + x] - pred[m][y * 16 + x]);
+    }
+    for (int m = 0; m < 2; m++)
+    {
+        if (sad[m] >= 0 && sad[m] < sad[predMode])
+            predMode = m;
+    }
+
+    // Luma transform, coef[raster block][raster coefficient]
+    short res[256];
+    short coef[16][16];
+    for (int y = 0; y < 16; y++)
+        for (int x = 0; x < 16; x++)
+            res[y * 16 + x] = src[y * ls + x] - pred[predMode][y * 16 + x];
+
+    for (int by = 0; by < 4; by++)
+    {
+        swForward4x4Pair(res + by * 64,     16, coef[by * 4],     coef[by * 4 + 1]);
+        swForward4x4Pair(res + by * 64 + 8, 16, coef[by * 4 + 2], coef[by * 4 + 3]);
+    }
+
+    // Luma DC: Hadamard and quantization
+    int dcCoef[16];
+    short dcLevel[16];
+    for (int b = 0; b < 16; b++)
+        dcCoef[b] = coef[b][0];
+    swHadamard4x4(dcCoef);
+    for (int b = 0; b < 16; b++)
+        dcLevel[b] = swQuantDC(dcCoef[b] >> 1, mfLuma[0], bias, qbits);
+
+    // Luma AC
+    bool lumaAC = false;
+    for (int b = 0; b < 16; b++)
+    {
+        coef[b][0] = 0;
+        lumaAC |= swQuant4x4(coef[b], mfLuma, bias, qbits);
+        coef[b][0] = 0;
+    }
+
+    // Chroma
+    int cs = sw->chromaStride;
+    int chromaOff = mby * 8 * cs + mbx * 8;
+    short chromaDc[2][4];
+    short chromaAc[2][4][16];
+    int cbpU = swEncodeChroma(sw, sw->srcU + chromaOff, sw->recU + chromaOff, left, top, mfChroma, chromaDc[0], chromaAc[0]);
+    int cbpV = swEncodeChroma(sw, sw->srcV + chromaOff, sw->recV + chromaOff, left, top, mfChroma, chromaDc[1], chromaAc[1]);
+    int cbpChroma = cbpU > cbpV ? cbpU : cbpV;
+
+    // Luma reconstruction
+    int dcRec[16];
+    for (int b = 0; b < 16; b++)
+        dcRec[b] = dcLevel[b];
+    swHadamard4x4(dcRec);
+
+    int lsDC = 16 * swDequantV[qp % 6][0];
+    for (int b = 0; b < 16; b++)
+    {
+        int d[16];
+        if (qp >= 36)
+            d[0] = (dcRec[b] * lsDC) << (qp / 6 - 6);
+        else
+            d[0] = (dcRec[b] * lsDC + (1 << (5 - qp / 6))) >> (6 - qp / 6);
+        for (int i = 1; i < 16; i++)
+            d[i] = (coef[b][i] * swDequantV[qp % 6][swPosClass[i]]) << (qp / 6);
+
+        int off = (b >> 2) * 4 * 16 + (b & 3) * 4;
+        swInverse4x4Add(d, pred[predMode] + off, 16, rec + (b >> 2) * 4 * ls + (b & 3) * 4, ls);
+    }
+
+    // macroblock_layer()
+    swPutUE(bw, 1 + predMode + 4 * cbpChroma + (lumaAC ? 12 : 0));  // mb_type I_16x16
+    swPutUE(bw, 0);                                                 // intra_chroma_pred_mode DC
+    swPutSE(bw, 0);                                                 // mb_qp_delta
+
+    // Intra16x16DCLevel
+    short scan[16];
+    for (int i = 0; i < 16; i++)
+        scan[i] = dcLevel[swZigzag[i]];
+    swResidualBlock(bw, scan, 16, swLumaNC(sw, mbAddr, 0, left, top));
+
+    // Intra16x16ACLevel
+    BYTE *nzLuma = sw->nzLuma + mbAddr * 16;
+    memset(nzLuma, 0, 16);
+    if (lumaAC)
+    {
+        for (int i = 0; i < 16; i++)
+        {
+            int b = swBlockRaster[i];
+            for (int k = 0; k < 15; k++)
+                scan[k] = coef[b][swZigzag[k + 1]];
+            nzLuma[b] = (BYTE) swResidualBlock(bw, scan, 15, swLumaNC(sw, mbAddr, b, left, top));
+        }
+    }
+
+    // Chroma DC & AC
+    BYTE *nzChroma = sw->nzChroma + mbAddr * 8;
+    memset(nzChroma, 0, 8);
+    if (cbpChroma)
+    {
+        swResidualBlock(bw, chromaDc[0], 4, -1);
+        swResidualBlock(bw, chromaDc[1], 4, -1);
+    }
+    if (cbpChroma == 2)
+    {
+        for (int c = 0; c < 2; c++)
+        {
+            for (int b = 0; b < 4; b++)
+            {
+                for (int k = 0; k < 15; k++)
+                    scan[k] = chromaAc[c][b][swZigzag[k + 1]];
+                nzChroma[c * 4 + b] = (BYTE) swResidualBlock(bw, scan, 15, swChromaNC(sw, mbAddr, c, b, left, top));
+            }
+        }
+    }
+}
+
+
+/*******************************************************************************
+ * Slices & parameter sets
+ ******************************************************************************/
+
+// Encodes slice_header() and slice_data() of one I slice
+static void swEncodeSlice(SwSlice *slice)
+{
+    SwSession *sw = slice->sw;
+    SwBitWriter *bw = &slice->bw;
+    bool idr = sw->frameNum == 0 && sw->lastIdr == sw->frames;
+
+    short mfLuma[16], mfChroma[16];
+    for (int i = 0; i < 16; i++)
+    {
+        mfLuma[i] = (short) swQuantMF[sw->qp % 6][swPosClass[i]];
+        mfChroma[i] = (short) swQuantMF[sw->qpChroma % 6][swPosClass[i]];
+    }
+
+    swResetBits(bw);
+    swPutUE(bw, slice->firstMb);    // first_mb_in_slice
+    swPutUE(bw, 7);                 // slice_type I, all slices
+    swPutUE(bw, 0);                 // pic_parameter_set_id
+    swPutBits(bw, sw->frameNum, 4); // frame_num
+    if (idr)
+        swPutUE(bw, sw->idrPicId);  // idr_pic_id
+
+    // dec_ref_pic_marking()
+    if (idr)
+        swPutBits(bw, 0, 2);        // no_output_of_prior_pics_flag, long_term_reference_flag
+    else
+        swPutBits(bw, 0, 1);        // adaptive_ref_pic_marking_mode_flag
+
+    swPutSE(bw, sw->qp - 26);       // slice_qp_delta
+    swPutUE(bw, 1);                 // disable_deblocking_filter_idc
+
+    for (unsigned int mbAddr = slice->firstMb; mbAddr < slice->endMb; mbAddr++)
+        swEncodeMacroblock(slice, mbAddr, mfLuma, mfChroma);
+
+    swPutTrailingBits(bw);
+}
+
+
+// Encodes its slice of every picture, until the session is released
+DWORD WINAPI swSliceThread(LPVOID param)
+{
+    SwSlice *slice = (SwSlice*)param;
+    for (;;)
+    {
+        WaitForSingleObject(slice->start, INFINITE);
+        if (slice->sw->stop)
+            break;
+        swEncodeSlice(slice);
+        SetEvent(slice->done);
+    }
+    return 0;
+}
+
+
+// Starts the workers of the slices that have none yet
+static bool swStartWorkers(SwSession *sw)
+{
+    while (sw->numWorkers + 1 < sw->numSlices)
+    {
+        SwSlice *slice = &sw->slices[sw->numWorkers + 1];
+        slice->start = CreateEvent(NULL, FALSE, FALSE, NULL);
+        slice->done = CreateEvent(NULL, FALSE, FALSE, NULL);
+        slice->thread = slice->start && slice->done ?
+                        CreateThread(NULL, 0, swSliceThread, slice, 0, NULL) : NULL;
+        if (slice->thread == NULL)
+        {
+            if (slice->start)
+                CloseHandle(slice->start);
+            if (slice->done)
+                CloseHandle(slice->done);
+            slice->start = slice->done = NULL;
+            fputs("Software encoder: cannot start the slice threads\n", stderr);
+            return false;
+        }
+        sw->numWorkers++;
+    }
+    return true;
+}
+
+
+// seq_parameter_set_rbsp(), constrained baseline
+static void swWriteSPS(SwSession *sw, SwBitWriter *bw)
+{
+    unsigned int level = sw->config.profileLevel.level ? sw->config.profileLevel.level : 40;
+    unsigned int cropRight = (sw->mbWidth * 16 - sw->width) / 2;
+    unsigned int cropBottom = (sw->mbHeight * 16 - sw->height) / 2;
+
+    swResetBits(bw);
+    swPutBits(bw, 66, 8);           // profile_idc
+    swPutBits(bw, 0xC0, 8);         // constraint_set0_flag, constraint_set1_flag
+    swPutBits(bw, level, 8);        // level_idc
+    swPutUE(bw, 0);                 // seq_parameter_set_id
+    swPutUE(bw, 0);                 // log2_max_frame_num_minus4
+    swPutUE(bw, 2);                 // pic_order_cnt_type
+    swPutUE(bw, 1);                 // max_num_ref_frames
+    swPutBits(bw, 0, 1);            // gaps_in_frame_num_value_allowed_flag
+    swPutUE(bw, sw->mbWidth - 1);
+    swPutUE(bw, sw->mbHeight - 1);
+    swPutBits(bw, 1, 1);            // frame_mbs_only_flag
+    swPutBits(bw, 1, 1);            // direct_8x8_inference_flag
+    if (cropRight || cropBottom)
+    {
+        swPutBits(bw, 1, 1);        // frame_cropping_flag
+        swPutUE(bw, 0);
+        swPutUE(bw, cropRight);
+        swPutUE(bw, 0);
+        swPutUE(bw, cropBottom);
+    }
+    else
+    {
+        swPutBits(bw, 0, 1);
+    }
+    swPutBits(bw, 0, 1);            // vui_parameters_present_flag
+    swPutTrailingBits(bw);
+}
+
+
+// pic_parameter_set_rbsp()
+static void swWritePPS(SwBitWriter *bw)
+{
+    swResetBits(bw);
+    swPutUE(bw, 0);                 // pic_parameter_set_id
+    swPutUE(bw, 0);                 // seq_parameter_set_id
+    swPutBits(bw, 0, 1);            // entropy_coding_mode_flag: CAVLC
+    swPutBits(bw, 0, 1);            // bottom_field_pic_order_in_frame_present_flag
+    swPutUE(bw, 0);                 // num_slice_groups_minus1
+    swPutUE(bw, 0);                 // num_ref_idx_l0_default_active_minus1
+    swPutUE(bw, 0);                 // num_ref_idx_l1_default_active_minus1
+    swPutBits(bw, 0, 3);            // weighted_pred_flag, weighted_bipred_idc
+    swPutSE(bw, 0);                 // pic_init_qp_minus26
+    swPutSE(bw, 0);                 // pic_init_qs_minus26
+    swPutSE(bw, 0);                 // chroma_qp_index_offset
+    swPutBits(bw, 1, 1);            // deblocking_filter_control_present_flag
+    swPutBits(bw, 0, 2);            // constrained_intra_pred_flag, redundant_pic_cnt_present_flag
+    swPutTrailingBits(bw);
+}
+
+
+// Makes room for size more bytes of output
+static bool swReserveOutput(SwSession *sw, unsigned int size)
+{
+    if (sw->outputSize + size > sw->outputCapacity)
+    {
+        unsigned int capacity = (sw->outputSize + size) * 2;
+        BYTE *output = (BYTE*) realloc(sw->output, capacity);
+        if (output == NULL)
+            return false;
+        sw->output = output;
+        sw->outputCapacity = capacity;
+    }
+    return true;
+}
+
+
+// Rate control: next picture QP from the bits spent so far
+static void swRateControl(SwSession *sw, unsigned int bits)
+{
+    OVE_CONFIG_RATE_CONTROL *rc = &sw->config.rateControl;
+    if (rc->encRateControlMethod == 0 || rc->encRateControlTargetBitRate == 0)
+    {
+        // the configured QP, only brought into the range of H.264
+        sw->qp = rc->encQP_I > 51 ? 51 : rc->encQP_I;
+    }
+    else
+    {
+        double fps = rc->encRateControlFrameRateNumerator /
+                     (double)(rc->encRateControlFrameRateDenominator ? rc->encRateControlFrameRateDenominator : 1);
+        double target = rc->encRateControlTargetBitRate / (fps > 0 ? fps : 30);
+        double buffer = rc->encVBVBufferSize ? rc->encVBVBufferSize : rc->encRateControlTargetBitRate;
+
+        // short term: 6 QP steps double the size; long term: drain the accumulated error.
+        // Without bits, when the session starts or is configured again, the QP is only clamped.
+        if (bits > 0)
+        {
+            sw->rcError += bits - target;
+            double delta = 3.0 * log(bits / target) / log(2.0) + 6.0 * sw->rcError / buffer;
+            if (delta > 2)
+                delta = 2;
+            if (delta < -2)
+                delta = -2;
+            sw->qp += (int)floor(delta + 0.5);
+        }
+        sw->qp = sw->qp < SW_RC_MIN_QP ? SW_RC_MIN_QP : sw->qp > 51 ? 51 : sw->qp;
+    }
+
+    sw->qpChroma = swChromaQp[sw->qp];
+}
+
+
+/*******************************************************************************
+ * Backend interface
+ ******************************************************************************/
+/*******************************************************************************
+ *  @fn     swGetDevice
+ *  @brief  Fills the device handle with the single virtual device (the CPU)
+ *  @param[in/out] deviceHandle : Hanlde for the device information
+ *  @return bool : true if successful; otherwise false.
+ ******************************************************************************/
+bool swGetDevice(OVDeviceHandle *deviceHandle)
+{
+    deviceHandle->platform = NULL;
+    deviceHandle->numDevices = 1;
+    deviceHandle->deviceInfo = new ovencode_device_info[1];
+    memset(deviceHandle->deviceInfo, 0, sizeof(ovencode_device_info));
+    deviceHandle->deviceInfo[0].device_id = 1;
+    return true;
+}
+
+
+bool swCreateSession(EncoderSession *session, EncoderDevice *device, OvConfigCtrl *pConfig)
+{
+    SwSession *sw = new SwSession;
+    memset(sw, 0, sizeof(SwSession));
+    session->priv = sw;
+    session->maxInFlight = 1;
+
+    sw->config = *pConfig;
+    sw->width = session->width;
+    sw->height = session->height;
+    sw->mbWidth = (session->width + 15) / 16;
+    sw->mbHeight = (session->height + 15) / 16;
+    sw->lumaStride = sw->mbWidth * 16;
+    sw->chromaStride = sw->mbWidth * 8;
+
+    unsigned int lumaSize = sw->lumaStride * sw->mbHeight * 16;
+    unsigned int chromaSize = lumaSize / 4;
+    sw->srcY = (BYTE*) malloc(lumaSize);
+    sw->srcU = (BYTE*) malloc(chromaSize);
+    sw->srcV = (BYTE*) malloc(chromaSize);
+    sw->recY = (BYTE*) malloc(lumaSize);
+    sw->recU = (BYTE*) malloc(chromaSize);
+    sw->recV = (BYTE*) malloc(chromaSize);
+    sw->nzLuma = (BYTE*) calloc(sw->mbWidth * sw->mbHeight, 16);
+    sw->nzChroma = (BYTE*) calloc(sw->mbWidth * sw->mbHeight, 8);
+
+    if (!sw->srcY || !sw->srcU || !sw->srcV || !sw->recY || !sw->recU || !sw->recV || !sw->nzLuma || !sw->nzChroma)
+    {
+        fputs("Software encoder: out of memory\n", stderr);
+        return false;
+    }
+
+    sw->qp = pConfig->rateControl.encQP_I;
+    swRateControl(sw, 0);
+    sw->rcError = 0;
+    return true;
+}
+
+
+bool swSendConfig(EncoderSession *session, OvConfigCtrl *pConfig, unsigned int configMask)
+{
+    SwSession *sw = (SwSession*)session->priv;
+
+    if (configMask & ENC_CONFIG_PICTURE)
+    {
+        sw->config.pictControl = pConfig->pictControl;
+
+        // One slice per core unless the configuration asks for more
+        SYSTEM_INFO sysInfo;
+        GetSystemInfo(&sysInfo);
+        unsigned int slices = pConfig->pictControl.encNumSlicesPerFrame;
+        if (slices <= 1)
+            slices = sysInfo.dwNumberOfProcessors;
+        if (slices > SW_MAX_SLICES)
+            slices = SW_MAX_SLICES;
+        if (slices > sw->mbHeight)
+            slices = sw->mbHeight;
+        sw->numSlices = slices ? slices : 1;
+
+        for (unsigned int i = 0; i < sw->numSlices; i++)
+        {
+            sw->slices[i].sw = sw;
+            sw->slices[i].firstMb = (i * sw->mbHeight / sw->numSlices) * sw->mbWidth;
+            sw->slices[i].endMb = ((i + 1) * sw->mbHeight / sw->numSlices) * sw->mbWidth;
+        }
+    }
+    // a new rate configuration starts the rate control again from the configured QP
+    if (configMask & ENC_CONFIG_RATE)
+    {
+        sw->config.rateControl = pConfig->rateControl;
+        sw->qp = pConfig->rateControl.encQP_I;
+        sw->rcError = 0;
+        swRateControl(sw, 0);
+    }
+    if (configMask & ENC_CONFIG_ME)
+        sw->config.meControl = pConfig->meControl;
+    if (configMask & ENC_CONFIG_RDO)
+        sw->config.rdoControl = pConfig->rdoControl;
+
+    return true;
+}
+
+
+bool swSubmit(EncoderSession *session, const BYTE *frame,
+              OVE_ENCODE_PARAMETERS_H264 *pictureParameter, unsigned int *taskId)
+{
+    SwSession *sw = (SwSession*)session->priv;
+    if (sw->hasOutput)
+    {
+        fputs("Software encoder: previous task not queried\n", stderr);
+        return false;
+    }
+    if (sw->numSlices == 0)
+    {
+        fputs("Software encoder: no configuration sent\n", stderr);
+        return false;
+    }
+
+    // Padded planar copy of the NV12 input, chroma follows the visible luma rows
+    unsigned int ls = sw->lumaStride, cs = sw->chromaStride;
+    const BYTE *uv = frame + session->pitch * session->height;
+    for (unsigned int y = 0; y < sw->mbHeight * 16; y++)
+    {
+        const BYTE *srcRow = frame + (y < sw->height ? y : sw->height - 1) * session->pitch;
+        BYTE *dst = sw->srcY + y * ls;
+        memcpy(dst, srcRow, sw->width);
+        memset(dst + sw->width, srcRow[sw->width - 1], ls - sw->width);
+    }
+    for (unsigned int y = 0; y < sw->mbHeight * 8; y++)
+    {
+        const BYTE *srcRow = uv + (y < sw->height / 2 ? y : sw->height / 2 - 1) * session->pitch;
+        BYTE *dstU = sw->srcU + y * cs, *dstV = sw->srcV + y * cs;
+        for (unsigned int x = 0; x < cs; x++)
+        {
+            unsigned int sx = x < sw->width / 2 ? x : sw->width / 2 - 1;
+            dstU[x] = srcRow[sx * 2];
+            dstV[x] = srcRow[sx * 2 + 1];
+        }
+    }
+
+    // Picture type: every picture is intra, IDR on request or every encIDRPeriod
+    unsigned int idrPeriod = sw->config.pictControl.encIDRPeriod;
+    unsigned int headerSpacing = sw->config.pictControl.encHeaderInsertionSpacing;
+    bool idr = sw->frames == 0 || pictureParameter->forcePicType == OVE_PICTURE_TYPE_H264_IDR ||
+               (idrPeriod && sw->frames - sw->lastIdr >= idrPeriod);
+    if (idr)
+    {
+        sw->frameNum = 0;
+        sw->lastIdr = sw->frames;
+    }
+
+    // Slices, the first one on this thread, the others on the workers of the session
+    if (!swStartWorkers(sw))
+        return false;
+    HANDLE done[SW_MAX_SLICES];
+    for (unsigned int i = 1; i < sw->numSlices; i++)
+    {
+        done[i - 1] = sw->slices[i].done;
+        SetEvent(sw->slices[i].start);
+    }
+    swEncodeSlice(&sw->slices[0]);
+    if (sw->numSlices > 1)
+        WaitForMultipleObjects(sw->numSlices - 1, done, TRUE, INFINITE);
+
+    // Access unit: SPS & PPS before every IDR or when asked, then the slices
+    bool ok = true;
+    sw->outputSize = 0;
+    if (idr || pictureParameter->insertSPS || (headerSpacing && sw->frames % headerSpacing == 0))
+    {
+        SwBitWriter bw = {NULL, 0, 0, 0, 0, false};
+        swWriteSPS(sw, &bw);
+        ok = !bw.failed && swReserveOutput(sw, 5 + bw.size * 3 / 2);
+        if (ok)
+            sw->outputSize = swWriteNal(sw->output, 0x67, bw.data, bw.size) - sw->output;
+        swWritePPS(&bw);
+        ok = ok && !bw.failed && swReserveOutput(sw, 5 + bw.size * 3 / 2);
+        if (ok)
+            sw->outputSize = swWriteNal(sw->output + sw->outputSize, 0x68, bw.data, bw.size) - sw->output;
+        free(bw.data);
+    }
+    for (unsigned int i = 0; ok && i < sw->numSlices; i++)
+    {
+        SwBitWriter *bw = &sw->slices[i].bw;
+        ok = !bw->failed && swReserveOutput(sw, 5 + bw->size * 3 / 2);
+        if (ok)
+            sw->outputSize = swWriteNal(sw->output + sw->outputSize, idr ? 0x65 : 0x61, bw->data, bw->size) - sw->output;
+    }
+    if (!ok)
+    {
+        fputs("Software encoder: out of memory\n", stderr);
+        return false;
+    }
+
+    swRateControl(sw, sw->outputSize * 8);
+    if (idr)
+        sw->idrPicId = (sw->idrPicId + 1) & 0xFFFF;
+    sw->frameNum = (sw->frameNum + 1) & 15;
+    sw->frames++;
+
+    sw->hasOutput = true;
+    *taskId = sw->taskId = sw->frames;
+    return true;
+}
+
+
+bool swQuery(EncoderSession *session, OVE_OUTPUT_DESCRIPTION *taskDescription)
+{
+    SwSession *sw = (SwSession*)session->priv;
+    if (!sw->hasOutput)
+        return false;
+
+    sw->hasOutput = false;
+    taskDescription->taskID = sw->taskId;
+    taskDescription->status = OVE_TASK_STATUS_COMPLETE;
+    taskDescription->bitstream_data = sw->output;
+    taskDescription->size_of_bitstream_data = sw->outputSize;
+    return true;
+}
+
+
+bool swReleaseTask(EncoderSession *session, unsigned int taskId)
+{
+    return true;
+}
+
+
+bool swReleaseSession(EncoderSession *session)
+{
+    SwSession *sw = (SwSession*)session->priv;
+    if (sw == NULL)
+        return true;
+
+    InterlockedExchange(&sw->stop, 1);
+    for (unsigned int i = 1; i <= sw->numWorkers; i++)
+    {
+        SetEvent(sw->slices[i].start);
+        WaitForSingleObject(sw->slices[i].thread, INFINITE);
+        CloseHandle(sw->slices[i].thread);
+        CloseHandle(sw->slices[i].start);
+        CloseHandle(sw->slices[i].done);
+    }
+
+    free(sw->srcY); free(sw->srcU); free(sw->srcV);
+    free(sw->recY); free(sw->recU); free(sw->recV);
+    free(sw->nzLuma); free(sw->nzChroma);
+    for (unsigned int i = 0; i < SW_MAX_SLICES; i++)
+        free(sw->slices[i].bw.data);
+    free(sw->output);
+    delete sw;
+    session->priv = NULL;
+    return true;
+}
+
+
+const EncoderBackend swBackend =
+{
+    "sw",
+    swCreateSession,
+    swSendConfig,
+    swSubmit,
+    swQuery,
+    swReleaseTask,
+    swReleaseSession
+};
+
+#endif
@@ -0,0 +1,296 @@
+/*******************************************************************************
+* This file is part of AvsVCEh264.
+* Contains the MPEG-TS muxer of the single session & live encodes: every
+* access unit is a PES packet of the video PID, with its PTS & the PCR in the
+* adaptation field of its first packet, and the PAT & PMT are repeated before
+* the IDRs and every tableMs. The packets of a frame are returned together,
+* to be written to a file, a pipe or a UDP stream.
+*
+* Copyright (C) 2013 David Gonzlez Garca <davidgg666@gmail.com>
+*******************************************************************************/
+#ifndef TSMUX_H
+#define TSMUX_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ini.h"
+
+#define TS_PACKET_SIZE      188
+#define TS_PAYLOAD_SIZE     184
+#define TS_PID_PAT          0x0000
+#define TS_PID_PMT          0x1000
+#define TS_PID_VIDEO        0x0100
+#define TS_STREAM_H264      0x1B
+#define TS_CLOCK            90000       // PTS & PCR base, per second
+#define TS_PES_HEADER       14          // start code, stream id, length, flags & PTS
+
+typedef struct TsConfig
+{
+    unsigned int tableMs;       // longest time between PAT/PMT, they are also sent before the IDRs
+    unsigned int delayMs;       // PTS ahead of the PCR, the decoder buffer
+} TsConfig;
+
+TsConfig tsConfig = {100, 700};
+
+// -ts: the output is a transport stream whatever its name, for -o -
+bool tsForce = false;
+
+typedef struct TsMuxer
+{
+    const AVS_VideoInfo *vi;
+    BYTE            tables[2 * TS_PACKET_SIZE];     // PAT & PMT, the continuity counters set when sent
+    BYTE            cc[3];                          // continuity counters of the PAT, PMT & video
+    unsigned int    tableFrames;                    // frames between PAT/PMT
+    unsigned int    lastTable;                      // frame of the last PAT/PMT
+    bool            tablesSent;
+    BYTE            *data;                          // packets of the last frame
+    unsigned int    size;
+    unsigned int    capacity;
+    unsigned int    frames;                         // overhead of the muxing
+    uint64          payloadBytes;
+    uint64          streamBytes;
+    unsigned int    maxOverhead;
+} TsMuxer;
+
+
+static int tsHandler(void* user, const char* section, const char* name, const char* value)
+{
+    TsConfig *pTs = (TsConfig*)user;
+    unsigned int uVal = (unsigned int)atoi(value);
+
+    if (strcmp(section, "ts") != 0)
+        return 1;
+
+    if (strcmp(name, "tableMs") == 0)
+        pTs->tableMs = uVal < 10 ? 10 : uVal;
+    else if (strcmp(name, "delayMs") == 0)
+        pTs->delayMs = uVal;
+
+    return 1;
+}
+
+
+// Reads the [ts] section of the configuration file
+void tsInit(char *configFilename)
+{
+    ini_parse(configFilename, tsHandler, &tsConfig);
+}
+
+
+// The output is a transport stream with -ts, when its name ends with .ts or for udp://
+bool tsIsOutput(const char *fileName)
+{
+    size_t length = strlen(fileName);
+    return tsForce || outputIsUdp(fileName) || (length > 3 && _stricmp(fileName + length - 3, ".ts") == 0);
+}
+
+
+// CRC-32 of the PSI sections, MSB first
+static unsigned int tsCrc(const BYTE *data, unsigned int size)
+{
+    unsigned int crc = 0xFFFFFFFF;
+    for (unsigned int i = 0; i < size; i++)
+    {
+        crc ^= (unsigned int)data[i] << 24;
+        for (int k = 0; k < 8; k++)
+            crc = crc & 0x80000000 ? (crc << 1) ^ 0x04C11DB7 : crc << 1;
+    }
+    return crc;
+}
+
+
+// A packet with a PSI section, padded with 0xFF
+static void tsPutSection(BYTE *packet, unsigned int pid, const BYTE *section, unsigned int size)
+{
+    memset(packet, 0xFF, TS_PACKET_SIZE);
+    packet[0] = 0x47;
+    packet[1] = 0x40 | (BYTE)(pid >> 8);       // payload_unit_start_indicator
+    packet[2] = (BYTE)pid;
+    packet[3] = 0x10;                           // payload only
+    packet[4] = 0;                              // pointer_field
+    memcpy(packet + 5, section, size);
+
+    unsigned int crc = tsCrc(section, size);
+    packet[5 + size]     = (BYTE)(crc >> 24);
+    packet[5 + size + 1] = (BYTE)(crc >> 16);
+    packet[5 + size + 2] = (BYTE)(crc >> 8);
+    packet[5 + size + 3] = (BYTE)crc;
+}
+
+
+/*******************************************************************************
+ *  @fn     tsOpen
+ *  @brief  Starts the muxer of a clip, with its PAT & PMT
+ *  @param[out] mux : Muxer
+ *  @param[in] vi   : Video info of the clip, for the timestamps
+ ******************************************************************************/
+void tsOpen(TsMuxer *mux, const AVS_VideoInfo *vi)
+{
+    memset(mux, 0, sizeof(TsMuxer));
+    mux->vi = vi;
+    mux->tableFrames = (unsigned int)((uint64)tsConfig.tableMs * vi->fps_numerator / (vi->fps_denominator * 1000ULL));
+    if (mux->tableFrames < 1)
+        mux->tableFrames = 1;
+
+    // program 1 in the PMT PID
+    static const BYTE pat[] =
+    {
+        0x00, 0xB0, 13, 0x00, 0x01, 0xC1, 0x00, 0x00,
+        0x00, 0x01, 0xE0 | (TS_PID_PMT >> 8), TS_PID_PMT & 0xFF
+    };
+    tsPutSection(mux->tables, TS_PID_PAT, pat, sizeof(pat));
+
+    // H.264 in the video PID, which carries the PCR
+    static const BYTE pmt[] =
+    {
+        0x02, 0xB0, 18, 0x00, 0x01, 0xC1, 0x00, 0x00,
+        0xE0 | (TS_PID_VIDEO >> 8), TS_PID_VIDEO & 0xFF, 0xF0, 0x00,
+        TS_STREAM_H264, 0xE0 | (TS_PID_VIDEO >> 8), TS_PID_VIDEO & 0xFF, 0xF0, 0x00
+    };
+    tsPutSection(mux->tables + TS_PACKET_SIZE, TS_PID_PMT, pmt, sizeof(pmt));
+}
+
+
+// Room for the packets of a frame
+static BYTE *tsReserve(TsMuxer *mux, unsigned int size)
+{
+    if (mux->size + size > mux->capacity)
+    {
+        while (mux->size + size > mux->capacity)
+            mux->capacity = mux->capacity ? mux->capacity * 2 : 64 * TS_PACKET_SIZE;
+        mux->data = (BYTE*) realloc(mux->data, mux->capacity);
+    }
+    BYTE *packet = mux->data + mux->size;
+    mux->size += size;
+    return packet;
+}
+
+
+// PTS or DTS field, the 33 bits split by markers
+static void tsPutTimestamp(BYTE *p, BYTE prefix, uint64 ts)
+{
+    p[0] = (BYTE)(prefix << 4 | ((ts >> 29) & 0x0E) | 1);
+    p[1] = (BYTE)(ts >> 22);
+    p[2] = (BYTE)(((ts >> 14) & 0xFE) | 1);
+    p[3] = (BYTE)(ts >> 7);
+    p[4] = (BYTE)(((ts << 1) & 0xFE) | 1);
+}
+
+
+/*******************************************************************************
+ *  @fn     tsMuxFrame
+ *  @brief  Packetizes the access unit of a frame in a PES packet, after the
+ *          PAT & PMT when they are due. The decode order is the display
+ *          order, the DTS is the PTS and only the PTS is sent. An access unit
+ *          delimiter is added when the frame has none.
+ *  @param[in/out] mux : Muxer, the packets in data & size until the next frame
+ *  @param[in] data    : Annex-B access unit
+ *  @param[in] size    : Bytes
+ *  @param[in] frame   : Frame number of the clip, for the timestamps
+ ******************************************************************************/
+void tsMuxFrame(TsMuxer *mux, const BYTE *data, unsigned int size, unsigned int frame)
+{
+    static const BYTE aud[6] = {0x00, 0x00, 0x00, 0x01, NAL_AUD, 0xF0};
+    const AVS_VideoInfo *vi = mux->vi;
+    bool idr = annexbIsIdr(data, size);
+    mux->size = 0;
+
+    if (idr || !mux->tablesSent || frame - mux->lastTable >= mux->tableFrames)
+    {
+        BYTE *tables = tsReserve(mux, 2 * TS_PACKET_SIZE);
+        memcpy(tables, mux->tables, 2 * TS_PACKET_SIZE);
+        tables[3] |= mux->cc[0]++ & 0x0F;
+        tables[TS_PACKET_SIZE + 3] |= mux->cc[1]++ & 0x0F;
+        mux->lastTable = frame;
+        mux->tablesSent = true;
+    }
+
+    // the PCR is the time of the frame, the PTS the same plus the delay
+    uint64 pcr = (uint64)frame * TS_CLOCK * vi->fps_denominator / vi->fps_numerator;
+    uint64 pts = pcr + tsConfig.delayMs * (TS_CLOCK / 1000);
+
+    BYTE pes[TS_PES_HEADER + sizeof(aud)] = {0x00, 0x00, 0x01, 0xE0, 0x00, 0x00, 0x84, 0x80, 0x05};
+    tsPutTimestamp(pes + 9, 2, pts);
+    unsigned int pesSize = TS_PES_HEADER;
+    unsigned int pos = annexbFindStartCode(data, 0, size);
+    if (pos + 3 >= size || (data[pos + 3] & 0x1F) != NAL_AUD)
+    {
+        memcpy(pes + pesSize, aud, sizeof(aud));
+        pesSize += sizeof(aud);
+    }
+
+    unsigned int total = pesSize + size;
+    unsigned int done = 0;
+    bool first = true;
+    while (done < total)
+    {
+        BYTE *packet = tsReserve(mux, TS_PACKET_SIZE);
+        packet[0] = 0x47;
+        packet[1] = (BYTE)((first ? 0x40 : 0) | (TS_PID_VIDEO >> 8));
+        packet[2] = TS_PID_VIDEO & 0xFF;
+
+        // adaptation field: the PCR & random access on the first packet, the stuffing on the last
+        unsigned int adaptation = first ? 8 : 0;
+        unsigned int left = total - done;
+        if (left < TS_PAYLOAD_SIZE - adaptation)
+            adaptation = TS_PAYLOAD_SIZE - left;
+        packet[3] = (BYTE)((adaptation ? 0x30 : 0x10) | (mux->cc[2]++ & 0x0F));
+
+        BYTE *p = packet + 4;
+        if (adaptation)
+        {
+            p[0] = (BYTE)(adaptation - 1);
+            if (adaptation > 1)
+            {
+                p[1] = 0;
+                unsigned int used = 2;
+                if (first)
+                {
+                    p[1] = (BYTE)(0x10 | (idr ? 0x40 : 0));
+                    p[2] = (BYTE)(pcr >> 25);
+                    p[3] = (BYTE)(pcr >> 17);
+                    p[4] = (BYTE)(pcr >> 9);
+                    p[5] = (BYTE)(pcr >> 1);
+                    p[6] = (BYTE)((pcr & 1) << 7 | 0x7E);
+                    p[7] = 0;                       // extension, the base is in 90 kHz
+                    used = 8;
+                }
+                memset(p + used, 0xFF, adaptation - used);
+            }
+            p += adaptation;
+        }
+
+        // the PES header always fits in the first packet
+        unsigned int n = TS_PAYLOAD_SIZE - adaptation;
+        if (first)
+        {
+            memcpy(p, pes, pesSize);
+            memcpy(p + pesSize, data, n - pesSize);
+        }
+        else
+            memcpy(p, data + done - pesSize, n);
+        done += n;
+        first = false;
+    }
+
+    unsigned int overhead = mux->size - size;
+    if (overhead > mux->maxOverhead)
+        mux->maxOverhead = overhead;
+    mux->payloadBytes += size;
+    mux->streamBytes += mux->size;
+    mux->frames++;
+}
+
+
+// Shows the overhead of the muxing & frees the muxer
+void tsClose(TsMuxer *mux)
+{
+    if (mux->frames)
+        fprintf(stderr, "TS          %u frames, overhead %.2f%%, %.0f bytes per frame, max %u\n",
+                mux->frames, 100.0 * (mux->streamBytes - mux->payloadBytes) / mux->payloadBytes,
+                (double)(mux->streamBytes - mux->payloadBytes) / mux->frames, mux->maxOverhead);
+    free(mux->data);
+}
+
+#endif
@@ -0,0 +1,217 @@
+/*******************************************************************************
+* This file is part of AvsVCEh264.
+* Contains the two pass mode: a first pass at constant QP with a fast motion
+* estimation preset measures the bits of every frame, then the target bitrate
+* of the second pass is spread over the segments of the clip by complexity.
+*
+* Copyright (C) 2013 David Gonzlez Garca <davidgg666@gmail.com>
+*******************************************************************************/
+#ifndef TWOPASS_H
+#define TWOPASS_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define TWOPASS_QP          26      // QP of the first pass
+#define TWOPASS_QCOMP       0.6     // 0: same rate for every segment, 1: rate proportional to the bits
+#define TWOPASS_MIN_RATE    0.25    // limits of a segment rate, times the target bitrate
+#define TWOPASS_MAX_RATE    4.0
+
+typedef struct TwoPassStats
+{
+    unsigned int    numFrames;
+    unsigned int    *frameBits;     // bits of every frame in the first pass
+    unsigned int    segmentFrames;  // frames of a segment: the IDR period or 1 second
+    unsigned int    numSegments;
+    unsigned int    *segmentRate;   // bitrate of every segment in the second pass
+} TwoPassStats;
+
+
+/*******************************************************************************
+ *  @fn     twoPassFastConfig
+ *  @brief  Configuration of the first pass: constant QP, the motion
+ *          estimation & RDO of the speed preset
+ *  @param[out] dst : First pass configuration
+ *  @param[in] src  : Configuration of the encode
+ ******************************************************************************/
+void twoPassFastConfig(OvConfigCtrl *dst, const OvConfigCtrl *src)
+{
+    *dst = *src;
+    dst->rateControl.encRateControlMethod = 0;
+    dst->rateControl.encQP_I = TWOPASS_QP;
+    dst->rateControl.encQP_P = TWOPASS_QP;
+
+    dst->meControl.forceZeroPointCenter = 0;
+    dst->meControl.encSearchRangeX = 16;
+    dst->meControl.encSearchRangeY = 16;
+    dst->meControl.enableAMD = 0;
+    dst->meControl.encDisableSubMode = 254;
+    dst->rdoControl.encForce16x16skip = 1;
+}
+
+
+/*******************************************************************************
+ *  @fn     twoPassAnalyze
+ *  @brief  First pass: encodes the clip in the globals on its own session,
+ *          the output is only measured
+ *  @param[in] format    : Frame format & backend of the session
+ *  @param[in] device    : Device on which the session is created
+ *  @param[in] pConfig   : Configuration of the encode
+ *  @param[out] stats    : Bits of every frame
+ *  @return bool : true if successful; otherwise false.
+ ******************************************************************************/
+bool twoPassAnalyze(EncoderSession *format, EncoderDevice *device, OvConfigCtrl *pConfig, TwoPassStats *stats)
+{
+    const EncoderBackend *encoder = format->backend;
+    OvConfigCtrl config;
+    twoPassFastConfig(&config, pConfig);
+
+    memset(stats, 0, sizeof(TwoPassStats));
+    stats->numFrames = info->num_frames;
+    stats->frameBits = new unsigned int[stats->numFrames];
+    memset(stats->frameBits, 0, stats->numFrames * sizeof(unsigned int));
+
+	OVE_OUTPUT_DESCRIPTION taskDescriptionList = {sizeof(OVE_OUTPUT_DESCRIPTION), 0, OVE_TASK_STATUS_NONE, 0, 0};
+
+    OVE_ENCODE_PARAMETERS_H264 pictureParameter;
+	memset(&pictureParameter, 0, sizeof(OVE_ENCODE_PARAMETERS_H264));
+	pictureParameter.size = sizeof(OVE_ENCODE_PARAMETERS_H264);
+	pictureParameter.pictureStructure = OVE_PICTURE_STRUCTURE_H264_FRAME;
+	pictureParameter.forceRefreshMap = (OVE_BOOL)true;
+	pictureParameter.forcePicType = OVE_PICTURE_TYPE_H264_NONE;
+
+    EncoderSession session = *format;
+    bool ok = encoder->createSession(&session, device, &config);
+    if (ok && !encoder->sendConfig(&session, &config, ENC_CONFIG_ALL))
+    {
+        fprintf(stderr, "OVEncodeSendConfig returned error\n");
+        ok = false;
+    }
+
+    Timer passTimer;
+    passTimer.start();
+    double shown = 0;
+    BYTE *frameData = (BYTE*) malloc(session.frameSize);
+    for (unsigned int f = 0; ok && f < stats->numFrames; f++)
+    {
+        if (GetAsyncKeyState(VK_F8))
+        {
+            ok = false;
+            break;
+        }
+
+        avsGetFrameNV12(f, frameData, session.pitch);
+        pictureParameter.insertSPS = (OVE_BOOL)(f == 0);
+
+        unsigned int iTaskID;
+        bool submitted = encoder->submit(&session, frameData, &pictureParameter, &iTaskID);
+        ok = submitted && encoder->query(&session, &taskDescriptionList);
+
+        if (ok && taskDescriptionList.status == OVE_TASK_STATUS_COMPLETE)
+            stats->frameBits[f] = taskDescriptionList.size_of_bitstream_data * 8;
+        if (ok)
+            releaseQueried(&session, &taskDescriptionList);
+        else if (submitted)
+            encoder->releaseTask(&session, iTaskID);    // not queried, still outstanding
+
+        double time = passTimer.getElapsedTime();
+        if (time - shown >= 1 || f + 1 == stats->numFrames)
+        {
+            fprintf(stderr, "\rPass 1      %u/%u  Fps: %3.3f", f + 1, stats->numFrames, (f + 1) / time);
+            shown = time;
+        }
+    }
+    fprintf(stderr, "\n");
+    free(frameData);
+
+    encoder->releaseSession(&session);
+    if (!ok)
+        fprintf(stderr, "The first pass failed\n");
+    return ok;
+}
+
+
+/*******************************************************************************
+ *  @fn     twoPassAllocate
+ *  @brief  Spreads the target bitrate over the segments: each one gets a rate
+ *          that grows with its first pass bits per frame, to the power of
+ *          TWOPASS_QCOMP, and the average rate is the target
+ *  @param[in/out] stats : First pass bits, gets the rate of every segment
+ *  @param[in] pConfig   : Configuration of the encode
+ ******************************************************************************/
+void twoPassAllocate(TwoPassStats *stats, OvConfigCtrl *pConfig)
+{
+    OVE_CONFIG_RATE_CONTROL *rc = &pConfig->rateControl;
+    unsigned int fps = (rc->encRateControlFrameRateNumerator + rc->encRateControlFrameRateDenominator / 2) /
+                       rc->encRateControlFrameRateDenominator;
+    stats->segmentFrames = pConfig->pictControl.encIDRPeriod ? pConfig->pictControl.encIDRPeriod : fps;
+    if (stats->segmentFrames == 0)
+        stats->segmentFrames = 1;
+    stats->numSegments = (stats->numFrames + stats->segmentFrames - 1) / stats->segmentFrames;
+    stats->segmentRate = new unsigned int[stats->numSegments];
+
+    // weight of every segment from its bits per frame
+    double *weight = new double[stats->numSegments];
+    double total = 0;
+    for (unsigned int s = 0; s < stats->numSegments; s++)
+    {
+        unsigned int first = s * stats->segmentFrames;
+        unsigned int end = first + stats->segmentFrames < stats->numFrames ? first + stats->segmentFrames : stats->numFrames;
+        double bits = 0;
+        for (unsigned int f = first; f < end; f++)
+            bits += stats->frameBits[f];
+        weight[s] = pow(bits / (end - first) + 1, TWOPASS_QCOMP);
+        total += weight[s] * (end - first);
+    }
+
+    // the rates keep the average at the target, within the limits of a segment
+    double target = rc->encRateControlTargetBitRate;
+    double maxRate = target * TWOPASS_MAX_RATE;
+    if (rc->encRateControlPeakBitRate && rc->encRateControlPeakBitRate < maxRate)
+        maxRate = rc->encRateControlPeakBitRate;
+    double scale = target * stats->numFrames / total;
+    for (int iteration = 0; iteration < 4; iteration++)
+    {
+        double clamped = 0, unclamped = 0;
+        for (unsigned int s = 0; s < stats->numSegments; s++)
+        {
+            unsigned int frames = s + 1 < stats->numSegments ? stats->segmentFrames :
+                                  stats->numFrames - s * stats->segmentFrames;
+            double rate = weight[s] * scale;
+            if (rate < target * TWOPASS_MIN_RATE || rate > maxRate)
+                clamped += (rate < maxRate ? target * TWOPASS_MIN_RATE : maxRate) * frames;
+            else
+                unclamped += weight[s] * frames;
+        }
+        if (unclamped == 0)
+            break;
+        scale = (target * stats->numFrames - clamped) / unclamped;
+    }
+    for (unsigned int s = 0; s < stats->numSegments; s++)
+    {
+        double rate = weight[s] * scale;
+        rate = rate < target * TWOPASS_MIN_RATE ? target * TWOPASS_MIN_RATE : rate > maxRate ? maxRate : rate;
+        stats->segmentRate[s] = (unsigned int)rate;
+    }
+    delete [] weight;
+
+    unsigned int lowest = stats->segmentRate[0], highest = stats->segmentRate[0];
+    for (unsigned int s = 1; s < stats->numSegments; s++)
+    {
+        lowest = stats->segmentRate[s] < lowest ? stats->segmentRate[s] : lowest;
+        highest = stats->segmentRate[s] > highest ? stats->segmentRate[s] : highest;
+    }
+    fprintf(stderr, "Pass 2      %u segments of %u frames, %u to %u kbps\n", stats->numSegments,
+            stats->segmentFrames, lowest / 1000, highest / 1000);
+}
+
+
+void twoPassDestroy(TwoPassStats *stats)
+{
+    delete [] stats->frameBits;
+    delete [] stats->segmentRate;
+    memset(stats, 0, sizeof(TwoPassStats));
+}
+
+#endif